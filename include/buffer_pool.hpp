@@ -0,0 +1,79 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+#include <array>
+#include <atomic>
+#include <bit>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+namespace mfcslib {
+	/*
+	 * Process-wide cache of anonymous mappings in power-of-two size classes.
+	 * Buffers are handed out uninitialized, and a reused one is already
+	 * faulted in. Classes from 2 MiB up are advised to transparent huge pages,
+	 * or taken from the reserved huge pages when those are enabled.
+	 */
+	class buffer_pool
+	{
+	public:
+		static constexpr size_t MIN_CLASS = 4096;
+		static constexpr size_t HUGE_PAGE = 2'097'152;
+		static constexpr size_t MAX_CACHED = 268'435'456;
+
+		static void* acquire(size_t size) {
+			auto length = class_of(size);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				auto& list = _free[_index_of(length)];
+				if (!list.empty()) {
+					auto pt = list.back();
+					list.pop_back();
+					_cached -= length;
+					return pt;
+				}
+			}
+			void* pt = MAP_FAILED;
+			if (length >= HUGE_PAGE && _huge_pages)
+				pt = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (pt == MAP_FAILED) {
+				pt = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (pt == MAP_FAILED) throw std::bad_alloc();
+				if (length >= HUGE_PAGE) madvise(pt, length, MADV_HUGEPAGE);
+			}
+			return pt;
+		}
+		/* Size must be the one the buffer was acquired with. */
+		static void release(void* pt, size_t size) {
+			if (pt == nullptr) return;
+			auto length = class_of(size);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (_cached + length <= MAX_CACHED) {
+					_free[_index_of(length)].push_back(pt);
+					_cached += length;
+					return;
+				}
+			}
+			munmap(pt, length);
+		}
+		/* Back large classes with MAP_HUGETLB, which needs pages reserved in vm.nr_hugepages. */
+		static void use_huge_pages(bool enable) {
+			_huge_pages = enable;
+		}
+		static size_t class_of(size_t size) {
+			return size <= MIN_CLASS ? MIN_CLASS : std::bit_ceil(size);
+		}
+
+	private:
+		static inline std::mutex _mutex;
+		static inline std::array<std::vector<void*>, 64> _free;
+		static inline size_t _cached = 0;
+		static inline std::atomic<bool> _huge_pages = false;
+
+		static size_t _index_of(size_t length) {
+			return std::countr_zero(length);
+		}
+	};
+}
+#endif // !BUFFER_POOL_HPP
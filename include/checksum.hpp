@@ -0,0 +1,323 @@
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif // __SSE4_2__
+#include "util.hpp"
+namespace mfcslib {
+	constexpr auto _make_crc32c_table() {
+		std::array<uint32_t, 256> table{};
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t crc = i;
+			for (int j = 0; j < 8; ++j) {
+				crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+			}
+			table[i] = crc;
+		}
+		return table;
+	}
+	constexpr inline auto crc32c_table = _make_crc32c_table();
+
+	/*
+	 * Incremental CRC32C (Castagnoli). Constructing from a previous value
+	 * continues the checksum of a stream from where it stopped. Built with
+	 * SSE4.2 the crc32 instruction does eight bytes at a time.
+	 */
+	class crc32c
+	{
+	public:
+		crc32c() = default;
+		explicit crc32c(uint32_t previous) :_crc(~previous) {}
+		~crc32c() = default;
+
+		void update(const void* data, size_t len) {
+		#ifdef __SSE4_2__
+			_crc = update_hardware(_crc, static_cast<const uint8_t*>(data), len);
+		#else
+			_crc = update_software(_crc, static_cast<const uint8_t*>(data), len);
+		#endif // __SSE4_2__
+		}
+		uint32_t value() const {
+			return ~_crc;
+		}
+
+		static uint32_t update_software(uint32_t crc, const uint8_t* pt, size_t len) {
+			while (len--) {
+				crc = crc32c_table[(crc ^ *pt++) & 0xFF] ^ (crc >> 8);
+			}
+			return crc;
+		}
+	#ifdef __SSE4_2__
+		static uint32_t update_hardware(uint32_t crc, const uint8_t* pt, size_t len) {
+			uint64_t crc64 = crc;
+			for (; len >= 8; pt += 8, len -= 8) {
+				uint64_t val;
+				memcpy(&val, pt, sizeof val);
+				crc64 = _mm_crc32_u64(crc64, val);
+			}
+			crc = uint32_t(crc64);
+			while (len--) crc = _mm_crc32_u8(crc, *pt++);
+			return crc;
+		}
+	#endif // __SSE4_2__
+
+	private:
+		uint32_t _crc = 0xFFFFFFFF;
+	};
+
+	constexpr uint64_t xxh_prime64_1 = 0x9E3779B185EBCA87ull;
+	constexpr uint64_t xxh_prime64_2 = 0xC2B2AE3D27D4EB4Full;
+	constexpr uint64_t xxh_prime64_3 = 0x165667B19E3779F9ull;
+	constexpr uint64_t xxh_prime64_4 = 0x85EBCA77C2B2AE63ull;
+	constexpr uint64_t xxh_prime64_5 = 0x27D4EB2F165667C5ull;
+
+	constexpr inline uint64_t _rotl64(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+	constexpr inline uint64_t _xxh64_round(uint64_t acc, uint64_t input) {
+		acc += input * xxh_prime64_2;
+		return _rotl64(acc, 31) * xxh_prime64_1;
+	}
+	constexpr inline uint64_t _xxh64_merge(uint64_t acc, uint64_t val) {
+		acc ^= _xxh64_round(0, val);
+		return acc * xxh_prime64_1 + xxh_prime64_4;
+	}
+	inline uint64_t _read64(const uint8_t* pt) {
+		uint64_t val;
+		memcpy(&val, pt, sizeof val);
+		return val;
+	}
+	inline uint32_t _read32(const uint8_t* pt) {
+		uint32_t val;
+		memcpy(&val, pt, sizeof val);
+		return val;
+	}
+
+	/* One-shot XXH64 of a buffer, used as the strong hash of data blocks. */
+	inline uint64_t xxh64(const void* data, size_t len, uint64_t seed = 0) {
+		auto pt = static_cast<const uint8_t*>(data);
+		auto end = pt + len;
+		uint64_t h64;
+		if (len >= 32) {
+			uint64_t v1 = seed + xxh_prime64_1 + xxh_prime64_2;
+			uint64_t v2 = seed + xxh_prime64_2;
+			uint64_t v3 = seed;
+			uint64_t v4 = seed - xxh_prime64_1;
+			do {
+				v1 = _xxh64_round(v1, _read64(pt));
+				v2 = _xxh64_round(v2, _read64(pt + 8));
+				v3 = _xxh64_round(v3, _read64(pt + 16));
+				v4 = _xxh64_round(v4, _read64(pt + 24));
+				pt += 32;
+			} while (pt + 32 <= end);
+			h64 = _rotl64(v1, 1) + _rotl64(v2, 7) + _rotl64(v3, 12) + _rotl64(v4, 18);
+			h64 = _xxh64_merge(h64, v1);
+			h64 = _xxh64_merge(h64, v2);
+			h64 = _xxh64_merge(h64, v3);
+			h64 = _xxh64_merge(h64, v4);
+		}
+		else {
+			h64 = seed + xxh_prime64_5;
+		}
+		h64 += len;
+		for (; pt + 8 <= end; pt += 8) {
+			h64 ^= _xxh64_round(0, _read64(pt));
+			h64 = _rotl64(h64, 27) * xxh_prime64_1 + xxh_prime64_4;
+		}
+		if (pt + 4 <= end) {
+			h64 ^= uint64_t(_read32(pt)) * xxh_prime64_1;
+			h64 = _rotl64(h64, 23) * xxh_prime64_2 + xxh_prime64_3;
+			pt += 4;
+		}
+		for (; pt < end; ++pt) {
+			h64 ^= *pt * xxh_prime64_5;
+			h64 = _rotl64(h64, 11) * xxh_prime64_1;
+		}
+		h64 ^= h64 >> 33;
+		h64 *= xxh_prime64_2;
+		h64 ^= h64 >> 29;
+		h64 *= xxh_prime64_3;
+		h64 ^= h64 >> 32;
+		return h64;
+	}
+
+	constexpr std::array<uint32_t, 64> sha256_k = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+	using sha256_digest = std::array<uint8_t, 32>;
+
+	/* Incremental SHA-256, used to name chunks by their content. */
+	class sha256
+	{
+	public:
+		sha256() = default;
+		~sha256() = default;
+
+		void update(const void* data, size_t len) {
+			auto pt = static_cast<const uint8_t*>(data);
+			_total += len;
+			if (_used > 0) {
+				auto n = std::min(len, sizeof _block - _used);
+				memcpy(_block + _used, pt, n);
+				_used += n;
+				pt += n;
+				len -= n;
+				if (_used < sizeof _block) return;
+				_compress(_block);
+				_used = 0;
+			}
+			for (; len >= sizeof _block; pt += sizeof _block, len -= sizeof _block) {
+				_compress(pt);
+			}
+			memcpy(_block, pt, len);
+			_used = len;
+		}
+		sha256_digest digest() {
+			uint64_t bits = _total * 8;
+			uint8_t pad = 0x80;
+			update(&pad, 1);
+			pad = 0;
+			while (_used != 56) update(&pad, 1);
+			for (int i = 7; i >= 0; --i) {
+				uint8_t byte = uint8_t(bits >> (i * 8));
+				update(&byte, 1);
+			}
+			sha256_digest out;
+			for (int i = 0; i < 8; ++i) {
+				out[i * 4] = uint8_t(_h[i] >> 24);
+				out[i * 4 + 1] = uint8_t(_h[i] >> 16);
+				out[i * 4 + 2] = uint8_t(_h[i] >> 8);
+				out[i * 4 + 3] = uint8_t(_h[i]);
+			}
+			return out;
+		}
+		static sha256_digest of(const void* data, size_t len) {
+			sha256 hash;
+			hash.update(data, len);
+			return hash.digest();
+		}
+
+	private:
+		uint32_t _h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+		uint8_t _block[64];
+		size_t _used = 0;
+		uint64_t _total = 0;
+
+		static constexpr uint32_t _rotr(uint32_t x, int r) {
+			return (x >> r) | (x << (32 - r));
+		}
+		void _compress(const uint8_t* chunk) {
+			uint32_t w[64];
+			for (int i = 0; i < 16; ++i) {
+				w[i] = uint32_t(chunk[i * 4]) << 24 | uint32_t(chunk[i * 4 + 1]) << 16 | uint32_t(chunk[i * 4 + 2]) << 8 | chunk[i * 4 + 3];
+			}
+			for (int i = 16; i < 64; ++i) {
+				uint32_t s0 = _rotr(w[i - 15], 7) ^ _rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+				uint32_t s1 = _rotr(w[i - 2], 17) ^ _rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+				w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+			}
+			uint32_t a = _h[0], b = _h[1], c = _h[2], d = _h[3], e = _h[4], f = _h[5], g = _h[6], h = _h[7];
+			for (int i = 0; i < 64; ++i) {
+				uint32_t t1 = h + (_rotr(e, 6) ^ _rotr(e, 11) ^ _rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+				uint32_t t2 = (_rotr(a, 2) ^ _rotr(a, 13) ^ _rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+				h = g;
+				g = f;
+				f = e;
+				e = d + t1;
+				d = c;
+				c = b;
+				b = a;
+				a = t1 + t2;
+			}
+			_h[0] += a;
+			_h[1] += b;
+			_h[2] += c;
+			_h[3] += d;
+			_h[4] += e;
+			_h[5] += f;
+			_h[6] += g;
+			_h[7] += h;
+		}
+	};
+
+	inline std::string to_hex(const uint8_t* data, size_t len) {
+		constexpr char digits[] = "0123456789abcdef";
+		std::string out(len * 2, '0');
+		for (size_t i = 0; i < len; ++i) {
+			out[i * 2] = digits[data[i] >> 4];
+			out[i * 2 + 1] = digits[data[i] & 0xF];
+		}
+		return out;
+	}
+
+	/* Checksum of len bytes of an opened file from off, continuing previous. */
+	inline uint32_t crc32c_of_file(int fd, uintmax_t len, uintmax_t off = 0, uint32_t previous = 0) {
+		crc32c crc(previous);
+		TypeArray<char> buf(1'048'576, uninitialized);
+		auto end = off + len;
+		while (off < end) {
+			auto ret = ::pread(fd, buf.get_ptr(), std::min<uintmax_t>(buf.length(), end - off), off);
+			if (ret < 0) throw IO_exception(strerror(errno));
+			if (ret == 0) break;
+			crc.update(buf.get_ptr(), ret);
+			off += ret;
+		}
+		return crc.value();
+	}
+
+	/*
+	 * The CRC32C of a whole file is kept in the user.sft.crc32c attribute
+	 * together with the size and mtime it was taken at, so it is only
+	 * trusted while the file is unchanged.
+	 */
+	constexpr auto checksum_xattr = "user.sft.crc32c";
+
+	inline std::string _checksum_stamp(const struct stat& st) {
+		return '/' + std::to_string(st.st_size) + '/' + std::to_string(st.st_mtim.tv_sec) + '.' + std::to_string(st.st_mtim.tv_nsec);
+	}
+	inline std::optional<uint32_t> load_checksum(int fd) {
+		struct stat st;
+		char value[96]{ 0 };
+		if (fstat(fd, &st) < 0) return {};
+		auto ret = fgetxattr(fd, checksum_xattr, value, sizeof value - 1);
+		if (ret <= 0) return {};
+		std::string_view stored(value, ret);
+		auto field = pop_field(stored);
+		uint32_t crc = 0;
+		auto [end, err] = std::from_chars(field.data(), field.data() + field.size(), crc);
+		if (err != std::errc() || end != field.data() + field.size()) return {};
+		if ('/' + std::string(stored) != _checksum_stamp(st)) return {};
+		return crc;
+	}
+	/* Best effort, filesystems without user attributes just skip the cache. */
+	inline void store_checksum(int fd, uint32_t crc) {
+		struct stat st;
+		if (fstat(fd, &st) < 0) return;
+		auto value = std::to_string(crc) + _checksum_stamp(st);
+		fsetxattr(fd, checksum_xattr, value.data(), value.size(), 0);
+	}
+	/* CRC32C of the first size bytes, taken from the attribute when size is the whole file. */
+	inline uint32_t file_checksum(int fd, uintmax_t size) {
+		struct stat st;
+		if (fstat(fd, &st) < 0 || uintmax_t(st.st_size) != size) return crc32c_of_file(fd, size);
+		if (auto crc = load_checksum(fd)) return *crc;
+		auto crc = crc32c_of_file(fd, size);
+		store_checksum(fd, crc);
+		return crc;
+	}
+}
+#endif // !CHECKSUM_HPP
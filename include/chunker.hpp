@@ -0,0 +1,92 @@
+#ifndef CHUNKER_HPP
+#define CHUNKER_HPP
+#include <array>
+#include <vector>
+#include "checksum.hpp"
+#include "util.hpp"
+namespace mfcslib {
+	constexpr auto _make_gear_table() {
+		std::array<uint64_t, 256> table{};
+		uint64_t seed = 0x5346542D43444321ull;
+		for (auto& val : table) {
+			/* splitmix64 */
+			uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			val = z ^ (z >> 31);
+		}
+		return table;
+	}
+	constexpr inline auto gear_table = _make_gear_table();
+
+	struct chunk_info
+	{
+		uintmax_t offset;
+		uint32_t length;
+		sha256_digest digest;
+	};
+
+	/*
+	 * Content-defined chunking with a gear rolling hash and normalized cut
+	 * masks in the manner of FastCDC. Boundaries depend only on nearby bytes,
+	 * so an insertion only changes the chunks around it.
+	 */
+	class content_chunker
+	{
+	public:
+		static constexpr size_t MIN_CHUNK = 16'384;
+		static constexpr size_t AVG_CHUNK = 65'536;
+		static constexpr size_t MAX_CHUNK = 262'144;
+
+		/* Length of the first chunk in data; len if data ends before a cut point. */
+		static size_t cut(const char* data, size_t len) {
+			if (len <= MIN_CHUNK) return len;
+			auto limit = std::min(len, MAX_CHUNK);
+			auto normal = std::min(limit, AVG_CHUNK);
+			uint64_t hash = 0;
+			size_t i = MIN_CHUNK;
+			for (; i < normal; ++i) {
+				hash = (hash << 1) + gear_table[(uint8_t)data[i]];
+				if ((hash & MASK_SMALL) == 0) return i + 1;
+			}
+			for (; i < limit; ++i) {
+				hash = (hash << 1) + gear_table[(uint8_t)data[i]];
+				if ((hash & MASK_LARGE) == 0) return i + 1;
+			}
+			return limit;
+		}
+
+		/* Split the first size bytes of an opened file and hash every chunk. */
+		static std::vector<chunk_info> split_file(int fd, uintmax_t size) {
+			std::vector<chunk_info> chunks;
+			TypeArray<char> buf(BUFFER_LENGTH, uninitialized);
+			size_t buf_len = 0;
+			uintmax_t buf_off = 0;
+			while (buf_off < size) {
+				while (buf_len < buf.length() && buf_off + buf_len < size) {
+					auto ret = ::pread(fd, buf.get_ptr() + buf_len, buf.length() - buf_len, buf_off + buf_len);
+					if (ret <= 0) throw IO_exception(ret < 0 ? strerror(errno) : "File shrank while reading.");
+					buf_len += ret;
+				}
+				size_t pos = 0;
+				/* Leave a partial chunk in the buffer unless the file ends here. */
+				while (pos < buf_len && (buf_len - pos >= MAX_CHUNK || buf_off + buf_len == size)) {
+					auto len = cut(buf.get_ptr() + pos, buf_len - pos);
+					chunks.push_back({ buf_off + pos, uint32_t(len), sha256::of(buf.get_ptr() + pos, len) });
+					pos += len;
+				}
+				memmove(buf.get_ptr(), buf.get_ptr() + pos, buf_len - pos);
+				buf_off += pos;
+				buf_len -= pos;
+			}
+			return chunks;
+		}
+
+	private:
+		static constexpr size_t BUFFER_LENGTH = 4'194'304;
+		/* 18 spread bits below the average size make cuts rarer, 14 above make them likelier. */
+		static constexpr uint64_t MASK_SMALL = 0x9249'2492'4924'9000ull;
+		static constexpr uint64_t MASK_LARGE = 0x9249'2492'4900'0000ull;
+	};
+}
+#endif // !CHUNKER_HPP
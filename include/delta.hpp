@@ -0,0 +1,393 @@
+#ifndef DELTA_HPP
+#define DELTA_HPP
+#include <bitset>
+#include <cmath>
+#include <memory>
+#include "checksum.hpp"
+#include "util.hpp"
+/*
+ * Rsync-style delta encoding.
+ *
+ * The side holding the old copy (the basis) sends a signature per block:
+ * a rolling weak checksum and an XXH64. The side holding the new copy slides
+ * a window over it and emits instructions for the basis to rebuild it:
+ *   'C' u64 first_block u32 count   copy a run of basis blocks
+ *   'D' u32 len, len bytes          literal data
+ *   'E' u64 size u32 crc32c         end, with size and checksum of the result
+ * Integers are in host byte order.
+ */
+namespace mfcslib {
+	struct block_signature
+	{
+		uint32_t weak;
+		uint64_t strong;
+	};
+	constexpr size_t signature_length = sizeof(uint32_t) + sizeof(uint64_t);
+	constexpr size_t max_block_size = 131'072;
+
+	/* Roughly the square root of the file size, like rsync. */
+	constexpr size_t choose_block_size(uintmax_t file_size) {
+		auto block = size_t(std::sqrt(double(file_size))) & ~size_t(7);
+		return std::clamp<size_t>(block, 700, max_block_size);
+	}
+
+	class rolling_checksum
+	{
+	public:
+		rolling_checksum() = default;
+		~rolling_checksum() = default;
+
+		void init(const char* data, size_t len) {
+			_a = _b = 0;
+			_len = (uint32_t)len;
+			for (size_t i = 0; i < len; ++i) {
+				_a += (uint8_t)data[i];
+				_b += uint32_t(len - i) * (uint8_t)data[i];
+			}
+		}
+		/* Slide the window one byte: drop out, take in. */
+		void roll(char out, char in) {
+			_a += (uint8_t)in - (uint8_t)out;
+			_b += _a - _len * (uint8_t)out;
+		}
+		uint32_t value() const {
+			return (_a & 0xFFFF) | (_b << 16);
+		}
+
+	private:
+		uint32_t _a = 0;
+		uint32_t _b = 0;
+		uint32_t _len = 0;
+	};
+
+	inline std::vector<block_signature> compute_signatures(int fd, uintmax_t size, size_t block) {
+		std::vector<block_signature> sigs;
+		sigs.reserve((size + block - 1) / block);
+		TypeArray<char> buf(block, uninitialized);
+		rolling_checksum weak;
+		for (uintmax_t off = 0; off < size; off += block) {
+			size_t len = std::min<uintmax_t>(block, size - off);
+			for (size_t got = 0; got < len;) {
+				auto ret = ::pread(fd, buf.get_ptr() + got, len - got, off + got);
+				if (ret <= 0) throw IO_exception(ret < 0 ? strerror(errno) : "File shrank while reading.");
+				got += ret;
+			}
+			weak.init(buf.get_ptr(), len);
+			sigs.push_back({ weak.value(), xxh64(buf.get_ptr(), len) });
+		}
+		return sigs;
+	}
+
+	inline std::string serialize_signatures(const std::vector<block_signature>& sigs) {
+		std::string out(sigs.size() * signature_length, '\0');
+		auto pt = out.data();
+		for (auto& sig : sigs) {
+			memcpy(pt, &sig.weak, sizeof sig.weak);
+			memcpy(pt + sizeof sig.weak, &sig.strong, sizeof sig.strong);
+			pt += signature_length;
+		}
+		return out;
+	}
+
+	inline std::vector<block_signature> parse_signatures(const char* data, size_t count) {
+		std::vector<block_signature> sigs(count);
+		for (auto& sig : sigs) {
+			memcpy(&sig.weak, data, sizeof sig.weak);
+			memcpy(&sig.strong, data + sizeof sig.weak, sizeof sig.strong);
+			data += signature_length;
+		}
+		return sigs;
+	}
+
+	/* Produces the instruction stream for a source file against basis signatures. */
+	class delta_encoder
+	{
+	public:
+		delta_encoder(int fd, uintmax_t size, size_t block, uintmax_t basis_size, std::vector<block_signature> sigs) :
+			_fd(fd), _size(size), _block(block), _basis_size(basis_size), _sigs(std::move(sigs)),
+			_buf(BUFFER_LENGTH + block, uninitialized), _tags(std::make_unique<std::bitset<65536>>()) {
+			for (uint32_t i = 0; i < _sigs.size(); ++i) {
+				_table[_sigs[i].weak].push_back(i);
+				_tags->set(_tag(_sigs[i].weak));
+			}
+		}
+		~delta_encoder() = default;
+
+		/*
+		 * Append the next instructions to out, stopping after STEP_LENGTH bytes
+		 * of the source even when that gave nothing to send yet. Returns false
+		 * once the end was emitted.
+		 */
+		bool next(std::string& out) {
+			if (_ended) return false;
+			auto start = out.size();
+			auto begin = position();
+			while (out.size() - start < OUTPUT_LENGTH && position() - begin < STEP_LENGTH) {
+				if (_pos + _block > _buf_len && _buf_off + _buf_len < _size) {
+					_refill(out);
+				}
+				auto avail = _buf_len - _pos;
+				if (avail == 0) {
+					_flush_literal(out);
+					_flush_copy(out);
+					_emit_end(out);
+					return false;
+				}
+				auto len = std::min<size_t>(_block, avail);
+				if (len < _block) {
+					/* In the tail only the short last basis block can still match. */
+					auto last_len = _sigs.empty() ? 0 : _block_length(uint32_t(_sigs.size() - 1));
+					if (last_len == 0 || last_len == _block || len < last_len) {
+						_pos = _buf_len;
+						continue;
+					}
+					if (len > last_len) {
+						_pos += len - last_len;
+						_rolling_valid = false;
+						continue;
+					}
+				}
+				auto window = _buf.get_ptr() + _pos;
+				if (!_rolling_valid) {
+					_weak.init(window, len);
+					_rolling_valid = true;
+				}
+				if (auto idx = _match(window, len); idx >= 0) {
+					_flush_literal(out);
+					if (_copy_count > 0 && _copy_first + _copy_count == (uint64_t)idx) {
+						++_copy_count;
+					}
+					else {
+						_flush_copy(out);
+						_copy_first = idx;
+						_copy_count = 1;
+					}
+					_matched += len;
+					_pos += len;
+					_lit = _pos;
+					_rolling_valid = false;
+					continue;
+				}
+				if (_pos + len < _buf_len && len == _block) {
+					_weak.roll(window[0], window[len]);
+				}
+				else {
+					_rolling_valid = false;
+				}
+				++_pos;
+				if (_pos - _lit >= MAX_LITERAL) {
+					_flush_copy(out);
+					_flush_literal(out);
+				}
+			}
+			return true;
+		}
+		/* Bytes of the source consumed so far. */
+		uintmax_t position() const {
+			return _buf_off + _pos;
+		}
+		/* Bytes of the source that were found in the basis. */
+		uintmax_t matched() const {
+			return _matched;
+		}
+
+	private:
+		static constexpr size_t BUFFER_LENGTH = 4'194'304;
+		static constexpr size_t OUTPUT_LENGTH = 262'144;
+		static constexpr size_t MAX_LITERAL = 1'048'576;
+		static constexpr uintmax_t STEP_LENGTH = 67'108'864;
+
+		int _fd;
+		uintmax_t _size;
+		size_t _block;
+		uintmax_t _basis_size;
+		std::vector<block_signature> _sigs;
+		std::unordered_map<uint32_t, std::vector<uint32_t>> _table;
+		TypeArray<char> _buf;
+		std::unique_ptr<std::bitset<65536>> _tags;
+		uintmax_t _buf_off = 0;
+		size_t _buf_len = 0;
+		size_t _pos = 0;
+		size_t _lit = 0;
+		rolling_checksum _weak;
+		bool _rolling_valid = false;
+		uint64_t _copy_first = 0;
+		uint32_t _copy_count = 0;
+		uintmax_t _matched = 0;
+		crc32c _crc;
+		bool _ended = false;
+
+		static uint32_t _tag(uint32_t weak) {
+			return (weak ^ (weak >> 16)) & 0xFFFF;
+		}
+		size_t _block_length(uint32_t idx) const {
+			if (idx + 1 < _sigs.size()) return _block;
+			return _basis_size - uintmax_t(idx) * _block;
+		}
+		int64_t _match(const char* window, size_t len) {
+			auto weak = _weak.value();
+			if (!_tags->test(_tag(weak))) return -1;
+			auto ite = _table.find(weak);
+			if (ite == _table.end()) return -1;
+			auto strong = xxh64(window, len);
+			/* Prefer the block following the last copy so runs stay contiguous. */
+			int64_t found = -1;
+			for (auto idx : ite->second) {
+				if (_block_length(idx) != len || _sigs[idx].strong != strong) continue;
+				if (_copy_count > 0 && idx == _copy_first + _copy_count) return idx;
+				if (found < 0) found = idx;
+			}
+			return found;
+		}
+		/* Keep the pending literal and the current window, read more of the file behind them. */
+		void _refill(std::string& out) {
+			if (_pos > _lit) _flush_literal(out);
+			auto keep = _buf_len - _lit;
+			memmove(_buf.get_ptr(), _buf.get_ptr() + _lit, keep);
+			_buf_off += _lit;
+			_pos -= _lit;
+			_lit = 0;
+			_buf_len = keep;
+			while (_buf_len < _buf.length() && _buf_off + _buf_len < _size) {
+				auto ret = ::pread(_fd, _buf.get_ptr() + _buf_len, _buf.length() - _buf_len, _buf_off + _buf_len);
+				if (ret <= 0) throw IO_exception(ret < 0 ? strerror(errno) : "File shrank while reading.");
+				_crc.update(_buf.get_ptr() + _buf_len, ret);
+				_buf_len += ret;
+			}
+		}
+		void _flush_literal(std::string& out) {
+			if (_pos == _lit) return;
+			_flush_copy(out);
+			uint32_t len = uint32_t(_pos - _lit);
+			out += 'D';
+			out.append(reinterpret_cast<const char*>(&len), sizeof len);
+			out.append(_buf.get_ptr() + _lit, len);
+			_lit = _pos;
+		}
+		void _flush_copy(std::string& out) {
+			if (_copy_count == 0) return;
+			out += 'C';
+			out.append(reinterpret_cast<const char*>(&_copy_first), sizeof _copy_first);
+			out.append(reinterpret_cast<const char*>(&_copy_count), sizeof _copy_count);
+			_copy_count = 0;
+		}
+		void _emit_end(std::string& out) {
+			uint64_t size = _size;
+			uint32_t crc = _crc.value();
+			out += 'E';
+			out.append(reinterpret_cast<const char*>(&size), sizeof size);
+			out.append(reinterpret_cast<const char*>(&crc), sizeof crc);
+			_ended = true;
+		}
+	};
+
+	/* Rebuilds the new file from the basis and an instruction stream fed in pieces. */
+	class delta_decoder
+	{
+	public:
+		delta_decoder(int basis_fd, size_t block, uintmax_t basis_size, int out_fd) :
+			_basis_fd(basis_fd), _block(block), _basis_size(basis_size), _out_fd(out_fd), _buf(COPY_LENGTH, uninitialized) {}
+		~delta_decoder() = default;
+
+		/* Consume up to len bytes of instructions, returns how many were used. */
+		size_t feed(const char* data, size_t len) {
+			size_t used = 0;
+			while (used < len && !_finished) {
+				if (_literal_left > 0) {
+					auto n = std::min<uintmax_t>(_literal_left, len - used);
+					_write(data + used, n);
+					_literal_left -= n;
+					used += n;
+					continue;
+				}
+				_head.push_back(data[used++]);
+				auto need = _head_length(_head[0]);
+				if (need == 0) throw IO_exception("Invalid delta instruction.");
+				if (_head.size() < need) continue;
+				_execute();
+				_head.clear();
+			}
+			return used;
+		}
+		bool finished() const {
+			return _finished;
+		}
+		/* Whether the rebuilt file has the size and checksum the encoder saw. */
+		bool verified() const {
+			return _finished && _expected_size == _written && _expected_crc == _crc.value();
+		}
+		uintmax_t written() const {
+			return _written;
+		}
+
+	private:
+		static constexpr size_t COPY_LENGTH = 1'048'576;
+
+		int _basis_fd;
+		size_t _block;
+		uintmax_t _basis_size;
+		int _out_fd;
+		TypeArray<char> _buf;
+		std::string _head;
+		uintmax_t _literal_left = 0;
+		uintmax_t _written = 0;
+		crc32c _crc;
+		bool _finished = false;
+		uint64_t _expected_size = 0;
+		uint32_t _expected_crc = 0;
+
+		static size_t _head_length(char op) {
+			switch (op)
+			{
+			case 'C':return 1 + sizeof(uint64_t) + sizeof(uint32_t);
+			case 'D':return 1 + sizeof(uint32_t);
+			case 'E':return 1 + sizeof(uint64_t) + sizeof(uint32_t);
+			}
+			return 0;
+		}
+		void _execute() {
+			auto pt = _head.data() + 1;
+			switch (_head[0])
+			{
+			case 'C': {
+				uint64_t first;
+				uint32_t count;
+				memcpy(&first, pt, sizeof first);
+				memcpy(&count, pt + sizeof first, sizeof count);
+				uintmax_t off = first * _block;
+				uintmax_t end = std::min<uintmax_t>((first + count) * _block, _basis_size);
+				if (off >= end) throw IO_exception("Delta copies beyond the basis file.");
+				while (off < end) {
+					auto ret = ::pread(_basis_fd, _buf.get_ptr(), std::min<uintmax_t>(_buf.length(), end - off), off);
+					if (ret <= 0) throw IO_exception(ret < 0 ? strerror(errno) : "Basis file shrank.");
+					_write(_buf.get_ptr(), ret);
+					off += ret;
+				}
+				break;
+			}
+			case 'D': {
+				uint32_t len;
+				memcpy(&len, pt, sizeof len);
+				_literal_left = len;
+				break;
+			}
+			case 'E':
+				memcpy(&_expected_size, pt, sizeof _expected_size);
+				memcpy(&_expected_crc, pt + sizeof _expected_size, sizeof _expected_crc);
+				_finished = true;
+				break;
+			}
+		}
+		void _write(const char* data, size_t len) {
+			_crc.update(data, len);
+			while (len > 0) {
+				auto ret = ::pwrite(_out_fd, data, len, _written);
+				if (ret < 0) throw IO_exception(strerror(errno));
+				data += ret;
+				len -= ret;
+				_written += ret;
+			}
+		}
+	};
+}
+#endif // !DELTA_HPP
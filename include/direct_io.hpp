@@ -0,0 +1,99 @@
+#ifndef DIRECT_IO_HPP
+#define DIRECT_IO_HPP
+#include <future>
+#include <fcntl.h>
+#include <unistd.h>
+#include "io.hpp"
+namespace mfcslib {
+	constexpr size_t DIRECT_ALIGNMENT = 4096;
+	constexpr size_t DIRECT_BUFFER_LENGTH = 4'194'304;
+
+	/*
+	 * Writes a file sequentially with O_DIRECT, bypassing the page cache.
+	 * Data is placed straight into one of two page-aligned pool buffers; a
+	 * full buffer is written on another thread while the next one fills. The
+	 * last, unaligned block is padded for the write and cut off by finish.
+	 */
+	class direct_writer
+	{
+	public:
+		/* Continue the file at start; the part of its block before start is read back first. */
+		direct_writer(const std::string& path, uintmax_t start) {
+			_fd = ::open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+			if (_fd < 0) throw file_exception(strerror(errno));
+			_buffers[0] = static_cast<char*>(buffer_pool::acquire(DIRECT_BUFFER_LENGTH));
+			_buffers[1] = static_cast<char*>(buffer_pool::acquire(DIRECT_BUFFER_LENGTH));
+			_base = start - start % DIRECT_ALIGNMENT;
+			_used = start - _base;
+			if (_used > 0) {
+				File head(path);
+				head.open_read_only();
+				for (size_t got = 0; got < _used;) {
+					auto ret = ::pread(head.get_fd(), _buffers[0] + got, _used - got, _base + got);
+					if (ret <= 0) throw IO_exception(ret < 0 ? strerror(errno) : "File is shorter than the resume offset.");
+					got += ret;
+				}
+			}
+		}
+		direct_writer(const direct_writer&) = delete;
+		~direct_writer() {
+			if (_pending.valid()) _pending.wait();
+			buffer_pool::release(_buffers[0], DIRECT_BUFFER_LENGTH);
+			buffer_pool::release(_buffers[1], DIRECT_BUFFER_LENGTH);
+			::close(_fd);
+		}
+
+		char* space() {
+			return _buffers[_current] + _used;
+		}
+		size_t space_left() const {
+			return DIRECT_BUFFER_LENGTH - _used;
+		}
+		/* len bytes were placed at space(); true when that filled a buffer and it went to the disk. */
+		bool commit(size_t len) {
+			_used += len;
+			if (_used < DIRECT_BUFFER_LENGTH) return false;
+			_submit(_used);
+			return true;
+		}
+		/* Wait for the buffer being written, rethrowing its error. */
+		void wait() {
+			if (_pending.valid()) _pending.get();
+		}
+		/* Write what is left and cut the file back to the end of the data. */
+		void finish() {
+			auto end = _base + _used;
+			if (_used > 0) {
+				auto padded = (_used + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+				memset(space(), 0, padded - _used);
+				_submit(padded);
+			}
+			wait();
+			if (::ftruncate(_fd, end) < 0) throw file_exception(strerror(errno));
+		}
+
+	private:
+		int _fd = -1;
+		char* _buffers[2]{};
+		std::future<void> _pending;
+		size_t _current = 0;
+		size_t _used = 0;
+		uintmax_t _base = 0;
+
+		void _submit(size_t len) {
+			wait();
+			_pending = std::async(std::launch::async, _write_out, _fd, _buffers[_current], len, _base);
+			_base += len;
+			_current ^= 1;
+			_used = 0;
+		}
+		static void _write_out(int fd, const char* data, size_t len, uintmax_t off) {
+			for (size_t done = 0; done < len;) {
+				auto ret = ::pwrite(fd, data + done, len - done, off + done);
+				if (ret < 0) throw IO_exception(strerror(errno));
+				done += ret;
+			}
+		}
+	};
+}
+#endif // !DIRECT_IO_HPP
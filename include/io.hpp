@@ -71,6 +71,22 @@ namespace mfcslib {
 			if (ret < 0 && errno != EAGAIN) throw IO_exception(strerror(errno));
 			return ret;
 		}
+		auto pread(TypeArray<Byte>& buf, size_t pos, size_t sz, off_t offset) {
+			auto len = buf.length();
+			if (pos >= len || sz > len || pos + sz > len)
+				throw out_of_range("In pread, pos or sz is out of range.");
+			auto ret = ::pread(_fd, buf.get_ptr() + pos, sz, offset);
+			if (ret < 0 && errno != EAGAIN) throw IO_exception(strerror(errno));
+			return ret;
+		}
+		auto pwrite(TypeArray<Byte>& buf, size_t pos, size_t sz, off_t offset) {
+			auto len = buf.length();
+			if (pos >= len || sz > len || pos + sz > len)
+				throw out_of_range("In pwrite, pos or sz is out of range.");
+			auto ret = ::pwrite(_fd, buf.get_ptr() + pos, sz, offset);
+			if (ret < 0 && errno != EAGAIN) throw IO_exception(strerror(errno));
+			return ret;
+		}
 		void close() {
 			::close(_fd);
 			_fd = -1;
@@ -163,6 +179,33 @@ namespace mfcslib {
 			_file_path = _get_path_from_fd(_fd);
 			return _fd;
 		}
+		/* Open without O_APPEND or O_TRUNC so that data can be placed with pwrite. */
+		auto open_random_access(int rwmode) {
+			int flag = rwmode == RDONLY ? O_RDONLY : rwmode == WRONLY ? O_WRONLY | O_CREAT : O_RDWR | O_CREAT;
+			_fd = ::open(_file_path.c_str(), flag, 0644);
+			if (_fd < 0) throw file_exception(strerror(errno));
+			fstat(_fd, &_file_stat);
+			if (!S_ISREG(_file_stat.st_mode)) {
+				::close(_fd);
+				throw std::invalid_argument(std::format("'{}' is not a regular file!\n", _file_path));
+			}
+			_file_path = _get_path_from_fd(_fd);
+			return _fd;
+		}
+		/* Reserve blocks for the whole file, falling back to ftruncate when the filesystem can not. */
+		void allocate(uintmax_t sz) {
+			if (sz == 0) return;
+			if (::fallocate(_fd, 0, 0, sz) == 0) return;
+			if (errno != EOPNOTSUPP && errno != ENOSYS) throw file_exception(strerror(errno));
+			if (::ftruncate(_fd, sz) < 0) throw file_exception(strerror(errno));
+		}
+		/* Reserve blocks for len bytes from off without changing the size, best effort. */
+		void preallocate(uintmax_t off, uintmax_t len) {
+			if (len > 0) ::fallocate(_fd, FALLOC_FL_KEEP_SIZE, off, len);
+		}
+		void truncate(uintmax_t sz) {
+			if (::ftruncate(_fd, sz) < 0) throw file_exception(strerror(errno));
+		}
 		bool is_existing() const {
 			return _fd > 0;
 		}
@@ -363,13 +406,56 @@ namespace mfcslib {
 		~ServerSocket() {}
 	};
 
+	/*
+	 * Keeps the dirty pages of a file being written sequentially to about two
+	 * windows. Each full window is handed to writeback at once, and the one
+	 * before it is waited for, so the kernel never piles up enough dirty data
+	 * to stall every writer on the box. With drop_cache the written pages are
+	 * also evicted, leaving the page cache to other users.
+	 */
+	class writeback_pacer
+	{
+	public:
+		writeback_pacer(int fd, uintmax_t start, uintmax_t window, bool drop_cache) :
+			_fd(fd), _window(window), _drop_cache(drop_cache), _flushed(start), _waited(start) {}
+		~writeback_pacer() = default;
+
+		/* Everything before end has been written. */
+		void advance(uintmax_t end) {
+			if (_window == 0 || end - _flushed < _window) return;
+			::sync_file_range(_fd, _flushed, end - _flushed, SYNC_FILE_RANGE_WRITE);
+			if (_flushed > _waited) {
+				::sync_file_range(_fd, _waited, _flushed - _waited,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+				if (_drop_cache) ::posix_fadvise(_fd, _waited, _flushed - _waited, POSIX_FADV_DONTNEED);
+				_waited = _flushed;
+			}
+			_flushed = end;
+		}
+
+	private:
+		int _fd;
+		uintmax_t _window;
+		bool _drop_cache;
+		uintmax_t _flushed;
+		uintmax_t _waited;
+	};
+
+	/* Path of a hidden file next to file, e.g. "dir/.name.suffix". */
+	inline std::string hidden_sibling(const std::string& file, const std::string& suffix) {
+		auto idx = file.find_last_of('/');
+		if (idx == std::string::npos) return '.' + file + suffix;
+		return file.substr(0, idx + 1) + '.' + file.substr(idx + 1) + suffix;
+	}
+
+	/* Paths of all regular files below path, each starting with path. */
 	std::vector<std::string> list_all_files_in_directory(const char* path) {
 		auto dir_d = opendir(path);
 		if (dir_d == nullptr) {
 			return {};
 		}
 		std::vector<std::string> res;
-		struct dirent* ptr = readdir(dir_d);
+		struct dirent* ptr = nullptr;
 		std::string _path = path;
 		if (_path.back() != '/') {
 			_path += '/';
@@ -378,15 +464,20 @@ namespace mfcslib {
 			if (strcmp(ptr->d_name, ".") == 0 || strcmp(ptr->d_name, "..") == 0) {
 				continue;
 			}
-			if (ptr->d_type == DT_REG) {
+			auto type = ptr->d_type;
+			if (type == DT_UNKNOWN) {
+				struct stat st;
+				if (lstat((_path + ptr->d_name).c_str(), &st) < 0) continue;
+				type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+			}
+			if (type == DT_REG) {
 				res.emplace_back(std::format("{}{}", _path, ptr->d_name));
-			} else if (ptr->d_type == DT_DIR) {
-				auto son_dir = list_all_files_in_directory(ptr->d_name);
-				for (auto& file : son_dir) {
-					res.emplace_back(_path + file);
-				}
+			} else if (type == DT_DIR) {
+				auto son_dir = list_all_files_in_directory((_path + ptr->d_name).c_str());
+				res.insert(res.end(), std::make_move_iterator(son_dir.begin()), std::make_move_iterator(son_dir.end()));
 			}
 		}
+		closedir(dir_d);
 		return res;
 	}
 }
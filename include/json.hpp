@@ -75,8 +75,9 @@ namespace mfcslib {
 	public:
 		json_parser() = default;
 		json_parser(mfcslib::File& in) {
-			TypeArray<char> buf(in.size() + 1);
-			in.read(buf);
+			TypeArray<char> buf(in.size() + 1, uninitialized);
+			auto len = in.read(buf);
+			buf.get_ptr()[len > 0 ? len : 0] = '\0';
 			pt = buf.get_ptr();
 			_json = parse_val();
 			pt = nullptr;
@@ -142,8 +143,9 @@ namespace mfcslib {
 		}
 	public:
 		void parse(const mfcslib::File& in) {
-			TypeArray<char> buf(in.size() + 1);
-			in.read(buf);
+			TypeArray<char> buf(in.size() + 1, uninitialized);
+			auto len = in.read(buf);
+			buf.get_ptr()[len > 0 ? len : 0] = '\0';
 			pt = buf.get_ptr();
 			_json = parse_val();
 			pt = nullptr;
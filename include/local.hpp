@@ -0,0 +1,112 @@
+#ifndef LOCAL_HPP
+#define LOCAL_HPP
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "util.hpp"
+/*
+ * Same-host transfers over a Unix socket. Instead of the data the peers pass
+ * the open file itself with SCM_RIGHTS, and the receiving side clones or
+ * copies it in the kernel.
+ */
+namespace mfcslib {
+	inline sockaddr_un local_address(const std::string& path) {
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof addr.sun_path) throw socket_exception("Unix socket path is too long.");
+		memcpy(addr.sun_path, path.data(), path.size());
+		return addr;
+	}
+
+	/* A listening socket at path, replacing a stale one left by an earlier run. */
+	inline int listen_local(const std::string& path) {
+		auto addr = local_address(path);
+		int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) throw socket_exception(strerror(errno));
+		::unlink(path.c_str());
+		if (::bind(fd, (sockaddr*)&addr, sizeof addr) < 0 || ::listen(fd, 16) < 0) {
+			::close(fd);
+			throw socket_exception(strerror(errno));
+		}
+		return fd;
+	}
+	inline int connect_local(const std::string& path) {
+		auto addr = local_address(path);
+		int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) throw socket_exception(strerror(errno));
+		if (::connect(fd, (sockaddr*)&addr, sizeof addr) < 0) {
+			::close(fd);
+			throw socket_exception(strerror(errno));
+		}
+		return fd;
+	}
+
+	/* Send data with file_fd attached; the whole of data goes out in one message. */
+	inline void send_with_fd(int sock, std::string_view data, int file_fd) {
+		iovec vec{ const_cast<char*>(data.data()), data.size() };
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+		msghdr msg{};
+		msg.msg_iov = &vec;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(int));
+		auto ret = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (ret != ssize_t(data.size())) throw socket_exception(ret < 0 ? strerror(errno) : "Short write of a message with a descriptor.");
+	}
+	/* Like read, a descriptor that came along replaces file_fd and the old one is closed. */
+	inline ssize_t recv_with_fd(int sock, char* buf, size_t len, int& file_fd) {
+		iovec vec{ buf, len };
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+		msghdr msg{};
+		msg.msg_iov = &vec;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+		auto ret = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if (ret < 0) return ret;
+		for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+			int received = -1;
+			memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+			if (file_fd >= 0) ::close(file_fd);
+			file_fd = received;
+		}
+		return ret;
+	}
+
+	/*
+	 * Make the first size bytes of out a copy of in: a reflink where the
+	 * filesystem shares extents, copy_file_range otherwise, and sendfile when
+	 * the two files are on filesystems copy_file_range can not cross.
+	 * Returns whether the copy was a reflink.
+	 */
+	inline bool clone_or_copy(int in, int out, uintmax_t size) {
+		struct stat st;
+		if (fstat(in, &st) == 0 && uintmax_t(st.st_size) == size && ::ioctl(out, FICLONE, in) == 0) return true;
+		if (::ftruncate(out, 0) < 0) throw file_exception(strerror(errno));
+		loff_t in_off = 0, out_off = 0;
+		while (uintmax_t(in_off) < size) {
+			auto ret = ::copy_file_range(in, &in_off, out, &out_off, size - in_off, 0);
+			if (ret < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) break;
+			if (ret <= 0) throw file_exception(ret < 0 ? strerror(errno) : "File shrank while copying.");
+		}
+		off_t off = in_off;
+		if (::lseek(out, off, SEEK_SET) < 0) throw file_exception(strerror(errno));
+		while (uintmax_t(off) < size) {
+			auto ret = ::sendfile(out, in, &off, size - off);
+			if (ret <= 0) throw file_exception(ret < 0 ? strerror(errno) : "File shrank while copying.");
+		}
+		return false;
+	}
+}
+#endif // !LOCAL_HPP
@@ -0,0 +1,665 @@
+#ifndef RUDP_HPP
+#define RUDP_HPP
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <random>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "checksum.hpp"
+#include "io.hpp"
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+/*
+ * Reliable transfer of one file over UDP, for long lossy links where a
+ * single TCP stream backs off on every random loss.
+ *
+ * The file is cut into packets of RUDP_PAYLOAD bytes numbered from 0. The
+ * receiver acknowledges every batch it reads with the cumulative count, the
+ * ranges received above it and the send time of the newest packet, which
+ * gives the sender its RTT. The sender paces packets at a rate set by
+ * a delay-based controller: the rate grows while the RTT stays near its
+ * minimum and drops to the measured delivery rate once a queue builds up,
+ * so random loss alone does not slow it down. A packet is lost when a
+ * packet sent later, by more than a quarter of the minimum RTT, has been
+ * acknowledged, or on a timeout. Packets go out with sendmmsg, several per
+ * datagram with UDP GSO, and come in with recvmmsg and GRO where the kernel
+ * offers them. A FIN carries the CRC32C of the file for the receiver to
+ * check.
+ *
+ * The side that connected its socket to the other one starts: a sender
+ * just sends, a receiver sends HELLO until data arrives. The other side
+ * takes the peer address from the first packet.
+ */
+namespace mfcslib {
+	constexpr size_t RUDP_PAYLOAD = 1400;
+	constexpr size_t RUDP_BATCH = 32;
+	constexpr size_t RUDP_MAX_RANGES = 48;
+	constexpr size_t RUDP_SOCKET_BUFFER = 16'777'216;
+	constexpr double RUDP_INITIAL_RATE = 12'500'000;
+	constexpr double RUDP_MIN_RATE = 125'000;
+	/* Losses above this share of an interval's packets are taken for congestion, below it for noise. */
+	constexpr double RUDP_LOSS_LIMIT = 0.3;
+	constexpr uint64_t RUDP_MIN_RTO = 20'000;
+	constexpr uint64_t RUDP_IDLE_TIMEOUT = 10'000'000;
+	constexpr uint64_t RUDP_LINGER = 500'000;
+
+	enum rudp_type :uint8_t
+	{
+		RUDP_HELLO = 1,
+		RUDP_DATA,
+		RUDP_ACK,
+		RUDP_FIN,
+		RUDP_FIN_ACK
+	};
+	/* value is the packet number of DATA, the cumulative count of ACK, the packet count of FIN, 1 or 0 in FIN_ACK. */
+	struct rudp_header
+	{
+		uint8_t type;
+		uint8_t reserved[3];
+		uint32_t id;
+		uint64_t value;
+		/* Send time of DATA, echoed in ACK; the CRC32C of the file in FIN. */
+		uint64_t time;
+	};
+	/* An ACK goes on with the next packet number after the newest received and the ranges, each [start, end). */
+	struct rudp_range
+	{
+		uint64_t start;
+		uint64_t end;
+	};
+
+	struct rudp_options
+	{
+		/* Fraction of packets this side drops on purpose before sending, to test under loss. */
+		double loss = 0;
+	};
+	struct rudp_stats
+	{
+		uint64_t packets = 0;
+		uint64_t retransmits = 0;
+		uint64_t min_rtt = 0;
+		double final_rate = 0;
+	};
+
+	inline uint64_t rudp_now() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	/* A UDP socket on the address of local with a port of the kernel's choice, buffers made as large as allowed. */
+	inline int rudp_socket(sockaddr_in local) {
+		int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) throw socket_exception(strerror(errno));
+		local.sin_port = 0;
+		if (::bind(fd, (sockaddr*)&local, sizeof local) < 0) {
+			::close(fd);
+			throw socket_exception(strerror(errno));
+		}
+		int size = RUDP_SOCKET_BUFFER;
+		for (auto [force, plain] : { std::pair{ SO_SNDBUFFORCE, SO_SNDBUF }, std::pair{ SO_RCVBUFFORCE, SO_RCVBUF } }) {
+			if (setsockopt(fd, SOL_SOCKET, force, &size, sizeof size) < 0) setsockopt(fd, SOL_SOCKET, plain, &size, sizeof size);
+		}
+		return fd;
+	}
+	inline uint16_t rudp_port(int fd) {
+		sockaddr_in addr{};
+		socklen_t len = sizeof addr;
+		getsockname(fd, (sockaddr*)&addr, &len);
+		return ntohs(addr.sin_port);
+	}
+	inline uint64_t rudp_packets(uint64_t size) {
+		return (size + RUDP_PAYLOAD - 1) / RUDP_PAYLOAD;
+	}
+
+	/* Parts shared by both ends. */
+	class rudp_endpoint
+	{
+	public:
+		rudp_endpoint(int fd, uint32_t id, bool connected, rudp_options options) :
+			_fd(fd), _id(id), _connected(connected), _options(options), _random(std::random_device{}()) {}
+		rudp_endpoint(const rudp_endpoint&) = delete;
+		~rudp_endpoint() = default;
+
+	protected:
+		int _fd;
+		uint32_t _id;
+		bool _connected;
+		rudp_options _options;
+		std::mt19937_64 _random;
+
+		bool _drop() {
+			return _options.loss > 0 && std::uniform_real_distribution<double>(0, 1)(_random) < _options.loss;
+		}
+		void _send_control(rudp_type type, uint64_t value, uint64_t time, std::string_view extra = {}) {
+			if (!_connected || _drop()) return;
+			rudp_header header{ type, {}, _id, value, time };
+			iovec vec[2]{ { &header, sizeof header }, { const_cast<char*>(extra.data()), extra.size() } };
+			msghdr msg{};
+			msg.msg_iov = vec;
+			msg.msg_iovlen = extra.empty() ? 1 : 2;
+			::sendmsg(_fd, &msg, 0);
+		}
+		/* Connect to the source of the first packet of the transfer. */
+		void _adopt_peer(const sockaddr_in& from) {
+			if (_connected) return;
+			if (::connect(_fd, (const sockaddr*)&from, sizeof from) < 0) throw socket_exception(strerror(errno));
+			_connected = true;
+		}
+		/* Wait up to timeout microseconds for the socket to become readable. */
+		bool _wait(uint64_t timeout) {
+			pollfd wait{ _fd, POLLIN, 0 };
+			timespec spec{ time_t(timeout / 1'000'000), long(timeout % 1'000'000 * 1000) };
+			return ::ppoll(&wait, 1, &spec, nullptr) > 0;
+		}
+	};
+
+	class rudp_sender :public rudp_endpoint
+	{
+	public:
+		/* Send the first size bytes of file_fd; connected tells whether fd already is connected to the receiver. */
+		rudp_sender(int fd, uint32_t id, bool connected, int file_fd, uint64_t size, rudp_options options = {}) :
+			rudp_endpoint(fd, id, connected, options), _file_fd(file_fd), _size(size), _packets(rudp_packets(size)),
+			_state(_packets, UNSENT), _sent_at(_packets, 0) {
+			int segment = sizeof(rudp_header) + RUDP_PAYLOAD;
+			_gso = setsockopt(_fd, SOL_UDP, UDP_SEGMENT, &segment, sizeof segment) == 0;
+		}
+		~rudp_sender() {
+			if (_map != MAP_FAILED) munmap(_map, _size);
+		}
+
+		/* True once the receiver confirmed the whole file. */
+		bool run() {
+			auto checksum = std::async(std::launch::async, file_checksum, _file_fd, _size);
+			if (_size > 0) {
+				_map = mmap(nullptr, _size, PROT_READ, MAP_SHARED, _file_fd, 0);
+				if (_map == MAP_FAILED) throw file_exception(strerror(errno));
+				madvise(_map, _size, MADV_SEQUENTIAL);
+			}
+			if (!_connected && !_wait_hello()) return false;
+			_last_progress = _last_refill = _interval_start = rudp_now();
+			while (_cum < _packets) {
+				_receive_acks();
+				if (_cum == _packets) break;
+				auto now = rudp_now();
+				if (now - _last_progress > RUDP_IDLE_TIMEOUT) return false;
+				_detect_losses(now);
+				_update_rate(now);
+				_tokens = std::min(_tokens + _rate * (now - _last_refill) / 1e6, _burst());
+				_last_refill = now;
+				size_t datagram = sizeof(rudp_header) + RUDP_PAYLOAD;
+				if (_sendable() > 0 && _tokens >= datagram * std::min<size_t>(_quantum(), _sendable())) {
+					_send_batch(size_t(_tokens / datagram));
+					continue;
+				}
+				/* Sleep until the next batch may go or an ack comes. */
+				uint64_t wait = _sendable() > 0 ? uint64_t((datagram * _quantum() - _tokens) / _rate * 1e6) : _rto();
+				_wait(std::clamp<uint64_t>(wait, 50, _rto()));
+			}
+			uint32_t crc = checksum.get();
+			for (int tries = 0; tries < 50; ++tries) {
+				_send_control(RUDP_FIN, _packets, crc);
+				auto deadline = rudp_now() + std::max(_rto(), uint64_t(100'000));
+				while (rudp_now() < deadline) {
+					if (!_wait(deadline - rudp_now())) break;
+					rudp_header header;
+					auto ret = ::recv(_fd, &header, sizeof header, MSG_DONTWAIT);
+					if (ret >= ssize_t(sizeof header) && header.id == _id && header.type == RUDP_FIN_ACK) return header.value == 1;
+				}
+			}
+			return false;
+		}
+		const rudp_stats& stats() {
+			_stats.min_rtt = _min_rtt;
+			_stats.final_rate = _rate;
+			return _stats;
+		}
+
+	private:
+		enum : uint8_t { UNSENT, IN_FLIGHT, LOST, ACKED };
+		int _file_fd;
+		uint64_t _size;
+		uint64_t _packets;
+		void* _map = MAP_FAILED;
+		bool _gso = false;
+		std::vector<uint8_t> _state;
+		std::vector<uint64_t> _sent_at;
+		std::deque<uint64_t> _lost;
+		uint64_t _next_new = 0;
+		uint64_t _cum = 0;
+		uint64_t _in_flight = 0;
+		/* Send time of the latest-sent packet acknowledged so far. */
+		uint64_t _newest_acked_sent = 0;
+		uint64_t _highest_acked = 0;
+		/* RTT in microseconds. */
+		uint64_t _min_rtt = UINT64_MAX;
+		uint64_t _srtt = 0;
+		uint64_t _rttvar = 0;
+		unsigned _backoff = 0;
+		/* Rate in bytes per second and the token bucket that paces it. */
+		double _rate = RUDP_INITIAL_RATE;
+		double _tokens = 0;
+		bool _slow_start = true;
+		uint64_t _last_refill = 0;
+		uint64_t _last_progress = 0;
+		/* The measuring interval the controller acts on. */
+		uint64_t _interval_start = 0;
+		uint64_t _interval_delivered = 0;
+		uint64_t _interval_sent = 0;
+		uint64_t _interval_lost = 0;
+		uint64_t _interval_min_rtt = UINT64_MAX;
+		/* Best delivery rate of late, fading by a twentieth each interval. */
+		double _delivery_max = 0;
+		rudp_stats _stats;
+
+		bool _wait_hello() {
+			auto deadline = rudp_now() + RUDP_IDLE_TIMEOUT;
+			while (rudp_now() < deadline) {
+				if (!_wait(deadline - rudp_now())) break;
+				rudp_header header;
+				sockaddr_in from{};
+				socklen_t len = sizeof from;
+				auto ret = ::recvfrom(_fd, &header, sizeof header, MSG_DONTWAIT, (sockaddr*)&from, &len);
+				if (ret >= ssize_t(sizeof header) && header.id == _id && header.type == RUDP_HELLO) {
+					_adopt_peer(from);
+					return true;
+				}
+			}
+			return false;
+		}
+		/* Doubles with every timeout in a row. */
+		uint64_t _rto() const {
+			auto base = _srtt == 0 ? 200'000 : std::max(_srtt + 4 * _rttvar, RUDP_MIN_RTO);
+			return base << _backoff;
+		}
+		/* Packets go out in groups of about a millisecond at the current rate. */
+		size_t _quantum() const {
+			return std::clamp<size_t>(size_t(_rate / 1000 / (sizeof(rudp_header) + RUDP_PAYLOAD)), 1, RUDP_BATCH);
+		}
+		double _burst() const {
+			return 2.0 * _quantum() * (sizeof(rudp_header) + RUDP_PAYLOAD);
+		}
+		/* Packets in flight are kept under twice the bandwidth-delay product. */
+		uint64_t _window() const {
+			auto rtt = _min_rtt == UINT64_MAX ? 100'000 : std::max<uint64_t>(_min_rtt, 1000);
+			return std::max<uint64_t>(uint64_t(2 * _rate * rtt / 1e6 / RUDP_PAYLOAD), 4 * RUDP_BATCH);
+		}
+		uint64_t _sendable() const {
+			auto waiting = _lost.size() + (_packets - _next_new);
+			auto room = _in_flight < _window() ? _window() - _in_flight : 0;
+			return std::min(waiting, room);
+		}
+		uint64_t _next_packet() {
+			while (!_lost.empty()) {
+				auto seq = _lost.front();
+				_lost.pop_front();
+				if (_state[seq] == LOST) {
+					++_stats.retransmits;
+					return seq;
+				}
+			}
+			return _next_new < _packets ? _next_new++ : UINT64_MAX;
+		}
+		size_t _payload_of(uint64_t seq) const {
+			return std::min<uint64_t>(RUDP_PAYLOAD, _size - seq * RUDP_PAYLOAD);
+		}
+
+		/* Up to count packets, retransmissions first, in GSO datagrams of up to RUDP_BATCH packets. */
+		void _send_batch(size_t count) {
+			constexpr size_t MAX_PACKETS = 8 * RUDP_BATCH;
+			count = std::min<size_t>({ count, _sendable(), MAX_PACKETS });
+			size_t per_message = _gso ? RUDP_BATCH : 1;
+			rudp_header headers[MAX_PACKETS];
+			iovec vec[2 * MAX_PACKETS];
+			mmsghdr messages[MAX_PACKETS]{};
+			size_t used = 0, message_count = 0, in_message = 0;
+			auto now = rudp_now();
+			for (size_t i = 0; i < count; ++i) {
+				auto seq = _next_packet();
+				if (seq == UINT64_MAX) break;
+				_state[seq] = IN_FLIGHT;
+				_sent_at[seq] = now;
+				++_in_flight;
+				++_interval_sent;
+				++_stats.packets;
+				/* A dropped packet is accounted as sent, it just never leaves. */
+				if (_drop()) continue;
+				auto payload = _payload_of(seq);
+				headers[used] = { RUDP_DATA, {}, _id, seq, now };
+				vec[2 * used] = { &headers[used], sizeof(rudp_header) };
+				vec[2 * used + 1] = { static_cast<char*>(_map) + seq * RUDP_PAYLOAD, payload };
+				/* Only the last segment of a GSO datagram may be short. */
+				if (in_message == 0 || in_message == per_message) {
+					messages[message_count].msg_hdr.msg_iov = &vec[2 * used];
+					messages[message_count].msg_hdr.msg_iovlen = 0;
+					++message_count;
+					in_message = 0;
+				}
+				messages[message_count - 1].msg_hdr.msg_iovlen += 2;
+				++in_message;
+				++used;
+				if (payload < RUDP_PAYLOAD) in_message = per_message;
+			}
+			for (size_t sent = 0; sent < message_count;) {
+				auto ret = ::sendmmsg(_fd, messages + sent, message_count - sent, 0);
+				if (ret < 0) {
+					if (errno == EINTR) continue;
+					/* Whatever did not go out is found lost later. */
+					break;
+				}
+				sent += ret;
+			}
+			_tokens -= double(count) * (sizeof(rudp_header) + RUDP_PAYLOAD);
+		}
+
+		void _mark_acked(uint64_t seq) {
+			if (_state[seq] == ACKED) return;
+			if (_state[seq] == IN_FLIGHT) --_in_flight;
+			_state[seq] = ACKED;
+			_newest_acked_sent = std::max(_newest_acked_sent, _sent_at[seq]);
+			_interval_delivered += _payload_of(seq);
+		}
+		void _receive_acks() {
+			constexpr size_t COUNT = 16;
+			constexpr size_t LENGTH = sizeof(rudp_header) + sizeof(uint64_t) + RUDP_MAX_RANGES * sizeof(rudp_range);
+			char buffers[COUNT][LENGTH];
+			iovec vec[COUNT];
+			mmsghdr messages[COUNT]{};
+			for (size_t i = 0; i < COUNT; ++i) {
+				vec[i] = { buffers[i], LENGTH };
+				messages[i].msg_hdr.msg_iov = &vec[i];
+				messages[i].msg_hdr.msg_iovlen = 1;
+			}
+			while (true) {
+				auto ret = ::recvmmsg(_fd, messages, COUNT, MSG_DONTWAIT, nullptr);
+				if (ret <= 0) return;
+				auto now = rudp_now();
+				for (int i = 0; i < ret; ++i) {
+					if (messages[i].msg_len < sizeof(rudp_header) + sizeof(uint64_t)) continue;
+					rudp_header header;
+					memcpy(&header, buffers[i], sizeof header);
+					if (header.id != _id || header.type != RUDP_ACK) continue;
+					_on_ack(header, std::string_view(buffers[i] + sizeof header, messages[i].msg_len - sizeof header), now);
+				}
+			}
+		}
+		void _on_ack(const rudp_header& header, std::string_view body, uint64_t now) {
+			auto cum = std::min(header.value, _packets);
+			bool progress = cum > _cum;
+			for (; _cum < cum; ++_cum) _mark_acked(_cum);
+			uint64_t highest = 0;
+			memcpy(&highest, body.data(), sizeof highest);
+			body.remove_prefix(sizeof highest);
+			for (; body.size() >= sizeof(rudp_range); body.remove_prefix(sizeof(rudp_range))) {
+				rudp_range range;
+				memcpy(&range, body.data(), sizeof range);
+				range.end = std::min(range.end, _packets);
+				for (auto seq = std::max(range.start, _cum); seq < range.end; ++seq) {
+					if (_state[seq] != ACKED) progress = true;
+					_mark_acked(seq);
+				}
+			}
+			_highest_acked = std::max(_highest_acked, std::min(highest, _packets));
+			if (progress) {
+				_last_progress = now;
+				_backoff = 0;
+			}
+			if (header.time > 0 && header.time <= now) {
+				auto rtt = now - header.time;
+				_min_rtt = std::min(_min_rtt, rtt);
+				_interval_min_rtt = std::min(_interval_min_rtt, rtt);
+				if (_srtt == 0) {
+					_srtt = rtt;
+					_rttvar = rtt / 2;
+				}
+				else {
+					_rttvar = (3 * _rttvar + (_srtt > rtt ? _srtt - rtt : rtt - _srtt)) / 4;
+					_srtt = (7 * _srtt + rtt) / 8;
+				}
+			}
+		}
+		void _declare_lost(uint64_t seq) {
+			_state[seq] = LOST;
+			--_in_flight;
+			++_interval_lost;
+			_lost.push_back(seq);
+		}
+		void _detect_losses(uint64_t now) {
+			if (_min_rtt != UINT64_MAX) {
+				auto reorder = std::max<uint64_t>(_min_rtt / 4, 100);
+				for (auto seq = _cum; seq < _highest_acked; ++seq) {
+					if (_state[seq] == IN_FLIGHT && _sent_at[seq] + reorder < _newest_acked_sent) _declare_lost(seq);
+				}
+			}
+			/* Nothing acknowledged for a whole timeout, e.g. the tail was lost: send again what is out that long. */
+			if (_in_flight > 0 && now - _last_progress > _rto()) {
+				for (auto seq = _cum; seq < _next_new; ++seq) {
+					if (_state[seq] == IN_FLIGHT && now - _sent_at[seq] > _rto()) _declare_lost(seq);
+				}
+				_rate = std::max(_rate / 2, RUDP_MIN_RATE);
+				_backoff = std::min(_backoff + 1, 6u);
+				_last_progress = now;
+			}
+		}
+		/*
+		 * Once per RTT: while the smallest RTT of the interval stays within a
+		 * few milliseconds of the minimum, the rate doubles (at the start) or
+		 * grows by a tenth as long as what arrives keeps up with what was sent
+		 * and not lost; when a queue shows, or far more is lost than random
+		 * loss explains, it falls back under the delivery rate, to no less
+		 * than half at once.
+		 */
+		void _update_rate(uint64_t now) {
+			auto interval = std::max<uint64_t>(_srtt, 2000);
+			/* A few packets say nothing about the delay or loss, much less about random loss. */
+			if (now - _interval_start < interval || _interval_sent < RUDP_BATCH || _interval_min_rtt == UINT64_MAX) return;
+			double delivery = _interval_delivered * 1e6 / (now - _interval_start);
+			double sending = (_interval_sent - _interval_lost) * RUDP_PAYLOAD * 1e6 / (now - _interval_start);
+			/* A receiver that stalls for an interval does not make the path any narrower. */
+			_delivery_max = std::max(delivery, _delivery_max * 0.95);
+			auto queue_delay = _interval_min_rtt - _min_rtt;
+			auto target = 2000 + _min_rtt / 10;
+			bool heavy_loss = _interval_sent >= 4 * RUDP_BATCH && _interval_lost > RUDP_LOSS_LIMIT * _interval_sent;
+			if (queue_delay > target || heavy_loss) {
+				_slow_start = false;
+				_rate = std::max({ delivery * 0.9, _rate / 2, RUDP_MIN_RATE });
+			}
+			else if (_slow_start || delivery > 0.85 * sending) {
+				_rate = std::min(_rate * (_slow_start ? 2 : 1.1), std::max(2 * _delivery_max, RUDP_INITIAL_RATE));
+			}
+			_interval_start = now;
+			_interval_delivered = _interval_sent = _interval_lost = 0;
+			_interval_min_rtt = UINT64_MAX;
+		}
+	};
+
+	class rudp_receiver :public rudp_endpoint
+	{
+	public:
+		/* Receive size bytes into file_fd, which is made that long first. */
+		rudp_receiver(int fd, uint32_t id, bool connected, int file_fd, uint64_t size, rudp_options options = {}) :
+			rudp_endpoint(fd, id, connected, options), _file_fd(file_fd), _size(size), _packets(rudp_packets(size)),
+			_received(_packets, 0) {
+			int on = 1;
+			_gro = setsockopt(_fd, SOL_UDP, UDP_GRO, &on, sizeof on) == 0;
+		}
+		~rudp_receiver() {
+			if (_map != MAP_FAILED) munmap(_map, _size);
+		}
+
+		/*
+		 * True when the whole file arrived and matched the sender's CRC32C,
+		 * which is then stored with it. on_result hears the same as soon as it
+		 * is known, before the wait for repeated FINs.
+		 */
+		bool run(const std::function<void(bool)>& on_result = {}) {
+			if (::ftruncate(_file_fd, _size) < 0) throw file_exception(strerror(errno));
+			if (_size > 0) {
+				_map = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _file_fd, 0);
+				if (_map == MAP_FAILED) throw file_exception(strerror(errno));
+			}
+			constexpr size_t COUNT = 32, LENGTH = 65'536;
+			auto buffer = make_buffer<char>(COUNT * LENGTH);
+			iovec vec[COUNT];
+			char controls[COUNT][CMSG_SPACE(sizeof(int))];
+			sockaddr_in from[COUNT];
+			mmsghdr messages[COUNT]{};
+			auto last_packet = rudp_now(), last_hello = uint64_t(0);
+			int result = -1;
+			uint64_t done_at = 0;
+			while (true) {
+				auto now = rudp_now();
+				/* Stay a while to answer a FIN again whose FIN_ACK got lost. */
+				if (result >= 0 && now - done_at > RUDP_LINGER) break;
+				if (now - last_packet > RUDP_IDLE_TIMEOUT) break;
+				if (_connected && !_got_data && now - last_hello > 20'000) {
+					_send_control(RUDP_HELLO, 0, 0);
+					last_hello = now;
+				}
+				if (!_wait(20'000)) continue;
+				for (size_t i = 0; i < COUNT; ++i) {
+					vec[i] = { buffer.get_ptr() + i * LENGTH, LENGTH };
+					messages[i].msg_hdr = {};
+					messages[i].msg_hdr.msg_iov = &vec[i];
+					messages[i].msg_hdr.msg_iovlen = 1;
+					messages[i].msg_hdr.msg_name = &from[i];
+					messages[i].msg_hdr.msg_namelen = sizeof from[i];
+					messages[i].msg_hdr.msg_control = controls[i];
+					messages[i].msg_hdr.msg_controllen = sizeof controls[i];
+				}
+				auto ret = ::recvmmsg(_fd, messages, COUNT, MSG_DONTWAIT, nullptr);
+				if (ret <= 0) continue;
+				last_packet = rudp_now();
+				uint64_t echo = 0;
+				bool data = false;
+				for (int i = 0; i < ret; ++i) {
+					size_t segment = messages[i].msg_len;
+					for (auto cmsg = CMSG_FIRSTHDR(&messages[i].msg_hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&messages[i].msg_hdr, cmsg)) {
+						if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+							int size = 0;
+							memcpy(&size, CMSG_DATA(cmsg), sizeof size);
+							if (size > 0) segment = size;
+						}
+					}
+					const char* pt = static_cast<const char*>(vec[i].iov_base);
+					for (size_t off = 0; off < messages[i].msg_len; off += segment) {
+						auto len = std::min<size_t>(segment, messages[i].msg_len - off);
+						if (len < sizeof(rudp_header)) continue;
+						rudp_header header;
+						memcpy(&header, pt + off, sizeof header);
+						if (header.id != _id) continue;
+						_adopt_peer(from[i]);
+						if (header.type == RUDP_DATA) {
+							_on_data(header, pt + off + sizeof header, len - sizeof header);
+							_arrived.push_back(header.value);
+							echo = std::max(echo, header.time);
+							data = true;
+						}
+						else if (header.type == RUDP_FIN && _cum == _packets) {
+							if (result < 0) {
+								crc32c crc;
+								if (_size > 0) crc.update(_map, _size);
+								result = crc.value() == uint32_t(header.time);
+								if (result == 1) store_checksum(_file_fd, crc.value());
+								done_at = rudp_now();
+								if (on_result) on_result(result == 1);
+							}
+							_send_control(RUDP_FIN_ACK, result, 0);
+						}
+					}
+				}
+				if (data) _send_ack(echo);
+			}
+			if (_map != MAP_FAILED) {
+				munmap(_map, _size);
+				_map = MAP_FAILED;
+			}
+			return result == 1;
+		}
+
+	private:
+		int _file_fd;
+		uint64_t _size;
+		uint64_t _packets;
+		void* _map = MAP_FAILED;
+		bool _gro = false;
+		bool _got_data = false;
+		std::vector<uint8_t> _received;
+		uint64_t _cum = 0;
+		uint64_t _highest = 0;
+		/* Received ranges above _cum, start to end. */
+		std::map<uint64_t, uint64_t> _ranges;
+		/* Packets read since the last ACK, duplicates included. */
+		std::vector<uint64_t> _arrived;
+		void _on_data(const rudp_header& header, const char* payload, size_t len) {
+			_got_data = true;
+			auto seq = header.value;
+			if (seq >= _packets || _received[seq]) return;
+			auto expected = std::min<uint64_t>(RUDP_PAYLOAD, _size - seq * RUDP_PAYLOAD);
+			if (len != expected) return;
+			memcpy(static_cast<char*>(_map) + seq * RUDP_PAYLOAD, payload, len);
+			_received[seq] = 1;
+			_highest = std::max(_highest, seq + 1);
+			if (seq == _cum) {
+				++_cum;
+				if (auto first = _ranges.begin(); first != _ranges.end() && first->first == _cum) {
+					_cum = first->second;
+					_ranges.erase(first);
+				}
+				return;
+			}
+			/* Merge with the ranges around seq. */
+			auto next = _ranges.lower_bound(seq);
+			uint64_t start = seq, end = seq + 1;
+			if (next != _ranges.begin()) {
+				auto prev = std::prev(next);
+				if (prev->second == seq) {
+					start = prev->first;
+					_ranges.erase(prev);
+				}
+			}
+			if (next != _ranges.end() && next->first == end) {
+				end = next->second;
+				_ranges.erase(next);
+			}
+			_ranges[start] = end;
+		}
+		/*
+		 * The cumulative count, the next packet after the newest and up to
+		 * RUDP_MAX_RANGES ranges: first those holding the packets that just
+		 * arrived, so a packet sent again needlessly is soon known to be here,
+		 * then the newest, which the sender detects losses by, then the oldest,
+		 * next to the holes.
+		 */
+		void _send_ack(uint64_t echo) {
+			std::vector<rudp_range> chosen;
+			auto add = [&chosen](std::map<uint64_t, uint64_t>::const_iterator ite) {
+				if (chosen.size() == RUDP_MAX_RANGES) return;
+				for (auto& range : chosen) if (range.start == ite->first) return;
+				chosen.push_back({ ite->first, ite->second });
+			};
+			for (auto seq : _arrived) {
+				auto ite = _ranges.upper_bound(seq);
+				if (ite == _ranges.begin()) continue;
+				if (--ite; seq < ite->second) add(ite);
+			}
+			_arrived.clear();
+			size_t count = 0;
+			for (auto ite = _ranges.rbegin(); ite != _ranges.rend() && count < RUDP_MAX_RANGES / 4; ++ite, ++count) add(std::prev(ite.base()));
+			for (auto ite = _ranges.begin(); ite != _ranges.end() && chosen.size() < RUDP_MAX_RANGES; ++ite) add(ite);
+			std::string body(reinterpret_cast<const char*>(&_highest), sizeof _highest);
+			body.append(reinterpret_cast<const char*>(chosen.data()), chosen.size() * sizeof(rudp_range));
+			_send_control(RUDP_ACK, _cum, echo, body);
+		}
+	};
+}
+#endif // !RUDP_HPP
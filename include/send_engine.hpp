@@ -0,0 +1,158 @@
+#ifndef SEND_ENGINE_HPP
+#define SEND_ENGINE_HPP
+#include <charconv>
+#include <optional>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "util.hpp"
+namespace mfcslib {
+	enum class send_method
+	{
+		SENDFILE,
+		SPLICE,
+		MMAP,
+		BUFFERED
+	};
+	constexpr std::string_view send_method_names[] = { "sendfile", "splice", "mmap", "buffered" };
+
+	/* Which engine moves file data to a socket and how much of it one call may move. */
+	struct send_options
+	{
+		static constexpr size_t DEFAULT_CHUNK = 2'097'152;
+		send_method method = send_method::SENDFILE;
+		size_t chunk = DEFAULT_CHUNK;
+
+		/* "name" or "name/chunk_bytes", e.g. "splice/1048576". */
+		static std::optional<send_options> parse(std::string_view text) {
+			send_options options;
+			auto name = pop_field(text);
+			size_t i = 0;
+			while (i < std::size(send_method_names) && send_method_names[i] != name) ++i;
+			if (i == std::size(send_method_names)) return {};
+			options.method = send_method(i);
+			if (!text.empty()) {
+				auto [end, err] = std::from_chars(text.data(), text.data() + text.size(), options.chunk);
+				if (err != std::errc() || end != text.data() + text.size() || options.chunk == 0) return {};
+			}
+			return options;
+		}
+		std::string_view name() const {
+			return send_method_names[size_t(method)];
+		}
+	};
+
+	/*
+	 * Sends one stream of a file to a socket with the chosen method:
+	 *   sendfile   zero copy in one call
+	 *   splice     zero copy through a pipe
+	 *   mmap       writev straight from a mapped window of the file
+	 *   buffered   pread into a buffer and write, where data could be transformed
+	 * send behaves like sendfile: it returns the bytes that reached the socket
+	 * and advances off by them, -1 with EAGAIN when the socket is full and 0 at
+	 * the end of the file. Data already taken from the file is kept for the
+	 * next call, so a nonblocking socket is fine.
+	 */
+	class send_engine
+	{
+	public:
+		explicit send_engine(send_options options = {}) :_options(options) {}
+		send_engine(const send_engine&) = delete;
+		~send_engine() {
+			if (_map != MAP_FAILED) munmap(_map, _map_len);
+			if (_pipe[0] >= 0) {
+				close(_pipe[0]);
+				close(_pipe[1]);
+			}
+		}
+
+		ssize_t send(int out_fd, int in_fd, off_t* off, size_t len) {
+			len = std::min(len, _options.chunk);
+			switch (_options.method) {
+			case send_method::SPLICE: return _splice(out_fd, in_fd, off, len);
+			case send_method::MMAP: return _mmap(out_fd, in_fd, off, len);
+			case send_method::BUFFERED: return _buffered(out_fd, in_fd, off, len);
+			default: return ::sendfile(out_fd, in_fd, off, len);
+			}
+		}
+		const send_options& options() const {
+			return _options;
+		}
+
+	private:
+		send_options _options;
+		int _pipe[2]{ -1, -1 };
+		size_t _in_pipe = 0;
+		void* _map = MAP_FAILED;
+		size_t _map_len = 0;
+		off_t _map_off = 0;
+		std::string _buffer;
+		size_t _buffer_start = 0;
+		size_t _buffered_len = 0;
+		off_t _buffered_off = -1;
+
+		/* The pipe holds the bytes from *off on that have not reached the socket yet. */
+		ssize_t _splice(int out_fd, int in_fd, off_t* off, size_t len) {
+			if (_pipe[0] < 0) {
+				if (pipe2(_pipe, O_CLOEXEC | O_NONBLOCK) < 0) return -1;
+				fcntl(_pipe[1], F_SETPIPE_SZ, int(std::min<size_t>(_options.chunk, 1'048'576)));
+			}
+			if (_in_pipe < len) {
+				loff_t pos = *off + _in_pipe;
+				auto ret = ::splice(in_fd, &pos, _pipe[1], nullptr, len - _in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (ret < 0 && errno != EAGAIN) return -1;
+				if (ret > 0) _in_pipe += ret;
+			}
+			if (_in_pipe == 0) return 0;
+			auto ret = ::splice(_pipe[0], nullptr, out_fd, nullptr, std::min(_in_pipe, len), SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+			if (ret <= 0) return ret;
+			_in_pipe -= ret;
+			*off += ret;
+			return ret;
+		}
+		/* Windows are mapped chunk by chunk, the last one is kept while it covers *off. */
+		ssize_t _mmap(int out_fd, int in_fd, off_t* off, size_t len) {
+			static const off_t page = sysconf(_SC_PAGESIZE);
+			if (_map == MAP_FAILED || *off < _map_off || *off >= _map_off + off_t(_map_len)) {
+				if (_map != MAP_FAILED) munmap(_map, _map_len);
+				struct stat st;
+				if (fstat(in_fd, &st) < 0) return -1;
+				if (*off >= st.st_size) return 0;
+				_map_off = *off / page * page;
+				_map_len = std::min<uintmax_t>(std::max(_options.chunk, size_t(page)), st.st_size - _map_off);
+				_map = mmap(nullptr, _map_len, PROT_READ, MAP_SHARED, in_fd, _map_off);
+				if (_map == MAP_FAILED) return -1;
+				madvise(_map, _map_len, MADV_SEQUENTIAL);
+				madvise(_map, _map_len, MADV_WILLNEED);
+			}
+			auto skip = *off - _map_off;
+			iovec vec{ static_cast<char*>(_map) + skip, std::min<size_t>(len, _map_len - skip) };
+			auto ret = ::writev(out_fd, &vec, 1);
+			if (ret > 0) *off += ret;
+			return ret;
+		}
+		/* The buffer holds _buffered_len bytes of the file from _buffered_off on, starting at _buffer_start. */
+		ssize_t _buffered(int out_fd, int in_fd, off_t* off, size_t len) {
+			if (_buffered_len == 0 || _buffered_off != *off) {
+				_buffer.resize(_options.chunk);
+				auto ret = ::pread(in_fd, _buffer.data(), len, *off);
+				if (ret <= 0) return ret;
+				_buffer_start = 0;
+				_buffered_len = ret;
+				_buffered_off = *off;
+			}
+			auto ret = ::write(out_fd, _buffer.data() + _buffer_start, std::min(_buffered_len, len));
+			if (ret <= 0) return ret;
+			_buffer_start += ret;
+			_buffered_len -= ret;
+			*off += ret;
+			_buffered_off = *off;
+			return ret;
+		}
+	};
+}
+#endif // !SEND_ENGINE_HPP
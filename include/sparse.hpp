@@ -0,0 +1,134 @@
+#ifndef SPARSE_HPP
+#define SPARSE_HPP
+#include <string_view>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checksum.hpp"
+/*
+ * A sparse file travels as a table of its data extents, u64 offset and
+ * u64 length each, followed by the data of every extent back to back and
+ * the u32 crc32c of that data. Everything else is a hole.
+ */
+namespace mfcslib {
+	struct extent
+	{
+		uint64_t offset;
+		uint64_t length;
+	};
+	constexpr size_t extent_entry_length = 2 * sizeof(uint64_t);
+
+	/* Whether the file has fewer blocks than its size needs, i.e. holes. */
+	inline bool is_sparse(int fd) {
+		struct stat st;
+		if (fstat(fd, &st) < 0) return false;
+		return uintmax_t(st.st_blocks) * 512 < uintmax_t(st.st_size);
+	}
+
+	/* Data extents of the first size bytes, the whole range when the filesystem can not tell. */
+	inline std::vector<extent> data_extents(int fd, uintmax_t size) {
+		std::vector<extent> extents;
+		off_t pos = 0;
+		while (uintmax_t(pos) < size) {
+			auto data = lseek(fd, pos, SEEK_DATA);
+			if (data < 0) {
+				if (errno == ENXIO) break;
+				return { { uint64_t(pos), size - pos } };
+			}
+			if (uintmax_t(data) >= size) break;
+			auto hole = lseek(fd, data, SEEK_HOLE);
+			if (hole < 0 || uintmax_t(hole) > size) hole = size;
+			extents.push_back({ uint64_t(data), uint64_t(hole - data) });
+			pos = hole;
+		}
+		return extents;
+	}
+
+	inline uintmax_t extents_length(const std::vector<extent>& extents) {
+		uintmax_t total = 0;
+		for (auto& item : extents) total += item.length;
+		return total;
+	}
+
+	inline std::string serialize_extents(const std::vector<extent>& extents) {
+		std::string out(extents.size() * extent_entry_length, '\0');
+		for (size_t i = 0; i < extents.size(); ++i) {
+			memcpy(out.data() + i * extent_entry_length, &extents[i].offset, sizeof(uint64_t));
+			memcpy(out.data() + i * extent_entry_length + sizeof(uint64_t), &extents[i].length, sizeof(uint64_t));
+		}
+		return out;
+	}
+
+	/* Extents must be ordered, disjoint and inside a file of size bytes. */
+	inline std::vector<extent> parse_extents(std::string_view data, uintmax_t size) {
+		std::vector<extent> extents(data.size() / extent_entry_length);
+		uint64_t end = 0;
+		for (size_t i = 0; i < extents.size(); ++i) {
+			memcpy(&extents[i].offset, data.data() + i * extent_entry_length, sizeof(uint64_t));
+			memcpy(&extents[i].length, data.data() + i * extent_entry_length + sizeof(uint64_t), sizeof(uint64_t));
+			if (extents[i].offset < end || extents[i].length > size || extents[i].offset > size - extents[i].length)
+				throw peer_exception("Invalid extent table.");
+			end = extents[i].offset + extents[i].length;
+		}
+		return extents;
+	}
+
+	/* CRC32C of the data of all extents in order. */
+	inline uint32_t crc32c_of_extents(int fd, const std::vector<extent>& extents) {
+		uint32_t crc = 0;
+		for (auto& item : extents) {
+			crc = crc32c_of_file(fd, item.length, item.offset, crc);
+		}
+		return crc;
+	}
+
+	/*
+	 * Places the data of a sparse stream into a file already truncated to
+	 * its size, so that the gaps between extents stay holes.
+	 */
+	class extent_writer
+	{
+	public:
+		extent_writer(int fd, std::vector<extent> extents) :_fd(fd), _extents(std::move(extents)) {
+			_remaining = extents_length(_extents);
+		}
+		~extent_writer() = default;
+
+		void feed(const char* data, size_t len) {
+			while (len > 0) {
+				if (_current >= _extents.size()) throw peer_exception("More data than the extent table announced.");
+				auto& item = _extents[_current];
+				auto take = std::min<uintmax_t>(len, item.length - _written);
+				for (size_t done = 0; done < take;) {
+					auto ret = ::pwrite(_fd, data + done, take - done, item.offset + _written + done);
+					if (ret < 0) throw IO_exception(strerror(errno));
+					done += ret;
+				}
+				_crc.update(data, take);
+				_written += take;
+				_remaining -= take;
+				data += take;
+				len -= take;
+				if (_written == item.length) {
+					++_current;
+					_written = 0;
+				}
+			}
+		}
+		uintmax_t remaining() const {
+			return _remaining;
+		}
+		uint32_t checksum() const {
+			return _crc.value();
+		}
+
+	private:
+		int _fd;
+		std::vector<extent> _extents;
+		crc32c _crc;
+		size_t _current = 0;
+		uintmax_t _written = 0;
+		uintmax_t _remaining = 0;
+	};
+}
+#endif // !SPARSE_HPP
@@ -0,0 +1,255 @@
+#ifndef TREE_HPP
+#define TREE_HPP
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "checksum.hpp"
+#include "io.hpp"
+/*
+ * A directory tree travels over one connection as
+ *   manifest   "<size>/<relative path>\0" for every file
+ *   contents   all files back to back in manifest order
+ *   trailer    u32 crc32c of every file in manifest order
+ */
+namespace mfcslib {
+	struct tree_entry
+	{
+		std::string path;
+		uintmax_t size;
+	};
+
+	/* Regular files below root with paths relative to it. */
+	inline std::vector<tree_entry> scan_tree(std::string root) {
+		if (root.back() != '/') root += '/';
+		std::vector<tree_entry> entries;
+		for (auto& path : list_all_files_in_directory(root.c_str())) {
+			struct stat st;
+			if (stat(path.c_str(), &st) < 0) continue;
+			entries.push_back({ path.substr(root.size()), uintmax_t(st.st_size) });
+		}
+		return entries;
+	}
+
+	inline std::string serialize_manifest(const std::vector<tree_entry>& entries) {
+		std::string out;
+		for (auto& entry : entries) {
+			out += std::to_string(entry.size);
+			out += '/';
+			out += entry.path;
+			out += '\0';
+		}
+		return out;
+	}
+
+	/* Only plain relative paths are accepted so that nothing lands outside the root. */
+	inline bool is_safe_relative_path(std::string_view path) {
+		if (path.empty() || path.front() == '/' || path.back() == '/') return false;
+		while (!path.empty()) {
+			auto part = pop_field(path);
+			if (part.empty() || part == "." || part == "..") return false;
+		}
+		return true;
+	}
+
+	inline std::vector<tree_entry> parse_manifest(std::string_view data, size_t count) {
+		std::vector<tree_entry> entries;
+		entries.reserve(count);
+		while (!data.empty()) {
+			auto entry = pop_field(data, '\0');
+			auto size = pop_field(entry);
+			uintmax_t value = 0;
+			auto [end, err] = std::from_chars(size.data(), size.data() + size.size(), value);
+			if (err != std::errc() || end != size.data() + size.size() || !is_safe_relative_path(entry))
+				throw peer_exception("Invalid entry in manifest.");
+			entries.push_back({ std::string(entry), value });
+		}
+		if (entries.size() != count) throw peer_exception("Manifest does not match its count.");
+		return entries;
+	}
+
+	/* Either small files packed into one buffer or one large file to be sent with sendfile. */
+	struct tree_piece
+	{
+		std::string packed;
+		std::unique_ptr<File> file;
+		size_t index = 0;
+		uintmax_t length = 0;
+	};
+
+	/*
+	 * Produces the contents of a tree in manifest order. Upcoming files are
+	 * opened ahead and their readahead is started with fadvise, and files
+	 * below SMALL_FILE are read and packed together to save per-file sends.
+	 * Checksums of packed files are taken here, large files are left to the
+	 * caller.
+	 */
+	class tree_packer
+	{
+	public:
+		static constexpr uintmax_t SMALL_FILE = 262'144;
+		static constexpr size_t PACK_SIZE = 1'048'576;
+		static constexpr size_t LOOKAHEAD = 64;
+
+		tree_packer(const std::string& root, const std::vector<tree_entry>& entries) :
+			_root(root.back() == '/' ? root : root + '/'), _entries(entries), _checksums(entries.size()) {}
+		~tree_packer() = default;
+
+		bool next(tree_piece& piece) {
+			_prefetch();
+			if (_opened.empty()) return false;
+			piece.packed.clear();
+			piece.file.reset();
+			piece.index = _next;
+			if (_entries[_next].size >= SMALL_FILE) {
+				piece.file = std::move(_opened.front());
+				piece.length = _entries[_next].size;
+				_opened.pop_front();
+				++_next;
+				return true;
+			}
+			while (!_opened.empty() && _entries[_next].size < SMALL_FILE &&
+				piece.packed.size() + _entries[_next].size <= PACK_SIZE) {
+				auto size = _entries[_next].size;
+				auto pos = piece.packed.size();
+				piece.packed.resize(pos + size);
+				for (uintmax_t got = 0; got < size;) {
+					auto ret = ::pread(_opened.front()->get_fd(), piece.packed.data() + pos + got, size - got, got);
+					if (ret < 0) throw IO_exception(strerror(errno));
+					if (ret == 0) throw file_exception(_entries[_next].path + " shrank while sending.");
+					got += ret;
+				}
+				crc32c crc;
+				crc.update(piece.packed.data() + pos, size);
+				_checksums[_next] = crc.value();
+				_opened.pop_front();
+				++_next;
+				_prefetch();
+			}
+			piece.length = piece.packed.size();
+			return true;
+		}
+		std::vector<uint32_t>& checksums() {
+			return _checksums;
+		}
+
+	private:
+		std::string _root;
+		const std::vector<tree_entry>& _entries;
+		std::vector<uint32_t> _checksums;
+		std::deque<std::unique_ptr<File>> _opened;
+		size_t _next = 0;
+
+		void _prefetch() {
+			while (_opened.size() < LOOKAHEAD && _next + _opened.size() < _entries.size()) {
+				auto& entry = _entries[_next + _opened.size()];
+				auto file = std::make_unique<File>(_root + entry.path);
+				file->open_read_only();
+				if (entry.size > 0) posix_fadvise(file->get_fd(), 0, entry.size, POSIX_FADV_WILLNEED);
+				_opened.push_back(std::move(file));
+			}
+		}
+	};
+
+	/*
+	 * Writes the contents stream of a tree below root as it arrives. Each
+	 * finished file gets its checksum cached in the attribute, files the
+	 * trailer disagrees with are removed again by verify.
+	 */
+	class tree_writer
+	{
+	public:
+		tree_writer(const std::string& root, std::vector<tree_entry> entries) :
+			_root(root.back() == '/' ? root : root + '/'), _entries(std::move(entries)), _checksums(_entries.size()) {
+			for (auto& entry : _entries) _remaining += entry.size;
+			_make_directories(_root);
+			_open_next();
+		}
+		~tree_writer() = default;
+
+		void feed(const char* data, size_t len) {
+			while (len > 0) {
+				if (finished()) throw peer_exception("More data than the manifest announced.");
+				auto take = std::min<uintmax_t>(len, _entries[_current].size - _written);
+				for (size_t done = 0; done < take;) {
+					auto ret = ::pwrite(_file.get_fd(), data + done, take - done, _written + done);
+					if (ret < 0) throw IO_exception(strerror(errno));
+					done += ret;
+				}
+				_crc.update(data, take);
+				_written += take;
+				_remaining -= take;
+				data += take;
+				len -= take;
+				if (_written == _entries[_current].size) _open_next();
+			}
+		}
+		bool finished() const {
+			return _current >= _entries.size();
+		}
+		/* Bytes of file contents still to come. */
+		uintmax_t remaining() const {
+			return _remaining;
+		}
+		size_t count() const {
+			return _entries.size();
+		}
+		/* Remove the files whose checksum differs from expected and return how many. */
+		size_t verify(const char* expected) {
+			size_t bad = 0;
+			for (size_t i = 0; i < _entries.size(); ++i) {
+				uint32_t crc = 0;
+				memcpy(&crc, expected + i * sizeof crc, sizeof crc);
+				if (crc == _checksums[i]) continue;
+				unlink((_root + _entries[i].path).c_str());
+				++bad;
+			}
+			return bad;
+		}
+
+	private:
+		std::string _root;
+		std::vector<tree_entry> _entries;
+		std::vector<uint32_t> _checksums;
+		std::string _last_dir;
+		File _file;
+		crc32c _crc;
+		size_t _current = 0;
+		uintmax_t _written = 0;
+		uintmax_t _remaining = 0;
+		bool _started = false;
+
+		/* Finish the current file and open the next one, creating empty files on the way. */
+		void _open_next() {
+			for (bool first = !_started; !finished(); first = false) {
+				if (!first) {
+					_checksums[_current] = _crc.value();
+					store_checksum(_file.get_fd(), _checksums[_current]);
+					_file.close();
+					if (++_current >= _entries.size()) break;
+				}
+				_started = true;
+				auto path = _root + _entries[_current].path;
+				auto dir = path.substr(0, path.find_last_of('/') + 1);
+				if (dir != _last_dir) {
+					_make_directories(dir);
+					_last_dir = dir;
+				}
+				_file = path;
+				_file.open(true, WRONLY);
+				_crc = crc32c();
+				_written = 0;
+				if (_entries[_current].size > 0) break;
+			}
+		}
+		static void _make_directories(const std::string& dir) {
+			for (auto pos = dir.find('/', 1); pos != std::string::npos; pos = dir.find('/', pos + 1)) {
+				if (mkdir(dir.substr(0, pos).c_str(), 0755) < 0 && errno != EEXIST)
+					throw file_exception(strerror(errno));
+			}
+		}
+	};
+}
+#endif // !TREE_HPP
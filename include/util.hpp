@@ -1,17 +1,29 @@
 #ifndef UTIL_HPP
 #define UTIL_HPP
+#include "buffer_pool.hpp"
 #include "exception.hpp"
 #include <array>
 #include <chrono>
 #include <cstring>
 #include <iostream>
 #include <ranges>
+#include <type_traits>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 namespace sc = std::chrono;
 using namespace std::chrono_literals;
 namespace mfcslib {
+	struct uninitialized_t
+	{
+		explicit uninitialized_t() = default;
+	};
+	inline constexpr uninitialized_t uninitialized{};
+
+	/*
+	 * Owned array of sz elements. Arrays of trivial types live in buffer_pool,
+	 * and the uninitialized constructor skips zeroing them.
+	 */
 	template<typename _Type>
 	class TypeArray
 	{
@@ -19,16 +31,20 @@ namespace mfcslib {
 	public:
 		TypeArray() = delete;
 		TypeArray(const TypeArray& arg) = delete;
-		constexpr ~TypeArray() {
+		~TypeArray() {
 			if (_DATA != nullptr) {
-				delete[] _DATA;
+				if constexpr (POOLED) buffer_pool::release(_DATA, _SIZE * sizeof(_Type));
+				else delete[] _DATA;
 				_SIZE = 0;
 				_DATA = nullptr;
 			}
 		};
-		constexpr explicit TypeArray(size_t sz) :_SIZE(sz) {
-			_DATA = new _Type[sz];
-			memset(_DATA, 0, sz);
+		explicit TypeArray(size_t sz) :TypeArray(sz, uninitialized) {
+			if constexpr (POOLED) memset(_DATA, 0, sz * sizeof(_Type));
+		}
+		TypeArray(size_t sz, uninitialized_t) :_SIZE(sz) {
+			if constexpr (POOLED) _DATA = static_cast<_Type*>(buffer_pool::acquire(sz * sizeof(_Type)));
+			else _DATA = new _Type[sz];
 		}
 		constexpr explicit TypeArray(TypeArray&& arg) {
 			_DATA = arg._DATA;
@@ -93,6 +109,7 @@ namespace mfcslib {
 		}
 
 	private:
+		static constexpr bool POOLED = std::is_trivially_copyable_v<_Type>;
 		_Type* _DATA = nullptr;
 		size_type _SIZE = 0;
 	};
@@ -100,6 +117,11 @@ namespace mfcslib {
 	auto make_array(size_t sz) {
 		return TypeArray<T>(sz);
 	}
+	/* A pooled array left uninitialized, for data about to be overwritten. */
+	template<typename T>
+	auto make_buffer(size_t sz) {
+		return TypeArray<T>(sz, uninitialized);
+	}
 
 	constexpr std::array<std::string_view, 11> all_percent = {
 		"\r[----------]",
@@ -199,6 +221,14 @@ namespace mfcslib {
 		return cont;
 	}
 
+	/* Cut the leading field before delim off str and return it. */
+	constexpr std::string_view pop_field(std::string_view& str, char delim = '/') {
+		auto idx = str.find(delim);
+		auto field = str.substr(0, idx);
+		str.remove_prefix(idx == std::string_view::npos ? str.size() : idx + 1);
+		return field;
+	}
+
 	template<typename P, typename T>
 	constexpr int64_t strchr_c(const P* str, const T ch) {
 		int64_t idx = 0;
@@ -213,6 +243,8 @@ namespace mfcslib {
 	constexpr inline char _single_hex_to_char(char h) {
 		if (h >= '0' && h <= '9')
 			return h - 48;
+		else if (h >= 'a' && h <= 'f')
+			return h - 87;
 		else
 			return h - 55;
 	}
@@ -0,0 +1,294 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include "../include/checksum.hpp"
+#include "../include/io.hpp"
+#define CACHE_QUOTA 17'179'869'184
+#define CACHE_SIGNAL_BYTES 1'048'576
+#define CACHE_TIMEOUT 60
+
+/* A file on its way from the upstream server into the cache. The fetching thread fills it in, the loop reads it. */
+struct cache_fetch
+{
+	enum
+	{
+		CONNECTING,
+		RECEIVING,
+		DONE,
+		FAILED
+	};
+	std::string name;
+	/* Where the data is written, renamed to path once it is whole and checked. */
+	std::string partial;
+	std::string path;
+	std::atomic<int> state{ CONNECTING };
+	std::atomic<uint64_t> size{ 0 };
+	std::atomic<uint64_t> received{ 0 };
+	/* CRC32C of the file, set before state becomes DONE. */
+	uint32_t crc = 0;
+};
+
+/* Sends one client a file that may still be arriving, as far as it has arrived. */
+class cache_reader
+{
+public:
+	enum status
+	{
+		SENT,
+		NEED_DATA,
+		SOCKET_FULL,
+		BROKEN
+	};
+	cache_reader(std::shared_ptr<cache_fetch> fetch) :_fetch(std::move(fetch)) {}
+	cache_reader(const cache_reader&) = delete;
+	~cache_reader() {
+		if (_fd >= 0) ::close(_fd);
+	}
+
+	/* SENT once the whole file is out and checked, NEED_DATA while waiting for the fetch. */
+	status send(int sock) {
+		while (true) {
+			auto state = _fetch->state.load(std::memory_order_acquire);
+			if (state == cache_fetch::FAILED) return BROKEN;
+			uint64_t have = _fetch->received.load(std::memory_order_acquire);
+			if (uint64_t(_off) == have) return have == _fetch->size && state == cache_fetch::DONE ? SENT : NEED_DATA;
+			/* The file is renamed when it is done, either name may be the one that is there. */
+			if (_fd < 0) _fd = ::open(_fetch->partial.c_str(), O_RDONLY | O_CLOEXEC);
+			if (_fd < 0) _fd = ::open(_fetch->path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (_fd < 0) return BROKEN;
+			auto ret = ::sendfile(sock, _fd, &_off, have - _off);
+			if (ret < 0 && errno == EAGAIN) return SOCKET_FULL;
+			if (ret <= 0) return BROKEN;
+		}
+	}
+
+private:
+	std::shared_ptr<cache_fetch> _fetch;
+	int _fd = -1;
+	off_t _off = 0;
+};
+
+/*
+ * Local copies of files from an upstream server, kept in one directory under
+ * a quota in bytes. A miss starts a fetch on a thread of its own while any
+ * number of clients stream the file as it arrives; requests for a file that
+ * is being fetched join that fetch instead of starting another. Fetches
+ * report progress on event_fd. Whole files are evicted least recently used
+ * first, with use recorded in their modification time so that the order
+ * survives a restart.
+ */
+class file_cache
+{
+public:
+	file_cache() = default;
+	file_cache(const file_cache&) = delete;
+	~file_cache() {
+		if (_event_fd >= 0) ::close(_event_fd);
+	}
+
+	void init(const std::string& dir, uint64_t quota, const std::string& ip, uint16_t port) {
+		_dir = dir;
+		if (_dir.back() != '/') _dir += '/';
+		_quota = quota;
+		_ip = ip;
+		_port = port;
+		::mkdir(_dir.c_str(), 0755);
+		_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (_event_fd < 0) throw mfcslib::file_exception(strerror(errno));
+		std::vector<std::pair<timespec, std::string>> found;
+		for (auto& path : mfcslib::list_all_files_in_directory(_dir.c_str())) {
+			auto name = path.substr(_dir.size());
+			if (name.find('/') != std::string::npos) continue;
+			/* Left over by a fetch that a restart cut short. */
+			if (name.starts_with('.') && name.ends_with(".part")) {
+				::unlink(path.c_str());
+				continue;
+			}
+			struct stat st;
+			if (::stat(path.c_str(), &st) == 0) found.push_back({ st.st_mtim, name });
+		}
+		std::sort(found.begin(), found.end(), [](auto& a, auto& b) {
+			return std::tie(a.first.tv_sec, a.first.tv_nsec) < std::tie(b.first.tv_sec, b.first.tv_nsec);
+		});
+		for (auto& [time, name] : found) _insert(name);
+		_evict();
+	}
+	bool enabled() const {
+		return _event_fd >= 0;
+	}
+	int event_fd() const {
+		return _event_fd;
+	}
+	uint64_t used() const {
+		return _used;
+	}
+
+	/* Path of name in the cache, which counts as a use of it. */
+	std::optional<std::string> lookup(const std::string& name) {
+		auto ite = _entries.find(name);
+		if (ite == _entries.end()) return std::nullopt;
+		auto path = _dir + name;
+		if (::utimensat(AT_FDCWD, path.c_str(), nullptr, 0) < 0) {
+			/* Removed behind our back. */
+			_remove(ite);
+			return std::nullopt;
+		}
+		_recent.splice(_recent.begin(), _recent, ite->second.position);
+		return path;
+	}
+	/* The fetch of name from upstream, a running one when there is. */
+	std::shared_ptr<cache_fetch> fetch(const std::string& name) {
+		if (auto ite = _fetching.find(name); ite != _fetching.end()) return ite->second;
+		auto fetch = std::make_shared<cache_fetch>();
+		fetch->name = name;
+		fetch->path = _dir + name;
+		fetch->partial = mfcslib::hidden_sibling(fetch->path, ".part");
+		_fetching[name] = fetch;
+		std::thread(_run, fetch, _ip, _port, _event_fd).detach();
+		return fetch;
+	}
+	/* Clear the event and take the fetches that ended since, the files that arrived whole join the cache. */
+	std::vector<std::shared_ptr<cache_fetch>> collect() {
+		uint64_t count = 0;
+		::read(_event_fd, &count, sizeof count);
+		std::vector<std::shared_ptr<cache_fetch>> ended;
+		for (auto ite = _fetching.begin(); ite != _fetching.end();) {
+			auto state = ite->second->state.load(std::memory_order_acquire);
+			if (state != cache_fetch::DONE && state != cache_fetch::FAILED) {
+				++ite;
+				continue;
+			}
+			if (state == cache_fetch::DONE) _insert(ite->first);
+			ended.push_back(std::move(ite->second));
+			ite = _fetching.erase(ite);
+		}
+		_evict();
+		return ended;
+	}
+
+private:
+	struct entry
+	{
+		uint64_t size;
+		std::list<std::string>::iterator position;
+	};
+	std::string _dir;
+	uint64_t _quota = CACHE_QUOTA;
+	std::string _ip;
+	uint16_t _port = 0;
+	int _event_fd = -1;
+	/* Names, the most recently used first. */
+	std::list<std::string> _recent;
+	std::unordered_map<std::string, entry> _entries;
+	uint64_t _used = 0;
+	std::unordered_map<std::string, std::shared_ptr<cache_fetch>> _fetching;
+
+	void _insert(const std::string& name) {
+		struct stat st;
+		if (::stat((_dir + name).c_str(), &st) < 0) return;
+		if (auto ite = _entries.find(name); ite != _entries.end()) _remove(ite, false);
+		_recent.push_front(name);
+		_entries[name] = { uint64_t(st.st_size), _recent.begin() };
+		_used += st.st_size;
+	}
+	void _remove(std::unordered_map<std::string, entry>::iterator ite, bool unlink_file = true) {
+		if (unlink_file) ::unlink((_dir + ite->first).c_str());
+		_used -= ite->second.size;
+		_recent.erase(ite->second.position);
+		_entries.erase(ite);
+	}
+	/* Clients still reading an evicted file keep it open until they are done. */
+	void _evict() {
+		while (_used > _quota && !_recent.empty()) _remove(_entries.find(_recent.back()));
+	}
+
+	/* Pokes event_fd every CACHE_SIGNAL_BYTES so readers waiting on the fetch go on. */
+	static void _run(std::shared_ptr<cache_fetch> fetch, std::string ip, uint16_t port, int event_fd) {
+		auto signal = [event_fd]() {
+			uint64_t one = 1;
+			::write(event_fd, &one, sizeof one);
+		};
+		try {
+			mfcslib::NetworkSocket upstream(ip, port);
+			timeval timeout{ CACHE_TIMEOUT, 0 };
+			setsockopt(upstream.get_fd(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+			setsockopt(upstream.get_fd(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+			_write_all(upstream.get_fd(), "g/" + fetch->name);
+			std::string reply;
+			for (char ch = 0; reply != "0";) {
+				_read_exact(upstream.get_fd(), &ch, 1);
+				if (ch == '\0') break;
+				reply += ch;
+			}
+			if (!reply.starts_with('/')) throw mfcslib::file_exception("Upstream does not have the file.");
+			std::string_view fields(reply);
+			fields.remove_prefix(1);
+			uint64_t size = std::stoull(std::string(mfcslib::pop_field(fields)));
+			mfcslib::File output(fetch->partial);
+			output.open_random_access(mfcslib::WRONLY);
+			output.truncate(0);
+			output.preallocate(0, size);
+			fetch->size = size;
+			fetch->state.store(cache_fetch::RECEIVING, std::memory_order_release);
+			signal();
+			/* Plain data, even for a sparse file. */
+			_write_all(upstream.get_fd(), "1");
+			auto buffer = mfcslib::make_buffer<Byte>(CACHE_SIGNAL_BYTES);
+			mfcslib::crc32c crc;
+			uint64_t received = 0, signalled = 0;
+			while (received < size) {
+				auto ret = ::read(upstream.get_fd(), buffer.get_ptr(), std::min<uint64_t>(buffer.length(), size - received));
+				if (ret <= 0) throw mfcslib::peer_exception("Upstream closed in the middle of the file.");
+				for (ssize_t written = 0; written < ret;) written += output.pwrite(buffer, written, ret - written, received + written);
+				crc.update(buffer.get_ptr(), ret);
+				received += ret;
+				fetch->received.store(received, std::memory_order_release);
+				if (received - signalled >= CACHE_SIGNAL_BYTES) {
+					signal();
+					signalled = received;
+				}
+			}
+			uint32_t expected = 0;
+			_read_exact(upstream.get_fd(), reinterpret_cast<char*>(&expected), sizeof expected);
+			if (expected != crc.value()) throw mfcslib::peer_exception("Checksum mismatch on the file from upstream.");
+			mfcslib::store_checksum(output.get_fd(), expected);
+			if (::rename(fetch->partial.c_str(), fetch->path.c_str()) < 0) throw mfcslib::file_exception(strerror(errno));
+			fetch->crc = expected;
+			fetch->state.store(cache_fetch::DONE, std::memory_order_release);
+		}
+		catch (const mfcslib::basic_exception& e) {}
+		catch (const std::exception& e) {}
+		if (fetch->state.load(std::memory_order_acquire) != cache_fetch::DONE) {
+			::unlink(fetch->partial.c_str());
+			fetch->state.store(cache_fetch::FAILED, std::memory_order_release);
+		}
+		signal();
+	}
+	static void _write_all(int sock, std::string_view data) {
+		while (!data.empty()) {
+			auto ret = ::send(sock, data.data(), data.size(), MSG_NOSIGNAL);
+			if (ret <= 0) throw mfcslib::socket_exception(ret < 0 ? strerror(errno) : "Connection closed.");
+			data.remove_prefix(ret);
+		}
+	}
+	static void _read_exact(int sock, char* data, size_t len) {
+		while (len > 0) {
+			auto ret = ::read(sock, data, len);
+			if (ret <= 0) throw mfcslib::peer_exception("Upstream closed in the middle of a reply.");
+			data += ret;
+			len -= ret;
+		}
+	}
+};
+#endif // !CACHE_HPP
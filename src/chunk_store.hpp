@@ -0,0 +1,126 @@
+#ifndef CHUNK_STORE_HPP
+#define CHUNK_STORE_HPP
+#include <cstdio>
+#include <optional>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include "../include/chunker.hpp"
+#include "../include/io.hpp"
+#define CHUNK_ENTRY_LENGTH 36
+
+/*
+ * Content-addressed store of file chunks. Every unique chunk is kept once as
+ * <dir>/<first two hex digits>/<sha256 hex>, and every file uploaded through
+ * it as a recipe listing its chunks in <dir>/recipes/<name>.
+ */
+class chunk_store
+{
+public:
+	chunk_store() = default;
+	~chunk_store() = default;
+
+	void init(const string& dir) {
+		_dir = dir;
+		if (_dir.back() != '/') _dir += '/';
+		mkdir(_dir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP);
+		mkdir((_dir + "recipes").c_str(), S_IRWXU | S_IRGRP | S_IXGRP);
+	}
+	bool enabled() const {
+		return !_dir.empty();
+	}
+	string chunk_path(const mfcslib::sha256_digest& digest) const {
+		auto hex = mfcslib::to_hex(digest.data(), digest.size());
+		return _dir + hex.substr(0, 2) + '/' + hex;
+	}
+	bool has(const mfcslib::sha256_digest& digest) const {
+		struct stat st;
+		return stat(chunk_path(digest).c_str(), &st) == 0;
+	}
+	/* Keep a chunk that arrived from a client after checking it really has that digest. */
+	void put(const mfcslib::sha256_digest& digest, mfcslib::TypeArray<Byte>& data, size_t len) {
+		if (mfcslib::sha256::of(data.get_ptr(), len) != digest)
+			throw mfcslib::peer_exception("Chunk content does not match its digest.");
+		auto path = chunk_path(digest);
+		mkdir(path.substr(0, path.find_last_of('/')).c_str(), S_IRWXU | S_IRGRP | S_IXGRP);
+		auto tmp_path = path + ".tmp";
+		{
+			mfcslib::File chunk(tmp_path);
+			chunk.open(true, mfcslib::WRONLY);
+			for (size_t written = 0; written < len;) {
+				written += chunk.write(data, written, len - written);
+			}
+		}
+		if (rename(tmp_path.c_str(), path.c_str()) < 0)
+			throw mfcslib::file_exception(strerror(errno));
+	}
+
+	void save_recipe(const string& name, const std::vector<mfcslib::chunk_info>& chunks) {
+		string content;
+		for (auto& chunk : chunks) {
+			content += mfcslib::to_hex(chunk.digest.data(), chunk.digest.size());
+			content += ' ' + std::to_string(chunk.length) + '\n';
+		}
+		auto path = _recipe_path(name);
+		auto tmp_path = path + ".tmp";
+		{
+			mfcslib::File recipe(tmp_path);
+			recipe.open(true, mfcslib::WRONLY);
+			recipe.write(content);
+		}
+		if (rename(tmp_path.c_str(), path.c_str()) < 0)
+			throw mfcslib::file_exception(strerror(errno));
+	}
+	std::optional<std::vector<mfcslib::chunk_info>> load_recipe(const string& name) const {
+		if (!enabled()) return {};
+		FILE* recipe = fopen(_recipe_path(name).c_str(), "r");
+		if (recipe == nullptr) return {};
+		std::vector<mfcslib::chunk_info> chunks;
+		char hex[65]{ 0 };
+		uint32_t length = 0;
+		uintmax_t offset = 0;
+		while (fscanf(recipe, "%64s %u", hex, &length) == 2) {
+			mfcslib::chunk_info chunk{ offset, length, {} };
+			for (size_t i = 0; i < chunk.digest.size(); ++i) {
+				chunk.digest[i] = uint8_t(mfcslib::hex_str_to_char(std::string_view(hex + i * 2, 2)));
+			}
+			chunks.push_back(chunk);
+			offset += length;
+		}
+		fclose(recipe);
+		return chunks;
+	}
+
+	/*
+	 * Write a file out of its chunks. Chunks landing on block boundaries are
+	 * cloned where the filesystem supports reflinks, the rest are copied in
+	 * the kernel with copy_file_range.
+	 */
+	void assemble(const std::vector<mfcslib::chunk_info>& chunks, mfcslib::File& out) const {
+		uintmax_t total = 0;
+		for (auto& chunk : chunks) total += chunk.length;
+		out.truncate(total);
+		for (auto& chunk : chunks) {
+			mfcslib::File source(chunk_path(chunk.digest));
+			source.open_read_only();
+			if (chunk.offset % CLONE_ALIGNMENT == 0 &&
+				(chunk.length % CLONE_ALIGNMENT == 0 || chunk.offset + chunk.length == total)) {
+				file_clone_range range{ source.get_fd(), 0, chunk.length, chunk.offset };
+				if (ioctl(out.get_fd(), FICLONERANGE, &range) == 0) continue;
+			}
+			loff_t in_off = 0, out_off = chunk.offset;
+			while (in_off < chunk.length) {
+				auto ret = copy_file_range(source.get_fd(), &in_off, out.get_fd(), &out_off, chunk.length - in_off, 0);
+				if (ret <= 0) throw mfcslib::file_exception(ret < 0 ? strerror(errno) : "Chunk is shorter than its recipe says.");
+			}
+		}
+	}
+
+private:
+	static constexpr uintmax_t CLONE_ALIGNMENT = 4096;
+	string _dir;
+
+	string _recipe_path(const string& name) const {
+		return _dir + "recipes/" + name;
+	}
+};
+#endif // !CHUNK_STORE_HPP
@@ -1,19 +1,52 @@
 #ifndef CL_HPP
 #define CL_HPP
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/sendfile.h>
 #include <iostream>
+#include "../include/chunker.hpp"
+#include "../include/delta.hpp"
 #include "../include/io.hpp"
+#include "../include/local.hpp"
+#include "../include/rudp.hpp"
+#include "../include/send_engine.hpp"
+#include "../include/sparse.hpp"
+#include "../include/tree.hpp"
+#include "message_log.hpp"
+#include "message_stream.hpp"
+#include "mirror.hpp"
+#include "resume.hpp"
+#include "session.hpp"
 #define BUFFER_SIZE 64
-#define MAXARRSZ 1024'000'000
-#define NUMSTOP 20'000
+#define PART_SIZE 8'388'608
+#define MAX_STREAMS 16
+#define PROBE_INTERVAL 500ms
+#define RETRY_TIMES 8
+#define RETRY_FIRST_DELAY 1s
+#define RETRY_MAX_DELAY 32s
+#define PREFETCH_PIECES 16
+#define RANGE_MIN 1'048'576
+#define RANGE_MAX 67'108'864
+#define RANGE_TIME 500ms
 using std::cout;
 using std::cerr;
 using std::endl;
 using std::to_string;
 using std::invalid_argument;
 using std::string_view;
+using std::thread;
+using std::vector;
 using namespace mfcslib;
 
 void send_msg_to(mfcslib::NetworkSocket& target, const string_view& msg) {
@@ -25,24 +58,103 @@ void send_msg_to(mfcslib::NetworkSocket& target, const string_view& msg) {
 		perror("Something wrong with the server");
 	}
 }
-void send_file_to(mfcslib::NetworkSocket& target, mfcslib::File& file) {
-	string request = "f/" + file.filename() + '/' + file.size_string();
+/* Read a reply of the form "/<size>" terminated by '\0'. A single '0' means failure. */
+string read_reply(mfcslib::NetworkSocket& target) {
+	string reply;
+	while (true) {
+		char ch = 0;
+		auto ret = target.read(&ch, 1);
+		if (ret <= 0) throw peer_exception("Connection closed while reading reply.");
+		if (ch == '\0') break;
+		reply += ch;
+		if (reply == "0") break;
+	}
+	return reply;
+}
+
+void write_all(mfcslib::NetworkSocket& target, string_view data) {
+	while (!data.empty()) {
+		auto ret = target.write(data);
+		if (ret <= 0) throw socket_exception(ret < 0 ? strerror(errno) : "Connection closed.");
+		data.remove_prefix(ret);
+	}
+}
+
+void read_exact(mfcslib::NetworkSocket& target, char* data, size_t len) {
+	while (len > 0) {
+		auto ret = target.read(data, len);
+		if (ret <= 0) throw peer_exception("Connection closed in the middle of a reply.");
+		data += ret;
+		len -= ret;
+	}
+}
+
+/* Send only the data extents of a file with holes, the server leaves the rest as holes too. */
+void send_file_sparse(mfcslib::NetworkSocket& target, mfcslib::File& file) {
+	auto file_sz = file.size();
+	auto extents = data_extents(file.get_fd(), file_sz);
+	auto checksum = std::async(std::launch::async, crc32c_of_extents, file.get_fd(), extents);
+	target.write("h/" + to_string(file_sz) + '/' + to_string(extents.size()) + '/' + file.filename());
+	if (target.read() != '1') throw peer_exception("Server refused the sparse upload.");
+	write_all(target, serialize_extents(extents));
+	auto data_sz = extents_length(extents);
+	uintmax_t have_send = 0;
+	for (auto& item : extents) {
+		off_t off = item.offset;
+		while (uintmax_t(off) < item.offset + item.length) {
+			auto ret = sendfile(target.get_fd(), file.get_fd(), &off, item.offset + item.length - off);
+			if (ret <= 0) throw socket_exception(ret < 0 ? strerror(errno) : "File shrank while sending.");
+			have_send += ret;
+			progress_bar(have_send, data_sz);
+		}
+	}
+	cout << "\nSent " << data_sz << " bytes of data for a sparse file of " << file_sz << " bytes.\n";
+	auto crc = checksum.get();
+	write_all(target, string_view(reinterpret_cast<const char*>(&crc), sizeof crc));
+	if (target.read() != '1') throw peer_exception("Server did not confirm the whole file.");
+}
+
+/*
+ * The CRC32C of the file is taken on another thread while sendfile runs,
+ * mostly from the page cache, and sent after the data for the server to check.
+ */
+void send_file_to(mfcslib::NetworkSocket& target, mfcslib::File& file, const send_options& options = {}) {
+	if (is_sparse(file.get_fd())) {
+		send_file_sparse(target, file);
+		return;
+	}
+	auto file_sz = file.size();
+	off_t off = 0;
+	auto checksum = std::async(std::launch::async, file_checksum, file.get_fd(), file_sz);
+	target.write("u/" + to_string(file_sz) + '/' + file.filename());
+	auto reply = read_reply(target);
+	if (reply.size() > 1) {
+		string_view fields(reply);
+		fields.remove_prefix(1);
+		auto offset = std::stoull(string(pop_field(fields)));
+		auto crc = (uint32_t)std::stoul(string(pop_field(fields)));
+		if (offset > 0 && offset < file_sz && crc32c_of_file(file.get_fd(), offset) == crc) {
+			off = offset;
+			cout << "Resuming from byte " << off << ".\n";
+		}
+	}
+	string request = "f/" + file.filename() + '/' + to_string(file_sz);
+	if (off > 0) request += '/' + to_string(off);
 	target.write(request);
 	char code = target.read();
 	if (code != '1') {
 		string error_msg = "Error while receving code from server in send file:\n";
 		error_msg += strerror(errno);
-		throw runtime_error(error_msg);
+		throw peer_exception(error_msg);
 	}
-	off_t off = 0;
-	uintmax_t have_send = 0;
-	auto file_sz = file.size();
+	uintmax_t have_send = off;
+	send_engine engine(options);
 	while (have_send < file_sz) {
-		auto ret = sendfile(target.get_fd(), file.get_fd(), &off, file_sz);
-		if(ret < 0)
-		{
-			perror("Sendfile failed");
-			break;
+		auto ret = engine.send(target.get_fd(), file.get_fd(), &off, file_sz - have_send);
+		if (ret <= 0) {
+			string error_msg = string(options.name()) + " failed: ";
+			error_msg += ret < 0 ? strerror(errno) : "connection closed";
+			throw socket_exception(error_msg);
 		}
 		have_send += ret;
 	#ifdef DEBUG
@@ -51,59 +163,1092 @@ void send_file_to(mfcslib::NetworkSocket& target, mfcslib::File& file) {
 		progress_bar(have_send, file_sz);
 	}
 	cout << '\n';
+	auto crc = checksum.get();
+	write_all(target, string_view(reinterpret_cast<const char*>(&crc), sizeof crc));
+	if (target.read() != '1') throw peer_exception("Server did not confirm the whole file.");
 }
-void get_file_from(mfcslib::NetworkSocket& tartget, const string& file) {
-	string request = "g/";
-	auto idx = file.find('/');
-	if (idx != string::npos) {
-		request += file.substr(idx + 1);
-	}
-	else request += file;
-	tartget.write(request);
-	TypeArray<Byte> msg(BUFFER_SIZE);
-	auto ret = tartget.read(msg);
-	if (ret <= 1) {
+/*
+ * Upload file to chain[0], the server target reached, which relays it down
+ * the rest of the chain while storing it. Returns whether every server
+ * confirmed its copy.
+ */
+bool send_file_chain(mfcslib::NetworkSocket& target, mfcslib::File& file, const vector<string>& chain) {
+	auto file_sz = file.size();
+	auto checksum = std::async(std::launch::async, file_checksum, file.get_fd(), file_sz);
+	string request = "n/" + to_string(file_sz) + '/' + file.filename() + '/';
+	for (size_t i = 1; i < chain.size(); ++i) request += chain[i] + (i + 1 < chain.size() ? "," : "");
+	target.write(request);
+	if (target.read() != '1') throw peer_exception("Server refused the chain upload.");
+	off_t off = 0;
+	while (uintmax_t(off) < file_sz) {
+		auto ret = sendfile(target.get_fd(), file.get_fd(), &off, file_sz - off);
+		if (ret <= 0) throw socket_exception(ret < 0 ? strerror(errno) : "Connection closed.");
+		progress_bar(off, file_sz);
+	}
+	cout << '\n';
+	auto crc = checksum.get();
+	write_all(target, string_view(reinterpret_cast<const char*>(&crc), sizeof crc));
+	auto reply = read_reply(target);
+	bool whole = reply.size() == chain.size() + 1;
+	for (size_t i = 0; i < chain.size(); ++i) {
+		bool ok = i + 1 < reply.size() && reply[i + 1] == '1';
+		whole = whole && ok;
+		cout << chain[i] << (ok ? ": stored\n" : ": failed\n");
+	}
+	return whole;
+}
+/*
+ * Have every server listed fetch file from the others, trading pieces until
+ * each holds all of it; those that hold it already seed the rest. Returns
+ * whether every server ended up with the whole file.
+ */
+bool join_swarm(const string& file, const vector<string>& servers) {
+	vector<std::unique_ptr<mfcslib::NetworkSocket>> targets;
+	for (size_t i = 0; i < servers.size(); ++i) {
+		string request = "j/" + file + '/';
+		for (size_t j = 0; j < servers.size(); ++j) {
+			if (j == i) continue;
+			if (request.back() != '/') request += ',';
+			request += servers[j];
+		}
+		auto idx = servers[i].find(':');
+		targets.push_back(std::make_unique<mfcslib::NetworkSocket>(servers[i].substr(0, idx), (uint16_t)std::stoul(servers[i].substr(idx + 1))));
+		targets.back()->write(request);
+		if (targets.back()->read() != '1') {
+			cerr << servers[i] << ": refused to join\n";
+			targets.back().reset();
+		}
+	}
+	auto start = sc::steady_clock::now();
+	vector<pollfd> fds;
+	for (auto& target : targets) fds.push_back({ target ? target->get_fd() : -1, POLLIN, 0 });
+	bool whole = std::ranges::all_of(targets, [](auto& target) { return target != nullptr; });
+	for (size_t left = std::ranges::count_if(targets, [](auto& target) { return target != nullptr; }); left > 0;) {
+		if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) throw socket_exception(strerror(errno));
+		for (size_t i = 0; i < fds.size(); ++i) {
+			if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+			char code = '0';
+			::read(fds[i].fd, &code, sizeof code);
+			fds[i].fd = -1;
+			--left;
+			whole = whole && code == '1';
+			cout << servers[i] << (code == '1' ? ": holds it after " : ": failed after ")
+				<< sc::duration<double>(sc::steady_clock::now() - start).count() << "s\n";
+		}
+	}
+	return whole;
+}
+/*
+ * Have target make its copy of dir, a directory in FileToSend, match the one
+ * on source, comparing their Merkle trees so that only what differs moves.
+ * Returns whether it ended up in sync.
+ */
+bool sync_directory(mfcslib::NetworkSocket& target, const string& dir, const string& source) {
+	auto start = sc::steady_clock::now();
+	target.write("x/" + source + '/' + dir);
+	if (target.read() != '1') {
+		cerr << "Refused to sync, Sync is off or the directory is being synced already.\n";
+		return false;
+	}
+	auto reply = read_reply(target);
+	if (reply.size() <= 1) {
+		cerr << "Sync failed.\n";
+		return false;
+	}
+	string_view fields(reply);
+	fields.remove_prefix(1);
+	auto fetched = pop_field(fields), removed = pop_field(fields), bytes = pop_field(fields), failed = fields;
+	cout << "Synced from " << source << " in " << sc::duration<double>(sc::steady_clock::now() - start).count() << "s: "
+		<< fetched << " files fetched (" << bytes << " bytes), " << removed << " removed";
+	if (failed != "0") cout << ", " << failed << " failed";
+	cout << '\n';
+	return failed == "0";
+}
+/*
+ * Have source send file, a name in its FileToSend, straight to the server at
+ * destination without the data passing through here. Returns whether
+ * destination stored it whole.
+ */
+bool push_file(mfcslib::NetworkSocket& source, const string& file, const string& destination) {
+	auto start = sc::steady_clock::now();
+	source.write("z/" + destination + '/' + file);
+	bool shown = false;
+	while (true) {
+		auto reply = read_reply(source);
+		if (!reply.starts_with('/')) {
+			cerr << "Refused to push, Push is off, the file is missing or " << destination << " would not take it.\n";
+			return false;
+		}
+		string_view fields(reply);
+		fields.remove_prefix(1);
+		auto sent = std::stoull(string(pop_field(fields)));
+		auto size = std::stoull(string(pop_field(fields)));
+		if (sent > 0) shown = progress_bar(sent, size);
+		if (fields.empty()) continue;
+		if (shown) cout << '\n';
+		if (fields != "1") {
+			cerr << "Push to " << destination << " failed after " << sent << " bytes.\n";
+			return false;
+		}
+		cout << "Pushed " << size << " bytes to " << destination << " in " << sc::duration<double>(sc::steady_clock::now() - start).count() << "s\n";
+		return true;
+	}
+}
+void get_file_from(mfcslib::NetworkSocket& target, const string& file) {
+	auto name = file.substr(file.find('/') + 1);
+	auto sidecar = resume_record::path_for(file);
+	resume_record record;
+	uintmax_t received = 0;
+	if (record.load(sidecar) && record.offset > 0) {
+		target.write("c/" + to_string(record.offset) + '/' + name);
+		auto reply = read_reply(target);
+		if (reply.size() > 1) {
+			string_view fields(reply);
+			fields.remove_prefix(1);
+			auto size = std::stoull(string(pop_field(fields)));
+			auto crc = (uint32_t)std::stoul(string(pop_field(fields)));
+			if (size == record.size && crc == record.crc) received = record.offset;
+		}
+	}
+	if (received > 0) {
+		target.write("r/" + to_string(received) + '/' + to_string(record.size - received) + '/' + name);
+		cout << "Resuming from byte " << received << ".\n";
+	}
+	else target.write("g/" + name);
+	auto reply = read_reply(target);
+	if (reply.size() <= 1) {
 		cerr<<"File might not be found in the server.\n";
 		exit(1);
 	}
-	tartget.write("1");
-	mfcslib::File file_output_stream(file);
-	file_output_stream.open(true, WRONLY);
-	auto msg_string = msg.to_string();
-	auto sizeOfFile = std::stoull(msg_string.substr(msg_string.find_last_of('/')+1));
-	if (sizeOfFile < MAXARRSZ) {
-		auto bufferForFile = mfcslib::make_array<Byte>(sizeOfFile);
-		ssize_t ret = 0;
-		auto bytesLeft = sizeOfFile;
-		while (true) {
-			ret += tartget.read(bufferForFile, ret, bytesLeft);
-			bytesLeft = sizeOfFile - ret;
-			progress_bar(ret, sizeOfFile);
-			if (ret <= 0 || bytesLeft <= 0) break;
+	string_view fields(reply);
+	fields.remove_prefix(1);
+	auto file_sz = std::stoull(string(pop_field(fields)));
+	mfcslib::File output(file);
+	output.open_random_access(WRONLY);
+	/* The server offers the extents of a sparse file, those need no resuming. */
+	if (received == 0 && !fields.empty()) {
+		target.write("s");
+		auto count = std::stoull(string(fields));
+		string table(count * extent_entry_length, '\0');
+		read_exact(target, table.data(), table.size());
+		output.truncate(0);
+		output.truncate(file_sz);
+		extent_writer writer(output.get_fd(), parse_extents(table, file_sz));
+		auto data_sz = writer.remaining();
+		auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+		while (writer.remaining() > 0) {
+			auto ret = target.read(buffer, 0, std::min<uintmax_t>(buffer.length(), writer.remaining()));
+			if (ret <= 0) throw peer_exception("Connection closed before the whole file arrived.");
+			writer.feed(buffer.get_ptr(), ret);
+			progress_bar(data_sz - writer.remaining(), data_sz);
+		}
+		uint32_t expected = 0;
+		read_exact(target, reinterpret_cast<char*>(&expected), sizeof expected);
+		resume_record::remove(sidecar);
+		if (expected != writer.checksum()) {
+			unlink(file.c_str());
+			throw peer_exception("Checksum mismatch, discarded the received file.");
+		}
+		cout << "\nReceived " << data_sz << " bytes of data for a sparse file of " << file_sz << " bytes.\n";
+		return;
+	}
+	target.write("1");
+	output.truncate(received);
+	record.size = file_sz;
+	crc32c crc(received > 0 ? record.crc : 0), sent_crc;
+	auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+	auto last_checkpoint = received;
+	while (received < file_sz) {
+		auto ret = target.read(buffer, 0, std::min<uintmax_t>(buffer.length(), file_sz - received));
+		if (ret <= 0) {
+			record.checkpoint(output, received, crc.value(), sidecar);
+			throw peer_exception("Connection closed before the whole file arrived.");
+		}
+		for (ssize_t written = 0; written < ret;) {
+			written += output.pwrite(buffer, written, ret - written, received + written);
+		}
+		crc.update(buffer.get_ptr(), ret);
+		sent_crc.update(buffer.get_ptr(), ret);
+		received += ret;
+		progress_bar(received, file_sz);
+		if (received - last_checkpoint >= RESUME_CHECKPOINT) {
+			record.checkpoint(output, received, crc.value(), sidecar);
+			last_checkpoint = received;
+		}
+	}
+	/* The server follows the data with the CRC32C of what it sent. */
+	uint32_t expected = 0;
+	read_exact(target, reinterpret_cast<char*>(&expected), sizeof expected);
+	resume_record::remove(sidecar);
+	if (expected != sent_crc.value()) {
+		unlink(file.c_str());
+		throw peer_exception("Checksum mismatch, discarded the received file.");
+	}
+	store_checksum(output.get_fd(), crc.value());
+	cout << '\n';
+}
+
+/*
+ * Same-host transfers through the server's Unix socket: the open file is
+ * handed over instead of its data, and the receiving side reflinks or
+ * copies it in the kernel.
+ */
+void send_file_local(const string& socket_path, mfcslib::File& file) {
+	mfcslib::NetworkSocket target(connect_local(socket_path), sockaddr_in{});
+	send_with_fd(target.get_fd(), "o/" + file.filename(), file.get_fd());
+	if (target.read() != '1') throw peer_exception("Server did not store the file.");
+	cout << "Handed " << file.size() << " bytes over " << socket_path << ".\n";
+}
+void get_file_local(const string& socket_path, const string& file) {
+	mfcslib::NetworkSocket target(connect_local(socket_path), sockaddr_in{});
+	target.write("q/" + file.substr(file.find_last_of('/') + 1));
+	string reply;
+	int file_fd = -1;
+	while (reply != "0") {
+		char ch = 0;
+		auto ret = recv_with_fd(target.get_fd(), &ch, 1, file_fd);
+		if (ret <= 0) {
+			if (file_fd >= 0) close(file_fd);
+			throw peer_exception("Connection closed while reading reply.");
 		}
-		file_output_stream.write(bufferForFile);
+		if (ch == '\0') break;
+		reply += ch;
+	}
+	if (reply.size() <= 1 || file_fd < 0) {
+		if (file_fd >= 0) close(file_fd);
+		cerr << "File might not be found in the server.\n";
+		exit(1);
+	}
+	auto file_sz = std::stoull(reply.substr(1));
+	bool cloned = false;
+	try {
+		mfcslib::File output(file);
+		output.open(true, WRONLY);
+		cloned = clone_or_copy(file_fd, output.get_fd(), file_sz);
+	}
+	catch (const basic_exception& e) {
+		close(file_fd);
+		throw;
+	}
+	close(file_fd);
+	cout << (cloned ? "Cloned " : "Copied ") << file_sz << " bytes over " << socket_path << ".\n";
+}
+
+/* A UDP socket on the address this connection uses, connected to port on the server. */
+int connect_udp(mfcslib::NetworkSocket& target, uint16_t port) {
+	sockaddr_in local{}, peer{};
+	socklen_t len = sizeof local;
+	getsockname(target.get_fd(), (sockaddr*)&local, &len);
+	len = sizeof peer;
+	getpeername(target.get_fd(), (sockaddr*)&peer, &len);
+	int fd = rudp_socket(local);
+	peer.sin_port = htons(port);
+	if (::connect(fd, (sockaddr*)&peer, sizeof peer) < 0) {
+		::close(fd);
+		throw socket_exception(strerror(errno));
+	}
+	return fd;
+}
+void print_udp_result(const char* verb, uintmax_t size, sc::steady_clock::time_point start, const rudp_stats* stats) {
+	auto seconds = sc::duration<double>(sc::steady_clock::now() - start).count();
+	cout << verb << ' ' << size << " bytes over UDP in " << seconds << "s, " << size / seconds / 1e6 << " MB/s";
+	if (stats != nullptr) cout << ", " << stats->retransmits << " of " << stats->packets << " packets resent";
+	cout << ".\n";
+}
+/* Send file over UDP; loss is the fraction of packets both ends drop on purpose. */
+void send_file_udp(mfcslib::NetworkSocket& target, mfcslib::File& file, double loss) {
+	target.write("v/f/" + to_string(uint64_t(loss * 1e6)) + '/' + file.size_string() + '/' + file.filename());
+	auto reply = read_reply(target);
+	if (reply.size() <= 1) throw peer_exception("Server refused the UDP transfer.");
+	string_view fields(reply);
+	fields.remove_prefix(1);
+	auto port = (uint16_t)std::stoul(string(pop_field(fields)));
+	auto id = (uint32_t)std::stoul(string(pop_field(fields)));
+	int fd = connect_udp(target, port);
+	auto start = sc::steady_clock::now();
+	rudp_sender sender(fd, id, true, file.get_fd(), file.size(), { loss });
+	try {
+		/* The server's reply decides, the FIN_ACK may just have been lost. */
+		sender.run();
+	}
+	catch (...) {
+		::close(fd);
+		throw;
 	}
-	else {
-		auto bufferForFile = mfcslib::make_array<Byte>(MAXARRSZ);
-		auto ret = 0ull;
-		auto bytesWritten = ret;
+	::close(fd);
+	if (target.read() != '1') throw peer_exception("Server did not confirm the whole file.");
+	print_udp_result("Sent", file.size(), start, &sender.stats());
+}
+void get_file_udp(mfcslib::NetworkSocket& target, const string& file, double loss) {
+	target.write("v/g/" + to_string(uint64_t(loss * 1e6)) + '/' + file.substr(file.find_last_of('/') + 1));
+	auto reply = read_reply(target);
+	if (reply.size() <= 1) {
+		cerr << "File might not be found in the server.\n";
+		exit(1);
+	}
+	string_view fields(reply);
+	fields.remove_prefix(1);
+	auto port = (uint16_t)std::stoul(string(pop_field(fields)));
+	auto id = (uint32_t)std::stoul(string(pop_field(fields)));
+	auto size = std::stoull(string(pop_field(fields)));
+	mfcslib::File output(file);
+	output.open(true, RDWR);
+	int fd = connect_udp(target, port);
+	auto start = sc::steady_clock::now();
+	bool ok = false;
+	try {
+		ok = rudp_receiver(fd, id, true, output.get_fd(), size, { loss }).run();
+	}
+	catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+	if (!ok) {
+		unlink(output.get_absolute().c_str());
+		throw peer_exception("File did not arrive whole over UDP.");
+	}
+	print_udp_result("Received", size, start, nullptr);
+}
+
+/*
+ * Run op on a fresh connection, reconnecting with exponential backoff when
+ * the transfer breaks. The transfers resume from their last checkpoint.
+ */
+template<typename F>
+void with_retry(const string& ip, uint16_t port, F&& op) {
+	auto delay = RETRY_FIRST_DELAY;
+	std::mt19937 engine(std::random_device{}());
+	for (int attempt = 1;; ++attempt) {
+		try {
+			mfcslib::NetworkSocket target(ip, port);
+			op(target);
+			return;
+		}
+		catch (const mfcslib::file_exception& e) {
+			throw;
+		}
+		catch (const mfcslib::IO_exception& e) {
+			if (attempt >= RETRY_TIMES) throw;
+			cerr << "\nTransfer interrupted: " << e.what() << "\nRetrying in " << delay.count() << "s.\n";
+		}
+		std::this_thread::sleep_for(delay + sc::milliseconds(engine() % 1000));
+		delay = std::min(delay * 2, RETRY_MAX_DELAY);
+	}
+}
+
+/* Upload only what the server's copy of the file lacks. */
+void send_file_delta(mfcslib::NetworkSocket& target, mfcslib::File& file) {
+	auto file_sz = file.size();
+	target.write("d/" + to_string(file_sz) + '/' + file.filename());
+	auto reply = read_reply(target);
+	if (reply.size() <= 1) throw peer_exception("Server refused the delta upload.");
+	string_view fields(reply);
+	fields.remove_prefix(1);
+	auto block = std::stoull(string(pop_field(fields)));
+	auto count = std::stoull(string(pop_field(fields)));
+	auto basis_size = std::stoull(string(pop_field(fields)));
+	string sig_bytes(count * signature_length, '\0');
+	read_exact(target, sig_bytes.data(), sig_bytes.size());
+	delta_encoder encoder(file.get_fd(), file_sz, block, basis_size, parse_signatures(sig_bytes.data(), count));
+	string out;
+	uintmax_t have_send = 0;
+	for (bool more = true; more;) {
+		out.clear();
+		more = encoder.next(out);
+		write_all(target, out);
+		have_send += out.size();
+		if (encoder.position() > 0) progress_bar(encoder.position(), file_sz);
+	}
+	cout << "\nSent " << have_send << " bytes for a file of " << file_sz << " bytes.\n";
+	if (target.read() != '1') throw peer_exception("Server could not rebuild the file.");
+}
+
+/* Upload only the chunks of the file the server's chunk store does not hold yet. */
+void send_file_dedup(mfcslib::NetworkSocket& target, mfcslib::File& file) {
+	auto file_sz = file.size();
+	auto chunks = content_chunker::split_file(file.get_fd(), file_sz);
+	target.write("k/" + to_string(file_sz) + '/' + to_string(chunks.size()) + '/' + file.filename());
+	if (target.read() != '1') {
+		cerr << "Server has no chunk store, sending the whole file.\n";
+		send_file_to(target, file);
+		return;
+	}
+	string manifest;
+	for (auto& chunk : chunks) {
+		manifest.append(reinterpret_cast<const char*>(chunk.digest.data()), chunk.digest.size());
+		manifest.append(reinterpret_cast<const char*>(&chunk.length), sizeof(chunk.length));
+	}
+	write_all(target, manifest);
+	string missing((chunks.size() + 7) / 8, '\0');
+	read_exact(target, missing.data(), missing.size());
+	auto buffer = mfcslib::make_buffer<Byte>(content_chunker::MAX_CHUNK);
+	uintmax_t have_send = 0;
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		if (!(missing[i / 8] & (1 << (i % 8)))) continue;
+		for (size_t got = 0; got < chunks[i].length;) {
+			auto ret = file.pread(buffer, got, chunks[i].length - got, chunks[i].offset + got);
+			if (ret <= 0) throw file_exception("File shrank while sending.");
+			got += ret;
+		}
+		write_all(target, string_view(buffer.get_ptr(), chunks[i].length));
+		have_send += chunks[i].length;
+		progress_bar(chunks[i].offset + chunks[i].length, file_sz);
+	}
+	cout << "\nSent " << have_send << " bytes in new chunks for a file of " << file_sz << " bytes.\n";
+	if (target.read() != '1') throw peer_exception("Server could not store the file.");
+}
+
+/* Download only what the local copy of the file lacks. */
+void get_file_delta(mfcslib::NetworkSocket& target, const string& file) {
+	mfcslib::File basis(file);
+	try {
+		basis.open_read_only();
+	}
+	catch (const mfcslib::file_exception& e) {
+		get_file_from(target, file);
+		return;
+	}
+	auto name = file.substr(file.find('/') + 1);
+	auto basis_size = basis.size();
+	auto block = choose_block_size(basis_size);
+	auto sigs = compute_signatures(basis.get_fd(), basis_size, block);
+	target.write("e/" + to_string(block) + '/' + to_string(sigs.size()) + '/' + to_string(basis_size) + '/' + name);
+	auto reply = read_reply(target);
+	if (reply.size() <= 1) {
+		cerr << "File might not be found in the server.\n";
+		exit(1);
+	}
+	auto file_sz = std::stoull(reply.substr(1));
+	write_all(target, serialize_signatures(sigs));
+	auto temp_path = hidden_sibling(file, ".delta");
+	mfcslib::File output(temp_path);
+	output.open_random_access(WRONLY);
+	output.truncate(0);
+	delta_decoder decoder(basis.get_fd(), block, basis_size, output.get_fd());
+	auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+	uintmax_t have_received = 0;
+	while (!decoder.finished()) {
+		auto ret = target.read(buffer);
+		if (ret <= 0) {
+			unlink(temp_path.c_str());
+			throw peer_exception("Connection closed before the delta ended.");
+		}
+		decoder.feed(buffer.get_ptr(), ret);
+		have_received += ret;
+		if (decoder.written() > 0) progress_bar(decoder.written(), file_sz);
+	}
+	if (!decoder.verified()) {
+		unlink(temp_path.c_str());
+		throw peer_exception("Rebuilt file does not match the server's copy.");
+	}
+	if (rename(temp_path.c_str(), file.c_str()) < 0) throw file_exception(strerror(errno));
+	cout << "\nReceived " << have_received << " bytes for a file of " << file_sz << " bytes.\n";
+}
+
+/*
+ * Send a whole directory over one connection. A prefetch thread opens,
+ * reads and packs the files ahead of this one, which only sends.
+ */
+void send_directory(mfcslib::NetworkSocket& target, string root) {
+	while (root.size() > 1 && root.back() == '/') root.pop_back();
+	auto entries = scan_tree(root);
+	auto manifest = serialize_manifest(entries);
+	uintmax_t total = 0;
+	for (auto& entry : entries) total += entry.size;
+	target.write("t/" + to_string(entries.size()) + '/' + to_string(total) + '/' + to_string(manifest.size()) + '/' + root.substr(root.find_last_of('/') + 1));
+	if (target.read() != '1') throw peer_exception("Server refused the directory.");
+	write_all(target, manifest);
+	tree_packer packer(root, entries);
+	std::deque<tree_piece> ready;
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool done = false, stop = false;
+	std::exception_ptr error;
+	thread prefetcher([&]() {
+		try {
+			while (true) {
+				tree_piece piece;
+				bool more = packer.next(piece);
+				std::unique_lock<std::mutex> lock(mutex);
+				if (!more) break;
+				changed.wait(lock, [&]() { return ready.size() < PREFETCH_PIECES || stop; });
+				if (stop) break;
+				ready.push_back(std::move(piece));
+				changed.notify_all();
+			}
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		done = true;
+		changed.notify_all();
+	});
+	auto finish = [&]() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+			changed.notify_all();
+		}
+		prefetcher.join();
+	};
+	uintmax_t have_send = 0;
+	try {
 		while (true) {
-			ssize_t currentReturn = 0;
-			while (ret < (MAXARRSZ - NUMSTOP)) {
-				currentReturn = tartget.read(bufferForFile, ret, MAXARRSZ - ret);
-				if (currentReturn <= 0) break;
-				ret += currentReturn;
-				if (ret + bytesWritten >= sizeOfFile) break;
+			tree_piece piece;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&]() { return !ready.empty() || done; });
+				if (ready.empty()) break;
+				piece = std::move(ready.front());
+				ready.pop_front();
+				changed.notify_all();
+			}
+			if (piece.file) {
+				auto checksum = std::async(std::launch::async, file_checksum, piece.file->get_fd(), piece.length);
+				off_t off = 0;
+				while (uintmax_t(off) < piece.length) {
+					auto ret = sendfile(target.get_fd(), piece.file->get_fd(), &off, piece.length - off);
+					if (ret <= 0) throw socket_exception(ret < 0 ? strerror(errno) : "File shrank while sending.");
+				}
+				packer.checksums()[piece.index] = checksum.get();
+			}
+			else write_all(target, piece.packed);
+			have_send += piece.length;
+			if (have_send > 0) progress_bar(have_send, total);
+		}
+	}
+	catch (...) {
+		finish();
+		throw;
+	}
+	finish();
+	if (error) std::rethrow_exception(error);
+	auto& checksums = packer.checksums();
+	write_all(target, string_view(reinterpret_cast<const char*>(checksums.data()), checksums.size() * sizeof(uint32_t)));
+	cout << "\nSent " << entries.size() << " files of " << total << " bytes.\n";
+	if (target.read() != '1') throw peer_exception("Server did not confirm the whole directory.");
+}
+
+/* Fetch a whole directory from the server over one connection. */
+void get_directory(mfcslib::NetworkSocket& target, string root) {
+	while (root.size() > 1 && root.back() == '/') root.pop_back();
+	auto name = root.starts_with("./") ? root.substr(2) : root;
+	target.write("l/" + name);
+	auto reply = read_reply(target);
+	if (reply.size() <= 1) {
+		cerr << "Directory might not be found in the server.\n";
+		exit(1);
+	}
+	string_view fields(reply);
+	fields.remove_prefix(1);
+	auto count = std::stoull(string(pop_field(fields)));
+	auto total = std::stoull(string(pop_field(fields)));
+	auto manifest_len = std::stoull(string(pop_field(fields)));
+	target.write("1");
+	string manifest(manifest_len, '\0');
+	read_exact(target, manifest.data(), manifest.size());
+	tree_writer writer(root, parse_manifest(manifest, count));
+	auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+	while (writer.remaining() > 0) {
+		auto ret = target.read(buffer, 0, std::min<uintmax_t>(buffer.length(), writer.remaining()));
+		if (ret <= 0) throw peer_exception("Connection closed before the whole directory arrived.");
+		writer.feed(buffer.get_ptr(), ret);
+		progress_bar(total - writer.remaining(), total);
+	}
+	string trailer(count * sizeof(uint32_t), '\0');
+	read_exact(target, trailer.data(), trailer.size());
+	if (auto bad = writer.verify(trailer.data()); bad > 0)
+		throw peer_exception(to_string(bad) + " files failed their checksum and were removed.");
+	cout << "\nReceived " << count << " files of " << total << " bytes.\n";
+}
+
+/* Send every line of path, or of stdin for "-", as a message over one stream. */
+void stream_messages(const string& ip, uint16_t port, const string& path) {
+	std::ifstream file;
+	if (path != "-") {
+		file.open(path);
+		if (!file) throw file_exception("Fail to open the message file.");
+	}
+	std::istream& input = path == "-" ? std::cin : file;
+	message_stream remote(ip, port);
+	string line;
+	auto start = std::chrono::steady_clock::now();
+	while (std::getline(input, line)) {
+		remote.send(line);
+	}
+	remote.close();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	cout << "Stored " << remote.acked() << " messages in " << secs.count() << " s.\n";
+}
+
+/* Print the messages starting with prefix as the server gets them, one per line, until it hangs up. */
+void subscribe_messages(const string& ip, uint16_t port, const string& prefix) {
+	mfcslib::NetworkSocket server(ip, port);
+	server.write("w/" + prefix);
+	if (server.read() != '1') throw peer_exception("Server refused the subscription.");
+	string pending;
+	auto buffer = make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+	while (true) {
+		auto ret = server.read(buffer, 0, buffer.length());
+		if (ret <= 0) break;
+		pending.append(buffer.get_ptr(), ret);
+		size_t used = 0;
+		message_record_header header;
+		while (pending.size() - used >= sizeof header) {
+			memcpy(&header, pending.data() + used, sizeof header);
+			if (pending.size() - used - sizeof header < header.length) break;
+			string_view data(pending.data() + used + sizeof header, header.length);
+			if (header.offset == UINT64_MAX && data.size() == sizeof(uint64_t)) {
+				uint64_t dropped = 0;
+				memcpy(&dropped, data.data(), sizeof dropped);
+				cerr << "[" << dropped << " messages dropped]\n";
+			}
+			else {
+				cout.write(data.data(), data.size()) << '\n';
+			}
+			used += sizeof header + header.length;
+		}
+		pending.erase(0, used);
+		cout.flush();
+	}
+}
+
+/*
+ * Run every line of a batch file through one session, e.g.
+ *     f ./local/file
+ *     g remote_file
+ *     m some text
+ * Returns the number of requests that failed.
+ */
+size_t run_batch(const string& ip, uint16_t port, const string& list) {
+	std::ifstream input(list);
+	if (!input) throw file_exception("Fail to open the batch file.");
+	session remote(ip, port);
+	vector<std::pair<string, std::future<bool>>> results;
+	size_t failed = 0;
+	string line;
+	while (std::getline(input, line)) {
+		if (line.empty() || line[0] == '#') continue;
+		auto argument = line.size() > 2 && line[1] == ' ' ? line.substr(2) : string();
+		try {
+			if (argument.empty()) throw invalid_argument("Invalid line.");
+			switch (line[0])
+			{
+			case 'f': results.emplace_back(line, remote.put(argument)); break;
+			case 'g': results.emplace_back(line, remote.get(argument)); break;
+			case 'm': results.emplace_back(line, remote.message(argument)); break;
+			default: throw invalid_argument("Unknown request.");
+			}
+		}
+		catch (const file_exception& e) {
+			cerr << "Failed: " << line << ": " << e.what() << '\n';
+			++failed;
+		}
+		catch (const std::exception& e) {
+			cerr << "Failed: " << line << ": " << e.what() << '\n';
+			++failed;
+		}
+	}
+	auto total = results.size() + failed;
+	for (auto& [request, result] : results) {
+		if (result.get()) continue;
+		cerr << "Failed: " << request << '\n';
+		++failed;
+	}
+	cout << total - failed << " of " << total << " requests succeeded.\n";
+	return failed;
+}
+
+/* Hands out part indexes to the streams and takes back parts of failed streams. */
+class part_dispatcher
+{
+public:
+	part_dispatcher(size_t count) :_count(count) {}
+	bool take(size_t& idx) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_retry.empty()) {
+			idx = _retry.back();
+			_retry.pop_back();
+			return true;
+		}
+		if (_next >= _count) return false;
+		idx = _next++;
+		return true;
+	}
+	void give_back(size_t idx) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_retry.push_back(idx);
+	}
+	bool finished() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _next >= _count && _retry.empty();
+	}
+
+private:
+	std::mutex _mutex;
+	vector<size_t> _retry;
+	size_t _next = 0;
+	size_t _count;
+};
+
+/*
+ * Run worker on a growing number of connections. Starting with one stream,
+ * the count is doubled after every probe interval in which the aggregate
+ * throughput still improved noticeably, up to MAX_STREAMS.
+ */
+template<typename F>
+void run_adaptive_streams(F&& worker, part_dispatcher& parts, const std::atomic<uintmax_t>& done, uintmax_t total, size_t part_count) {
+	std::atomic<int> active = 0;
+	vector<thread> streams;
+	auto spawn = [&]() {
+		++active;
+		streams.emplace_back([&]() {
+			worker();
+			--active;
+		});
+	};
+	spawn();
+	double best_rate = 0;
+	bool growing = true;
+	uintmax_t last_done = 0;
+	auto last_time = sc::steady_clock::now();
+	while (active > 0) {
+		std::this_thread::sleep_for(50ms);
+		auto now = sc::steady_clock::now();
+		if (now - last_time < PROBE_INTERVAL) continue;
+		uintmax_t current = done;
+		double rate = double(current - last_done) / sc::duration<double>(now - last_time).count();
+		if (current > 0) progress_bar(current, total);
+		last_done = current;
+		last_time = now;
+		if (!growing) continue;
+		if (rate > best_rate * 1.2) {
+			best_rate = rate;
+			auto target = std::min<size_t>({ streams.size() * 2, size_t(MAX_STREAMS), part_count });
+			while (streams.size() < target) spawn();
+		}
+		else growing = false;
+	}
+	for (auto& td : streams) td.join();
+	if (!parts.finished()) throw peer_exception("All streams failed before the transfer completed.");
+	progress_bar(total, total);
+#ifdef DEBUG
+	cout << "\nUsed " << streams.size() << " streams.";
+#endif // DEBUG
+	cout << '\n';
+}
+
+/* Split the file into parts and upload them over parallel connections. */
+void send_file_parallel(const string& ip, uint16_t port, mfcslib::File& file) {
+	auto file_sz = file.size();
+	if (file_sz == 0) {
+		mfcslib::NetworkSocket target(ip, port);
+		send_file_to(target, file);
+		return;
+	}
+	auto transfer_id = to_string(std::mt19937_64(std::random_device{}())());
+	auto header_tail = '/' + to_string(file_sz) + '/';
+	auto name = file.filename();
+	size_t part_count = (file_sz + PART_SIZE - 1) / PART_SIZE;
+	part_dispatcher parts(part_count);
+	std::atomic<uintmax_t> have_send = 0;
+	auto worker = [&]() {
+		size_t idx = 0;
+		bool holding = false;
+		try {
+			mfcslib::NetworkSocket target(ip, port);
+			while ((holding = parts.take(idx))) {
+				off_t off = idx * PART_SIZE;
+				uintmax_t len = std::min<uintmax_t>(PART_SIZE, file_sz - off);
+				target.write("p/" + transfer_id + header_tail + to_string(off) + '/' + to_string(len) + '/' + name);
+				if (target.read() != '1') throw peer_exception("Server refused the part.");
+				auto checksum = std::async(std::launch::async, crc32c_of_file, file.get_fd(), len, uintmax_t(off), 0u);
+				auto left = len;
+				while (left > 0) {
+					auto ret = sendfile(target.get_fd(), file.get_fd(), &off, left);
+					if (ret <= 0) throw socket_exception(strerror(errno));
+					left -= ret;
+				}
+				auto crc = checksum.get();
+				write_all(target, string_view(reinterpret_cast<const char*>(&crc), sizeof crc));
+				if (target.read() != '1') throw peer_exception("Server did not confirm the part.");
+				have_send += len;
+			}
+		}
+		catch (const mfcslib::basic_exception& e) {
+			if (holding) parts.give_back(idx);
+			cerr << "\nStream failed: " << e.what() << '\n';
+		}
+	};
+	run_adaptive_streams(worker, parts, have_send, file_sz, part_count);
+}
+
+/* Fetch disjoint ranges of a file over parallel connections and place them with pwrite. */
+void get_file_parallel(const string& ip, uint16_t port, const string& file) {
+	auto name = file.substr(file.find('/') + 1);
+	uintmax_t file_sz = 0;
+	{
+		mfcslib::NetworkSocket target(ip, port);
+		target.write("r/0/0/" + name);
+		auto reply = read_reply(target);
+		if (reply.size() <= 1) {
+			cerr << "File might not be found in the server.\n";
+			exit(1);
+		}
+		file_sz = std::stoull(reply.substr(1));
+	}
+	mfcslib::File output(file);
+	output.open(true, WRONLY);
+	if (file_sz == 0) return;
+	output.allocate(file_sz);
+	size_t part_count = (file_sz + PART_SIZE - 1) / PART_SIZE;
+	part_dispatcher parts(part_count);
+	std::atomic<uintmax_t> have_received = 0;
+	auto worker = [&]() {
+		size_t idx = 0;
+		bool holding = false;
+		try {
+			mfcslib::NetworkSocket target(ip, port);
+			auto buffer = mfcslib::make_buffer<Byte>(PART_SIZE);
+			while ((holding = parts.take(idx))) {
+				uintmax_t off = idx * PART_SIZE;
+				uintmax_t len = std::min<uintmax_t>(PART_SIZE, file_sz - off);
+				target.write("r/" + to_string(off) + '/' + to_string(len) + '/' + name);
+				if (read_reply(target).size() <= 1) throw peer_exception("Server refused the range.");
+				target.write("1");
+				uintmax_t got = 0;
+				while (got < len) {
+					auto ret = target.read(buffer, got, len - got);
+					if (ret <= 0) throw peer_exception("Connection closed in the middle of a range.");
+					got += ret;
+				}
+				uint32_t expected = 0;
+				read_exact(target, reinterpret_cast<char*>(&expected), sizeof expected);
+				crc32c crc;
+				crc.update(buffer.get_ptr(), len);
+				if (crc.value() != expected) throw peer_exception("Checksum mismatch in a range.");
+				output.pwrite(buffer, 0, len, off);
+				have_received += len;
 			}
-			if (currentReturn <= 0) break;
-			file_output_stream.write(bufferForFile, 0, ret);
-			bytesWritten += ret;
-			progress_bar(bytesWritten, sizeOfFile);
-			if (bytesWritten >= sizeOfFile) break;
-			bufferForFile.empty_array();
-			ret = 0;
 		}
+		catch (const mfcslib::basic_exception& e) {
+			if (holding) parts.give_back(idx);
+			cerr << "\nStream failed: " << e.what() << '\n';
+		}
+	};
+	run_adaptive_streams(worker, parts, have_received, file_sz, part_count);
+}
+
+/*
+ * Hands out byte ranges of a file to the sources of a download. A source asks
+ * for what it moves in RANGE_TIME at its measured rate, so a fast source
+ * takes big ranges and a slow one small ones, and the work shifts towards
+ * whichever is faster at the moment. Once everything is handed out, an idle
+ * source also takes a range another is still on when it would finish it
+ * sooner, or the other is overdue; the first to finish counts.
+ */
+class range_dispatcher
+{
+public:
+	struct range
+	{
+		size_t id;
+		uintmax_t off;
+		uintmax_t len;
+	};
+
+	range_dispatcher(uintmax_t size) :_size(size) {}
+	std::optional<range> take(double rate) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto now = sc::steady_clock::now();
+		if (!_retry.empty()) {
+			auto id = _retry.back();
+			_retry.pop_back();
+			return _start(id, now, rate);
+		}
+		if (_next < _size) {
+			auto len = std::clamp<uintmax_t>(uintmax_t(rate * sc::duration<double>(RANGE_TIME).count()), RANGE_MIN, RANGE_MAX);
+			_flights.push_back({ _next, std::min(len, _size - _next) });
+			_next += _flights.back().len;
+			return _start(_flights.size() - 1, now, rate);
+		}
+		if (rate <= 0) return std::nullopt;
+		std::optional<size_t> best;
+		double best_left = 0;
+		for (size_t id = 0; id < _flights.size(); ++id) {
+			auto& flight = _flights[id];
+			if (flight.done || flight.helped || flight.owners == 0) continue;
+			double left = flight.len / flight.rate - sc::duration<double>(now - flight.start).count();
+			if ((left < 0 || left > flight.len / rate) && (!best || left < 0 || left > best_left)) {
+				best = id;
+				best_left = left < 0 ? HUGE_VAL : left;
+			}
+		}
+		if (!best) return std::nullopt;
+		_flights[*best].helped = true;
+		++_flights[*best].owners;
+		return range{ *best, _flights[*best].off, _flights[*best].len };
+	}
+	/* True for the first source to finish the range. */
+	bool complete(size_t id) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		--_flights[id].owners;
+		if (_flights[id].done) return false;
+		_flights[id].done = true;
+		++_done;
+		return true;
+	}
+	/* A range one of two sources gave up on may be helped again. */
+	void give_back(size_t id) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto& flight = _flights[id];
+		if (--flight.owners == 0 && !flight.done) _retry.push_back(id);
+		else flight.helped = false;
+	}
+	bool finished() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _next >= _size && _done == _flights.size();
+	}
+
+private:
+	struct flight
+	{
+		uintmax_t off;
+		uintmax_t len;
+		sc::steady_clock::time_point start{};
+		/* Rate of the source that took it first. */
+		double rate = 0;
+		int owners = 0;
+		bool helped = false;
+		bool done = false;
+	};
+	std::mutex _mutex;
+	vector<flight> _flights;
+	vector<size_t> _retry;
+	uintmax_t _next = 0;
+	uintmax_t _size;
+	size_t _done = 0;
+
+	range _start(size_t id, sc::steady_clock::time_point now, double rate) {
+		auto& flight = _flights[id];
+		flight.start = now;
+		flight.rate = std::max(rate, double(RANGE_MIN) / sc::duration<double>(RANGE_TIME).count());
+		flight.owners = 1;
+		flight.helped = false;
+		return { id, flight.off, flight.len };
+	}
+};
+
+/* Fetch disjoint ranges of file from every source holding it at once, each over one connection. */
+void get_file_multi(const vector<string>& sources, const string& file) {
+	auto name = file.substr(file.find('/') + 1);
+	vector<std::unique_ptr<mfcslib::NetworkSocket>> targets;
+	vector<string> names;
+	uintmax_t file_sz = 0;
+	for (auto& source : sources) {
+		try {
+			auto idx = source.find(':');
+			auto target = std::make_unique<mfcslib::NetworkSocket>(source.substr(0, idx), (uint16_t)std::stoul(source.substr(idx + 1)));
+			target->write("r/0/0/" + name);
+			auto reply = read_reply(*target);
+			if (reply.size() <= 1) throw peer_exception("File might not be found in the server.");
+			auto size = std::stoull(reply.substr(1));
+			if (!targets.empty() && size != file_sz) throw peer_exception("Its copy has another size.");
+			file_sz = size;
+			targets.push_back(std::move(target));
+			names.push_back(source);
+		}
+		catch (const mfcslib::basic_exception& e) {
+			cerr << source << " left out: " << e.what() << '\n';
+		}
+	}
+	if (targets.empty()) {
+		cerr << "No source holds the file.\n";
+		exit(1);
+	}
+	mfcslib::File output(file);
+	output.open(true, WRONLY);
+	if (file_sz == 0) return;
+	output.allocate(file_sz);
+	range_dispatcher ranges(file_sz);
+	std::atomic<uintmax_t> have_received = 0;
+	std::atomic<int> active = 0;
+	/* A range marked done that could not be written leaves a hole in the file. */
+	std::atomic<bool> write_failed = false;
+	vector<std::atomic<uintmax_t>> shares(targets.size());
+	auto worker = [&](size_t source) {
+		auto& target = *targets[source];
+		/* A whole range, grown to the largest one taken. */
+		vector<char> buffer;
+		double rate = 0;
+		try {
+			while (!ranges.finished()) {
+				auto range = ranges.take(rate);
+				if (!range) {
+					std::this_thread::sleep_for(50ms);
+					continue;
+				}
+				auto start = sc::steady_clock::now();
+				try {
+					target.write("r/" + to_string(range->off) + '/' + to_string(range->len) + '/' + name);
+					if (read_reply(target).size() <= 1) throw peer_exception("Server refused the range.");
+					target.write("1");
+					/*
+					 * Held until it checks out, and written only by the first source to
+					 * finish it: a duplicate still arriving must not overwrite a range
+					 * that is done, since a bad one would not be fetched again.
+					 */
+					if (buffer.size() < range->len) buffer.resize(range->len);
+					read_exact(target, buffer.data(), range->len);
+					uint32_t expected = 0;
+					read_exact(target, reinterpret_cast<char*>(&expected), sizeof expected);
+					crc32c crc;
+					crc.update(buffer.data(), range->len);
+					if (crc.value() != expected) throw peer_exception("Checksum mismatch in a range.");
+				}
+				catch (...) {
+					ranges.give_back(range->id);
+					throw;
+				}
+				if (ranges.complete(range->id)) {
+					for (uintmax_t written = 0; written < range->len;) {
+						auto ret = ::pwrite(output.get_fd(), buffer.data() + written, range->len - written, range->off + written);
+						if (ret <= 0) {
+							write_failed = true;
+							throw file_exception(ret < 0 ? strerror(errno) : "Short write.");
+						}
+						written += ret;
+					}
+					have_received += range->len;
+					shares[source] += range->len;
+				}
+				double current = range->len / sc::duration<double>(sc::steady_clock::now() - start).count();
+				rate = rate == 0 ? current : (rate + current) / 2;
+			}
+		}
+		catch (const mfcslib::basic_exception& e) {
+			if (!ranges.finished()) cerr << '\n' << names[source] << " failed: " << e.what() << '\n';
+		}
+		--active;
+	};
+	vector<thread> workers;
+	for (size_t i = 0; i < targets.size(); ++i) {
+		++active;
+		workers.emplace_back(worker, i);
+	}
+	while (active > 0 && !ranges.finished()) {
+		std::this_thread::sleep_for(50ms);
+		progress_bar(have_received.load(), file_sz);
 	}
+	/* Sources still on a range someone else finished are cut off. */
+	for (auto& target : targets) shutdown(target->get_fd(), SHUT_RDWR);
+	for (auto& td : workers) td.join();
+	if (!ranges.finished()) throw mfcslib::peer_exception("All sources failed before the transfer completed.");
+	if (write_failed) throw mfcslib::file_exception("Failed to write the file.");
+	progress_bar(file_sz, file_sz);
 	cout << '\n';
+	for (size_t i = 0; i < names.size(); ++i) cout << names[i] << ": " << shares[i] << " bytes\n";
 }
 #endif
@@ -0,0 +1,183 @@
+#ifndef FANOUT_HPP
+#define FANOUT_HPP
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+#include "message_log.hpp"
+#define SUBSCRIBER_QUEUE 4'194'304
+#define FANOUT_IOV_MAX 64
+
+/* What happens to a message for a subscriber whose queue is full. */
+enum class drop_policy
+{
+	OLDEST,
+	NEWEST,
+	DISCONNECT
+};
+
+/*
+ * Delivers published messages to subscribed connections whose prefix the
+ * message starts with. A message is framed once, as a record of the message
+ * log, and the same buffer is queued for every subscriber it goes to. Each
+ * queue is bounded in bytes; a subscriber that can not keep up loses
+ * messages by the drop policy and is told how many with a notice record,
+ * offset UINT64_MAX and a u64 count as data, before the next one it gets.
+ * Subscribers that fail are collected for the loop to close.
+ */
+class fanout
+{
+public:
+	fanout() = default;
+	fanout(const fanout&) = delete;
+	~fanout() = default;
+
+	void configure(size_t queue_limit, drop_policy policy) {
+		_queue_limit = queue_limit;
+		_policy = policy;
+	}
+	void add(int fd, std::string prefix) {
+		auto& sub = _subscribers[fd];
+		sub = subscriber();
+		sub.prefix = std::move(prefix);
+	}
+	void remove(int fd) {
+		_subscribers.erase(fd);
+	}
+	bool empty() const {
+		return _subscribers.empty();
+	}
+	size_t size() const {
+		return _subscribers.size();
+	}
+
+	/* Queue the message for its subscribers, it goes out on the next flush_pending. */
+	void publish(uint64_t offset, std::string_view message) {
+		std::shared_ptr<const std::string> record;
+		for (auto& [fd, sub] : _subscribers) {
+			if (!message.starts_with(sub.prefix)) continue;
+			if (!record) record = _make_record(offset, message);
+			if (!_enqueue(sub, record)) {
+				_dead.push_back(fd);
+				continue;
+			}
+			if (!sub.pending) {
+				sub.pending = true;
+				_pending.push_back(fd);
+			}
+		}
+	}
+	void flush_pending() {
+		for (int fd : _pending) {
+			auto ite = _subscribers.find(fd);
+			if (ite == _subscribers.end()) continue;
+			ite->second.pending = false;
+			if (!flush(fd)) _dead.push_back(fd);
+		}
+		_pending.clear();
+	}
+	/* Write what the socket takes, false when the subscriber is gone. */
+	bool flush(int fd) {
+		auto ite = _subscribers.find(fd);
+		if (ite == _subscribers.end()) return false;
+		auto& sub = ite->second;
+		while (!sub.queue.empty()) {
+			iovec vec[FANOUT_IOV_MAX];
+			int count = 0;
+			for (auto& item : sub.queue) {
+				if (count == FANOUT_IOV_MAX) break;
+				auto skip = count == 0 ? sub.front_sent : 0;
+				vec[count++] = { const_cast<char*>(item->data()) + skip, item->size() - skip };
+			}
+			auto ret = ::writev(fd, vec, count);
+			if (ret < 0) return errno == EAGAIN;
+			sub.queued -= ret;
+			for (size_t left = ret; left > 0;) {
+				auto rest = sub.queue.front()->size() - sub.front_sent;
+				if (left < rest) {
+					sub.front_sent += left;
+					break;
+				}
+				left -= rest;
+				sub.queue.pop_front();
+				sub.front_sent = 0;
+			}
+		}
+		return true;
+	}
+	/* Subscribers that failed since the last call. */
+	std::vector<int> take_dead() {
+		return std::exchange(_dead, {});
+	}
+
+private:
+	struct subscriber
+	{
+		std::string prefix;
+		std::deque<std::shared_ptr<const std::string>> queue;
+		/* Bytes of the front record already written. */
+		size_t front_sent = 0;
+		size_t queued = 0;
+		uint64_t dropped = 0;
+		bool pending = false;
+	};
+	std::unordered_map<int, subscriber> _subscribers;
+	std::vector<int> _pending;
+	std::vector<int> _dead;
+	size_t _queue_limit = SUBSCRIBER_QUEUE;
+	drop_policy _policy = drop_policy::OLDEST;
+
+	static std::shared_ptr<const std::string> _make_record(uint64_t offset, std::string_view data) {
+		message_record_header header{ offset, uint32_t(data.size()), 0 };
+		mfcslib::crc32c crc;
+		crc.update(data.data(), data.size());
+		header.crc = crc.value();
+		auto record = std::make_shared<std::string>(reinterpret_cast<const char*>(&header), sizeof header);
+		record->append(data);
+		return record;
+	}
+	/* 1 for a message, the count it carries for a notice. */
+	static uint64_t _message_count(const std::string& record) {
+		message_record_header header;
+		memcpy(&header, record.data(), sizeof header);
+		if (header.offset != UINT64_MAX) return 1;
+		uint64_t count = 0;
+		memcpy(&count, record.data() + sizeof header, sizeof count);
+		return count;
+	}
+	/* False when the subscriber is to be dropped altogether. */
+	bool _enqueue(subscriber& sub, const std::shared_ptr<const std::string>& record) {
+		if (sub.queued + record->size() > _queue_limit) {
+			if (_policy == drop_policy::DISCONNECT) return false;
+			if (_policy == drop_policy::NEWEST) {
+				++sub.dropped;
+				return true;
+			}
+			/* The front record stays when it is partly written already. */
+			while (sub.queued + record->size() > _queue_limit) {
+				auto victim = sub.queue.begin() + (sub.front_sent > 0 ? 1 : 0);
+				if (victim == sub.queue.end()) break;
+				sub.queued -= (*victim)->size();
+				sub.dropped += _message_count(**victim);
+				sub.queue.erase(victim);
+			}
+			if (sub.queued + record->size() > _queue_limit) {
+				++sub.dropped;
+				return true;
+			}
+		}
+		if (sub.dropped > 0) {
+			auto notice = _make_record(UINT64_MAX, { reinterpret_cast<const char*>(&sub.dropped), sizeof sub.dropped });
+			sub.queued += notice->size();
+			sub.queue.push_back(std::move(notice));
+			sub.dropped = 0;
+		}
+		sub.queued += record->size();
+		sub.queue.push_back(record);
+		return true;
+	}
+};
+#endif // !FANOUT_HPP
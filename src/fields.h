@@ -6,5 +6,24 @@
 #define f_FileToSend "FileToSend"
 #define f_DefaultPage "DefaultPage"
 #define f_ListenPort "ListenPort"
+#define f_ChunkStore "ChunkStore"
+#define f_ChunkStoreOnly "ChunkStoreOnly"
+#define f_WritebackWindow "WritebackWindow"
+#define f_DropWrittenPages "DropWrittenPages"
+#define f_DirectReceive "DirectReceive"
+#define f_DropSentPages "DropSentPages"
+#define f_SendEngine "SendEngine"
+#define f_HugePages "HugePages"
+#define f_UnixSocket "UnixSocket"
+#define f_MessageLog "MessageLog"
+#define f_SubscriberQueue "SubscriberQueue"
+#define f_SubscriberDrop "SubscriberDrop"
+#define f_ChainRelay "ChainRelay"
+#define f_Swarm "Swarm"
+#define f_Upstream "Upstream"
+#define f_CacheDir "CacheDir"
+#define f_CacheQuota "CacheQuota"
+#define f_Sync "Sync"
+#define f_Push "Push"
 
 #endif // !FIELDSH
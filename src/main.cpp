@@ -14,6 +14,7 @@ void usage() {
 		"    ./sft.out [option]\n"
 		"Client mode:\n"
 		"    ./sft.out [option] [argument] ip:port\n"
+		"    ./sft.out [option] [argument] socket_path   (same host, through the server's UnixSocket)\n"
 		"Options: \n"
 		"    General:\n"
 		"        -h             This information.\n"
@@ -21,17 +22,56 @@ void usage() {
 		"    In server mode:\n"
 		"        -n             No log file will be created.\n"
 		"    In client mode:\n"
-		"        -f             File mode for sending file. Argument is your file's path.\n"
-		"        -g             Fetch file from server. Argument is the file name on server.\n"
+		"        -f             File mode for sending file. Argument is your file's path, or a directory to send it whole.\n"
+		"        -g             Fetch file from server. Argument is the file name on server, ending with '/' for a directory.\n"
 		"        -m             Message mode for sending messages. Argument is your content.\n"
+		"        -b             Run a list of requests over one connection. Argument is a file with lines like 'f ./file', 'g name' or 'm text'.\n"
+		"        -p             Transfer with -f or -g over parallel connections.\n"
+		"        -d             Transfer with -f or -g only the parts that differ from the copy on the other side.\n"
+		"        -k             Send with -f only the chunks the server's chunk store does not hold yet.\n"
+		"        -e             Send -f with another engine: sendfile, splice, mmap or buffered, optionally with '/chunk_bytes'.\n"
+		"        -i             Stream every line of a file as a message over one connection. Argument '-' reads stdin.\n"
+		"        -w             Subscribe to the messages starting with a prefix and print them as they arrive. Argument '' gets all.\n"
+		"        -u             Transfer a single file with -f or -g over UDP, for long links that lose packets.\n"
+		"        -l             With -u, drop this percentage of packets on purpose to test under loss.\n"
+		"        -j             Have every server listed fetch a file from the others in a swarm, until all hold it.\n"
+		"        -s             Make a directory in the first server's FileToSend match the one on the second, '/' for all of it.\n"
+		"        -r             Keep mirroring a directory into the server's FileReceived as it changes, until killed.\n"
+		"        -t             Have the first server send a file from its FileToSend straight to the second one.\n"
 		"Arguments: \n"
-		"        -f             [file_path]\n"
-		"        -g             [file_name]\n"
+		"        -f             [file_path], followed by several ip:port to relay it down a chain of servers\n"
+		"        -g             [file_name], followed by several ip:port to fetch it from all of them at once\n"
 		"        -m             [contents]\n"
+		"        -b             [list_path]\n"
+		"        -e             [engine][/chunk_bytes]\n"
+		"        -i             [file_path or -]\n"
+		"        -w             [prefix]\n"
+		"        -l             [percent]\n"
+		"        -j             [file_name] ip:port ip:port...\n"
+		"        -s             [dir_name] ip:port_to_update ip:port_to_copy\n"
+		"        -r             [dir_path]\n"
+		"        -t             [file_name] ip:port_to_send_from ip:port_to_send_to\n"
 		"Examples:\n"
 		"    ./sft.out -f ./file 255.255.255.0:8888\n"
 		"    ./sft.out -g file_name 255.255.255.0:8888\n"
 		"    ./sft.out -m hello,world! 255.255.255.0:8888\n"
+		"    ./sft.out -p -f ./file 255.255.255.0:8888\n"
+		"    ./sft.out -d -g file_name 255.255.255.0:8888\n"
+		"    ./sft.out -k -f ./file 255.255.255.0:8888\n"
+		"    ./sft.out -f ./dir/ 255.255.255.0:8888\n"
+		"    ./sft.out -g dir/ 255.255.255.0:8888\n"
+		"    ./sft.out -b ./list.txt 255.255.255.0:8888\n"
+		"    ./sft.out -e splice/1048576 -f ./file 255.255.255.0:8888\n"
+		"    ./sft.out -f ./file /tmp/sft.sock\n"
+		"    ./sft.out -i - 255.255.255.0:8888 < telemetry.txt\n"
+		"    ./sft.out -w sensors/ 255.255.255.0:8888\n"
+		"    ./sft.out -u -l 1 -f ./file 255.255.255.0:8888\n"
+		"    ./sft.out -f ./file 10.0.0.1:8888 10.0.0.2:8888 10.0.0.3:8888\n"
+		"    ./sft.out -g file_name 10.0.0.1:8888 10.0.0.2:8888 10.0.0.3:8888\n"
+		"    ./sft.out -j file_name 10.0.0.1:8888 10.0.0.2:8888 10.0.0.3:8888\n"
+		"    ./sft.out -s dir_name 10.0.0.2:8888 10.0.0.1:8888\n"
+		"    ./sft.out -r ./dir 255.255.255.0:8888\n"
+		"    ./sft.out -t file_name 10.0.0.1:8888 10.0.0.2:8888\n"
 	);
 	exit(2);
 }
@@ -42,7 +82,8 @@ void version() {
 	cout << "\033[1mBuilt date: \033[0m" << __DATE__ << ' ' << __TIME__ << endl;
 }
 
-void check_file(char* path) {
+/* Exit unless path is a readable regular file or directory, return whether it is a directory. */
+bool check_file(char* path) {
 	if (strchr(path, '/') == NULL) {
 		fprintf(stderr, "Invalid path. Please check the path.\n");
 		exit(1);
@@ -54,10 +95,11 @@ void check_file(char* path) {
 	
 	struct stat st;
 	stat(path, &st);
-	if (!S_ISREG(st.st_mode)) {
-		fprintf(stderr, "Target file is not a regular file.\n");
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "Target file is not a regular file or directory.\n");
 		exit(1);
 	}
+	return S_ISDIR(st.st_mode);
 }
 
 void parse_arg(const string_view& arg, string& ip, uint16_t& port) {
@@ -93,10 +135,23 @@ int main(int argc, char* argv[])
 {
 	int opt = 0;
 	bool no_log_file = false;
+	bool parallel = false;
+	bool delta = false;
+	bool dedup = false;
+	bool udp = false;
+	double loss = 0;
 	char* mesg = nullptr;
 	char* path = nullptr;
 	char* file_to_get = nullptr;
-	char mode[] = "cm:f:g:hvn";
+	char* batch = nullptr;
+	char* stream = nullptr;
+	char* topic = nullptr;
+	char* swarm = nullptr;
+	char* sync_dir = nullptr;
+	char* mirror_dir = nullptr;
+	char* file_to_push = nullptr;
+	mfcslib::send_options engine;
+	char mode[] = "cm:f:g:b:e:i:w:l:j:s:r:t:hvnpdku";
 	static vector<int> sig_to_register = { SIGINT,SIGSEGV,SIGTERM };
 	while ((opt = getopt(argc, argv, mode)) != EOF) {
 		switch (opt)
@@ -121,6 +176,47 @@ int main(int argc, char* argv[])
 		case 'g':
 			file_to_get = optarg;
 			break;
+		case 'b':
+			batch = optarg;
+			break;
+		case 'i':
+			stream = optarg;
+			break;
+		case 'w':
+			topic = optarg;
+			break;
+		case 'j':
+			swarm = optarg;
+			break;
+		case 's':
+			sync_dir = optarg;
+			break;
+		case 'r':
+			mirror_dir = optarg;
+			break;
+		case 't':
+			file_to_push = optarg;
+			break;
+		case 'p':
+			parallel = true;
+			break;
+		case 'd':
+			delta = true;
+			break;
+		case 'k':
+			dedup = true;
+			break;
+		case 'u':
+			udp = true;
+			break;
+		case 'l':
+			loss = atof(optarg) / 100;
+			if (loss < 0 || loss >= 1) usage();
+			break;
+		case 'e':
+			if (auto options = mfcslib::send_options::parse(optarg); options) engine = *options;
+			else usage();
+			break;
 		default: throw std::invalid_argument("");
 		}
 	}
@@ -140,22 +236,185 @@ int main(int argc, char* argv[])
 		receive_loop rl;
 		rl.loop();
 	}
+	else if (strchr(argv[optind], '/') != nullptr) {
+		/* A path instead of ip:port is the server's Unix socket on this host. */
+		try {
+			if (path != nullptr && !check_file(path)) {
+				mfcslib::File file(path);
+				file.open_read_only();
+				send_file_local(argv[optind], file);
+			}
+			else if (file_to_get != nullptr && !string_view(file_to_get).ends_with('/')) {
+				get_file_local(argv[optind], file_to_get);
+			}
+			else {
+				fprintf(stderr, "Only a single file can be sent with -f or fetched with -g over a Unix socket.\n");
+				exit(1);
+			}
+		}
+		catch (const mfcslib::basic_exception& e) {
+			fprintf(stderr, "%s\n", e.what().c_str());
+			exit(1);
+		}
+	}
 	else{
 		string ip;
 		uint16_t port = 0;
 		parse_arg(argv[optind], ip, port);
-		mfcslib::NetworkSocket server(ip, port);
-		if (path != nullptr) {
-			check_file(path);
+		if (udp) {
+			if (path != nullptr && !check_file(path)) {
+				mfcslib::File file(path);
+				file.open_read_only();
+				mfcslib::NetworkSocket server(ip, port);
+				send_file_udp(server, file, loss);
+			}
+			else if (file_to_get != nullptr && !string_view(file_to_get).ends_with('/')) {
+				mfcslib::NetworkSocket server(ip, port);
+				get_file_udp(server, file_to_get, loss);
+			}
+			else {
+				fprintf(stderr, "Only a single file can be sent with -f or fetched with -g over UDP.\n");
+				exit(1);
+			}
+		}
+		else if (path != nullptr && check_file(path)) {
+			with_retry(ip, port, [path](mfcslib::NetworkSocket& server) {
+				send_directory(server, path);
+			});
+		}
+		else if (path != nullptr) {
 			mfcslib::File file(path);
 			file.open_read_only();
-			send_file_to(server, file);
+			if (argc - optind > 1) {
+				/* More addresses after the first make a chain the file is relayed down. */
+				try {
+					mfcslib::NetworkSocket server(ip, port);
+					if (!send_file_chain(server, file, vector<string>(argv + optind, argv + argc))) exit(1);
+				}
+				catch (const mfcslib::basic_exception& e) {
+					fprintf(stderr, "%s\n", e.what().c_str());
+					exit(1);
+				}
+			}
+			else if (parallel) {
+				try {
+					send_file_parallel(ip, port, file);
+				}
+				catch (const mfcslib::basic_exception& e) {
+					fprintf(stderr, "%s\n", e.what().c_str());
+					exit(1);
+				}
+			}
+			else if (delta) {
+				with_retry(ip, port, [&file](mfcslib::NetworkSocket& server) {
+					send_file_delta(server, file);
+				});
+			}
+			else if (dedup) {
+				with_retry(ip, port, [&file](mfcslib::NetworkSocket& server) {
+					send_file_dedup(server, file);
+				});
+			}
+			else {
+				with_retry(ip, port, [&file, &engine](mfcslib::NetworkSocket& server) {
+					send_file_to(server, file, engine);
+				});
+			}
+		}
+		else if (batch != nullptr) {
+			if (run_batch(ip, port, batch) > 0) exit(1);
+		}
+		else if (swarm != nullptr) {
+			try {
+				if (!join_swarm(swarm, vector<string>(argv + optind, argv + argc))) exit(1);
+			}
+			catch (const mfcslib::basic_exception& e) {
+				fprintf(stderr, "%s\n", e.what().c_str());
+				exit(1);
+			}
+		}
+		else if (sync_dir != nullptr) {
+			if (argc - optind != 2) usage();
+			try {
+				string dir(sync_dir);
+				while (dir.starts_with('/')) dir.erase(0, 1);
+				mfcslib::NetworkSocket server(ip, port);
+				if (!sync_directory(server, dir, argv[optind + 1])) exit(1);
+			}
+			catch (const mfcslib::basic_exception& e) {
+				fprintf(stderr, "%s\n", e.what().c_str());
+				exit(1);
+			}
+		}
+		else if (file_to_push != nullptr) {
+			if (argc - optind != 2) usage();
+			try {
+				mfcslib::NetworkSocket server(ip, port);
+				if (!push_file(server, file_to_push, argv[optind + 1])) exit(1);
+			}
+			catch (const mfcslib::basic_exception& e) {
+				fprintf(stderr, "%s\n", e.what().c_str());
+				exit(1);
+			}
+		}
+		else if (mirror_dir != nullptr) {
+			if (!check_file(mirror_dir)) {
+				fprintf(stderr, "Only a directory can be mirrored.\n");
+				exit(1);
+			}
+			try {
+				mirror(mirror_dir, ip, port).run();
+			}
+			catch (const mfcslib::basic_exception& e) {
+				fprintf(stderr, "%s\n", e.what().c_str());
+				exit(1);
+			}
+		}
+		else if (stream != nullptr) {
+			stream_messages(ip, port, stream);
+		}
+		else if (topic != nullptr) {
+			subscribe_messages(ip, port, topic);
 		}
 		else if (mesg != nullptr) {
+			mfcslib::NetworkSocket server(ip, port);
 			send_msg_to(server, mesg);
 		}
 		else if(file_to_get!=nullptr){
-			get_file_from(server, file_to_get);
+			if (string_view(file_to_get).ends_with('/')) {
+				with_retry(ip, port, [file_to_get](mfcslib::NetworkSocket& server) {
+					get_directory(server, file_to_get);
+				});
+			}
+			else if (argc - optind > 1) {
+				/* The same file on several servers is fetched from all of them at once. */
+				try {
+					get_file_multi(vector<string>(argv + optind, argv + argc), file_to_get);
+				}
+				catch (const mfcslib::basic_exception& e) {
+					fprintf(stderr, "%s\n", e.what().c_str());
+					exit(1);
+				}
+			}
+			else if (parallel) {
+				try {
+					get_file_parallel(ip, port, file_to_get);
+				}
+				catch (const mfcslib::basic_exception& e) {
+					fprintf(stderr, "%s\n", e.what().c_str());
+					exit(1);
+				}
+			}
+			else if (delta) {
+				with_retry(ip, port, [file_to_get](mfcslib::NetworkSocket& server) {
+					get_file_delta(server, file_to_get);
+				});
+			}
+			else {
+				with_retry(ip, port, [file_to_get](mfcslib::NetworkSocket& server) {
+					get_file_from(server, file_to_get);
+				});
+			}
 		}
 	}
 	cout << "Success on dealing. Please check the server." << endl;
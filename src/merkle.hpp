@@ -0,0 +1,488 @@
+#ifndef MERKLE_HPP
+#define MERKLE_HPP
+#include <algorithm>
+#include <atomic>
+#include <format>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "../include/checksum.hpp"
+#include "../include/io.hpp"
+#include "../include/tree.hpp"
+#define SYNC_TIMEOUT 60
+#define SYNC_BUFFER_SIZE 1'048'576
+
+struct merkle_dir;
+
+/* A file or directory in a Merkle tree, files carry what their hash was taken from. */
+struct merkle_entry
+{
+	std::string name;
+	uint64_t hash = 0;
+	/* Null for a file. */
+	std::shared_ptr<const merkle_dir> dir;
+	uint64_t size = 0;
+	uint32_t crc = 0;
+	ino_t ino = 0;
+	timespec mtime{};
+
+	bool same_as(const merkle_entry& other) const {
+		return name == other.name && hash == other.hash && dir == other.dir && size == other.size && ino == other.ino
+			&& mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec;
+	}
+};
+
+/* A directory hashes the names, kinds and hashes of its entries, sorted by name. */
+struct merkle_dir
+{
+	uint64_t hash = 0;
+	std::vector<merkle_entry> entries;
+
+	const merkle_entry* find(std::string_view name) const {
+		auto ite = std::lower_bound(entries.begin(), entries.end(), name, [](const merkle_entry& entry, std::string_view name) {
+			return entry.name < name;
+		});
+		return ite != entries.end() && ite->name == name ? &*ite : nullptr;
+	}
+	/* The directory at a relative path below this one, null when there is none. */
+	const merkle_dir* descend(std::string_view path) const {
+		auto dir = this;
+		while (dir && !path.empty()) {
+			auto entry = dir->find(mfcslib::pop_field(path));
+			dir = entry ? entry->dir.get() : nullptr;
+		}
+		return dir;
+	}
+};
+
+inline uint64_t merkle_file_hash(uint64_t size, uint32_t crc) {
+	char data[sizeof size + sizeof crc];
+	memcpy(data, &size, sizeof size);
+	memcpy(data + sizeof size, &crc, sizeof crc);
+	return mfcslib::xxh64(data, sizeof data);
+}
+
+/* Files a transfer is still writing, next to the ones they become. */
+inline bool is_transfer_leftover(std::string_view name) {
+	if (!name.starts_with('.')) return false;
+	for (auto suffix : { ".part", ".swarm", ".sft", ".delta", ".sync" }) {
+		if (name.ends_with(suffix)) return true;
+	}
+	return false;
+}
+
+/* Timeouts go on once both sides are scanned, a first scan reads every file and has no bound. */
+inline void set_sync_timeout(int sock, int option) {
+	timeval timeout{ SYNC_TIMEOUT, 0 };
+	setsockopt(sock, SOL_SOCKET, option, &timeout, sizeof timeout);
+}
+/* Every directory along dir, which ends with '/'. */
+inline void make_directories(const std::string& dir) {
+	for (auto pos = dir.find('/', 1); pos != std::string::npos; pos = dir.find('/', pos + 1)) ::mkdir(dir.substr(0, pos).c_str(), 0755);
+}
+/* A file, or a directory with all below it; false when there was nothing to remove. */
+inline bool remove_tree(const std::string& path) {
+	if (::unlink(path.c_str()) == 0) return true;
+	if (errno != EISDIR && errno != EPERM) return false;
+	auto dir_d = ::opendir(path.c_str());
+	if (dir_d == nullptr) return false;
+	for (struct dirent* ptr = nullptr; (ptr = ::readdir(dir_d)) != nullptr;) {
+		if (strcmp(ptr->d_name, ".") == 0 || strcmp(ptr->d_name, "..") == 0) continue;
+		remove_tree(path + '/' + ptr->d_name);
+	}
+	::closedir(dir_d);
+	return ::rmdir(path.c_str()) == 0;
+}
+
+/*
+ * Merkle trees of directories below a root, one per directory asked for.
+ * A file hashes its size and CRC32C, which comes from the checksum
+ * attribute, so only new or changed files are read. Each scan starts from
+ * the last one of the same directory: a file whose inode, size and mtime
+ * are unchanged keeps its entry without being opened, and a directory in
+ * which nothing changed is shared with the last tree as it is. Trees are
+ * never modified once built, so a scan can be read by any thread while the
+ * next one is made, and scans of different directories run side by side;
+ * when two race on one directory the later to finish is kept. Subdirectories are scanned on threads of their own while
+ * there are cores to spare.
+ */
+class merkle_index
+{
+public:
+	merkle_index() = default;
+	merkle_index(const merkle_index&) = delete;
+	~merkle_index() = default;
+
+	void init(std::string root) {
+		if (root.empty()) root = "./";
+		if (root.back() != '/') root += '/';
+		_root = std::move(root);
+	}
+	/* A fresh tree of path below the root, "" for the root itself, or null when it is not a directory. */
+	std::shared_ptr<const merkle_dir> scan(const std::string& path) {
+		/* Only the lookup and the publishing hold the lock, the files are read without it. */
+		std::shared_ptr<const merkle_dir> last;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (auto ite = _trees.find(path); ite != _trees.end()) last = ite->second;
+		}
+		int fd = ::open((_root + path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		std::atomic<int> spare = int(std::thread::hardware_concurrency()) - 1;
+		auto tree = fd < 0 ? nullptr : _scan(fd, last, spare);
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (tree) _trees[path] = tree;
+		else _trees.erase(path);
+		return tree;
+	}
+	/* Hold path for writing, false when it overlaps a path held already. */
+	bool claim(const std::string& path) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto& held : _claimed) {
+			if (_contains(held, path) || _contains(path, held)) return false;
+		}
+		_claimed.push_back(path);
+		return true;
+	}
+	void release(const std::string& path) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		std::erase(_claimed, path);
+	}
+
+private:
+	std::string _root;
+	std::mutex _mutex;
+	std::unordered_map<std::string, std::shared_ptr<const merkle_dir>> _trees;
+	std::vector<std::string> _claimed;
+
+	static bool _contains(std::string_view outer, std::string_view inner) {
+		return outer.empty() || inner == outer || (inner.starts_with(outer) && inner[outer.size()] == '/');
+	}
+	/* Takes fd. */
+	static std::shared_ptr<const merkle_dir> _scan(int fd, const std::shared_ptr<const merkle_dir>& last, std::atomic<int>& spare) {
+		auto dir_d = ::fdopendir(fd);
+		if (dir_d == nullptr) {
+			::close(fd);
+			return std::make_shared<merkle_dir>();
+		}
+		auto dir = std::make_shared<merkle_dir>();
+		/* Subdirectories being scanned elsewhere, by their place in entries. */
+		std::vector<std::pair<size_t, std::future<std::shared_ptr<const merkle_dir>>>> pending;
+		for (struct dirent* ptr = nullptr; (ptr = ::readdir(dir_d)) != nullptr;) {
+			std::string_view name(ptr->d_name);
+			if (name == "." || name == ".." || is_transfer_leftover(name)) continue;
+			struct stat st;
+			if (::fstatat(fd, ptr->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+			auto old = last ? last->find(name) : nullptr;
+			merkle_entry entry;
+			entry.name = name;
+			if (S_ISDIR(st.st_mode)) {
+				int sub = ::openat(fd, ptr->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (sub < 0) continue;
+				auto last_sub = old ? old->dir : nullptr;
+				if (spare.fetch_sub(1) > 0) {
+					pending.emplace_back(dir->entries.size(), std::async(std::launch::async, [sub, last_sub, &spare]() {
+						auto scanned = _scan(sub, last_sub, spare);
+						spare.fetch_add(1);
+						return scanned;
+					}));
+				}
+				else {
+					spare.fetch_add(1);
+					entry.dir = _scan(sub, last_sub, spare);
+					entry.hash = entry.dir->hash;
+				}
+			}
+			else if (S_ISREG(st.st_mode)) {
+				entry.size = st.st_size;
+				entry.ino = st.st_ino;
+				entry.mtime = st.st_mtim;
+				if (old && !old->dir && old->size == entry.size && old->ino == entry.ino
+					&& old->mtime.tv_sec == entry.mtime.tv_sec && old->mtime.tv_nsec == entry.mtime.tv_nsec) {
+					entry.crc = old->crc;
+				}
+				else {
+					int file_fd = ::openat(fd, ptr->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+					if (file_fd < 0) continue;
+					entry.crc = mfcslib::file_checksum(file_fd, entry.size);
+					::close(file_fd);
+				}
+				entry.hash = merkle_file_hash(entry.size, entry.crc);
+			}
+			else continue;
+			dir->entries.push_back(std::move(entry));
+		}
+		::closedir(dir_d);
+		for (auto& [index, scanned] : pending) {
+			auto& entry = dir->entries[index];
+			entry.dir = scanned.get();
+			entry.hash = entry.dir->hash;
+		}
+		std::sort(dir->entries.begin(), dir->entries.end(), [](auto& a, auto& b) { return a.name < b.name; });
+		if (last && last->entries.size() == dir->entries.size()
+			&& std::equal(dir->entries.begin(), dir->entries.end(), last->entries.begin(), [](auto& a, auto& b) { return a.same_as(b); })) {
+			return last;
+		}
+		std::string record;
+		for (auto& entry : dir->entries) {
+			record += entry.name;
+			record += '\0';
+			record += entry.dir ? 'd' : 'f';
+			record.append(reinterpret_cast<const char*>(&entry.hash), sizeof entry.hash);
+		}
+		dir->hash = mfcslib::xxh64(record.data(), record.size());
+		return dir;
+	}
+};
+
+/*
+ * One side of a sync session: the server that holds the directory to copy
+ * from answers "y/<dir>" with "/<root hash>" and then, until the other side
+ * hangs up, any number of '\0' terminated requests on the same connection:
+ *   l/<path>   "/<count>" then "<d|f>/<hash>/<size>/<name>" for each entry
+ *   g/<path>   "/<size>", the file and its u32 crc32c
+ * Paths are relative to dir, hashes in hex, and a path that is not there is
+ * answered with a lone '0'.
+ */
+class merkle_source
+{
+public:
+	merkle_source(int sock, std::string root, std::shared_ptr<const merkle_dir> tree) :
+		_sock(sock), _root(std::move(root)), _tree(std::move(tree)) {}
+	merkle_source(const merkle_source&) = delete;
+	~merkle_source() = default;
+
+	void run() {
+		write_all(_sock, std::format("/{:016x}", _tree->hash) + '\0');
+		for (std::string request; read_line(_sock, request);) {
+			set_sync_timeout(_sock, SO_RCVTIMEO);
+			std::string_view path(request);
+			path.remove_prefix(std::min<size_t>(2, path.size()));
+			if (request.starts_with("l/")) _list(path);
+			else if (request.starts_with("g/") && mfcslib::is_safe_relative_path(path)) _send(path);
+			else write_all(_sock, "0");
+		}
+	}
+
+	static void write_all(int sock, std::string_view data) {
+		while (!data.empty()) {
+			auto ret = ::send(sock, data.data(), data.size(), MSG_NOSIGNAL);
+			if (ret <= 0) throw mfcslib::socket_exception(ret < 0 ? strerror(errno) : "Connection closed.");
+			data.remove_prefix(ret);
+		}
+	}
+	static void read_exact(int sock, char* data, size_t len) {
+		while (len > 0) {
+			auto ret = ::read(sock, data, len);
+			if (ret <= 0) throw mfcslib::peer_exception("Peer closed in the middle of a reply.");
+			data += ret;
+			len -= ret;
+		}
+	}
+	/* Up to '\0', false when the peer hung up between lines. */
+	static bool read_line(int sock, std::string& line) {
+		line.clear();
+		for (char ch = 0;;) {
+			auto ret = ::read(sock, &ch, 1);
+			if (ret <= 0) {
+				if (line.empty()) return false;
+				throw mfcslib::peer_exception("Peer closed in the middle of a line.");
+			}
+			if (ch == '\0') return true;
+			line += ch;
+		}
+	}
+
+private:
+	int _sock;
+	std::string _root;
+	std::shared_ptr<const merkle_dir> _tree;
+
+	void _list(std::string_view path) {
+		auto dir = _tree->descend(path);
+		if (dir == nullptr) {
+			write_all(_sock, "0");
+			return;
+		}
+		auto reply = '/' + std::to_string(dir->entries.size()) + '\0';
+		for (auto& entry : dir->entries) {
+			reply += std::format("{}/{:016x}/{}/{}", entry.dir ? 'd' : 'f', entry.hash, entry.size, entry.name);
+			reply += '\0';
+		}
+		write_all(_sock, reply);
+	}
+	void _send(std::string_view path) {
+		int fd = ::open((_root + std::string(path)).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		struct stat st;
+		if (fd < 0 || ::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			if (fd >= 0) ::close(fd);
+			write_all(_sock, "0");
+			return;
+		}
+		uintmax_t size = st.st_size;
+		try {
+			auto crc = mfcslib::file_checksum(fd, size);
+			write_all(_sock, '/' + std::to_string(size) + '\0');
+			for (off_t off = 0; uintmax_t(off) < size;) {
+				auto ret = ::sendfile(_sock, fd, &off, size - off);
+				/* A file cut short under us leaves nothing to finish the reply with. */
+				if (ret <= 0) throw mfcslib::file_exception(ret < 0 ? strerror(errno) : "File shrank while being sent.");
+			}
+			write_all(_sock, { reinterpret_cast<const char*>(&crc), sizeof crc });
+		}
+		catch (...) {
+			::close(fd);
+			throw;
+		}
+		::close(fd);
+	}
+};
+
+/*
+ * The other side of a sync session, which makes a local directory match the
+ * source's. Subtrees whose hashes agree are skipped whole, so a directory
+ * already in sync costs one round trip after the scans. Changed and missing
+ * files are fetched next to their place, checked against their CRC32C and
+ * renamed over it; entries the source does not have are removed.
+ */
+class merkle_puller
+{
+public:
+	struct result
+	{
+		uint64_t fetched = 0;
+		uint64_t removed = 0;
+		uint64_t bytes = 0;
+		uint64_t failed = 0;
+	};
+
+	/* root is the local directory, ending with '/'. */
+	merkle_puller(int sock, std::string root) :_sock(sock), _root(std::move(root)), _buffer(mfcslib::make_buffer<char>(SYNC_BUFFER_SIZE)) {}
+	merkle_puller(const merkle_puller&) = delete;
+	~merkle_puller() = default;
+
+	/* After "y/<dir>" has been sent, with the local tree as scanned just before. */
+	result run(const merkle_dir& local) {
+		std::string reply;
+		if (!merkle_source::read_line(_sock, reply)) throw mfcslib::peer_exception("Source closed before the root hash.");
+		set_sync_timeout(_sock, SO_RCVTIMEO);
+		if (!reply.starts_with('/')) throw mfcslib::file_exception("Source has no such directory.");
+		if (std::stoull(reply.substr(1), nullptr, 16) != local.hash) _pull("", &local);
+		return _result;
+	}
+
+private:
+	struct remote_entry
+	{
+		bool dir;
+		uint64_t hash;
+		std::string name;
+	};
+	int _sock;
+	std::string _root;
+	decltype(mfcslib::make_buffer<char>(0)) _buffer;
+	result _result;
+
+	static std::string _join(const std::string& path, const std::string& name) {
+		return path.empty() ? name : path + '/' + name;
+	}
+	std::vector<remote_entry> _list(const std::string& path) {
+		merkle_source::write_all(_sock, "l/" + path + '\0');
+		std::string line;
+		if (!merkle_source::read_line(_sock, line)) throw mfcslib::peer_exception("Source closed before the listing.");
+		if (!line.starts_with('/')) throw mfcslib::peer_exception("Source lost a directory: " + path);
+		auto count = std::stoull(line.substr(1));
+		std::vector<remote_entry> entries;
+		for (uint64_t i = 0; i < count; ++i) {
+			if (!merkle_source::read_line(_sock, line)) throw mfcslib::peer_exception("Source closed in the middle of a listing.");
+			std::string_view fields(line);
+			auto kind = mfcslib::pop_field(fields);
+			auto hash = std::stoull(std::string(mfcslib::pop_field(fields)), nullptr, 16);
+			mfcslib::pop_field(fields);
+			if (fields.empty() || fields == "." || fields == ".." || fields.find('/') != std::string_view::npos) {
+				throw mfcslib::peer_exception("Invalid name in a listing.");
+			}
+			/* Kept in name order, which the removals below rely on. */
+			if (!entries.empty() && entries.back().name >= fields) throw mfcslib::peer_exception("Listing out of order.");
+			entries.push_back({ kind == "d", hash, std::string(fields) });
+		}
+		return entries;
+	}
+	void _pull(const std::string& path, const merkle_dir* local) {
+		auto remote = _list(path);
+		for (auto& entry : remote) {
+			auto mine = local ? local->find(entry.name) : nullptr;
+			auto rel = _join(path, entry.name);
+			auto target = _root + rel;
+			if (mine && entry.dir == bool(mine->dir) && entry.hash == mine->hash) continue;
+			/* A file where a directory goes or the other way round. */
+			if (mine && entry.dir != bool(mine->dir)) {
+				remove_tree(target);
+				mine = nullptr;
+			}
+			if (entry.dir) {
+				::mkdir(target.c_str(), 0755);
+				_pull(rel, mine ? mine->dir.get() : nullptr);
+			}
+			else _fetch(rel, target);
+		}
+		if (local == nullptr) return;
+		for (auto& entry : local->entries) {
+			if (std::ranges::binary_search(remote, entry.name, {}, &remote_entry::name)) continue;
+			if (remove_tree(_root + _join(path, entry.name))) ++_result.removed;
+		}
+	}
+	void _fetch(const std::string& path, const std::string& target) {
+		merkle_source::write_all(_sock, "g/" + path + '\0');
+		std::string line;
+		if (!merkle_source::read_line(_sock, line)) throw mfcslib::peer_exception("Source closed before a file.");
+		if (!line.starts_with('/')) {
+			/* Gone from the source since its scan. */
+			++_result.failed;
+			return;
+		}
+		auto size = std::stoull(line.substr(1));
+		auto partial = mfcslib::hidden_sibling(target, ".sync");
+		mfcslib::File output(partial);
+		output.open_random_access(mfcslib::WRONLY);
+		output.truncate(0);
+		output.preallocate(0, size);
+		mfcslib::crc32c crc;
+		bool written = true;
+		for (uint64_t received = 0; received < size;) {
+			auto ret = ::read(_sock, _buffer.get_ptr(), std::min<uint64_t>(_buffer.length(), size - received));
+			if (ret <= 0) {
+				::unlink(partial.c_str());
+				throw mfcslib::peer_exception("Source closed in the middle of a file.");
+			}
+			for (ssize_t done = 0; written && done < ret;) {
+				auto wrote = ::pwrite(output.get_fd(), _buffer.get_ptr() + done, ret - done, received + done);
+				if (wrote <= 0) written = false;
+				else done += wrote;
+			}
+			crc.update(_buffer.get_ptr(), ret);
+			received += ret;
+		}
+		uint32_t expected = 0;
+		merkle_source::read_exact(_sock, reinterpret_cast<char*>(&expected), sizeof expected);
+		if (written && expected == crc.value()) {
+			mfcslib::store_checksum(output.get_fd(), expected);
+			if (::rename(partial.c_str(), target.c_str()) == 0) {
+				++_result.fetched;
+				_result.bytes += size;
+				return;
+			}
+		}
+		::unlink(partial.c_str());
+		++_result.failed;
+	}
+};
+#endif // !MERKLE_HPP
@@ -0,0 +1,391 @@
+#ifndef MESSAGE_LOG_HPP
+#define MESSAGE_LOG_HPP
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "../include/checksum.hpp"
+#include "../include/io.hpp"
+#define MESSAGE_MAX 1'048'576
+#define MESSAGE_SEGMENT_SIZE 67'108'864
+#define MESSAGE_INDEX_INTERVAL 4096
+
+/*
+ * Durable log of the messages sent to the server, kept in segments under
+ * <dir>. <base>.log holds records of the messages numbered from base on:
+ *     u64 offset, u32 length, u32 crc32c of the data, data
+ * <base>.index holds (u64 offset, u64 position in the log) for the first
+ * record and then one record every 4 KiB, for readers to map and search.
+ * A segment is closed once it passes 64 MiB.
+ *
+ * Appends only write. The fdatasync that makes them durable runs on a
+ * thread of the log, covering everything appended before it was asked for,
+ * so connections appending meanwhile share the next one. Each finished sync
+ * is signalled on event_fd.
+ */
+struct message_record_header
+{
+	uint64_t offset;
+	uint32_t length;
+	uint32_t crc;
+};
+struct message_index_entry
+{
+	uint64_t offset;
+	uint64_t position;
+};
+
+/* Base offsets of the segments in dir, in order. */
+inline std::vector<uint64_t> message_segments(const string& dir) {
+	std::vector<uint64_t> bases;
+	for (auto& path : mfcslib::list_all_files_in_directory(dir.c_str())) {
+		auto name = std::string_view(path).substr(path.find_last_of('/') + 1);
+		if (name.size() != 24 || !name.ends_with(".log")) continue;
+		uint64_t base = 0;
+		auto [end, err] = std::from_chars(name.data(), name.data() + 20, base);
+		if (err == std::errc() && end == name.data() + 20) bases.push_back(base);
+	}
+	std::sort(bases.begin(), bases.end());
+	return bases;
+}
+inline string message_segment_path(const string& dir, uint64_t base, const char* suffix) {
+	char name[32];
+	snprintf(name, sizeof name, "%020llu%s", (unsigned long long)base, suffix);
+	return dir + name;
+}
+
+/* Length of the valid records at the front of data, which should start at offset; offset is moved past them. */
+inline size_t valid_records(std::string_view data, uint64_t& offset, std::vector<message_index_entry>* index = nullptr) {
+	size_t position = 0, indexed = 0;
+	while (data.size() - position >= sizeof(message_record_header)) {
+		message_record_header header;
+		memcpy(&header, data.data() + position, sizeof header);
+		if (header.offset != offset || header.length > MESSAGE_MAX ||
+			data.size() - position - sizeof header < header.length) break;
+		mfcslib::crc32c crc;
+		crc.update(data.data() + position + sizeof header, header.length);
+		if (crc.value() != header.crc) break;
+		if (index != nullptr && (position == 0 || position - indexed >= MESSAGE_INDEX_INTERVAL)) {
+			index->push_back({ offset, position });
+			indexed = position;
+		}
+		position += sizeof header + header.length;
+		++offset;
+	}
+	return position;
+}
+
+class message_log
+{
+public:
+	message_log() = default;
+	message_log(const message_log&) = delete;
+	~message_log() {
+		if (_syncer.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = true;
+			}
+			_changed.notify_all();
+			_syncer.join();
+		}
+		for (int fd : _retired) ::close(fd);
+		for (int fd : { _log_fd, _index_fd, _event_fd, _dir_fd }) {
+			if (fd >= 0) ::close(fd);
+		}
+	}
+
+	/* Open the log in dir, cutting a record torn by a crash off the last segment. */
+	void open(const string& dir) {
+		_dir = dir;
+		if (_dir.back() != '/') _dir += '/';
+		_dir_fd = ::open(_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (_dir_fd < 0 || _event_fd < 0) throw mfcslib::file_exception(strerror(errno));
+		auto bases = message_segments(_dir);
+		if (bases.empty()) _start_segment(0);
+		else _recover(bases.back());
+		_synced = _next_offset;
+		_requested = _next_offset;
+		_syncer = std::thread(&message_log::_sync_loop, this);
+	}
+	bool enabled() const {
+		return _log_fd >= 0;
+	}
+
+	/* Append complete frames (u32 length, data) holding count messages, returns the offset of the last one. */
+	uint64_t append(std::string_view frames, uint64_t count) {
+		_records.clear();
+		_index.clear();
+		for (uint64_t i = 0; i < count; ++i) {
+			uint32_t len = 0;
+			memcpy(&len, frames.data(), sizeof len);
+			_add_record(frames.substr(sizeof len, len));
+			frames.remove_prefix(sizeof len + len);
+		}
+		_write_out();
+		return _next_offset - 1;
+	}
+	uint64_t append_message(std::string_view message) {
+		_records.clear();
+		_index.clear();
+		_add_record(message);
+		_write_out();
+		return _next_offset - 1;
+	}
+	/* Messages appended so far, i.e. the offset the next one gets. */
+	uint64_t end() const {
+		return _next_offset;
+	}
+	/* Messages before this offset are on the disk. */
+	uint64_t synced() const {
+		return _synced.load(std::memory_order_acquire);
+	}
+	/* Have everything appended so far synced, together with whatever else is appended before the sync starts. */
+	void request_sync() {
+		if (synced() == _next_offset) return;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_requested == _next_offset) return;
+			_requested = _next_offset;
+		}
+		_changed.notify_one();
+	}
+	int event_fd() const {
+		return _event_fd;
+	}
+	/* Clear the event after a sync finished, returns the errno of a failed sync or 0. */
+	int drain() {
+		uint64_t count = 0;
+		::read(_event_fd, &count, sizeof count);
+		return _sync_error.exchange(0);
+	}
+
+	/* Length of the complete frames at the front of data, count is set to their number. */
+	static size_t complete_frames(std::string_view data, uint64_t& count) {
+		size_t used = 0;
+		count = 0;
+		while (data.size() - used >= sizeof(uint32_t)) {
+			uint32_t len = 0;
+			memcpy(&len, data.data() + used, sizeof len);
+			if (len > MESSAGE_MAX) throw mfcslib::peer_exception("Message is too long.");
+			if (data.size() - used - sizeof len < len) break;
+			used += sizeof len + len;
+			++count;
+		}
+		return used;
+	}
+
+private:
+	string _dir;
+	int _dir_fd = -1;
+	int _log_fd = -1;
+	int _index_fd = -1;
+	int _event_fd = -1;
+	uint64_t _next_offset = 0;
+	uint64_t _position = 0;
+	uint64_t _indexed = 0;
+	string _records;
+	string _index;
+	/* Shared with the sync thread. */
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::thread _syncer;
+	uint64_t _requested = 0;
+	std::vector<int> _retired;
+	bool _new_segment = false;
+	bool _stopping = false;
+	std::atomic<uint64_t> _synced{ 0 };
+	std::atomic<int> _sync_error{ 0 };
+
+	void _add_record(std::string_view data) {
+		message_record_header header{ _next_offset, uint32_t(data.size()), 0 };
+		mfcslib::crc32c crc;
+		crc.update(data.data(), data.size());
+		header.crc = crc.value();
+		auto position = _position + _records.size();
+		if (position == 0 || position - _indexed >= MESSAGE_INDEX_INTERVAL) {
+			message_index_entry entry{ _next_offset, position };
+			_index.append(reinterpret_cast<const char*>(&entry), sizeof entry);
+			_indexed = position;
+		}
+		_records.append(reinterpret_cast<const char*>(&header), sizeof header);
+		_records.append(data);
+		++_next_offset;
+	}
+	void _write_out() {
+		_write_all(_log_fd, _records);
+		_write_all(_index_fd, _index);
+		_position += _records.size();
+		if (_position >= MESSAGE_SEGMENT_SIZE) _start_segment(_next_offset);
+	}
+	static void _write_all(int fd, std::string_view data) {
+		while (!data.empty()) {
+			auto ret = ::write(fd, data.data(), data.size());
+			if (ret < 0) throw mfcslib::IO_exception(strerror(errno));
+			data.remove_prefix(ret);
+		}
+	}
+	static int _open_segment_file(const string& path, int flags) {
+		int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | flags, 0644);
+		if (fd < 0) throw mfcslib::file_exception(strerror(errno));
+		return fd;
+	}
+	/* The current segment goes to the sync thread, which syncs and closes it. */
+	void _start_segment(uint64_t base) {
+		int log_fd = _open_segment_file(message_segment_path(_dir, base, ".log"), O_CREAT | O_TRUNC | O_APPEND);
+		int index_fd = _open_segment_file(message_segment_path(_dir, base, ".index"), O_CREAT | O_TRUNC | O_APPEND);
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_log_fd >= 0) {
+				_retired.push_back(_log_fd);
+				_retired.push_back(_index_fd);
+			}
+			_log_fd = log_fd;
+			_index_fd = index_fd;
+			_new_segment = true;
+		}
+		_position = 0;
+		_indexed = 0;
+	}
+	/* Keep the valid records of the last segment and rebuild its index from them. */
+	void _recover(uint64_t base) {
+		_log_fd = _open_segment_file(message_segment_path(_dir, base, ".log"), O_APPEND);
+		_index_fd = _open_segment_file(message_segment_path(_dir, base, ".index"), O_CREAT | O_TRUNC | O_APPEND);
+		struct stat st;
+		if (fstat(_log_fd, &st) < 0) throw mfcslib::file_exception(strerror(errno));
+		_next_offset = base;
+		std::vector<message_index_entry> index;
+		if (st.st_size > 0) {
+			auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, _log_fd, 0);
+			if (data == MAP_FAILED) throw mfcslib::file_exception(strerror(errno));
+			_position = valid_records({ static_cast<const char*>(data), size_t(st.st_size) }, _next_offset, &index);
+			munmap(data, st.st_size);
+		}
+		if (_position < uintmax_t(st.st_size) && ::ftruncate(_log_fd, _position) < 0) throw mfcslib::file_exception(strerror(errno));
+		_write_all(_index_fd, { reinterpret_cast<const char*>(index.data()), index.size() * sizeof(message_index_entry) });
+		_indexed = index.empty() ? 0 : index.back().position;
+		fdatasync(_log_fd);
+		if (_position >= MESSAGE_SEGMENT_SIZE) _start_segment(_next_offset);
+	}
+	void _sync_loop() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (true) {
+			_changed.wait(lock, [this]() { return _stopping || _requested > _synced.load(std::memory_order_relaxed); });
+			if (_stopping) break;
+			auto target = _requested;
+			auto retired = std::move(_retired);
+			_retired.clear();
+			bool new_segment = std::exchange(_new_segment, false);
+			int log_fd = ::dup(_log_fd), index_fd = ::dup(_index_fd);
+			lock.unlock();
+			int error = 0;
+			for (int fd : retired) {
+				if (fdatasync(fd) < 0) error = errno;
+				::close(fd);
+			}
+			if (log_fd < 0 || fdatasync(log_fd) < 0) error = errno;
+			if (index_fd < 0 || fdatasync(index_fd) < 0) error = errno;
+			if (new_segment && fsync(_dir_fd) < 0) error = errno;
+			if (log_fd >= 0) ::close(log_fd);
+			if (index_fd >= 0) ::close(index_fd);
+			if (error == 0) _synced.store(target, std::memory_order_release);
+			else _sync_error.store(error);
+			uint64_t one = 1;
+			::write(_event_fd, &one, sizeof one);
+			lock.lock();
+			/* A failed sync is retried on the next request only. */
+			if (error != 0) _requested = _synced.load(std::memory_order_relaxed);
+		}
+	}
+};
+
+/*
+ * Reads the message log from any offset, e.g. in another process. The index
+ * of the segment holding the offset is mapped to find where to start, and
+ * records are read up to the first one not completely written yet.
+ */
+class message_reader
+{
+public:
+	explicit message_reader(const string& dir) :_dir(dir) {
+		if (_dir.back() != '/') _dir += '/';
+	}
+	~message_reader() = default;
+
+	/* Call each(offset, data) for at most max messages from offset on, returns how many there were. */
+	template<typename F>
+	size_t read(uint64_t offset, size_t max, F&& each) {
+		auto bases = message_segments(_dir);
+		auto ite = std::upper_bound(bases.begin(), bases.end(), offset);
+		if (ite == bases.begin()) return 0;
+		size_t delivered = 0;
+		for (--ite; ite != bases.end() && delivered < max; ++ite) {
+			auto before = delivered;
+			delivered += _read_segment(*ite, offset, max - delivered, each);
+			if (delivered == before && ite + 1 != bases.end() && offset < *(ite + 1)) break;
+		}
+		return delivered;
+	}
+
+private:
+	string _dir;
+
+	/* Position of the last indexed record at or before offset. */
+	uint64_t _start_position(uint64_t base, uint64_t offset) {
+		mfcslib::File index(message_segment_path(_dir, base, ".index"));
+		try {
+			index.open_read_only();
+		}
+		catch (const mfcslib::file_exception& e) {
+			return 0;
+		}
+		auto count = index.size() / sizeof(message_index_entry);
+		if (count == 0) return 0;
+		auto data = mmap(nullptr, count * sizeof(message_index_entry), PROT_READ, MAP_SHARED, index.get_fd(), 0);
+		if (data == MAP_FAILED) return 0;
+		auto entries = static_cast<const message_index_entry*>(data);
+		auto found = std::upper_bound(entries, entries + count, offset,
+			[](uint64_t value, const message_index_entry& entry) { return value < entry.offset; });
+		uint64_t position = found == entries ? 0 : (found - 1)->position;
+		munmap(data, count * sizeof(message_index_entry));
+		return position;
+	}
+	template<typename F>
+	size_t _read_segment(uint64_t base, uint64_t& offset, size_t max, F& each) {
+		mfcslib::File log(message_segment_path(_dir, base, ".log"));
+		log.open_read_only();
+		auto size = log.size();
+		auto position = _start_position(base, offset);
+		if (position >= size) return 0;
+		auto data = mmap(nullptr, size, PROT_READ, MAP_SHARED, log.get_fd(), 0);
+		if (data == MAP_FAILED) throw mfcslib::file_exception(strerror(errno));
+		madvise(data, size, MADV_SEQUENTIAL);
+		std::string_view records(static_cast<const char*>(data) + position, size - position);
+		size_t delivered = 0;
+		while (delivered < max && records.size() >= sizeof(message_record_header)) {
+			message_record_header header;
+			memcpy(&header, records.data(), sizeof header);
+			uint64_t expected = header.offset;
+			if (valid_records(records.substr(0, sizeof header + std::min<size_t>(header.length, records.size() - sizeof header)), expected) == 0) break;
+			if (header.offset >= offset) {
+				each(header.offset, records.substr(sizeof header, header.length));
+				offset = header.offset + 1;
+				++delivered;
+			}
+			records.remove_prefix(sizeof header + header.length);
+		}
+		munmap(data, size);
+		return delivered;
+	}
+};
+#endif // !MESSAGE_LOG_HPP
@@ -0,0 +1,126 @@
+#ifndef MESSAGE_STREAM_HPP
+#define MESSAGE_STREAM_HPP
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../include/io.hpp"
+#define MESSAGE_SEND_BATCH 65'536
+
+/*
+ * Client side of a message stream: many small messages over one connection.
+ * send only frames a message into a buffer, which goes out in one write once
+ * it holds a batch or on flush. A reader thread takes the server's
+ * cumulative acks, so acked() tells how many messages are stored.
+ *
+ *     message_stream s("192.168.100.5", 9007);
+ *     for (auto& line : lines) s.send(line);
+ *     s.close();    // flushes and waits until every message is stored
+ */
+class message_stream
+{
+public:
+	/* on_ack runs on the reader thread with the new cumulative count. */
+	message_stream(const std::string& ip, uint16_t port, std::function<void(uint64_t)> on_ack = {}) :
+		_socket(ip, port), _on_ack(std::move(on_ack)) {
+		int flag = 1;
+		setsockopt(_socket.get_fd(), IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+		_write_all("i/\n");
+		if (_socket.read() != '1') throw mfcslib::peer_exception("Server refused the message stream.");
+		_reader = std::thread(&message_stream::_read_acks, this);
+	}
+	message_stream(const message_stream&) = delete;
+	~message_stream() {
+		try {
+			close();
+		}
+		catch (const mfcslib::basic_exception& e) {}
+		if (_reader.joinable()) {
+			shutdown(_socket.get_fd(), SHUT_RDWR);
+			_reader.join();
+		}
+	}
+
+	/* Queue a message, returns its sequence number counting from 1. */
+	uint64_t send(std::string_view message) {
+		if (message.size() > UINT32_MAX) throw std::invalid_argument("Message is too long.");
+		uint32_t len = message.size();
+		_batch.append(reinterpret_cast<const char*>(&len), sizeof len);
+		_batch.append(message);
+		if (_batch.size() >= MESSAGE_SEND_BATCH) flush();
+		return ++_sent;
+	}
+	void flush() {
+		_write_all(_batch);
+		_batch.clear();
+	}
+	uint64_t sent() const {
+		return _sent;
+	}
+	uint64_t acked() const {
+		return _acked.load(std::memory_order_acquire);
+	}
+	/* Block until the server has stored message seq, false when the connection broke first. */
+	bool wait_for(uint64_t seq) {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_changed.wait(lock, [this, seq]() { return acked() >= seq || _broken; });
+		return acked() >= seq;
+	}
+	/* Flush, wait for the last ack and hang up. */
+	void close() {
+		if (!_reader.joinable()) return;
+		flush();
+		bool complete = wait_for(_sent);
+		shutdown(_socket.get_fd(), SHUT_RDWR);
+		_reader.join();
+		if (!complete) throw mfcslib::peer_exception("Connection broke before every message was stored.");
+	}
+
+private:
+	mfcslib::NetworkSocket _socket;
+	std::function<void(uint64_t)> _on_ack;
+	std::string _batch;
+	uint64_t _sent = 0;
+	std::atomic<uint64_t> _acked{ 0 };
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::thread _reader;
+	bool _broken = false;
+
+	void _write_all(std::string_view data) {
+		while (!data.empty()) {
+			auto ret = _socket.write(data);
+			if (ret <= 0) throw mfcslib::socket_exception(ret < 0 ? strerror(errno) : "Connection closed.");
+			data.remove_prefix(ret);
+		}
+	}
+	/* Acks are u64 counts; only the latest of those that arrived together matters. */
+	void _read_acks() {
+		char data[sizeof(uint64_t) * 64];
+		size_t have = 0;
+		while (true) {
+			auto ret = _socket.read(data + have, sizeof data - have);
+			if (ret <= 0) break;
+			have += ret;
+			auto whole = have / sizeof(uint64_t) * sizeof(uint64_t);
+			if (whole == 0) continue;
+			uint64_t count = 0;
+			memcpy(&count, data + whole - sizeof count, sizeof count);
+			memmove(data, data + whole, have - whole);
+			have -= whole;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_acked.store(count, std::memory_order_release);
+			}
+			_changed.notify_all();
+			if (_on_ack) _on_ack(count);
+		}
+		std::lock_guard<std::mutex> lock(_mutex);
+		_broken = true;
+		_changed.notify_all();
+	}
+};
+#endif // !MESSAGE_STREAM_HPP
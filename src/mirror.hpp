@@ -0,0 +1,369 @@
+#ifndef MIRROR_HPP
+#define MIRROR_HPP
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "../include/checksum.hpp"
+#include "session.hpp"
+#define MIRROR_SETTLE 100ms
+#define MIRROR_MAX_DELAY 500ms
+#define MIRROR_IN_FLIGHT 64
+#define MIRROR_RETRY 1s
+#define MIRROR_EVENT_BUFFER 65'536
+#define MIRROR_WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DONT_FOLLOW | IN_EXCL_UNLINK | IN_ONLYDIR)
+
+using namespace std::chrono_literals;
+
+/*
+ * Keeps a directory mirrored into FileReceived/<its name> on a server, over
+ * one session, as it changes. Every directory below it has an inotify
+ * watch, so the tree is walked only at the start and after the event queue
+ * overflowed. A file is put once it is closed after writing and then left
+ * alone for MIRROR_SETTLE, or at the latest MIRROR_MAX_DELAY after the first
+ * write, so a burst of writes costs one transfer. Renames inside the tree
+ * are renames on the server; whatever leaves the tree or is deleted is
+ * removed there. Requests are pipelined, at most MIRROR_IN_FLIGHT at a time,
+ * and those cut off by a broken connection are sent again once it is back.
+ * The first walk puts what the server lacks but can not tell what was
+ * removed here while no mirror ran, so such files stay on the server.
+ */
+class mirror
+{
+public:
+	mirror(std::string root, std::string ip, uint16_t port) :_root(std::move(root)), _ip(std::move(ip)), _port(port) {
+		while (_root.size() > 1 && _root.back() == '/') _root.pop_back();
+		_base = _root.substr(_root.find_last_of('/') + 1);
+		_root += '/';
+		_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (_inotify < 0) throw mfcslib::file_exception(strerror(errno));
+	}
+	mirror(const mirror&) = delete;
+	~mirror() {
+		::close(_inotify);
+	}
+
+	/* Never returns unless the tree can not be watched at all. */
+	void run() {
+		/* A server going away must not take the daemon with it. */
+		signal(SIGPIPE, SIG_IGN);
+		_watch_tree("", false);
+		if (_watches.empty()) throw mfcslib::file_exception("Fail to watch " + _root + ": " + strerror(errno));
+		while (true) {
+			if (!_session && clock::now() >= _retry_at) _connect();
+			pollfd wait{ _inotify, POLLIN, 0 };
+			::poll(&wait, 1, _wait_ms());
+			_read_events();
+			auto now = clock::now();
+			_expire_moves(now);
+			_flush_dirty(now);
+			_pump();
+		}
+	}
+
+private:
+	using clock = std::chrono::steady_clock;
+	/* 'h' put unless the server has it, 'f' put, 'd' make directory, 'r' rename to to, 'x' remove. */
+	struct op
+	{
+		char kind;
+		std::string path;
+		std::string to;
+	};
+	struct flight
+	{
+		op what;
+		std::future<bool> done;
+	};
+	struct dirty_file
+	{
+		clock::time_point first;
+		clock::time_point last;
+	};
+	/* Half of a rename, until its other half turns up or it is taken for a move out of the tree. */
+	struct move
+	{
+		std::string path;
+		bool dir;
+		clock::time_point at;
+	};
+	std::string _root;
+	std::string _base;
+	std::string _ip;
+	uint16_t _port;
+	int _inotify = -1;
+	/* Watch descriptor to the directory it watches, relative to the root. */
+	std::unordered_map<int, std::string> _watches;
+	std::unordered_map<std::string, dirty_file> _dirty;
+	std::unordered_map<uint32_t, move> _moves;
+	std::deque<op> _ops;
+	std::deque<flight> _flights;
+	std::optional<session> _session;
+	clock::time_point _retry_at;
+
+	static std::string _join(const std::string& dir, const char* name) {
+		return dir.empty() ? std::string(name) : dir + '/' + name;
+	}
+	static bool _under(const std::string& path, const std::string& dir) {
+		return path == dir || (path.starts_with(dir) && path[dir.size()] == '/');
+	}
+	std::string _remote(const std::string& path) const {
+		return path.empty() ? _base : _base + '/' + path;
+	}
+
+	void _connect() {
+		try {
+			_session.emplace(_ip, _port);
+			std::cout << "Connected to " << _ip << ':' << _port << std::endl;
+		}
+		catch (const mfcslib::basic_exception& e) {
+			_session.reset();
+			_retry_at = clock::now() + MIRROR_RETRY;
+		}
+	}
+	/* The session broke: what was in flight goes out again first, on the next connection. */
+	void _disconnect() {
+		for (auto ite = _flights.rbegin(); ite != _flights.rend(); ++ite) _ops.push_front(std::move(ite->what));
+		_flights.clear();
+		_session.reset();
+		_retry_at = clock::now() + MIRROR_RETRY;
+		std::cerr << "Connection lost, reconnecting." << std::endl;
+	}
+	int _wait_ms() const {
+		/* Requests queued while there was no connection. */
+		if (_session && !_ops.empty()) return 0;
+		auto due = clock::time_point::max();
+		for (auto& [path, file] : _dirty) due = std::min(due, std::min(file.last + MIRROR_SETTLE, file.first + MIRROR_MAX_DELAY));
+		for (auto& [cookie, moved] : _moves) due = std::min(due, moved.at + MIRROR_SETTLE);
+		if (!_session) due = std::min(due, _retry_at);
+		/* Replies are looked at now and then while they come in. */
+		if (!_flights.empty()) due = std::min(due, clock::now() + 10ms);
+		if (due == clock::time_point::max()) return -1;
+		return int(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(due - clock::now()).count() + 1));
+	}
+
+	/* Watch dir and everything below it, queuing its files: checked against the server on a first look, as written otherwise. */
+	void _watch_tree(const std::string& dir, bool fresh) {
+		int wd = inotify_add_watch(_inotify, (_root + dir).c_str(), MIRROR_WATCH_MASK);
+		if (wd < 0) {
+			if (errno == ENOSPC) std::cerr << "Out of inotify watches, raise fs.inotify.max_user_watches." << std::endl;
+			return;
+		}
+		_watches[wd] = dir;
+		_ops.push_back({ 'd', dir, {} });
+		auto dir_d = ::opendir((_root + dir).c_str());
+		if (dir_d == nullptr) return;
+		std::vector<std::string> subdirs;
+		for (struct dirent* ptr = nullptr; (ptr = ::readdir(dir_d)) != nullptr;) {
+			if (strcmp(ptr->d_name, ".") == 0 || strcmp(ptr->d_name, "..") == 0) continue;
+			auto path = _join(dir, ptr->d_name);
+			auto type = ptr->d_type;
+			if (type == DT_UNKNOWN) {
+				struct stat st;
+				if (::lstat((_root + path).c_str(), &st) < 0) continue;
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+			if (type == DT_DIR) subdirs.push_back(std::move(path));
+			else if (type == DT_REG) {
+				if (fresh) _touch(path);
+				else _ops.push_back({ 'h', std::move(path), {} });
+			}
+		}
+		::closedir(dir_d);
+		for (auto& subdir : subdirs) _watch_tree(subdir, fresh);
+	}
+	void _unwatch_tree(const std::string& dir) {
+		std::erase_if(_watches, [this, &dir](auto& watch) {
+			if (!_under(watch.second, dir)) return false;
+			inotify_rm_watch(_inotify, watch.first);
+			return true;
+		});
+	}
+	void _touch(const std::string& path) {
+		auto now = clock::now();
+		auto [ite, added] = _dirty.try_emplace(path, dirty_file{ now, now });
+		ite->second.last = now;
+	}
+	/* Writes below path that are not out yet, now that it is gone. */
+	void _forget(const std::string& path) {
+		std::erase_if(_dirty, [&path](auto& file) { return _under(file.first, path); });
+	}
+	void _renamed(const std::string& from, const std::string& to, bool dir) {
+		_ops.push_back({ 'r', from, to });
+		if (dir) {
+			for (auto& [wd, path] : _watches) {
+				if (_under(path, from)) path = to + path.substr(from.size());
+			}
+		}
+		std::vector<std::pair<std::string, dirty_file>> moved;
+		std::erase_if(_dirty, [&](auto& file) {
+			if (!_under(file.first, from)) return false;
+			moved.emplace_back(to + file.first.substr(from.size()), file.second);
+			return true;
+		});
+		for (auto& file : moved) _dirty.insert(std::move(file));
+	}
+
+	void _read_events() {
+		alignas(inotify_event) char buffer[MIRROR_EVENT_BUFFER];
+		while (true) {
+			auto ret = ::read(_inotify, buffer, sizeof buffer);
+			if (ret <= 0) return;
+			for (char* pt = buffer; pt < buffer + ret;) {
+				auto event = reinterpret_cast<inotify_event*>(pt);
+				pt += sizeof(inotify_event) + event->len;
+				_handle(*event);
+			}
+		}
+	}
+	void _handle(const inotify_event& event) {
+		if (event.mask & IN_Q_OVERFLOW) {
+			/* Events were lost, only a walk can tell what changed. Removals in that window are missed. */
+			std::cerr << "Too many changes at once, walking the tree again." << std::endl;
+			_moves.clear();
+			_watch_tree("", false);
+			return;
+		}
+		auto ite = _watches.find(event.wd);
+		if (ite == _watches.end()) return;
+		if (event.mask & IN_IGNORED) {
+			_watches.erase(ite);
+			return;
+		}
+		if (event.len == 0) return;
+		auto path = _join(ite->second, event.name);
+		bool dir = event.mask & IN_ISDIR;
+		if (event.mask & IN_CLOSE_WRITE) _touch(path);
+		else if (event.mask & IN_CREATE) {
+			/* A new file is put when it is closed. */
+			if (dir) _watch_tree(path, true);
+		}
+		else if (event.mask & IN_DELETE) {
+			_forget(path);
+			_ops.push_back({ 'x', path, {} });
+		}
+		else if (event.mask & IN_MOVED_FROM) _moves[event.cookie] = { path, dir, clock::now() };
+		else if (event.mask & IN_MOVED_TO) {
+			if (auto moved = _moves.find(event.cookie); moved != _moves.end()) {
+				_renamed(moved->second.path, path, dir);
+				_moves.erase(moved);
+			}
+			else if (dir) _watch_tree(path, true);
+			else _touch(path);
+		}
+	}
+	/* Halves of renames left alone long enough were moves out of the tree. */
+	void _expire_moves(clock::time_point now) {
+		std::erase_if(_moves, [this, now](auto& item) {
+			auto& moved = item.second;
+			if (now - moved.at < MIRROR_SETTLE) return false;
+			if (moved.dir) _unwatch_tree(moved.path);
+			_forget(moved.path);
+			_ops.push_back({ 'x', moved.path, {} });
+			return true;
+		});
+	}
+	void _flush_dirty(clock::time_point now) {
+		std::erase_if(_dirty, [this, now](auto& file) {
+			if (now < file.second.last + MIRROR_SETTLE && now < file.second.first + MIRROR_MAX_DELAY) return false;
+			_ops.push_back({ 'f', file.first, {} });
+			return true;
+		});
+	}
+
+	void _pump() {
+		while (_session) {
+			while (!_flights.empty() && _flights.front().done.wait_for(0s) == std::future_status::ready) {
+				bool ok = _flights.front().done.get();
+				if (!ok && _session->broken()) break;
+				_settle(_flights.front().what, ok);
+				_flights.pop_front();
+			}
+			if (_session->broken()) {
+				_disconnect();
+				return;
+			}
+			if (_ops.empty()) return;
+			if (_flights.size() >= MIRROR_IN_FLIGHT) {
+				_flights.front().done.wait();
+				continue;
+			}
+			auto next = std::move(_ops.front());
+			_ops.pop_front();
+			_issue(std::move(next));
+		}
+	}
+	void _issue(op next) {
+		auto remote = _remote(next.path);
+		std::future<bool> done;
+		try {
+			switch (next.kind) {
+			case 'h': {
+				mfcslib::File file(_root + next.path);
+				file.open_read_only();
+				done = _session->have(remote, file.size(), mfcslib::file_checksum(file.get_fd(), file.size()));
+				break;
+			}
+			case 'f':
+				done = _session->put(_root + next.path, remote);
+				break;
+			case 'd':
+				done = _session->make_directory(remote);
+				break;
+			case 'r':
+				done = _session->rename(remote, _remote(next.to));
+				break;
+			default:
+				done = _session->remove(remote);
+				break;
+			}
+		}
+		catch (const mfcslib::file_exception& e) {
+			/* Gone from here since, whatever took it away has an event of its own. */
+			return;
+		}
+		catch (const mfcslib::basic_exception& e) {
+			_ops.push_front(std::move(next));
+			return;
+		}
+		catch (const std::invalid_argument& e) {
+			std::cerr << "Can not mirror " << next.path << ", its name has a line break." << std::endl;
+			return;
+		}
+		_flights.push_back({ std::move(next), std::move(done) });
+	}
+	void _settle(const op& done, bool ok) {
+		switch (done.kind) {
+		case 'h':
+			if (!ok) _ops.push_back({ 'f', done.path, {} });
+			break;
+		case 'f':
+			if (ok) std::cout << "+ " << done.path << std::endl;
+			else std::cerr << "Fail to mirror " << done.path << std::endl;
+			break;
+		case 'r':
+			if (ok) std::cout << done.path << " -> " << done.to << std::endl;
+			else {
+				/* The server did not have it, so it gets all of it. */
+				struct stat st;
+				if (::lstat((_root + done.to).c_str(), &st) == 0 && S_ISDIR(st.st_mode)) _watch_tree(done.to, false);
+				else _ops.push_back({ 'f', done.to, {} });
+			}
+			break;
+		case 'x':
+			std::cout << "- " << done.path << std::endl;
+			break;
+		}
+	}
+};
+#endif // !MIRROR_HPP
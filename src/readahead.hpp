@@ -0,0 +1,61 @@
+#ifndef READAHEAD_HPP
+#define READAHEAD_HPP
+#include <fcntl.h>
+#include <unistd.h>
+#include "thread_pool.hpp"
+#define READAHEAD_WINDOW 4'194'304
+#define DROP_BEHIND_MIN 268'435'456
+
+/*
+ * Keeps the page cache one window ahead of a range being sent with sendfile.
+ * The next window is read in by readahead on the pool while the current one
+ * is sent, so sendfile seldom waits for the disk on the loop thread. Large
+ * one-shot streams can drop the pages they have passed.
+ */
+class readahead_stream
+{
+public:
+	readahead_stream(thread_pool& pool, int fd, uintmax_t start, uintmax_t end, bool drop_behind) :
+		_pool(pool), _fd(fd), _end(end), _issued(start), _dropped(start),
+		_drop_behind(drop_behind && end - start >= DROP_BEHIND_MIN) {
+		posix_fadvise(_fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+		_issue(start);
+	}
+	readahead_stream(const readahead_stream&) = delete;
+	~readahead_stream() = default;
+
+	/* Everything before pos has been sent. */
+	void advance(uintmax_t pos) {
+		_issue(pos);
+		if (_drop_behind && pos >= _dropped + 2 * READAHEAD_WINDOW) {
+			/* A window is left behind, its pages may still sit in the socket buffer. */
+			auto upto = pos - READAHEAD_WINDOW;
+			posix_fadvise(_fd, _dropped, upto - _dropped, POSIX_FADV_DONTNEED);
+			_dropped = upto;
+		}
+	}
+
+private:
+	thread_pool& _pool;
+	int _fd;
+	uintmax_t _end;
+	uintmax_t _issued;
+	uintmax_t _dropped;
+	bool _drop_behind;
+
+	/* Start reading the next window once pos is within a window of the data already asked for. */
+	void _issue(uintmax_t pos) {
+		if (_issued >= _end || _issued > pos + READAHEAD_WINDOW) return;
+		auto len = std::min<uintmax_t>(2 * READAHEAD_WINDOW, _end - _issued);
+		/* The task gets its own descriptor, the sender may close the file before it runs. */
+		int fd = dup(_fd);
+		if (fd < 0) return;
+		_pool.submit_to_pool(_read_in, fd, _issued, len);
+		_issued += len;
+	}
+	static void _read_in(int fd, uintmax_t off, uintmax_t len) {
+		readahead(fd, off, len);
+		close(fd);
+	}
+};
+#endif // !READAHEAD_HPP
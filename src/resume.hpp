@@ -0,0 +1,65 @@
+#ifndef RESUME_HPP
+#define RESUME_HPP
+#include <cstdio>
+#include "../include/checksum.hpp"
+#include "../include/io.hpp"
+#define RESUME_CHECKPOINT 67'108'864
+#define RECEIVE_BUFFER_SIZE 4'194'304
+
+/*
+ * Sidecar of a partially transferred file, kept next to it as ".<name>.sft".
+ * It records how many leading bytes are known to be on disk and their CRC32C,
+ * so that an interrupted transfer can continue from there.
+ */
+struct resume_record
+{
+	uintmax_t size = 0;
+	uintmax_t offset = 0;
+	uint32_t crc = 0;
+
+	static string path_for(const string& file) {
+		return mfcslib::hidden_sibling(file, ".sft");
+	}
+	bool load(const string& path) {
+		try {
+			mfcslib::File sidecar(path);
+			sidecar.open_read_only();
+			auto buf = mfcslib::make_array<Byte>(BUFFER_LENGTH);
+			sidecar.read(buf);
+			std::string_view content(buf.get_ptr());
+			size = std::stoull(string(mfcslib::pop_field(content)));
+			offset = std::stoull(string(mfcslib::pop_field(content)));
+			crc = (uint32_t)std::stoul(string(mfcslib::pop_field(content)));
+			return offset <= size;
+		}
+		catch (const mfcslib::basic_exception& e) {}
+		catch (const std::exception& e) {}
+		return false;
+	}
+	/* Sync the data of file and record that its first received bytes hash to value. */
+	void checkpoint(mfcslib::File& file, uintmax_t received, uint32_t value, const string& path) {
+		fdatasync(file.get_fd());
+		offset = received;
+		crc = value;
+		save(path);
+	}
+	/* The data up to offset must already be synced. */
+	void save(const string& path) const {
+		auto tmp_path = path + ".tmp";
+		{
+			mfcslib::File sidecar(tmp_path);
+			sidecar.open(true, mfcslib::WRONLY);
+			sidecar.write(std::to_string(size) + '/' + std::to_string(offset) + '/' + std::to_string(crc));
+			fdatasync(sidecar.get_fd());
+		}
+		if (rename(tmp_path.c_str(), path.c_str()) < 0)
+			throw mfcslib::file_exception(strerror(errno));
+	}
+	static void remove(const string& path) {
+		::unlink(path.c_str());
+	}
+
+private:
+	static constexpr size_t BUFFER_LENGTH = 64;
+};
+#endif // !RESUME_HPP
@@ -1,21 +1,42 @@
 #ifndef S_HPP
 #define S_HPP
 #include "../include/coroutine.hpp"
+#include "../include/delta.hpp"
+#include "../include/direct_io.hpp"
 #include "../include/http.hpp"
 #include "../include/io.hpp"
+#include "../include/local.hpp"
+#include "../include/rudp.hpp"
+#include "../include/send_engine.hpp"
+#include "../include/sparse.hpp"
+#include "../include/tree.hpp"
+#include "cache.hpp"
+#include "chunk_store.hpp"
 #include "epoll_utility.hpp"
+#include "fanout.hpp"
 #include "fields.h"
 #include "logger.hpp"
+#include "merkle.hpp"
+#include "message_log.hpp"
+#include "readahead.hpp"
+#include "resume.hpp"
+#include "swarm.hpp"
+#include <atomic>
+#include <deque>
+#include <exception>
 #include <format>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#ifndef MAXARRSZ
-#define MAXARRSZ 1024'000'000
-#define NUMSTOP 20'000
-#endif // !MAXARRSZ
 #define LOG_INFO(...) if(log::get_instance()->enable_log()) log::get_instance()->process_and_submit(LINFO,__VA_ARGS__)
 #define LOG_DEBUG(...) if(log::get_instance()->enable_log()) log::get_instance()->process_and_submit(LDEBUG,__VA_ARGS__)
 #define LOG_VERBOSE if(log::get_instance()->enable_log()) log::get_instance()->process_and_submit(LDEBUG,"in ",__FILE__,':',std::to_string(__LINE__))
@@ -30,6 +51,14 @@
 #define DEFAULT_PORT 9007
 #define ALARM_TIME 1800s
 #define TIMEOUT 30000
+#define PART_BUFFER_SIZE 1'048'576
+#define WRITEBACK_WINDOW 8'388'608
+#define SESSION_LINE_MAX 8192
+#define MESSAGE_BATCH_MAX 4'194'304
+#define CHAIN_TIMEOUT 60
+#define DELTA_SIGNATURE_MAX 4'194'304
+#define PUSH_CHUNK 4'194'304
+#define PUSH_PROGRESS 200ms
 using std::cout;
 using std::endl;
 using std::to_string;
@@ -44,7 +73,21 @@ enum MyEnum
 	FILE_TYPE,
 	MESSAGE_TYPE,
 	HTTP_TYPE,
-	GET_TYPE
+	GET_TYPE,
+	PART_TYPE,
+	QUERY_TYPE,
+	DELTA_TYPE,
+	DEDUP_TYPE,
+	TREE_TYPE,
+	SESSION_TYPE,
+	LOCAL_TYPE,
+	STREAM_TYPE,
+	SUBSCRIBE_TYPE,
+	UDP_TYPE,
+	CHAIN_TYPE,
+	SWARM_TYPE,
+	SYNC_TYPE,
+	PUSH_TYPE
 };
 
 struct data_info :public mfcslib::NetworkSocket
@@ -57,12 +100,79 @@ struct data_info :public mfcslib::NetworkSocket
 		*pt_fd = -1;
 		this->ip_port = *pt_addr;
 		::memset(pt_addr, 0, sizeof(sockaddr_in));
+		/* The descriptor may be reused from a connection that was closed without being erased. */
+		requests.clear();
+		task.destroy();
+		is_write_awaiting = false;
+		is_read_awaiting = false;
+		local = false;
+		if (passed_fd >= 0) ::close(passed_fd);
+		passed_fd = -1;
+		sync_wait = 0;
+		subscriber = false;
+		cache_wait = false;
+		pool_wait = false;
 		return *this;
 	}
+	~data_info() {
+		if (passed_fd >= 0) ::close(passed_fd);
+	}
+	/* The socket was closed by close_connection, erasing the entry must not close the number again. */
+	void forget_fd() {
+		_fd = -1;
+	}
 	string requests;
 	co_handle task;
 	bool is_write_awaiting = false;
 	bool is_read_awaiting = false;
+	/* Connected through the Unix socket, where requests may carry a descriptor. */
+	bool local = false;
+	int passed_fd = -1;
+	/* Resumed once the message log is synced up to this offset, 0 when not waiting. */
+	uint64_t sync_wait = 0;
+	/* Fed by the fanout instead of a task. */
+	bool subscriber = false;
+	/* Resumed when a fetch from the upstream server moves on. */
+	bool cache_wait = false;
+	/* Resumed when a job it handed to io_pool is done. */
+	bool pool_wait = false;
+};
+
+/* A piece of a file to be sent, either a whole file or a chunk from the chunk store. */
+struct send_segment
+{
+	string path;
+	uintmax_t offset;
+	uintmax_t length;
+};
+
+/*
+ * Work a task hands to io_pool, shared with the pool so that a task torn down
+ * meanwhile never waits for it. The task checks done after every resume.
+ */
+template<typename R>
+struct pool_job
+{
+	std::atomic<bool> done{ false };
+	R value{};
+	std::exception_ptr error;
+
+	R get() {
+		if (error) std::rethrow_exception(error);
+		return std::move(value);
+	}
+};
+
+/* A file uploaded in parts over several connections, shared by all of them. */
+struct part_transfer
+{
+	/* Written as a hidden ".part" sibling of path until every part is in. */
+	string path;
+	mfcslib::File file;
+	uintmax_t size = 0;
+	uintmax_t received = 0;
+	std::unordered_set<uintmax_t> finished_parts;
+	sc::time_point<sc::system_clock> last_active;
 };
 
 class receive_loop
@@ -83,15 +193,99 @@ private:
 		ListenPort
 	};
 	epoll_utility epoll_instance;
+	/* Last activity of each connection, for timing out idle ones. */
+	mfcslib::timer<int> clock{ ALARM_TIME };
 	unordered_map<int, data_info> connections;
 	unordered_map<string, string> json_conf;
+	unordered_map<string, long long> json_num;
+	unordered_map<string, std::shared_ptr<part_transfer>> transfers;
+	chunk_store store;
+	message_log messages;
+	/* Connections whose task waits for the message log to reach the disk. */
+	std::vector<int> sync_waiters;
+	fanout subscribers;
+	file_cache cache;
+	/* Connections whose task waits for a fetch from the upstream server. */
+	std::vector<int> cache_waiters;
+	/* Files being fetched from a swarm, their pieces are served as they arrive. */
+	swarm_registry swarms;
+	/* Merkle trees of directories in FileToSend, kept between syncs so that unchanged files are not read again. */
+	merkle_index trees;
+	mfcslib::send_options engine_options;
+	/* Runs hashing, scans and copies of whole files off the loop thread. */
+	thread_pool io_pool{ 2 };
+	/* Reads ahead of streams being sent; kept apart so that long jobs on io_pool do not stall them. */
+	thread_pool readahead_pool{ 2 };
+	/* Signalled by io_pool when a job of a task is done. */
+	int pool_event_fd = -1;
+	/* Connections whose task waits for a job on io_pool. */
+	std::vector<int> pool_waiters;
+	/* Settings that hold a name rather than a directory. */
+	static constexpr std::string_view plain_keys[] = { f_DefaultPage, f_SendEngine, f_UnixSocket, f_SubscriberDrop, f_Upstream };
 	static inline bool running;
 	static inline int pipe_fd[2];
 
 	int decide_action(int fd);
+	mfcslib::writeback_pacer make_pacer(int fd, uintmax_t start) {
+		return { fd, start, uintmax_t(std::max(json_num[f_WritebackWindow], 0ll)), json_num[f_DropWrittenPages] != 0 };
+	}
 	co_handle handle_sft_file(int fd);
-	void handle_sft_mesg(int fd);
+	co_handle handle_sft_sparse_file(int fd);
+	co_handle handle_sft_mesg(int fd);
+	void wait_for_sync(int fd, uint64_t offset);
+	void resume_synced();
+	bool missing_here(const string& name);
+	void wait_for_cache(int fd);
+	void resume_cache_waiters();
+	/* Run func on io_pool, the task then waits with wait_for_pool until the job is done. */
+	template<typename F, typename R = std::invoke_result_t<F>>
+	std::shared_ptr<pool_job<R>> run_on_pool(F func) {
+		auto job = std::make_shared<pool_job<R>>();
+		io_pool.submit_to_pool([job, func = std::move(func), event_fd = pool_event_fd]() mutable {
+			try {
+				job->value = func();
+			}
+			catch (...) {
+				job->error = std::current_exception();
+			}
+			job->done.store(true, std::memory_order_release);
+			uint64_t one = 1;
+			write(event_fd, &one, sizeof one);
+		});
+		return job;
+	}
+	void wait_for_pool(int fd);
+	void resume_pool_waiters();
+	co_handle handle_proxy_get(int fd);
+	void handle_subscribe(int fd);
+	void publish_frames(string_view frames, uint64_t first);
+	void close_dead_subscribers();
+	void handle_local(int fd);
+	static void local_receive(int file_fd, string path, int reply_fd);
+	void handle_udp(int fd);
+	static void udp_transfer(bool upload, int udp_fd, uint32_t id, int file_fd, uint64_t size, mfcslib::rudp_options options, string path, int reply_fd);
+	void handle_chain(int fd);
+	static void chain_relay(int fd, uint64_t size, string name, string path, std::vector<string> hops, uintmax_t window, bool drop_cache);
+	void handle_swarm(int fd);
+	static void swarm_join(string name, string path, std::vector<std::pair<string, uint16_t>> peers, swarm_registry& swarms, int reply_fd);
+	void handle_sync(int fd);
+	static void sync_serve(int fd, string dir, string root, merkle_index& trees);
+	static void sync_pull(int fd, string dir, string ip, uint16_t port, string root, merkle_index& trees);
+	void handle_push(int fd);
+	static void push_file(int fd, string name, std::vector<send_segment> segments, uintmax_t size, string ip, uint16_t port);
 	co_handle handle_sft_get_file(int fd);
+	co_handle handle_sft_part(int fd);
+	co_handle handle_sft_query(int fd);
+	co_handle handle_sft_delta_file(int fd);
+	co_handle handle_sft_delta_get(int fd);
+	co_handle handle_sft_dedup_file(int fd);
+	co_handle handle_sft_tree_file(int fd);
+	co_handle handle_sft_tree_get(int fd);
+	co_handle handle_sft_session(int fd);
+	co_handle handle_sft_stream(int fd);
+	std::vector<send_segment> locate_file(const string& full_path, uintmax_t& size);
+	static void clip_segments(std::vector<send_segment>& segments, uintmax_t off, uintmax_t len);
+	static uint32_t checksum_segments(std::vector<send_segment> segments, bool whole_file);
 	void close_connection(int fd);
 	static void alarm_handler(int sig);
 	co_handle handle_http(int fd);
@@ -122,6 +316,7 @@ void receive_loop::loop()
 			json_conf[f_FileReceived] = "./";
 			json_conf[f_FileToSend] = "./";
 			json_conf[f_DefaultPage] = "index.html";
+			json_conf[f_MessageLog] = "./";
 			for (auto& [key, value] : js.get_obj()) {
 				auto val = value.at<string>();
 				if (key == f_ListenPort) {
@@ -129,9 +324,15 @@ void receive_loop::loop()
 					if (val) port = (uint16_t)*val;
 					continue;
 				}
+				if (val == nullptr) {
+					if (auto num = value.at<long long>(); num) json_num[key] = *num;
+					else if (auto flag = value.at<bool>(); flag) json_num[key] = *flag;
+					continue;
+				}
 				if (string_view str = *val; str != "")
 					json_conf[key] = str;
-				if (key != f_DefaultPage) {
+				/* Every other string names a directory. */
+				if (std::find(std::begin(plain_keys), std::end(plain_keys), key) == std::end(plain_keys)) {
 					if (json_conf[key].back() != '/') json_conf[key] += '/';
 					mkdir(json_conf[key].data(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IWOTH);
 				}
@@ -139,17 +340,65 @@ void receive_loop::loop()
 		}
 		catch (std::exception& e) {}
 	}
+	json_num.try_emplace(f_WritebackWindow, WRITEBACK_WINDOW);
+	json_num.try_emplace(f_SubscriberQueue, SUBSCRIBER_QUEUE);
+	{
+		auto policy = drop_policy::OLDEST;
+		if (auto ite = json_conf.find(f_SubscriberDrop); ite != json_conf.end()) {
+			if (ite->second == "newest") policy = drop_policy::NEWEST;
+			else if (ite->second == "disconnect") policy = drop_policy::DISCONNECT;
+			else if (ite->second != "oldest") LOG_WARN("Unknown drop policy: ", ite->second, ", dropping the oldest.");
+		}
+		subscribers.configure(size_t(std::max(json_num[f_SubscriberQueue], 0ll)), policy);
+	}
+	mfcslib::buffer_pool::use_huge_pages(json_num[f_HugePages] != 0);
+	if (auto ite = json_conf.find(f_SendEngine); ite != json_conf.end()) {
+		if (auto options = mfcslib::send_options::parse(ite->second); options) engine_options = *options;
+		else LOG_WARN("Unknown send engine: ", ite->second, ", using sendfile.");
+	}
+	io_pool.init_pool();
+	readahead_pool.init_pool();
+	pool_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool_event_fd < 0) throw runtime_error(string("Error in creating the pool event: ") + GETERR);
+	epoll_instance.add_fd_or_event(pool_event_fd, false, true, 0);
+	trees.init(json_conf[f_FileToSend]);
+	if (auto ite = json_conf.find(f_ChunkStore); ite != json_conf.end()) {
+		store.init(ite->second);
+	}
+	if (auto ite = json_conf.find(f_Upstream); ite != json_conf.end()) {
+		auto colon = ite->second.rfind(':');
+		if (colon != string::npos) {
+			json_conf.try_emplace(f_CacheDir, "./Cache/");
+			json_num.try_emplace(f_CacheQuota, CACHE_QUOTA);
+			cache.init(json_conf[f_CacheDir], uint64_t(std::max(json_num[f_CacheQuota], 0ll)),
+				ite->second.substr(0, colon), (uint16_t)atoi(ite->second.c_str() + colon + 1));
+			epoll_instance.add_fd_or_event(cache.event_fd(), false, true, 0);
+		}
+		else LOG_WARN("Upstream needs ip:port, not ", ite->second, ", caching is off.");
+	}
 	mfcslib::ServerSocket localserver(port);
 	running = true;
 	int socket_fd = localserver.get_fd();
 	localserver.set_nonblocking();
 	epoll_instance.add_fd_or_event(socket_fd, false, true, 0);
 	epoll_instance.add_fd_or_event(pipe_fd[0], false, false, 0);
+	try {
+		messages.open(json_conf[f_MessageLog]);
+		epoll_instance.add_fd_or_event(messages.event_fd(), false, true, 0);
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Fail to open the message log: ", e.what());
+	}
+	int local_fd = -1;
+	if (auto ite = json_conf.find(f_UnixSocket); ite != json_conf.end()) {
+		local_fd = mfcslib::listen_local(ite->second);
+		epoll_instance.set_fd_no_block(local_fd);
+		epoll_instance.add_fd_or_event(local_fd, false, true, 0);
+	}
 	signal(SIGALRM, alarm_handler);
 	alarm(ALARM_TIME.count());
 	LOG_INFO("Server starts.");
 	LOG_INFO("Listening on local: " + localserver.get_ip_port_s());
-	mfcslib::timer<int> clock(ALARM_TIME);
 	while (running) {
 		int count = epoll_instance.wait_for_epoll(-1);
 		if (count < 0) [[unlikely]] {
@@ -176,10 +425,43 @@ void receive_loop::loop()
 					LOG_ERROR("Accept failed: ", e.what());
 				}
 			}
+			else if (cache.enabled() && react_fd == cache.event_fd()) {
+				for (auto& fetch : cache.collect()) {
+					if (fetch->state == cache_fetch::DONE) {
+						LOG_INFO("Cached from upstream: ", fetch->name, '/', to_string(fetch->size));
+					}
+					else LOG_ERROR("Fail to fetch from upstream: ", fetch->name);
+				}
+				resume_cache_waiters();
+			}
+			else if (react_fd == pool_event_fd) {
+				uint64_t count = 0;
+				read(pool_event_fd, &count, sizeof count);
+				resume_pool_waiters();
+			}
+			else if (react_fd == messages.event_fd()) {
+				if (int error = messages.drain(); error != 0) LOG_ERROR("Fail to sync the message log: ", strerror(error));
+				resume_synced();
+			}
+			else if (react_fd == local_fd) {
+				int accepted_fd = 0;
+				while ((accepted_fd = accept4(local_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					LOG_INFO("Accept from the local socket.");
+					epoll_instance.add_fd_or_event(accepted_fd, false, true, EPOLLOUT);
+					connections[accepted_fd] = mfcslib::NetworkSocket(accepted_fd, sockaddr_in{});
+					connections[accepted_fd].local = true;
+					clock.insert_or_update(accepted_fd);
+				}
+			}
 			else if (epoll_instance.events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				auto& di = connections[react_fd];
+				if ((epoll_instance.events[i].events & EPOLLIN) && di.is_read_awaiting) {
+					/* Drain what arrived together with the hangup before closing. */
+					di.task.resume();
+				}
 				LOG_INFO("Disconnect from client: ",connections[react_fd].get_ip_port_s());
+				if (di.subscriber) subscribers.remove(react_fd);
 				close_connection(react_fd);
-				clock.erase_value(react_fd);
 				connections.erase(react_fd);
 			}
 			else if (react_fd == pipe_fd[0]) {
@@ -194,6 +476,26 @@ void receive_loop::loop()
 					close_connection(i);
 					connections.erase(i);
 				}
+				auto now = sc::system_clock::now();
+				std::erase_if(transfers, [&now](const auto& item) {
+					auto& transfer = *item.second;
+					if (transfer.received >= transfer.size || now - transfer.last_active < ALARM_TIME) return false;
+					unlink(hidden_sibling(transfer.path, ".part").c_str());
+					return true;
+				});
+			}
+			else if (connections[react_fd].subscriber) {
+				/* Subscribers only listen, whatever they send is ignored. */
+				if (epoll_instance.events[i].events & EPOLLIN) {
+					char ignored[256];
+					while (read(react_fd, ignored, sizeof ignored) > 0);
+				}
+				if ((epoll_instance.events[i].events & EPOLLOUT) && !subscribers.flush(react_fd)) {
+					LOG_INFO("Subscriber is gone: ", connections[react_fd].get_ip_port_s());
+					subscribers.remove(react_fd);
+					close_connection(react_fd);
+					connections.erase(react_fd);
+				}
 			}
 			else if (epoll_instance.events[i].events & EPOLLIN) {
 				auto& di = connections[react_fd];
@@ -202,17 +504,86 @@ void receive_loop::loop()
 				if (di.is_read_awaiting) {
 					task.resume();
 				}
+				else if (di.sync_wait != 0) {
+					/* Resumed by resume_synced. */
+				}
+				else if (di.cache_wait) {
+					/* Resumed by resume_cache_waiters. */
+				}
+				else if (di.pool_wait) {
+					/* Resumed by resume_pool_waiters. */
+				}
+				else if (di.is_write_awaiting) {
+					/* New requests wait in the socket until the current reply is out. */
+					if (epoll_instance.events[i].events & EPOLLOUT) task.resume();
+				}
 				else {
 					switch (decide_action(react_fd))
 					{
 					case FILE_TYPE:
-						task = handle_sft_file(react_fd);
+						if (di.requests[0] == 'f') task = handle_sft_file(react_fd);
+						else task = handle_sft_sparse_file(react_fd);
 						break;
 					case MESSAGE_TYPE:
-						handle_sft_mesg(react_fd);
+						task = handle_sft_mesg(react_fd);
 						break;
 					case GET_TYPE:
-						task = handle_sft_get_file(react_fd);
+						if (di.requests[0] == 'g' && missing_here(di.requests.substr(2))) task = handle_proxy_get(react_fd);
+						else task = handle_sft_get_file(react_fd);
+						break;
+					case PART_TYPE:
+						task = handle_sft_part(react_fd);
+						break;
+					case QUERY_TYPE:
+						task = handle_sft_query(react_fd);
+						break;
+					case DELTA_TYPE:
+						if (di.requests[0] == 'd') task = handle_sft_delta_file(react_fd);
+						else task = handle_sft_delta_get(react_fd);
+						break;
+					case DEDUP_TYPE:
+						task = handle_sft_dedup_file(react_fd);
+						break;
+					case TREE_TYPE:
+						if (di.requests[0] == 't') task = handle_sft_tree_file(react_fd);
+						else task = handle_sft_tree_get(react_fd);
+						break;
+					case SESSION_TYPE:
+						task = handle_sft_session(react_fd);
+						break;
+					case LOCAL_TYPE:
+						handle_local(react_fd);
+						break;
+					case STREAM_TYPE:
+						task = handle_sft_stream(react_fd);
+						break;
+					case SUBSCRIBE_TYPE:
+						handle_subscribe(react_fd);
+						if (di.subscriber) clock.erase_value(react_fd);
+						break;
+					case UDP_TYPE:
+						handle_udp(react_fd);
+						break;
+					case CHAIN_TYPE:
+						/* chain_relay goes on with a duplicate of the socket. */
+						handle_chain(react_fd);
+						close_connection(react_fd);
+						connections.erase(react_fd);
+						break;
+					case SWARM_TYPE:
+						handle_swarm(react_fd);
+						break;
+					case SYNC_TYPE:
+						/* sync_serve or sync_pull goes on with a duplicate of the socket. */
+						handle_sync(react_fd);
+						close_connection(react_fd);
+						connections.erase(react_fd);
+						break;
+					case PUSH_TYPE:
+						/* push_file reports on a duplicate of the socket. */
+						handle_push(react_fd);
+						close_connection(react_fd);
+						connections.erase(react_fd);
 						break;
 					case HTTP_TYPE:
 						task = handle_http(react_fd);
@@ -224,7 +595,6 @@ void receive_loop::loop()
 							" Received unknown request: ",
 							di.requests);
 						close_connection(react_fd);
-						clock.erase_value(react_fd);
 						connections.erase(react_fd);
 						break;
 					}
@@ -238,6 +608,10 @@ void receive_loop::loop()
 				}
 			}
 		}
+		/* Messages appended while handling these events go to the disk with one sync. */
+		if (messages.enabled()) messages.request_sync();
+		subscribers.flush_pending();
+		close_dead_subscribers();
 	}
 	LOG_INFO("Server quits.");
 	exit(0);
@@ -249,7 +623,8 @@ int receive_loop::decide_action(int fd)
 	auto ret = 0ll;
 	do {
 		char buffer[1024]{ 0 };
-		ret = read(fd, buffer, 1023);
+		if (connections[fd].local) ret = mfcslib::recv_with_fd(fd, buffer, 1023, connections[fd].passed_fd);
+		else ret = read(fd, buffer, 1023);
 		request += buffer;
 	} while (ret > 0);
 	if (ret <= 0 && errno != EAGAIN) {
@@ -264,9 +639,32 @@ int receive_loop::decide_action(int fd)
 	}
 	switch (request[0])
 	{
-	case 'f':return FILE_TYPE;
+	case 'f': [[fallthrough]];
+	case 'h':return FILE_TYPE;
+	case 'r': [[fallthrough]];
+	case 'b': [[fallthrough]];
 	case 'g':return GET_TYPE;
+	case 'p':return PART_TYPE;
+	case 'u': [[fallthrough]];
+	case 'c':return QUERY_TYPE;
+	case 'd': [[fallthrough]];
+	case 'e':return DELTA_TYPE;
+	case 'k':return DEDUP_TYPE;
+	case 't': [[fallthrough]];
+	case 'l':return TREE_TYPE;
+	case 's':return SESSION_TYPE;
 	case 'm':return MESSAGE_TYPE;
+	case 'i':return STREAM_TYPE;
+	case 'w':return SUBSCRIBE_TYPE;
+	case 'v':return UDP_TYPE;
+	case 'n':return CHAIN_TYPE;
+	case 'a': [[fallthrough]];
+	case 'j':return SWARM_TYPE;
+	case 'x': [[fallthrough]];
+	case 'y':return SYNC_TYPE;
+	case 'z':return PUSH_TYPE;
+	case 'o': [[fallthrough]];
+	case 'q':return connections[fd].local ? LOCAL_TYPE : -1;
 	case 'G': [[fallthrough]];
 	case 'P':return HTTP_TYPE;
 	}
@@ -275,185 +673,2380 @@ int receive_loop::decide_action(int fd)
 
 co_handle receive_loop::handle_sft_file(int fd)
 {
-	char msg1 = '1';
-	write(fd, &msg1, sizeof(msg1));
 	data_info& current_mission = connections[fd];
-	auto name_size = current_mission.requests.substr(2);
+	string_view header(current_mission.requests);
+	header.remove_prefix(2);
+	string file_name(pop_field(header));
+	uintmax_t size = 0, offset = 0;
+	try {
+		size = std::stoull(string(pop_field(header)));
+		if (!header.empty() && header != "\n") offset = std::stoull(string(header));
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent invalid file request: ", current_mission.requests);
+		close_connection(fd);
+		co_return;
+	}
+	auto name_size = file_name + '/' + to_string(size);
 	current_mission.requests.clear();
-	LOG_INFO("Receiving file from:", current_mission.get_ip_port_s(), ' ', name_size);
-	auto idx = name_size.find('/');
-	auto size = std::stoull(name_size.substr(idx + 1));
 	string name = json_conf[f_FileReceived];
-	name += name_size.substr(0, idx);
+	name += file_name;
+	auto sidecar = resume_record::path_for(name);
+	resume_record record;
+	char code = '1';
+	if (offset > 0 && (!record.load(sidecar) || record.size != size || record.offset != offset)) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " asked to resume ", name_size, " from a stale offset.");
+		code = '0';
+		write(fd, &code, sizeof code);
+		co_return;
+	}
+	record.size = size;
+	write(fd, &code, sizeof code);
+	if (offset > 0) {
+		LOG_INFO("Resuming file from:", current_mission.get_ip_port_s(), ' ', name_size, " at ", to_string(offset));
+	}
+	else {
+		LOG_INFO("Receiving file from:", current_mission.get_ip_port_s(), ' ', name_size);
+	}
 	mfcslib::File output_file(name);
-	output_file.open(true, WRONLY);
-	try {
-		auto complete = false;
-		if (size < MAXARRSZ) {
-			auto bufferForFile = mfcslib::make_array<Byte>(size);
-			auto ret = 0ll;
-			auto bytesLeft = size;
-			while (true) {
-				auto currentRet = bufferForFile.read(fd, ret, bytesLeft);
-			#ifdef DEBUG
-				//cout << "Return from read:" << currentRet << endl;
-			#endif // DEBUG
-				if (currentRet < 0) {
+	uintmax_t received = offset;
+	crc32c crc(offset > 0 ? record.crc : 0);
+	std::unique_ptr<mfcslib::direct_writer> direct;
+	try {
+		output_file.open_random_access(WRONLY);
+		output_file.truncate(offset);
+		output_file.preallocate(offset, size - offset);
+		if (json_num[f_DirectReceive]) {
+			try {
+				direct = std::make_unique<mfcslib::direct_writer>(name, offset);
+			}
+			catch (const mfcslib::file_exception& e) {
+				LOG_WARN("No O_DIRECT for ", name_size, ": ", e.what(), ", receiving through the page cache.");
+			}
+		}
+		auto pacer = make_pacer(output_file.get_fd(), offset);
+		auto bufferForFile = mfcslib::make_buffer<Byte>(direct ? 0 : RECEIVE_BUFFER_SIZE);
+		auto last_checkpoint = received;
+		while (received < size) {
+			ssize_t ret = 0;
+			if (direct) {
+				ret = read(fd, direct->space(), std::min<uintmax_t>(direct->space_left(), size - received));
+				if (ret < 0 && errno != EAGAIN) throw IO_exception(strerror(errno));
+			}
+			else ret = bufferForFile.read(fd, 0, std::min<uintmax_t>(bufferForFile.length(), size - received));
+			if (ret < 0) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret == 0) break;
+			if (direct) {
+				crc.update(direct->space(), ret);
+				received += ret;
+				/* Only data that has left the buffers can be checkpointed. */
+				if (direct->commit(ret) && received - last_checkpoint >= RESUME_CHECKPOINT) {
+					direct->wait();
+					record.checkpoint(output_file, received, crc.value(), sidecar);
+					last_checkpoint = received;
+				}
+				continue;
+			}
+			for (ssize_t written = 0; written < ret;) {
+				written += output_file.pwrite(bufferForFile, written, ret - written, received + written);
+			}
+			crc.update(bufferForFile.get_ptr(), ret);
+			received += ret;
+			pacer.advance(received);
+		#ifdef DEBUG
+			mfcslib::progress_bar(received, size);
+		#endif // DEBUG
+			if (received - last_checkpoint >= RESUME_CHECKPOINT) {
+				record.checkpoint(output_file, received, crc.value(), sidecar);
+				last_checkpoint = received;
+			}
+		}
+		if (direct) direct->finish();
+		if (received >= size) {
+			/* The client follows the data with the CRC32C of the whole file. */
+			uint32_t expected = 0;
+			for (size_t got = 0; got < sizeof expected;) {
+				auto ret = read(fd, reinterpret_cast<char*>(&expected) + got, sizeof expected - got);
+				if (ret < 0 && errno == EAGAIN) {
 					current_mission.is_read_awaiting = true;
 					co_yield 1;
 					continue;
 				}
-				ret += currentRet;
-				bytesLeft = size - ret;
-			#ifdef DEBUG
-				mfcslib::progress_bar(ret, size);
-			#endif // DEBUG
-				if (bytesLeft <= 0 || currentRet == 0) break;
+				if (ret <= 0) throw peer_exception("Connection closed before the checksum arrived.");
+				got += ret;
 			}
-			if (bytesLeft <= 0) complete = true;
-			output_file.write(bufferForFile);
-		}
-		else {
-			auto bufferForFile = mfcslib::make_array<Byte>(MAXARRSZ);
-			auto ret = 0ll;
-			size_t bytesWritten = ret;
-			while (true) {
-				auto currentReturn = 0ll;
-				while (ret < (MAXARRSZ - NUMSTOP)) {
-					currentReturn = bufferForFile.read(fd, ret, MAXARRSZ - ret);
-					if (currentReturn < 0) {
-						current_mission.is_read_awaiting = true;
-						co_yield 1;
-						continue;
-					}
-					ret += currentReturn;
-					bytesWritten += currentReturn;
-				#ifdef DEBUG
-					mfcslib::progress_bar(bytesWritten, size);
-				#endif // DEBUG
-					if (bytesWritten >= size || currentReturn == 0) break;
-				}
-				output_file.write(bufferForFile, 0, ret);
-				if (bytesWritten >= size) {
-					complete = true;
-					break;
-				}
-				if (currentReturn == 0) break;
-				bufferForFile.empty_array();
-				ret = 0;
+			resume_record::remove(sidecar);
+			if (expected == crc.value()) {
+				store_checksum(output_file.get_fd(), expected);
+				LOG_INFO("Success on receiving file: ", name_size);
 			}
-		}
-		if (complete) {
-			LOG_INFO("Success on receiving file: ", name_size);
+			else {
+				code = '0';
+				unlink(name.c_str());
+				LOG_ERROR("Checksum mismatch on file: ", name_size, ", discarded it.");
+			}
+			write(fd, &code, sizeof code);
 		}
 		else {
-			LOG_ERROR("Not received complete file data.");
+			record.checkpoint(output_file, received, crc.value(), sidecar);
+			LOG_ERROR("Not received complete file data. Kept ", to_string(received), " bytes for resuming.");
 		}
 	}
 	catch (const mfcslib::basic_exception& e) {
 		LOG_ERROR("Client:", current_mission.get_ip_port_s(),' ', e.what());
 		LOG_ERROR("Not received complete file data.");
 		LOG_CLOSE(current_mission.get_ip_port_s());
+		/* Buffered direct data may be lost, the last periodic checkpoint stays valid then. */
+		if (output_file.available() && received > offset && !direct) record.checkpoint(output_file, received, crc.value(), sidecar);
 		close_connection(fd);
 	}
 	current_mission.is_read_awaiting = false;
 	co_return;
 }
 
-void receive_loop::handle_sft_mesg(int fd)
+/* Receive only the data extents of a sparse file, leaving holes everywhere else. */
+co_handle receive_loop::handle_sft_sparse_file(int fd)
 {
+	data_info& current_mission = connections[fd];
+	string_view header(current_mission.requests);
+	header.remove_prefix(2);
+	if (header.back() == '\n') header.remove_suffix(1);
+	uintmax_t size = 0, count = 0;
+	try {
+		size = std::stoull(string(pop_field(header)));
+		count = std::stoull(string(pop_field(header)));
+	}
+	catch (const std::exception& e) {
+		header = {};
+	}
+	if (!is_safe_relative_path(header) || header.find('/') != string_view::npos || count > size / 512 + 1) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent invalid sparse file request: ", current_mission.requests);
+		close_connection(fd);
+		co_return;
+	}
+	string file_name(header);
+	auto name_size = file_name + '/' + to_string(size);
+	current_mission.requests.clear();
 	char code = '1';
 	write(fd, &code, sizeof code);
-	LOG_MSG(connections[fd].get_ip_port_s(), &connections[fd].requests[2]);
-	connections[fd].requests.clear();
+	LOG_INFO("Receiving sparse file from:", current_mission.get_ip_port_s(), ' ', name_size, " in ", to_string(count), " extents");
+	code = '0';
+	string name = json_conf[f_FileReceived] + file_name;
+	try {
+		string table(count * extent_entry_length, '\0');
+		for (size_t got = 0; got < table.size();) {
+			auto ret = read(fd, table.data() + got, table.size() - got);
+			if (ret < 0 && errno == EAGAIN) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret <= 0) throw peer_exception("Connection closed while receiving the extent table.");
+			got += ret;
+		}
+		mfcslib::File output_file(name);
+		output_file.open_random_access(WRONLY);
+		output_file.truncate(0);
+		output_file.truncate(size);
+		extent_writer writer(output_file.get_fd(), parse_extents(table, size));
+		auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+		while (writer.remaining() > 0) {
+			auto ret = buffer.read(fd, 0, std::min<uintmax_t>(buffer.length(), writer.remaining()));
+			if (ret < 0) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret == 0) throw peer_exception("Connection closed before all extents arrived.");
+			writer.feed(buffer.get_ptr(), ret);
+		}
+		uint32_t expected = 0;
+		for (size_t got = 0; got < sizeof expected;) {
+			auto ret = read(fd, reinterpret_cast<char*>(&expected) + got, sizeof expected - got);
+			if (ret < 0 && errno == EAGAIN) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret <= 0) throw peer_exception("Connection closed before the checksum arrived.");
+			got += ret;
+		}
+		if (expected == writer.checksum()) {
+			code = '1';
+			LOG_INFO("Success on receiving sparse file: ", name_size);
+		}
+		else {
+			unlink(name.c_str());
+			LOG_ERROR("Checksum mismatch on sparse file: ", name_size, ", discarded it.");
+		}
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+	}
+	write(fd, &code, sizeof code);
+	if (code != '1') {
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	current_mission.is_read_awaiting = false;
+	co_return;
 }
 
-co_handle receive_loop::handle_sft_get_file(int fd)
+co_handle receive_loop::handle_sft_query(int fd)
 {
 	data_info& current_mission = connections[fd];
-	string& request = current_mission.requests;
-	LOG_INFO("Receive file request from:",
-		current_mission.get_ip_port_s(), ' ',
-		&request[2]);
-	string full_path = json_conf[f_FileToSend];
-	full_path += &request[2];
-	if (full_path.back() == '\n') full_path.pop_back();
-	request.clear();
+	string request = std::move(current_mission.requests);
+	current_mission.requests.clear();
+	string_view fields(request);
+	auto type = fields[0];
+	fields.remove_prefix(2);
+	if (fields.back() == '\n') fields.remove_suffix(1);
+	string reply("0");
 	try {
-		mfcslib::File requested_file(full_path); //throw runtime_error
-		requested_file.open_read_only();
-		string react_msg("/" + requested_file.size_string());
-		write(fd, react_msg.c_str(), react_msg.size() + 1);
-		ssize_t ret = 0;
-		char flag = '0';
-		while (1) {
-			ret = recv(fd, &flag, sizeof(flag), 0);
-			if (ret >= 0 || errno != EAGAIN) break;
-			else {
-				current_mission.is_read_awaiting = true;
+		auto number = std::stoull(string(pop_field(fields)));
+		if (!is_safe_relative_path(fields)) throw std::invalid_argument("Invalid name.");
+		if (type == 'u') {
+			/* Upload resume: how much of FileReceived/name is already kept. */
+			resume_record record;
+			if (record.load(resume_record::path_for(json_conf[f_FileReceived] + string(fields))) && record.size == number)
+				reply = std::format("/{}/{}", record.offset, record.crc);
+			else
+				reply = "/0/0";
+		}
+		else {
+			/* Download resume: checksum of the first number bytes of FileToSend/name, read on io_pool. */
+			auto checksum = run_on_pool([path = json_conf[f_FileToSend] + string(fields), number] {
+				mfcslib::File requested_file(path);
+				requested_file.open_read_only();
+				auto size = requested_file.size();
+				if (number > size) return string("0");
+				/* All of it may have its checksum cached. */
+				auto crc = number == size ? file_checksum(requested_file.get_fd(), size) : crc32c_of_file(requested_file.get_fd(), number);
+				return std::format("/{}/{}", size, crc);
+			});
+			while (!checksum->done.load(std::memory_order_acquire)) {
+				wait_for_pool(fd);
 				co_yield 1;
 			}
+			reply = checksum->get();
 		}
-		if (flag != '1' || ret <= 0)
-			throw peer_exception("Receive flag failed.");
-		off_t off = 0;
-		uintmax_t send_size = requested_file.size();
-		int file_fd = requested_file.get_fd();
-	#ifdef DEBUG
-		auto file_sz = requested_file.size();
-	#endif // DEBUG
-		while (send_size > 0) {
-			ssize_t ret = sendfile(fd, file_fd, &off, send_size);
-		#ifdef DEBUG
-			//cout << "Return from sendfile: " << ret << endl;
-		#endif // DEBUG
-			if (ret <= 0) {
-				if (errno == EAGAIN) {
-					current_mission.is_read_awaiting = false;
-					current_mission.is_write_awaiting = true;
-					co_yield 1;
-					continue;
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent invalid query: ", request);
+	}
+	write(fd, reply.c_str(), reply.size() + 1);
+	co_return;
+}
+
+co_handle receive_loop::handle_sft_delta_file(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string_view header(current_mission.requests);
+	header.remove_prefix(2);
+	if (header.back() == '\n') header.remove_suffix(1);
+	uintmax_t size = 0;
+	try {
+		size = std::stoull(string(pop_field(header)));
+	}
+	catch (const std::exception& e) {
+		header = {};
+	}
+	if (!is_safe_relative_path(header) || header.find('/') != string_view::npos) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent invalid delta request: ", current_mission.requests);
+		close_connection(fd);
+		co_return;
+	}
+	string name = json_conf[f_FileReceived] + string(header);
+	auto name_size = string(header) + '/' + to_string(size);
+	current_mission.requests.clear();
+	LOG_INFO("Receiving delta of file from:", current_mission.get_ip_port_s(), ' ', name_size);
+	mfcslib::File basis(name);
+	uintmax_t basis_size = 0;
+	size_t block = choose_block_size(size);
+	string reply;
+	try {
+		std::vector<block_signature> sigs;
+		try {
+			basis.open_read_only();
+			basis_size = basis.size();
+			block = choose_block_size(basis_size);
+			/* Hashed on io_pool with a descriptor of its own, the task may be gone before the job ends. */
+			int basis_fd = dup(basis.get_fd());
+			if (basis_fd < 0) throw file_exception(GETERR);
+			auto job = run_on_pool([basis_fd, basis_size, block] {
+				std::vector<block_signature> sigs;
+				try {
+					sigs = compute_signatures(basis_fd, basis_size, block);
 				}
-				else {
-					if (ret < 0) {
-						LOG_ERROR_C(current_mission.get_ip_port_s());
-					#ifdef DEBUG
-						perror("Sendfile failed");
-					#endif // DEBUG
-					}
-					LOG_ERROR("Not received complete file data.");
-					co_return;
+				catch (...) {
+					close(basis_fd);
+					throw;
 				}
+				close(basis_fd);
+				return sigs;
+			});
+			while (!job->done.load(std::memory_order_acquire)) {
+				wait_for_pool(fd);
+				co_yield 1;
 			}
-			send_size -= ret;
-		#ifdef DEBUG
-			//cout << "Bytes left: " << send_size << endl;
-			mfcslib::progress_bar((file_sz - send_size), file_sz);
-		#endif // DEBUG
+			sigs = job->get();
 		}
-	#ifdef DEBUG
-		cout << "\nFinishing file sending." << endl;
-	#endif // DEBUG
-		LOG_INFO("Success on sending file to client:", current_mission.get_ip_s());
+		catch (const mfcslib::file_exception& e) {}
+		reply = std::format("/{}/{}/{}", block, sigs.size(), basis_size);
+		reply += '\0';
+		reply += serialize_signatures(sigs);
 	}
-	catch (const mfcslib::peer_exception& e) {
-		LOG_ERROR("Client:", current_mission.get_ip_port_s(),' ', e.what());
-		LOG_CLOSE(current_mission.get_ip_port_s());
+	catch (const std::exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+		reply = "0";
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+		reply = "0";
+	}
+	for (size_t sent = 0; sent < reply.size();) {
+		auto ret = write(fd, reply.data() + sent, reply.size() - sent);
+		if (ret < 0) {
+			if (errno == EAGAIN) {
+				current_mission.is_write_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			LOG_ERROR_C(current_mission.get_ip_port_s());
+			close_connection(fd);
+			co_return;
+		}
+		sent += ret;
+	}
+	current_mission.is_write_awaiting = false;
+	if (reply == "0") co_return;
+	auto temp_path = hidden_sibling(name, ".delta");
+	char code = '0';
+	try {
+		mfcslib::File output(temp_path);
+		output.open_random_access(WRONLY);
+		output.truncate(0);
+		delta_decoder decoder(basis.get_fd(), block, basis_size, output.get_fd());
+		auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+		uintmax_t received = 0;
+		while (!decoder.finished()) {
+			auto ret = buffer.read(fd);
+			if (ret < 0) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret == 0) break;
+			decoder.feed(buffer.get_ptr(), ret);
+			received += ret;
+		}
+		if (decoder.verified() && rename(temp_path.c_str(), name.c_str()) == 0) {
+			code = '1';
+			LOG_INFO("Success on receiving file: ", name_size, " with ", to_string(received), " bytes of delta.");
+		}
+		else {
+			LOG_ERROR("Rebuilt file does not match the client's copy: ", name_size);
+		}
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+	}
+	if (code != '1') unlink(temp_path.c_str());
+	write(fd, &code, sizeof code);
+	current_mission.is_read_awaiting = false;
+	co_return;
+}
+
+co_handle receive_loop::handle_sft_delta_get(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string_view header(current_mission.requests);
+	header.remove_prefix(2);
+	if (header.back() == '\n') header.remove_suffix(1);
+	size_t block = 0, count = 0;
+	uintmax_t basis_size = 0;
+	try {
+		block = std::stoull(string(pop_field(header)));
+		count = std::stoull(string(pop_field(header)));
+		basis_size = std::stoull(string(pop_field(header)));
+	}
+	catch (const std::exception& e) {
+		header = {};
+	}
+	if (!is_safe_relative_path(header) || block == 0 || block > max_block_size || count != (basis_size + block - 1) / block) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent invalid delta request: ", current_mission.requests);
 		close_connection(fd);
+		co_return;
+	}
+	LOG_INFO("Receive delta file request from:", current_mission.get_ip_port_s(), ' ', string(header));
+	string full_path = json_conf[f_FileToSend] + string(header);
+	current_mission.requests.clear();
+	try {
+		auto requested_file = std::make_shared<mfcslib::File>(full_path);
+		requested_file->open_read_only();
+		auto file_size = requested_file->size();
+		/* A basis far larger than the file has few blocks that can still match. */
+		if (count > DELTA_SIGNATURE_MAX || count > 2 * (file_size / block + 1))
+			throw peer_exception("Too many signatures for " + string(header) + '.');
+		string react_msg("/" + to_string(file_size));
+		write(fd, react_msg.c_str(), react_msg.size() + 1);
+		auto sig_bytes = mfcslib::make_buffer<Byte>(count * signature_length + 1);
+		size_t got = 0;
+		while (got < count * signature_length) {
+			auto ret = sig_bytes.read(fd, got, count * signature_length - got);
+			if (ret < 0) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret == 0) throw peer_exception("Connection closed while receiving signatures.");
+			got += ret;
+		}
+		current_mission.is_read_awaiting = false;
+		auto encoder = std::make_shared<delta_encoder>(requested_file->get_fd(), file_size, block, basis_size,
+			parse_signatures(sig_bytes.get_ptr(), count));
+		sig_bytes.destroy();
+		uintmax_t sent_total = 0;
+		for (bool more = true; more;) {
+			/* Each step reads and matches on io_pool; the job holds the file open in case the task is gone first. */
+			auto step = run_on_pool([requested_file, encoder] {
+				std::pair<bool, string> step;
+				step.first = encoder->next(step.second);
+				return step;
+			});
+			while (!step->done.load(std::memory_order_acquire)) {
+				wait_for_pool(fd);
+				co_yield 1;
+			}
+			string out;
+			std::tie(more, out) = step->get();
+			for (size_t sent = 0; sent < out.size();) {
+				auto ret = write(fd, out.data() + sent, out.size() - sent);
+				if (ret < 0) {
+					if (errno == EAGAIN) {
+						current_mission.is_write_awaiting = true;
+						co_yield 1;
+						continue;
+					}
+					throw peer_exception(GETERR);
+				}
+				sent += ret;
+			}
+			sent_total += out.size();
+		}
+		LOG_INFO("Success on sending file to client:", current_mission.get_ip_s(), " with ", to_string(sent_total), " bytes of delta.");
 	}
 	catch (const mfcslib::file_exception& e) {
-		LOG_ERROR("Client:", current_mission.get_ip_port_s(),' ', e.what());
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
 		char code = '0';
 		write(fd, &code, sizeof code);
 	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
 	current_mission.is_read_awaiting = false;
 	current_mission.is_write_awaiting = false;
 	co_return;
 }
 
-void receive_loop::close_connection(int fd)
+co_handle receive_loop::handle_sft_dedup_file(int fd)
 {
-	epoll_instance.remove_fd_from_epoll(fd);
+	data_info& current_mission = connections[fd];
+	string_view header(current_mission.requests);
+	header.remove_prefix(2);
+	if (header.back() == '\n') header.remove_suffix(1);
+	uintmax_t size = 0, count = 0;
+	try {
+		size = std::stoull(string(pop_field(header)));
+		count = std::stoull(string(pop_field(header)));
+	}
+	catch (const std::exception& e) {
+		header = {};
+	}
+	if (!is_safe_relative_path(header) || header.find('/') != string_view::npos || count > size / content_chunker::MIN_CHUNK + 1 || (count == 0 && size > 0)) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent invalid dedup request: ", current_mission.requests);
+		close_connection(fd);
+		co_return;
+	}
+	string file_name(header);
+	auto name_size = file_name + '/' + to_string(size);
+	current_mission.requests.clear();
+	char code = store.enabled() ? '1' : '0';
+	write(fd, &code, sizeof code);
+	if (code == '0') co_return;
+	LOG_INFO("Receiving file through the chunk store from:", current_mission.get_ip_port_s(), ' ', name_size);
+	code = '0';
+	try {
+		auto manifest = mfcslib::make_buffer<Byte>(count * CHUNK_ENTRY_LENGTH + 1);
+		for (size_t got = 0; got < count * CHUNK_ENTRY_LENGTH;) {
+			auto ret = manifest.read(fd, got, count * CHUNK_ENTRY_LENGTH - got);
+			if (ret < 0) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret == 0) throw peer_exception("Connection closed while receiving the manifest.");
+			got += ret;
+		}
+		std::vector<chunk_info> chunks(count);
+		uintmax_t total = 0;
+		for (size_t i = 0; i < count; ++i) {
+			auto entry = manifest.get_ptr() + i * CHUNK_ENTRY_LENGTH;
+			memcpy(chunks[i].digest.data(), entry, chunks[i].digest.size());
+			memcpy(&chunks[i].length, entry + chunks[i].digest.size(), sizeof(uint32_t));
+			if (chunks[i].length == 0 || chunks[i].length > content_chunker::MAX_CHUNK)
+				throw peer_exception("Invalid chunk length in manifest.");
+			chunks[i].offset = total;
+			total += chunks[i].length;
+		}
+		if (total != size) throw peer_exception("Manifest does not add up to the file size.");
+		/* A set bit asks the client for that chunk, once per distinct digest. */
+		string missing((count + 7) / 8, '\0');
+		std::vector<size_t> wanted;
+		std::unordered_set<string> seen;
+		for (size_t i = 0; i < count; ++i) {
+			string key(reinterpret_cast<const char*>(chunks[i].digest.data()), chunks[i].digest.size());
+			if (!seen.insert(key).second || store.has(chunks[i].digest)) continue;
+			missing[i / 8] |= char(1 << (i % 8));
+			wanted.push_back(i);
+		}
+		for (size_t sent = 0; sent < missing.size();) {
+			auto ret = write(fd, missing.data() + sent, missing.size() - sent);
+			if (ret < 0) {
+				if (errno != EAGAIN) throw peer_exception(GETERR);
+				current_mission.is_write_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			sent += ret;
+		}
+		current_mission.is_write_awaiting = false;
+		auto buffer = mfcslib::make_buffer<Byte>(content_chunker::MAX_CHUNK);
+		uintmax_t new_bytes = 0;
+		for (auto idx : wanted) {
+			size_t len = chunks[idx].length;
+			for (size_t got = 0; got < len;) {
+				auto ret = buffer.read(fd, got, len - got);
+				if (ret < 0) {
+					current_mission.is_read_awaiting = true;
+					co_yield 1;
+					continue;
+				}
+				if (ret == 0) throw peer_exception("Connection closed while receiving chunks.");
+				got += ret;
+			}
+			store.put(chunks[idx].digest, buffer, len);
+			new_bytes += len;
+		}
+		store.save_recipe(file_name, chunks);
+		if (!json_num[f_ChunkStoreOnly]) {
+			/* Copying the chunks out can take a while for a large file, it runs on io_pool. */
+			auto job = run_on_pool([&store = store, chunks, path = json_conf[f_FileReceived] + file_name] {
+				mfcslib::File output(path);
+				output.open_random_access(WRONLY);
+				store.assemble(chunks, output);
+				return true;
+			});
+			while (!job->done.load(std::memory_order_acquire)) {
+				wait_for_pool(fd);
+				co_yield 1;
+			}
+			job->get();
+		}
+		code = '1';
+		LOG_INFO("Success on receiving file: ", name_size, " with ", to_string(new_bytes), " bytes new to the chunk store.");
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+	}
+	write(fd, &code, sizeof code);
+	if (code != '1') {
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	current_mission.is_read_awaiting = false;
+	current_mission.is_write_awaiting = false;
+	co_return;
+}
+
+co_handle receive_loop::handle_sft_tree_file(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string_view header(current_mission.requests);
+	header.remove_prefix(2);
+	if (header.back() == '\n') header.remove_suffix(1);
+	uintmax_t count = 0, total = 0, manifest_len = 0;
+	try {
+		count = std::stoull(string(pop_field(header)));
+		total = std::stoull(string(pop_field(header)));
+		manifest_len = std::stoull(string(pop_field(header)));
+	}
+	catch (const std::exception& e) {
+		header = {};
+	}
+	if (!is_safe_relative_path(header) || header.find('/') != string_view::npos || manifest_len > count * (PATH_MAX + 24)) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent invalid directory request: ", current_mission.requests);
+		close_connection(fd);
+		co_return;
+	}
+	string dir_name(header);
+	current_mission.requests.clear();
+	char code = '1';
+	write(fd, &code, sizeof code);
+	LOG_INFO("Receiving directory from:", current_mission.get_ip_port_s(), ' ', dir_name, " with ", to_string(count), " files of ", to_string(total), " bytes");
+	code = '0';
+	try {
+		string manifest(manifest_len, '\0');
+		for (size_t got = 0; got < manifest_len;) {
+			auto ret = read(fd, manifest.data() + got, manifest_len - got);
+			if (ret < 0 && errno == EAGAIN) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret <= 0) throw peer_exception("Connection closed while receiving the manifest.");
+			got += ret;
+		}
+		tree_writer writer(json_conf[f_FileReceived] + dir_name, parse_manifest(manifest, count));
+		auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+		while (writer.remaining() > 0) {
+			auto ret = buffer.read(fd, 0, std::min<uintmax_t>(buffer.length(), writer.remaining()));
+			if (ret < 0) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret == 0) throw peer_exception("Connection closed before the whole directory arrived.");
+			writer.feed(buffer.get_ptr(), ret);
+		}
+		string trailer(count * sizeof(uint32_t), '\0');
+		for (size_t got = 0; got < trailer.size();) {
+			auto ret = read(fd, trailer.data() + got, trailer.size() - got);
+			if (ret < 0 && errno == EAGAIN) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret <= 0) throw peer_exception("Connection closed before the checksums arrived.");
+			got += ret;
+		}
+		if (auto bad = writer.verify(trailer.data()); bad == 0) {
+			code = '1';
+			LOG_INFO("Success on receiving directory: ", dir_name);
+		}
+		else {
+			LOG_ERROR(to_string(bad), " files of directory ", dir_name, " failed their checksum and were removed.");
+		}
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+	}
+	write(fd, &code, sizeof code);
+	if (code != '1') {
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	current_mission.is_read_awaiting = false;
+	co_return;
+}
+
+co_handle receive_loop::handle_sft_tree_get(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string_view name(current_mission.requests);
+	name.remove_prefix(2);
+	if (name.back() == '\n') name.remove_suffix(1);
+	while (!name.empty() && name.back() == '/') name.remove_suffix(1);
+	string dir_name(name);
+	current_mission.requests.clear();
+	LOG_INFO("Receive directory request from:", current_mission.get_ip_port_s(), ' ', dir_name);
+	string root = json_conf[f_FileToSend] + dir_name;
+	struct stat st;
+	if (!is_safe_relative_path(dir_name) || stat(root.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+		char code = '0';
+		write(fd, &code, sizeof code);
+		co_return;
+	}
+	try {
+		/* Walking a large tree takes a while, it runs on io_pool. */
+		auto scan = run_on_pool([root] { return scan_tree(root); });
+		while (!scan->done.load(std::memory_order_acquire)) {
+			wait_for_pool(fd);
+			co_yield 1;
+		}
+		auto entries = scan->get();
+		auto manifest = serialize_manifest(entries);
+		uintmax_t total = 0;
+		for (auto& entry : entries) total += entry.size;
+		auto reply = std::format("/{}/{}/{}", entries.size(), total, manifest.size());
+		write(fd, reply.c_str(), reply.size() + 1);
+		ssize_t ret = 0;
+		char flag = '0';
+		while (1) {
+			ret = recv(fd, &flag, sizeof(flag), 0);
+			if (ret >= 0 || errno != EAGAIN) break;
+			current_mission.is_read_awaiting = true;
+			co_yield 1;
+		}
+		if (flag != '1' || ret <= 0)
+			throw peer_exception("Receive flag failed.");
+		current_mission.is_read_awaiting = false;
+		tree_packer packer(root, entries);
+		tree_piece piece;
+		/* The manifest goes out first, then pieces of contents, then the checksums. */
+		string_view out(manifest);
+		bool sent_trailer = false;
+		while (true) {
+			while (!out.empty()) {
+				auto ret = write(fd, out.data(), out.size());
+				if (ret < 0 && errno == EAGAIN) {
+					current_mission.is_write_awaiting = true;
+					co_yield 1;
+					continue;
+				}
+				if (ret <= 0) throw peer_exception("Connection closed while sending the directory.");
+				out.remove_prefix(ret);
+			}
+			if (sent_trailer) break;
+			if (!packer.next(piece)) {
+				auto& checksums = packer.checksums();
+				out = string_view(reinterpret_cast<const char*>(checksums.data()), checksums.size() * sizeof(uint32_t));
+				sent_trailer = true;
+				continue;
+			}
+			if (!piece.file) {
+				out = piece.packed;
+				continue;
+			}
+			/* The job keeps the file open, the task may be gone before it ends. */
+			std::shared_ptr<mfcslib::File> file(std::move(piece.file));
+			auto checksum = run_on_pool([file, length = piece.length] { return file_checksum(file->get_fd(), length); });
+			off_t off = 0;
+			while (uintmax_t(off) < piece.length) {
+				auto ret = sendfile(fd, file->get_fd(), &off, piece.length - off);
+				if (ret < 0 && errno == EAGAIN) {
+					current_mission.is_write_awaiting = true;
+					co_yield 1;
+					continue;
+				}
+				if (ret <= 0) throw peer_exception("Connection closed while sending the directory.");
+			}
+			while (!checksum->done.load(std::memory_order_acquire)) {
+				wait_for_pool(fd);
+				co_yield 1;
+			}
+			packer.checksums()[piece.index] = checksum->get();
+		}
+		LOG_INFO("Success on sending directory to client:", current_mission.get_ip_s(), ' ', dir_name);
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	current_mission.is_read_awaiting = false;
+	current_mission.is_write_awaiting = false;
+	co_return;
+}
+
+/*
+ * A session carries many pipelined requests over one connection. Each is a
+ * line "<id>/<op>/<args>\n", answered in order with "<id>/1..." or "<id>/0"
+ * terminated by '\0':
+ *   m/<text>          message
+ *   n                 no-op to keep the connection warm
+ *   g/<name>          get a file, answered with /1/<size>, the data and its u32 crc32c
+ *   f/<path>/<size>   put a file, the line is followed by the data and its u32 crc32c
+ *   h/<size>/<crc>/<path>   whether the file there has that size and crc32c
+ *   d/<path>          make a directory
+ *   r/<length>/<from>/<to>  rename, length being that of from
+ *   x/<path>          remove a file or a directory with all below it
+ * Paths are relative to FileReceived and directories on the way are made.
+ * A put replaces its file only once the data has checked out. A failed
+ * request only fails that request.
+ */
+co_handle receive_loop::handle_sft_session(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string pending = current_mission.requests.substr(current_mission.requests.find('\n') + 1);
+	current_mission.requests.clear();
+	LOG_INFO("Session starts with:", current_mission.get_ip_port_s());
+	auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+	string out("1");
+	string id;
+	/* The get in progress. */
+	std::vector<send_segment> segments;
+	std::shared_ptr<pool_job<uint32_t>> checksum;
+	mfcslib::File source;
+	off_t source_off = 0;
+	/* The put in progress. */
+	mfcslib::File output;
+	string output_name, output_path;
+	uintmax_t receive_size = 0, received = 0;
+	bool receiving = false;
+	crc32c receive_crc;
+	try {
+		while (true) {
+			while (!out.empty()) {
+				auto ret = write(fd, out.data(), out.size());
+				if (ret < 0 && errno == EAGAIN) {
+					current_mission.is_read_awaiting = false;
+					current_mission.is_write_awaiting = true;
+					co_yield 1;
+					continue;
+				}
+				if (ret <= 0) throw peer_exception("Connection closed while replying.");
+				out.erase(0, ret);
+			}
+			current_mission.is_write_awaiting = false;
+			if (!segments.empty()) {
+				auto& segment = segments.front();
+				if (!source.available()) {
+					source = segment.path;
+					source.open_read_only();
+					source_off = segment.offset;
+				}
+				uintmax_t left = segment.offset + segment.length - source_off;
+				auto ret = left > 0 ? sendfile(fd, source.get_fd(), &source_off, left) : 0;
+				if (ret < 0 && errno == EAGAIN) {
+					current_mission.is_read_awaiting = false;
+					current_mission.is_write_awaiting = true;
+					co_yield 1;
+					continue;
+				}
+				if (ret < 0 || (ret == 0 && left > 0)) throw peer_exception("Fail to send a file in session.");
+				if (uintmax_t(source_off) == segment.offset + segment.length) {
+					source.close();
+					segments.erase(segments.begin());
+					while (segments.empty() && !checksum->done.load(std::memory_order_acquire)) {
+						wait_for_pool(fd);
+						co_yield 1;
+					}
+					if (segments.empty()) {
+						auto crc = checksum->get();
+						out.assign(reinterpret_cast<const char*>(&crc), sizeof crc);
+					}
+				}
+				continue;
+			}
+			if (receiving && received < receive_size && !pending.empty()) {
+				auto take = std::min<uintmax_t>(pending.size(), receive_size - received);
+				for (size_t written = 0; output.available() && written < take;) {
+					auto ret = ::pwrite(output.get_fd(), pending.data() + written, take - written, received + written);
+					if (ret < 0) {
+						LOG_ERROR("Fail to write ", output_name, " in session: ", GETERR);
+						output.close();
+						unlink(hidden_sibling(output_path, ".part").c_str());
+						break;
+					}
+					written += ret;
+				}
+				receive_crc.update(pending.data(), take);
+				received += take;
+				pending.erase(0, take);
+				continue;
+			}
+			if (receiving && received == receive_size && pending.size() >= sizeof(uint32_t)) {
+				uint32_t expected = 0;
+				memcpy(&expected, pending.data(), sizeof expected);
+				pending.erase(0, sizeof expected);
+				receiving = false;
+				bool success = output.available() && expected == receive_crc.value();
+				auto partial = hidden_sibling(output_path, ".part");
+				if (success) {
+					store_checksum(output.get_fd(), expected);
+					success = rename(partial.c_str(), output_path.c_str()) == 0;
+				}
+				if (success) {
+					LOG_INFO("Success on receiving file in session: ", output_name, '/', to_string(receive_size));
+				}
+				else if (output.available()) {
+					LOG_ERROR("Checksum mismatch on file in session: ", output_name, ", discarded it.");
+					unlink(partial.c_str());
+				}
+				output.close();
+				out = id + (success ? "/1" : "/0") + '\0';
+				continue;
+			}
+			if (!receiving) {
+				if (auto eol = pending.find('\n'); eol != string::npos) {
+					string line = pending.substr(0, eol);
+					pending.erase(0, eol + 1);
+					string_view fields(line);
+					id = pop_field(fields);
+					auto op = pop_field(fields);
+					out = id + '/';
+					if (op == "m") {
+						LOG_MSG(current_mission.get_ip_port_s(), string(fields));
+						out += '1';
+					}
+					else if (op == "n") {
+						out += '1';
+					}
+					else if (op == "g") {
+						uintmax_t size = 0;
+						bool found = false;
+						try {
+							if (!is_safe_relative_path(fields)) throw file_exception("Invalid file name.");
+							segments = locate_file(json_conf[f_FileToSend] + string(fields), size);
+							out += "1/" + to_string(size);
+							found = true;
+						}
+						catch (const mfcslib::file_exception& e) {
+							LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', string(fields), ": ", e.what());
+							out += '0';
+						}
+						out += '\0';
+						if (!segments.empty()) {
+							checksum = run_on_pool([segments] { return checksum_segments(segments, true); });
+						}
+						else if (found) {
+							uint32_t crc = 0;
+							out.append(reinterpret_cast<const char*>(&crc), sizeof crc);
+						}
+						continue;
+					}
+					else if (op == "f") {
+						auto slash = fields.rfind('/');
+						if (slash == string_view::npos) throw peer_exception("Invalid put in session: " + line);
+						output_name = fields.substr(0, slash);
+						receive_size = std::stoull(string(fields.substr(slash + 1)));
+						if (!is_safe_relative_path(output_name))
+							throw peer_exception("Invalid file name in session: " + output_name);
+						output_path = json_conf[f_FileReceived] + output_name;
+						make_directories(output_path.substr(0, output_path.find_last_of('/') + 1));
+						output = hidden_sibling(output_path, ".part");
+						try {
+							output.open(true, WRONLY);
+						}
+						catch (const std::exception& e) {
+							LOG_ERROR("Fail to open ", output_name, " in session: ", e.what());
+						}
+						receiving = true;
+						received = 0;
+						receive_crc = crc32c();
+						out.clear();
+						continue;
+					}
+					else if (op == "h") {
+						auto size = std::stoull(string(pop_field(fields)));
+						auto crc = (uint32_t)std::stoul(string(pop_field(fields)));
+						bool same = false;
+						if (is_safe_relative_path(fields)) {
+							/* A file not seen before is read whole for its checksum. */
+							auto check = run_on_pool([path = json_conf[f_FileReceived] + string(fields), size, crc] {
+								bool same = false;
+								int file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+								struct stat st;
+								if (file_fd >= 0 && fstat(file_fd, &st) == 0 && S_ISREG(st.st_mode) && uintmax_t(st.st_size) == size) {
+									same = file_checksum(file_fd, size) == crc;
+								}
+								if (file_fd >= 0) close(file_fd);
+								return same;
+							});
+							while (!check->done.load(std::memory_order_acquire)) {
+								wait_for_pool(fd);
+								co_yield 1;
+							}
+							same = check->get();
+						}
+						out += same ? '1' : '0';
+					}
+					else if (op == "d") {
+						if (!is_safe_relative_path(fields)) throw peer_exception("Invalid path in session: " + line);
+						make_directories(json_conf[f_FileReceived] + string(fields) + '/');
+						out += '1';
+					}
+					else if (op == "x") {
+						if (!is_safe_relative_path(fields)) throw peer_exception("Invalid path in session: " + line);
+						auto removal = run_on_pool([path = json_conf[f_FileReceived] + string(fields)] {
+							remove_tree(path);
+							return true;
+						});
+						while (!removal->done.load(std::memory_order_acquire)) {
+							wait_for_pool(fd);
+							co_yield 1;
+						}
+						/* The path is gone either way. */
+						out += '1';
+					}
+					else if (op == "r") {
+						auto length = std::stoull(string(pop_field(fields)));
+						if (length + 1 > fields.size() || fields[length] != '/') throw peer_exception("Invalid rename in session: " + line);
+						auto from = fields.substr(0, length), to = fields.substr(length + 1);
+						if (!is_safe_relative_path(from) || !is_safe_relative_path(to)) throw peer_exception("Invalid path in session: " + line);
+						auto target = json_conf[f_FileReceived] + string(to);
+						make_directories(target.substr(0, target.find_last_of('/') + 1));
+						out += rename((json_conf[f_FileReceived] + string(from)).c_str(), target.c_str()) == 0 ? '1' : '0';
+					}
+					else throw peer_exception("Unknown request in session: " + line);
+					out += '\0';
+					continue;
+				}
+				if (pending.size() > SESSION_LINE_MAX) throw peer_exception("Request line in session is too long.");
+			}
+			auto ret = buffer.read(fd);
+			if (ret < 0) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret == 0) break;
+			pending.append(buffer.get_ptr(), ret);
+		}
+		if (receiving && output.available()) unlink(hidden_sibling(output_path, ".part").c_str());
+		LOG_INFO("Session ends with:", current_mission.get_ip_port_s());
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent invalid request in session: ", e.what());
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	current_mission.is_read_awaiting = false;
+	current_mission.is_write_awaiting = false;
+	co_return;
+}
+
+/*
+ * Find what makes up the file to send: the file itself, or when it only
+ * exists as a recipe in the chunk store, its chunks.
+ */
+std::vector<send_segment> receive_loop::locate_file(const string& full_path, uintmax_t& size)
+{
+	try {
+		mfcslib::File requested_file(full_path);
+		requested_file.open_read_only();
+		size = requested_file.size();
+		return { { full_path, 0, size } };
+	}
+	catch (const mfcslib::file_exception& e) {
+		auto name = full_path.substr(full_path.find_last_of('/') + 1);
+		auto recipe = store.load_recipe(name);
+		if (!recipe && cache.enabled() && full_path == json_conf[f_FileToSend] + name) {
+			if (auto cached = cache.lookup(name); cached) {
+				mfcslib::File cached_file(*cached);
+				cached_file.open_read_only();
+				size = cached_file.size();
+				return { { *cached, 0, size } };
+			}
+		}
+		if (!recipe) throw;
+		std::vector<send_segment> segments;
+		size = 0;
+		for (auto& chunk : *recipe) {
+			segments.push_back({ store.chunk_path(chunk.digest), 0, chunk.length });
+			size += chunk.length;
+		}
+		return segments;
+	}
+}
+
+/* Cut segments down to the len bytes starting at off of their concatenation. */
+void receive_loop::clip_segments(std::vector<send_segment>& segments, uintmax_t off, uintmax_t len)
+{
+	std::vector<send_segment> clipped;
+	for (auto& segment : segments) {
+		if (len == 0) break;
+		if (off >= segment.length) {
+			off -= segment.length;
+			continue;
+		}
+		auto take = std::min(segment.length - off, len);
+		clipped.push_back({ segment.path, segment.offset + off, take });
+		len -= take;
+		off = 0;
+	}
+	segments = std::move(clipped);
+}
+
+/* CRC32C of what is about to be sent. A whole file may have it cached in an attribute. */
+uint32_t receive_loop::checksum_segments(std::vector<send_segment> segments, bool whole_file)
+{
+	uint32_t crc = 0;
+	for (auto& segment : segments) {
+		mfcslib::File source(segment.path);
+		source.open_read_only();
+		if (whole_file && segments.size() == 1) return file_checksum(source.get_fd(), segment.length);
+		crc = crc32c_of_file(source.get_fd(), segment.length, segment.offset, crc);
+	}
+	return crc;
+}
+
+/*
+ * A stream of messages on one connection after "i/": each is a u32 length
+ * followed by its bytes. What arrives until the socket runs dry is appended
+ * to the message log in one batch, and reading goes on while the log syncs.
+ * Once a batch is on the disk it is acknowledged with the cumulative u64
+ * count of messages of this stream stored so far.
+ */
+co_handle receive_loop::handle_sft_stream(int fd)
+{
+	data_info& current_mission = connections[fd];
+	current_mission.requests.clear();
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+	LOG_INFO("Message stream starts with:", current_mission.get_ip_port_s());
+	auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+	string pending;
+	string out("1");
+	uint64_t stored = 0;
+	/* Batches not on the disk yet: the log offset after the batch, and the count to acknowledge then. */
+	std::deque<std::pair<uint64_t, uint64_t>> unsynced;
+	bool finished = false;
+	try {
+		if (!messages.enabled()) throw file_exception("Message log is not available.");
+		while (true) {
+			uint64_t ack = 0;
+			for (; !unsynced.empty() && unsynced.front().first <= messages.synced(); unsynced.pop_front()) {
+				ack = unsynced.front().second;
+			}
+			if (ack > 0) out.assign(reinterpret_cast<const char*>(&ack), sizeof ack);
+			while (!out.empty()) {
+				auto ret = write(fd, out.data(), out.size());
+				if (ret < 0 && errno == EAGAIN) {
+					current_mission.is_read_awaiting = false;
+					current_mission.is_write_awaiting = true;
+					co_yield 1;
+					continue;
+				}
+				if (ret <= 0) throw peer_exception("Connection closed while acknowledging.");
+				out.erase(0, ret);
+			}
+			current_mission.is_write_awaiting = false;
+			if (finished) {
+				if (unsynced.empty()) break;
+				current_mission.is_read_awaiting = false;
+				wait_for_sync(fd, unsynced.front().first - 1);
+				co_yield 1;
+				continue;
+			}
+			auto ret = buffer.read(fd);
+			if (ret > 0) {
+				pending.append(buffer.get_ptr(), ret);
+				if (pending.size() < MESSAGE_BATCH_MAX) continue;
+			}
+			else if (ret == 0) finished = true;
+			else if (errno != EAGAIN) throw peer_exception(strerror(errno));
+			uint64_t count = 0;
+			auto used = message_log::complete_frames(pending, count);
+			if (count > 0) {
+				auto last = messages.append(string_view(pending.data(), used), count);
+				if (!subscribers.empty()) publish_frames(string_view(pending.data(), used), last + 1 - count);
+				pending.erase(0, used);
+				stored += count;
+				unsynced.emplace_back(last + 1, stored);
+			}
+			else if (ret < 0) {
+				/* New data or the next sync, whichever comes first. */
+				current_mission.is_read_awaiting = true;
+				if (!unsynced.empty()) wait_for_sync(fd, unsynced.front().first - 1);
+				co_yield 1;
+				current_mission.sync_wait = 0;
+			}
+		}
+		LOG_INFO("Message stream ends with:", current_mission.get_ip_port_s(), ", stored ", to_string(stored), " messages.");
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " stored ", to_string(stored), " messages, then: ", e.what());
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	current_mission.is_read_awaiting = false;
+	current_mission.is_write_awaiting = false;
+	current_mission.sync_wait = 0;
+	co_return;
+}
+
+/* The message is acknowledged once it is in the message log on the disk. */
+co_handle receive_loop::handle_sft_mesg(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string& request = current_mission.requests;
+	LOG_MSG(current_mission.get_ip_port_s(), &request[2]);
+	char code = '1';
+	string_view message(request);
+	message.remove_prefix(2);
+	if (message.ends_with('\n')) message.remove_suffix(1);
+	if (messages.enabled()) {
+		try {
+			auto offset = messages.append_message(message);
+			subscribers.publish(offset, message);
+			wait_for_sync(fd, offset);
+			request.clear();
+			co_yield 1;
+		}
+		catch (const mfcslib::basic_exception& e) {
+			LOG_ERROR("Fail to keep message in the message log: ", e.what());
+			code = '0';
+		}
+	}
+	else subscribers.publish(0, message);
+	request.clear();
+	write(fd, &code, sizeof code);
+	co_return;
+}
+
+/*
+ * "w/<prefix>" turns the connection into a subscriber of the messages that
+ * start with prefix, all of them when it is empty. Subscribers stay until
+ * they hang up, the idle timeout does not apply to them.
+ */
+void receive_loop::handle_subscribe(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string prefix = current_mission.requests.substr(2);
+	current_mission.requests.clear();
+	if (!prefix.empty() && prefix.back() == '\n') prefix.pop_back();
+	char code = '1';
+	if (write(fd, &code, sizeof code) != sizeof code) {
+		LOG_ERROR_C(current_mission.get_ip_port_s());
+		return;
+	}
+	int flag = 1;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof flag);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+	LOG_INFO("Subscriber:", current_mission.get_ip_port_s(), " to '", prefix, "'");
+	current_mission.subscriber = true;
+	subscribers.add(fd, std::move(prefix));
+}
+
+/* Publish complete frames whose first message got offset first. */
+void receive_loop::publish_frames(string_view frames, uint64_t first)
+{
+	while (!frames.empty()) {
+		uint32_t len = 0;
+		memcpy(&len, frames.data(), sizeof len);
+		subscribers.publish(first++, frames.substr(sizeof len, len));
+		frames.remove_prefix(sizeof len + len);
+	}
+}
+
+void receive_loop::close_dead_subscribers()
+{
+	for (int fd : subscribers.take_dead()) {
+		auto ite = connections.find(fd);
+		subscribers.remove(fd);
+		if (ite == connections.end() || !ite->second.subscriber) continue;
+		LOG_INFO("Dropping subscriber: ", ite->second.get_ip_port_s());
+		close_connection(fd);
+		connections.erase(ite);
+	}
+}
+
+void receive_loop::wait_for_sync(int fd, uint64_t offset)
+{
+	auto& mission = connections[fd];
+	if (mission.sync_wait == 0) sync_waiters.push_back(fd);
+	mission.sync_wait = offset + 1;
+}
+
+/* Resume the tasks whose messages are on the disk now. */
+void receive_loop::resume_synced()
+{
+	auto synced = messages.synced();
+	auto waiting = std::move(sync_waiters);
+	sync_waiters.clear();
+	for (int fd : waiting) {
+		auto ite = connections.find(fd);
+		if (ite == connections.end() || ite->second.sync_wait == 0) continue;
+		if (ite->second.sync_wait > synced) {
+			sync_waiters.push_back(fd);
+			continue;
+		}
+		ite->second.sync_wait = 0;
+		ite->second.task.resume();
+	}
+}
+
+/* Whether a g request for name has to go to the upstream server. */
+bool receive_loop::missing_here(const string& name)
+{
+	if (!cache.enabled()) return false;
+	string file_name(name);
+	if (file_name.ends_with('\n')) file_name.pop_back();
+	if (file_name.empty() || !is_safe_relative_path(file_name) || file_name.find('/') != string::npos) return false;
+	try {
+		uintmax_t size = 0;
+		locate_file(json_conf[f_FileToSend] + file_name, size);
+		return false;
+	}
+	catch (const mfcslib::file_exception& e) {
+		return true;
+	}
+}
+
+void receive_loop::wait_for_cache(int fd)
+{
+	auto& mission = connections[fd];
+	if (!mission.cache_wait) cache_waiters.push_back(fd);
+	mission.cache_wait = true;
+}
+
+/* Every waiting task looks again at its fetch, those with nothing new wait once more. */
+void receive_loop::resume_cache_waiters()
+{
+	auto waiting = std::move(cache_waiters);
+	cache_waiters.clear();
+	for (int fd : waiting) {
+		auto ite = connections.find(fd);
+		if (ite == connections.end() || !ite->second.cache_wait) continue;
+		ite->second.cache_wait = false;
+		ite->second.task.resume();
+	}
+}
+
+void receive_loop::wait_for_pool(int fd)
+{
+	auto& mission = connections[fd];
+	if (!mission.pool_wait) pool_waiters.push_back(fd);
+	mission.pool_wait = true;
+	mission.is_read_awaiting = false;
+	mission.is_write_awaiting = false;
+}
+
+/* Every waiting task looks again at its job, those still running wait once more. */
+void receive_loop::resume_pool_waiters()
+{
+	auto waiting = std::move(pool_waiters);
+	pool_waiters.clear();
+	for (int fd : waiting) {
+		auto ite = connections.find(fd);
+		if (ite == connections.end() || !ite->second.pool_wait) continue;
+		ite->second.pool_wait = false;
+		ite->second.task.resume();
+	}
+}
+
+/*
+ * A g request for a file that is neither here nor in the cache. The reply
+ * and data are those of handle_sft_get_file, only the data is sent as it
+ * comes in from the upstream server, and every client asking meanwhile
+ * shares the one fetch.
+ */
+co_handle receive_loop::handle_proxy_get(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string name = current_mission.requests.substr(2);
+	if (name.back() == '\n') name.pop_back();
+	current_mission.requests.clear();
+	auto fetch = cache.fetch(name);
+	LOG_INFO("Fetch from upstream for:", current_mission.get_ip_port_s(), ' ', name);
+	try {
+		while (fetch->state == cache_fetch::CONNECTING) {
+			wait_for_cache(fd);
+			co_yield 1;
+		}
+		if (fetch->state == cache_fetch::FAILED) throw file_exception("Upstream does not have it.");
+		string reply("/" + to_string(fetch->size));
+		write(fd, reply.c_str(), reply.size() + 1);
+		char flag = '0';
+		ssize_t ret = 0;
+		while ((ret = recv(fd, &flag, sizeof flag, 0)) < 0 && errno == EAGAIN) {
+			current_mission.is_read_awaiting = true;
+			co_yield 1;
+		}
+		current_mission.is_read_awaiting = false;
+		if (ret <= 0 || flag != '1') throw peer_exception("Receive flag failed.");
+		cache_reader reader(fetch);
+		for (auto status = reader.send(fd); status != cache_reader::SENT; status = reader.send(fd)) {
+			if (status == cache_reader::BROKEN) throw peer_exception("Fetch from upstream broke off.");
+			if (status == cache_reader::SOCKET_FULL) current_mission.is_write_awaiting = true;
+			else wait_for_cache(fd);
+			co_yield 1;
+			current_mission.is_write_awaiting = false;
+		}
+		for (size_t sent = 0; sent < sizeof fetch->crc;) {
+			auto ret = write(fd, reinterpret_cast<const char*>(&fetch->crc) + sent, sizeof fetch->crc - sent);
+			if (ret < 0 && errno == EAGAIN) {
+				current_mission.is_write_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret <= 0) throw peer_exception("Connection closed before the checksum was sent.");
+			sent += ret;
+		}
+		LOG_INFO("Success on sending file to client:", current_mission.get_ip_s());
+	}
+	catch (const mfcslib::peer_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	catch (const mfcslib::file_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', name, ' ', e.what());
+		char code = '0';
+		write(fd, &code, sizeof code);
+	}
+	current_mission.is_read_awaiting = false;
+	current_mission.is_write_awaiting = false;
+	co_return;
+}
+
+/*
+ * Requests on the Unix socket carry no data: "o/<name>" comes with the open
+ * file to store as name, "q/<name>" is answered with the open file to send.
+ * Copies run on the pool, the reply goes out there on a descriptor of its own.
+ */
+void receive_loop::handle_local(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string request = std::move(current_mission.requests);
+	current_mission.requests.clear();
+	if (request.back() == '\n') request.pop_back();
+	string name = request.substr(std::min<size_t>(2, request.size()));
+	char code = '0';
+	if (name.empty() || !is_safe_relative_path(name) || name.find('/') != string::npos) {
+		LOG_ERROR("Invalid local request: ", request);
+		write(fd, &code, sizeof code);
+		return;
+	}
+	if (request[0] == 'o') {
+		int file_fd = std::exchange(current_mission.passed_fd, -1);
+		int reply_fd = file_fd < 0 ? -1 : dup(fd);
+		if (reply_fd < 0) {
+			if (file_fd >= 0) close(file_fd);
+			LOG_ERROR("Local upload came without a file: ", name);
+			write(fd, &code, sizeof code);
+			return;
+		}
+		LOG_INFO("Receive local file:", name);
+		io_pool.submit_to_pool(local_receive, file_fd, json_conf[f_FileReceived] + name, reply_fd);
+		return;
+	}
+	LOG_INFO("Send local file:", name);
+	try {
+		mfcslib::File requested_file(json_conf[f_FileToSend] + name);
+		requested_file.open_read_only();
+		string reply = "/" + to_string(requested_file.size());
+		mfcslib::send_with_fd(fd, string_view(reply.data(), reply.size() + 1), requested_file.get_fd());
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Local request for ", name, " failed: ", e.what());
+		write(fd, &code, sizeof code);
+	}
+}
+
+/* Runs on the pool, so it reports through the reply only. */
+void receive_loop::local_receive(int file_fd, string path, int reply_fd)
+{
+	char code = '0';
+	bool created = false;
+	try {
+		struct stat st;
+		if (fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) throw mfcslib::file_exception("Not a regular file.");
+		mfcslib::File output(path);
+		output.open(true, mfcslib::WRONLY);
+		created = true;
+		mfcslib::clone_or_copy(file_fd, output.get_fd(), st.st_size);
+		code = '1';
+	}
+	catch (const mfcslib::basic_exception& e) {}
+	catch (const std::exception& e) {}
+	if (code == '0' && created) unlink(path.c_str());
+	write(reply_fd, &code, sizeof code);
+	close(reply_fd);
+	close(file_fd);
+}
+
+/*
+ * v/f/<loss ppm>/<size>/<name> sends a file over UDP, v/g/<loss ppm>/<name>
+ * asks for one. The reply gives the port of a UDP socket on the address the
+ * client reached, the transfer id and for v/g the size; the transfer runs on
+ * its own thread and reports '1' or '0' on this connection when it ends.
+ */
+void receive_loop::handle_udp(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string request = std::move(current_mission.requests);
+	current_mission.requests.clear();
+	if (request.back() == '\n') request.pop_back();
+	string_view rest(request);
+	rest.remove_prefix(std::min<size_t>(2, rest.size()));
+	char code = '0';
+	int udp_fd = -1, file_fd = -1;
+	try {
+		auto direction = pop_field(rest);
+		bool upload = direction == "f";
+		if (!upload && direction != "g") throw std::invalid_argument("Unknown direction.");
+		mfcslib::rudp_options options;
+		auto loss_ppm = std::min(std::stoull(string(pop_field(rest))), 1'000'000ull);
+		options.loss = loss_ppm / 1e6;
+		uint64_t size = upload ? std::stoull(string(pop_field(rest))) : 0;
+		string name(rest);
+		if (name.empty() || !is_safe_relative_path(name) || name.find('/') != string::npos) throw std::invalid_argument("Invalid name.");
+		mfcslib::File file((upload ? json_conf[f_FileReceived] : json_conf[f_FileToSend]) + name);
+		if (upload) file.open(true, mfcslib::RDWR);
+		else {
+			file.open_read_only();
+			size = file.size();
+		}
+		sockaddr_in local{};
+		socklen_t len = sizeof local;
+		if (getsockname(fd, (sockaddr*)&local, &len) < 0) throw mfcslib::socket_exception(strerror(errno));
+		udp_fd = mfcslib::rudp_socket(local);
+		uint32_t id = std::random_device{}();
+		string reply = "/" + to_string(mfcslib::rudp_port(udp_fd)) + "/" + to_string(id);
+		if (!upload) reply += "/" + to_string(size);
+		int reply_fd = dup(fd);
+		if (reply_fd < 0) throw mfcslib::socket_exception(strerror(errno));
+		file_fd = dup(file.get_fd());
+		if (file_fd < 0) {
+			close(reply_fd);
+			throw mfcslib::file_exception(strerror(errno));
+		}
+		LOG_INFO(upload ? "Receive file over UDP:" : "Send file over UDP:", name, " loss ppm:", to_string(loss_ppm));
+		write(fd, reply.c_str(), reply.size() + 1);
+		std::thread(udp_transfer, upload, udp_fd, id, file_fd, size, options, file.get_absolute(), reply_fd).detach();
+		return;
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("UDP request failed: ", request, ' ', e.what());
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Invalid UDP request: ", request);
+	}
+	if (udp_fd >= 0) close(udp_fd);
+	if (file_fd >= 0) close(file_fd);
+	write(fd, &code, sizeof code);
+}
+
+/* Closes every descriptor it is given; an upload that fails is removed before reply_fd hears '0'. */
+void receive_loop::udp_transfer(bool upload, int udp_fd, uint32_t id, int file_fd, uint64_t size, mfcslib::rudp_options options, string path, int reply_fd)
+{
+	char code = '0';
+	bool replied = false;
+	try {
+		bool ok = false;
+		if (upload) {
+			/* The client hears the result right away, not after the receiver lingers. */
+			mfcslib::rudp_receiver receiver(udp_fd, id, false, file_fd, size, options);
+			ok = receiver.run([&](bool whole) {
+				char early = whole ? '1' : '0';
+				if (!whole) unlink(path.c_str());
+				write(reply_fd, &early, sizeof early);
+				replied = true;
+			});
+		}
+		else {
+			mfcslib::rudp_sender sender(udp_fd, id, false, file_fd, size, options);
+			ok = sender.run();
+		}
+		if (ok) code = '1';
+	}
+	catch (const mfcslib::basic_exception& e) {}
+	catch (const std::exception& e) {}
+	if (!replied) {
+		if (upload && code == '0') unlink(path.c_str());
+		write(reply_fd, &code, sizeof code);
+	}
+	close(reply_fd);
+	close(file_fd);
+	close(udp_fd);
+}
+
+/*
+ * n/<size>/<name>/<ip:port>,<ip:port>... uploads a file that goes on to the
+ * servers listed, in that order: every hop writes the stream while passing it
+ * to the next, so the file reaches all of them in about the time of one
+ * transfer and a slow hop holds back the ones before it. The connection
+ * leaves the loop for a thread of its own, which answers '1' once the rest of
+ * the chain is connected and, after the checksum, "/<codes>" with '1' or '0'
+ * for this server and each one down the list. Relaying to others needs
+ * ChainRelay; the last hop, with an empty list, is always accepted.
+ */
+void receive_loop::handle_chain(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string request = std::move(current_mission.requests);
+	current_mission.requests.clear();
+	if (request.back() == '\n') request.pop_back();
+	string_view rest(request);
+	rest.remove_prefix(std::min<size_t>(2, rest.size()));
+	char code = '0';
+	try {
+		auto size = std::stoull(string(pop_field(rest)));
+		string name(pop_field(rest));
+		if (name.empty() || !is_safe_relative_path(name)) throw std::invalid_argument("Invalid name.");
+		std::vector<string> hops;
+		while (!rest.empty()) hops.emplace_back(pop_field(rest, ','));
+		if (!hops.empty() && !json_num[f_ChainRelay]) {
+			LOG_ERROR("Refused to relay ", name, " to ", to_string(hops.size()), " more servers, ChainRelay is off.");
+			write(fd, &code, sizeof code);
+			return;
+		}
+		int relay_fd = dup(fd);
+		if (relay_fd < 0) throw mfcslib::socket_exception(strerror(errno));
+		LOG_INFO("Receive file for a chain:", current_mission.get_ip_port_s(), ' ', name, '/', to_string(size), " relaying to ", to_string(hops.size()), " more");
+		std::thread(chain_relay, relay_fd, size, name, json_conf[f_FileReceived] + name, std::move(hops),
+			uintmax_t(std::max(json_num[f_WritebackWindow], 0ll)), json_num[f_DropWrittenPages] != 0).detach();
+		return;
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Chain request failed: ", request, ' ', e.what());
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Invalid chain request: ", request);
+	}
+	write(fd, &code, sizeof code);
+}
+
+/*
+ * Writes the upload to path while passing it on to the first of hops.
+ * A hop that can not be reached is skipped; one that fails midway is cut off
+ * and the upload goes on for this server alone.
+ */
+void receive_loop::chain_relay(int fd, uint64_t size, string name, string path, std::vector<string> hops, uintmax_t window, bool drop_cache)
+{
+	auto blocking = [](int sock) {
+		timeval timeout{ CHAIN_TIMEOUT, 0 };
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+	};
+	auto write_all = [](int sock, const char* data, size_t len) {
+		while (len > 0) {
+			auto ret = ::send(sock, data, len, MSG_NOSIGNAL);
+			if (ret <= 0) return false;
+			data += ret;
+			len -= ret;
+		}
+		return true;
+	};
+	auto read_all = [](int sock, char* data, size_t len) {
+		while (len > 0) {
+			auto ret = ::read(sock, data, len);
+			if (ret <= 0) return false;
+			data += ret;
+			len -= ret;
+		}
+		return true;
+	};
+	blocking(fd);
+	/* One code for each hop down the list, those never reached stay '0'. */
+	string codes(hops.size(), '0');
+	std::optional<mfcslib::NetworkSocket> next;
+	size_t first = hops.size();
+	for (size_t i = 0; i < hops.size() && !next; ++i) {
+		try {
+			auto colon = hops[i].rfind(':');
+			if (colon == string::npos) continue;
+			next.emplace(hops[i].substr(0, colon), (uint16_t)std::stoul(hops[i].substr(colon + 1)));
+			blocking(next->get_fd());
+			string request = "n/" + to_string(size) + '/' + name + '/';
+			for (size_t j = i + 1; j < hops.size(); ++j) request += hops[j] + (j + 1 < hops.size() ? "," : "");
+			char reply = '0';
+			if (!write_all(next->get_fd(), request.data(), request.size())
+				|| ::read(next->get_fd(), &reply, sizeof reply) != 1 || reply != '1') next.reset();
+			else first = i;
+		}
+		catch (const mfcslib::basic_exception& e) {
+			next.reset();
+		}
+		catch (const std::exception& e) {
+			next.reset();
+		}
+	}
+	char code = '0';
+	bool created = false, started = false;
+	try {
+		mfcslib::File output(path);
+		output.open_random_access(WRONLY);
+		created = true;
+		output.truncate(0);
+		output.preallocate(0, size);
+		code = '1';
+		started = true;
+		if (!write_all(fd, &code, sizeof code)) throw peer_exception("Upstream closed before the data.");
+		mfcslib::writeback_pacer pacer(output.get_fd(), 0, window, drop_cache);
+		auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+		crc32c crc;
+		/* The next hop gets each piece before it is written here, so the two overlap. */
+		for (uintmax_t received = 0; received < size;) {
+			auto ret = ::read(fd, buffer.get_ptr(), std::min<uintmax_t>(buffer.length(), size - received));
+			if (ret <= 0) throw peer_exception("Upstream closed in the middle of the data.");
+			if (next && !write_all(next->get_fd(), buffer.get_ptr(), ret)) next.reset();
+			for (ssize_t written = 0; code == '1' && written < ret;) {
+				auto wrote = ::pwrite(output.get_fd(), buffer.get_ptr() + written, ret - written, received + written);
+				if (wrote <= 0) code = '0';
+				else written += wrote;
+			}
+			crc.update(buffer.get_ptr(), ret);
+			received += ret;
+			if (code == '1') pacer.advance(received);
+		}
+		uint32_t expected = 0;
+		if (!read_all(fd, reinterpret_cast<char*>(&expected), sizeof expected)) throw peer_exception("Upstream closed before the checksum.");
+		if (next && !write_all(next->get_fd(), reinterpret_cast<const char*>(&expected), sizeof expected)) next.reset();
+		if (code == '1' && expected == crc.value()) store_checksum(output.get_fd(), expected);
+		else code = '0';
+		/* The codes of the rest of the chain, from the next hop down. */
+		if (next) {
+			string result;
+			for (char ch = 0; ::read(next->get_fd(), &ch, 1) == 1 && ch != '\0';) result += ch;
+			if (result.starts_with('/')) {
+				auto count = std::min(result.size() - 1, codes.size() - first);
+				codes.replace(first, count, result, 1, count);
+			}
+		}
+	}
+	catch (const mfcslib::basic_exception& e) {
+		code = 'x';
+	}
+	catch (const std::exception& e) {
+		code = 'x';
+	}
+	if (code != '1' && created) unlink(path.c_str());
+	/* Refused before the data, or the upload broke and there is nothing to answer. */
+	if (code == 'x') {
+		if (!started) write_all(fd, "0", 1);
+		close(fd);
+		return;
+	}
+	string reply = "/" + string(1, code) + codes;
+	write_all(fd, reply.c_str(), reply.size() + 1);
+	close(fd);
+}
+
+/*
+ * a/<name> tells which pieces of FileToSend/name this server holds, as
+ * "/<size>/<piece size>/<hex piece map>", for the other servers of a swarm.
+ * j/<name>/<ip:port>,<ip:port>... has this server fetch name from those
+ * servers, piece by piece in "b" requests, into FileToSend while serving the
+ * pieces it already has to them. It answers '1' when the fetch starts and
+ * '1' or '0' again when it ends. Joining needs Swarm.
+ */
+void receive_loop::handle_swarm(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string request = std::move(current_mission.requests);
+	current_mission.requests.clear();
+	if (request.back() == '\n') request.pop_back();
+	string_view rest(request);
+	rest.remove_prefix(std::min<size_t>(2, rest.size()));
+	char code = '0';
+	try {
+		string name(pop_field(rest));
+		if (name.empty() || !is_safe_relative_path(name)) throw std::invalid_argument("Invalid name.");
+		string path = json_conf[f_FileToSend] + name;
+		std::shared_ptr<swarm_file> partial;
+		bool fetching = swarms.find(name, partial);
+		if (request[0] == 'a') {
+			string reply;
+			if (partial) reply = std::format("/{}/{}/{}", partial->size, SWARM_PIECE, swarm_bitmap(partial->have()));
+			else if (!fetching) {
+				mfcslib::File file(path);
+				file.open_read_only();
+				auto size = file.size();
+				reply = std::format("/{}/{}/{}", size, SWARM_PIECE, swarm_bitmap(std::vector<bool>((size + SWARM_PIECE - 1) / SWARM_PIECE, true)));
+			}
+			if (!reply.empty()) {
+				write(fd, reply.c_str(), reply.size() + 1);
+				return;
+			}
+			write(fd, &code, sizeof code);
+			return;
+		}
+		if (!json_num[f_Swarm]) {
+			LOG_ERROR("Refused to join the swarm for ", name, ", Swarm is off.");
+			write(fd, &code, sizeof code);
+			return;
+		}
+		if (!fetching && access(path.c_str(), F_OK) == 0) {
+			/* Already a seed. */
+			write(fd, "11", 2);
+			return;
+		}
+		std::vector<std::pair<string, uint16_t>> peers;
+		while (!rest.empty()) {
+			auto peer = pop_field(rest, ',');
+			auto colon = peer.rfind(':');
+			if (colon == string_view::npos) throw std::invalid_argument("Invalid peer.");
+			peers.emplace_back(string(peer.substr(0, colon)), (uint16_t)std::stoul(string(peer.substr(colon + 1))));
+		}
+		if (peers.empty() || !swarms.reserve(name)) {
+			LOG_ERROR("Refused to join the swarm for ", name, fetching ? ", it is being fetched already." : ", no peers given.");
+			write(fd, &code, sizeof code);
+			return;
+		}
+		int reply_fd = dup(fd);
+		if (reply_fd < 0) {
+			swarms.release(name);
+			throw mfcslib::socket_exception(strerror(errno));
+		}
+		LOG_INFO("Join the swarm for ", name, " with ", to_string(peers.size()), " peers");
+		code = '1';
+		write(fd, &code, sizeof code);
+		std::thread(swarm_join, name, path, std::move(peers), std::ref(swarms), reply_fd).detach();
+		return;
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Swarm request failed: ", request, ' ', e.what());
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Invalid swarm request: ", request);
+	}
+	write(fd, &code, sizeof code);
+}
+
+/* Fetches into a ".swarm" sibling of path and moves it into place once the whole file is in and hashed. */
+void receive_loop::swarm_join(string name, string path, std::vector<std::pair<string, uint16_t>> peers, swarm_registry& swarms, int reply_fd)
+{
+	char code = '0';
+	auto partial_path = mfcslib::hidden_sibling(path, ".swarm");
+	try {
+		if (auto size = swarm_fetcher::probe(peers, name); size) {
+			mfcslib::File output(partial_path);
+			output.open_random_access(RDWR);
+			output.truncate(*size);
+			output.preallocate(0, *size);
+			auto file = std::make_shared<swarm_file>(output.get_absolute(), *size);
+			swarms.attach(name, file);
+			if (swarm_fetcher(name, peers, file, output.get_fd()).run()) {
+				store_checksum(output.get_fd(), crc32c_of_file(output.get_fd(), *size));
+				if (rename(partial_path.c_str(), path.c_str()) == 0) code = '1';
+			}
+		}
+	}
+	catch (const mfcslib::basic_exception& e) {}
+	catch (const std::exception& e) {}
+	/* From here on the pieces are served from the whole file, or not at all. */
+	swarms.release(name);
+	if (code == '0') unlink(partial_path.c_str());
+	write(reply_fd, &code, sizeof code);
+	close(reply_fd);
+}
+
+/*
+ * y/<dir> opens a sync session on FileToSend/dir, "" for FileToSend itself,
+ * answered by a merkle_source on a thread of its own. x/<ip:port>/<dir> has
+ * this server make its FileToSend/dir match the one on that server through
+ * such a session. It answers '1' when the pull starts and, when it ends,
+ * "/<fetched>/<removed>/<bytes>/<failed>" or '0'. Pulling needs Sync.
+ */
+void receive_loop::handle_sync(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string request = std::move(current_mission.requests);
+	current_mission.requests.clear();
+	if (request.back() == '\n') request.pop_back();
+	string_view rest(request);
+	rest.remove_prefix(std::min<size_t>(2, rest.size()));
+	char code = '0';
+	try {
+		string source;
+		if (request[0] == 'x') source = pop_field(rest);
+		while (rest.ends_with('/')) rest.remove_suffix(1);
+		string dir(rest);
+		if (!dir.empty() && !is_safe_relative_path(dir)) throw std::invalid_argument("Invalid directory.");
+		if (request[0] == 'x' && !json_num[f_Sync]) {
+			LOG_ERROR("Refused to sync ", dir, " from ", source, ", Sync is off.");
+			write(fd, &code, sizeof code);
+			return;
+		}
+		auto colon = source.rfind(':');
+		if (request[0] == 'x' && colon == string::npos) throw std::invalid_argument("Invalid source.");
+		int session_fd = dup(fd);
+		if (session_fd < 0) throw mfcslib::socket_exception(strerror(errno));
+		auto root = json_conf[f_FileToSend] + (dir.empty() ? "" : dir + '/');
+		if (request[0] == 'y') {
+			LOG_INFO("Sync session for ", dir, " with ", current_mission.get_ip_port_s());
+			std::thread(sync_serve, session_fd, dir, root, std::ref(trees)).detach();
+		}
+		else {
+			LOG_INFO("Sync ", dir, " from ", source);
+			std::thread(sync_pull, session_fd, dir, source.substr(0, colon), (uint16_t)std::stoul(source.substr(colon + 1)), root, std::ref(trees)).detach();
+		}
+		return;
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Sync request failed: ", request, ' ', e.what());
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Invalid sync request: ", request);
+	}
+	write(fd, &code, sizeof code);
+}
+
+/* Runs on its own thread until the other side hangs up. */
+void receive_loop::sync_serve(int fd, string dir, string root, merkle_index& trees)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	set_sync_timeout(fd, SO_SNDTIMEO);
+	try {
+		if (auto tree = trees.scan(dir); tree) merkle_source(fd, root, tree).run();
+		else merkle_source::write_all(fd, "0");
+	}
+	catch (const mfcslib::basic_exception& e) {}
+	catch (const std::exception& e) {}
+	close(fd);
+}
+
+/* Claims dir so no other pull writes there meanwhile; answers '0' when it is taken or the pull fails. */
+void receive_loop::sync_pull(int fd, string dir, string ip, uint16_t port, string root, merkle_index& trees)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	set_sync_timeout(fd, SO_SNDTIMEO);
+	string reply = "0";
+	if (trees.claim(dir)) {
+		try {
+			merkle_source::write_all(fd, "1");
+			mfcslib::NetworkSocket source(ip, port);
+			set_sync_timeout(source.get_fd(), SO_SNDTIMEO);
+			/* The source scans its side while this one is scanned. */
+			merkle_source::write_all(source.get_fd(), "y/" + dir);
+			make_directories(root);
+			auto local = trees.scan(dir);
+			if (!local) throw mfcslib::file_exception("Can not open the directory.");
+			auto result = merkle_puller(source.get_fd(), root).run(*local);
+			reply = std::format("/{}/{}/{}/{}", result.fetched, result.removed, result.bytes, result.failed);
+		}
+		catch (const mfcslib::basic_exception& e) {}
+		catch (const std::exception& e) {}
+		trees.release(dir);
+	}
+	write(fd, reply.c_str(), reply.size() + 1);
+	close(fd);
+}
+
+/*
+ * z/<ip:port>/<name> has this server send FileToSend/name straight to that
+ * server, which stores it in its FileReceived as the last hop of a chain
+ * upload, so the data never passes through the client asking. The connection
+ * leaves the loop for a thread of its own, which answers '0' when the push
+ * can not start and otherwise "/<sent>/<size>" about every PUSH_PROGRESS,
+ * ending with "/<sent>/<size>/<code>" where the code is '1' once the other
+ * server has stored the file and its checksum matched. Pushing needs Push.
+ */
+void receive_loop::handle_push(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string request = std::move(current_mission.requests);
+	current_mission.requests.clear();
+	if (request.back() == '\n') request.pop_back();
+	string_view rest(request);
+	rest.remove_prefix(std::min<size_t>(2, rest.size()));
+	char code = '0';
+	try {
+		string target(pop_field(rest));
+		string name(rest);
+		if (name.empty() || !is_safe_relative_path(name)) throw std::invalid_argument("Invalid name.");
+		auto colon = target.rfind(':');
+		if (colon == string::npos) throw std::invalid_argument("Invalid target.");
+		if (!json_num[f_Push]) {
+			LOG_ERROR("Refused to push ", name, " to ", target, ", Push is off.");
+			write(fd, &code, sizeof code);
+			return;
+		}
+		uintmax_t size = 0;
+		auto segments = locate_file(json_conf[f_FileToSend] + name, size);
+		int reply_fd = dup(fd);
+		if (reply_fd < 0) throw mfcslib::socket_exception(strerror(errno));
+		LOG_INFO("Push ", name, '/', to_string(size), " to ", target, " for ", current_mission.get_ip_port_s());
+		std::thread(push_file, reply_fd, name, std::move(segments), size, target.substr(0, colon), (uint16_t)std::stoul(target.substr(colon + 1))).detach();
+		return;
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Push request failed: ", request, ' ', e.what());
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Invalid push request: ", request);
+	}
+	write(fd, &code, sizeof code);
+}
+
+/* The push goes on when the client asking hangs up, it just hears no more. */
+void receive_loop::push_file(int fd, string name, std::vector<send_segment> segments, uintmax_t size, string ip, uint16_t port)
+{
+	auto blocking = [](int sock) {
+		timeval timeout{ CHAIN_TIMEOUT, 0 };
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+	};
+	auto write_all = [](int sock, const char* data, size_t len) {
+		while (len > 0) {
+			auto ret = ::send(sock, data, len, MSG_NOSIGNAL);
+			if (ret <= 0) return false;
+			data += ret;
+			len -= ret;
+		}
+		return true;
+	};
+	blocking(fd);
+	bool listening = true, started = false;
+	uintmax_t sent = 0;
+	auto report = [&](string_view tail) {
+		auto record = std::format("/{}/{}{}", sent, size, tail);
+		if (listening) listening = write_all(fd, record.c_str(), record.size() + 1);
+	};
+	char code = '0';
+	try {
+		mfcslib::NetworkSocket target(ip, port);
+		blocking(target.get_fd());
+		/* Read while the data goes out, unless the attribute has it. */
+		auto checksum = std::async(std::launch::async, checksum_segments, segments, true);
+		string request = "n/" + to_string(size) + '/' + name.substr(name.find_last_of('/') + 1) + '/';
+		char reply = '0';
+		if (!write_all(target.get_fd(), request.data(), request.size())
+			|| ::read(target.get_fd(), &reply, sizeof reply) != 1 || reply != '1') throw peer_exception("Target refused the file.");
+		started = true;
+		report("");
+		auto last = std::chrono::steady_clock::now();
+		for (auto& segment : segments) {
+			mfcslib::File source(segment.path);
+			source.open_read_only();
+			off_t off = segment.offset;
+			for (auto end = segment.offset + segment.length; uintmax_t(off) < end;) {
+				auto ret = sendfile(target.get_fd(), source.get_fd(), &off, std::min<uintmax_t>(PUSH_CHUNK, end - off));
+				if (ret <= 0) throw socket_exception(ret < 0 ? strerror(errno) : "Target closed in the middle of the data.");
+				sent += ret;
+				if (auto now = std::chrono::steady_clock::now(); now - last >= PUSH_PROGRESS) {
+					report("");
+					last = now;
+				}
+			}
+		}
+		auto crc = checksum.get();
+		if (!write_all(target.get_fd(), reinterpret_cast<const char*>(&crc), sizeof crc)) throw socket_exception("Target closed before the checksum.");
+		string result;
+		for (char ch = 0; ::read(target.get_fd(), &ch, 1) == 1 && ch != '\0';) result += ch;
+		if (result == "/1") code = '1';
+	}
+	catch (const mfcslib::basic_exception& e) {}
+	catch (const std::exception& e) {}
+	if (started) report(string("/") + code);
+	else write_all(fd, &code, sizeof code);
+	close(fd);
+}
+
+co_handle receive_loop::handle_sft_get_file(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string& request = current_mission.requests;
+	LOG_INFO("Receive file request from:",
+		current_mission.get_ip_port_s(), ' ',
+		&request[2]);
+	string_view request_view(request);
+	request_view.remove_prefix(2);
+	uintmax_t range_off = 0, range_len = 0, piece = 0;
+	bool is_piece = request[0] == 'b';
+	bool is_ranged = request[0] == 'r' || is_piece;
+	try {
+		if (is_piece) piece = std::stoull(string(pop_field(request_view)));
+		else if (is_ranged) {
+			range_off = std::stoull(string(pop_field(request_view)));
+			range_len = std::stoull(string(pop_field(request_view)));
+		}
+	}
+	catch (const std::exception& e) {
+		request_view = {};
+	}
+	string full_path = json_conf[f_FileToSend];
+	full_path += request_view;
+	if (full_path.back() == '\n') full_path.pop_back();
+	request.clear();
+	try {
+		uintmax_t file_size = 0;
+		std::vector<send_segment> segments;
+		std::shared_ptr<swarm_file> partial;
+		if (is_piece && swarms.find(full_path.substr(json_conf[f_FileToSend].size()), partial)) {
+			/* A file still being fetched gives only the pieces it holds. */
+			if (!partial || !partial->has(piece)) throw file_exception("Piece is not here yet.");
+			file_size = partial->size;
+			segments = { { partial->path, 0, file_size } };
+		}
+		else segments = locate_file(full_path, file_size); //throw file_exception
+		if (is_piece) {
+			if (piece >= (file_size + SWARM_PIECE - 1) / SWARM_PIECE) throw file_exception("No such piece.");
+			range_off = piece * SWARM_PIECE;
+			range_len = std::min<uintmax_t>(SWARM_PIECE, file_size - range_off);
+		}
+		string react_msg("/" + to_string(file_size));
+		/* A sparse file offers its extent count, the client may then ask for the data extents only. */
+		std::vector<extent> extents;
+		bool sparse = false;
+		/* Where the data is when it is one file, which may be a copy in the cache. */
+		auto whole_path = segments.empty() ? full_path : segments.front().path;
+		if (!is_ranged && segments.size() == 1) {
+			mfcslib::File requested_file(whole_path);
+			requested_file.open_read_only();
+			if ((sparse = is_sparse(requested_file.get_fd()))) {
+				extents = data_extents(requested_file.get_fd(), file_size);
+				react_msg += '/' + to_string(extents.size());
+			}
+		}
+		write(fd, react_msg.c_str(), react_msg.size() + 1);
+		if (is_ranged && range_len == 0) co_return;
+		if (is_ranged && range_off + range_len > file_size)
+			throw peer_exception("Requested range is out of the file.");
+		ssize_t ret = 0;
+		char flag = '0';
+		while (1) {
+			ret = recv(fd, &flag, sizeof(flag), 0);
+			if (ret >= 0 || errno != EAGAIN) break;
+			else {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+			}
+		}
+		if ((flag != '1' && (flag != 's' || !sparse)) || ret <= 0)
+			throw peer_exception("Receive flag failed.");
+		uintmax_t send_size = is_ranged ? range_len : file_size;
+		/* The fetch may have finished meanwhile, renaming the file to its own name. */
+		if (partial && access(partial->path.c_str(), F_OK) != 0) segments = { { full_path, 0, file_size } };
+		clip_segments(segments, range_off, send_size);
+		if (flag == 's') {
+			auto table = serialize_extents(extents);
+			for (size_t sent = 0; sent < table.size();) {
+				auto ret = write(fd, table.data() + sent, table.size() - sent);
+				if (ret < 0 && errno == EAGAIN) {
+					current_mission.is_read_awaiting = false;
+					current_mission.is_write_awaiting = true;
+					co_yield 1;
+					continue;
+				}
+				if (ret <= 0) throw peer_exception("Connection closed while sending the extent table.");
+				sent += ret;
+			}
+			segments.clear();
+			for (auto& item : extents) segments.push_back({ whole_path, item.offset, item.length });
+			send_size = extents_length(extents);
+		}
+		auto checksum = run_on_pool([segments, whole_file = !is_ranged && flag == '1'] { return checksum_segments(segments, whole_file); });
+	#ifdef DEBUG
+		auto file_sz = send_size;
+	#endif // DEBUG
+		for (auto& segment : segments) {
+			mfcslib::File requested_file(segment.path);
+			requested_file.open_read_only();
+			int file_fd = requested_file.get_fd();
+			off_t off = segment.offset;
+			uintmax_t segment_left = segment.length;
+			readahead_stream ahead(readahead_pool, file_fd, segment.offset, segment.offset + segment.length, json_num[f_DropSentPages] != 0);
+			mfcslib::send_engine engine(engine_options);
+			while (segment_left > 0) {
+				ahead.advance(off);
+				ssize_t ret = engine.send(fd, file_fd, &off, segment_left);
+			#ifdef DEBUG
+				//cout << "Return from sendfile: " << ret << endl;
+			#endif // DEBUG
+				if (ret <= 0) {
+					if (errno == EAGAIN) {
+						current_mission.is_read_awaiting = false;
+						current_mission.is_write_awaiting = true;
+						co_yield 1;
+						continue;
+					}
+					else {
+						if (ret < 0) {
+							LOG_ERROR_C(current_mission.get_ip_port_s());
+						#ifdef DEBUG
+							perror("Sendfile failed");
+						#endif // DEBUG
+						}
+						LOG_ERROR("Not received complete file data.");
+						co_return;
+					}
+				}
+				segment_left -= ret;
+				send_size -= ret;
+			#ifdef DEBUG
+				//cout << "Bytes left: " << send_size << endl;
+				mfcslib::progress_bar((file_sz - send_size), file_sz);
+			#endif // DEBUG
+			}
+		}
+		/* The data is followed by its CRC32C for the client to check. */
+		while (!checksum->done.load(std::memory_order_acquire)) {
+			wait_for_pool(fd);
+			co_yield 1;
+		}
+		auto crc = checksum->get();
+		for (size_t sent = 0; sent < sizeof crc;) {
+			auto ret = write(fd, reinterpret_cast<const char*>(&crc) + sent, sizeof crc - sent);
+			if (ret < 0 && errno == EAGAIN) {
+				current_mission.is_write_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret <= 0) throw peer_exception("Connection closed before the checksum was sent.");
+			sent += ret;
+		}
+	#ifdef DEBUG
+		cout << "\nFinishing file sending." << endl;
+	#endif // DEBUG
+		if (!is_ranged)
+			LOG_INFO("Success on sending file to client:", current_mission.get_ip_s());
+	}
+	catch (const mfcslib::peer_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(),' ', e.what());
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	catch (const mfcslib::file_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(),' ', e.what());
+		char code = '0';
+		write(fd, &code, sizeof code);
+	}
+	current_mission.is_read_awaiting = false;
+	current_mission.is_write_awaiting = false;
+	co_return;
+}
+
+co_handle receive_loop::handle_sft_part(int fd)
+{
+	data_info& current_mission = connections[fd];
+	string_view header(current_mission.requests);
+	header.remove_prefix(2);
+	std::shared_ptr<part_transfer> transfer;
+	uintmax_t off = 0, len = 0;
+	try {
+		string id(pop_field(header));
+		auto size = std::stoull(string(pop_field(header)));
+		off = std::stoull(string(pop_field(header)));
+		len = std::stoull(string(pop_field(header)));
+		if (header.back() == '\n') header.remove_suffix(1);
+		if (len == 0 || len > size || off > size - len || !is_safe_relative_path(header) || header.find('/') != string_view::npos)
+			throw std::invalid_argument("Invalid part.");
+		auto path = json_conf[f_FileReceived] + string(header);
+		if (auto ite = transfers.find(id); ite != transfers.end()) {
+			transfer = ite->second;
+			if (transfer->size != size || transfer->path != path) throw std::invalid_argument("Part of another file.");
+		}
+		else {
+			transfer = std::make_shared<part_transfer>();
+			transfer->path = path;
+			transfer->file = hidden_sibling(path, ".part");
+			transfer->file.open_random_access(RDWR);
+			transfer->file.truncate(size);
+			transfer->file.allocate(size);
+			transfer->size = size;
+			transfers[id] = transfer;
+			LOG_INFO("Receiving file in parts from:", current_mission.get_ip_port_s(), ' ', string(header), '/', to_string(size));
+		}
+		transfer->last_active = sc::system_clock::now();
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent invalid part request: ", current_mission.requests);
+		close_connection(fd);
+		co_return;
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+		close_connection(fd);
+		co_return;
+	}
+	current_mission.requests.clear();
+	char code = '1';
+	write(fd, &code, sizeof code);
+	try {
+		auto buffer = mfcslib::make_buffer<Byte>(std::min<uintmax_t>(len, PART_BUFFER_SIZE));
+		uintmax_t received = 0;
+		crc32c crc;
+		/* A part already in, e.g. sent again by a stream that timed out, is read and dropped. */
+		bool needed = !transfer->finished_parts.contains(off);
+		auto pacer = make_pacer(transfer->file.get_fd(), off);
+		while (received < len) {
+			auto ret = buffer.read(fd, 0, std::min<uintmax_t>(buffer.length(), len - received));
+			if (ret < 0) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret == 0) throw peer_exception("Connection closed in the middle of a part.");
+			for (ssize_t written = 0; needed && written < ret;) {
+				written += transfer->file.pwrite(buffer, written, ret - written, off + received + written);
+			}
+			crc.update(buffer.get_ptr(), ret);
+			received += ret;
+			if (needed) pacer.advance(off + received);
+		}
+		uint32_t expected = 0;
+		for (size_t got = 0; got < sizeof expected;) {
+			auto ret = read(fd, reinterpret_cast<char*>(&expected) + got, sizeof expected - got);
+			if (ret < 0 && errno == EAGAIN) {
+				current_mission.is_read_awaiting = true;
+				co_yield 1;
+				continue;
+			}
+			if (ret <= 0) throw peer_exception("Connection closed before the checksum of a part.");
+			got += ret;
+		}
+		transfer->last_active = sc::system_clock::now();
+		if (expected != crc.value()) {
+			LOG_ERROR("Client:", current_mission.get_ip_port_s(), " sent a part failing its checksum at ", to_string(off));
+			code = '0';
+			write(fd, &code, sizeof code);
+			current_mission.is_read_awaiting = false;
+			co_return;
+		}
+		bool last = false;
+		if (needed && transfer->finished_parts.insert(off).second) {
+			transfer->received += len;
+			last = transfer->received >= transfer->size;
+		}
+		if (last) {
+			/* Every part was checked on its own, the checksum of the whole is kept for later transfers. */
+			auto finish = run_on_pool([transfer] {
+				store_checksum(transfer->file.get_fd(), crc32c_of_file(transfer->file.get_fd(), transfer->size));
+				return rename(hidden_sibling(transfer->path, ".part").c_str(), transfer->path.c_str()) == 0;
+			});
+			while (!finish->done.load(std::memory_order_acquire)) {
+				wait_for_pool(fd);
+				co_yield 1;
+			}
+			std::erase_if(transfers, [&transfer](const auto& item) { return item.second == transfer; });
+			if (finish->get()) {
+				LOG_INFO("Success on receiving file: ", transfer->path, '/', to_string(transfer->size));
+			}
+			else {
+				LOG_ERROR("Failed to move the received file into place: ", transfer->path);
+				unlink(hidden_sibling(transfer->path, ".part").c_str());
+				code = '0';
+			}
+		}
+		write(fd, &code, sizeof code);
+	}
+	catch (const mfcslib::basic_exception& e) {
+		LOG_ERROR("Client:", current_mission.get_ip_port_s(), ' ', e.what());
+		LOG_CLOSE(current_mission.get_ip_port_s());
+		close_connection(fd);
+	}
+	current_mission.is_read_awaiting = false;
+	co_return;
+}
+
+/* Closes the socket, the only place that does; the entry stays until it is erased or the number is reused. */
+void receive_loop::close_connection(int fd)
+{
+	epoll_instance.remove_fd_from_epoll(fd);
+	clock.erase_value(fd);
+	if (auto ite = connections.find(fd); ite != connections.end()) ite->second.forget_fd();
 }
 
 void receive_loop::alarm_handler(int sig)
@@ -496,6 +3089,50 @@ co_handle receive_loop::handle_http(int fd)
 			else
 				target_http += json_conf[f_DefaultPage];
 			LOG_INFO("Client ", current_mission.get_ip_port_s(), " requests HTTP for: ", target_http);
+			/* A miss goes to the upstream server by name, sent whole as it comes in. */
+			if (cache.enabled() && !request_path.empty() && access(target_http.c_str(), F_OK) != 0) {
+				auto name = decode_url(request_path);
+				while (name.starts_with('/')) name.erase(0, 1);
+				if (!name.empty() && is_safe_relative_path(name) && name.find('/') == string::npos) {
+					if (auto cached = cache.lookup(name); cached) target_http = *cached;
+					else {
+						auto fetch = cache.fetch(name);
+						LOG_INFO("Fetch from upstream for HTTP: ", name);
+						while (fetch->state == cache_fetch::CONNECTING) {
+							wait_for_cache(fd);
+							co_yield 1;
+						}
+						if (fetch->state == cache_fetch::FAILED) throw file_exception("Upstream does not have it.");
+						response.add_status_code(200);
+						response.add_date();
+						response.add_content_length(fetch->size);
+						response.add_server_info();
+						response.add_content_type(mfcslib::File(name).get_type());
+						response.add_connection_type(false);
+						response.add_blank_line();
+						current_mission.write(response.data());
+						cache_reader reader(fetch);
+						for (auto status = reader.send(fd); status != cache_reader::SENT; status = reader.send(fd)) {
+							if (status == cache_reader::BROKEN) {
+								LOG_ERROR("Client:", current_mission.get_ip_port_s(), " lost the fetch from upstream for: ", name);
+								close_connection(fd);
+								co_return;
+							}
+							if (status == cache_reader::SOCKET_FULL) current_mission.is_write_awaiting = true;
+							else wait_for_cache(fd);
+							co_yield 1;
+							current_mission.is_write_awaiting = false;
+						}
+						LOG_INFO("Finish sending: " + name);
+						if (parse_result[hd_connection] == "close") {
+							close_connection(fd);
+							LOG_CLOSE(current_mission.get_ip_port_s());
+							co_return;
+						}
+						goto next_round;
+					}
+				}
+			}
 			loff_t off = 0;
 			mfcslib::File send_page = target_http;
 			send_page.open_read_only();
@@ -552,20 +3189,25 @@ co_handle receive_loop::handle_http(int fd)
 				}
 			}
 			current_mission.write(response.data());
-			ssize_t ret = 0;
-			do {
-				ret = sendfile64(current_mission.get_fd(), send_page.get_fd(), &off, sz);
+			auto end = off + sz;
+			readahead_stream ahead(readahead_pool, send_page.get_fd(), off, end, json_num[f_DropSentPages] != 0);
+			mfcslib::send_engine engine(engine_options);
+			while (off < (loff_t)end) {
+				ahead.advance(off);
+				auto ret = engine.send(current_mission.get_fd(), send_page.get_fd(), &off, end - off);
 				if (ret == -1) {
 					if (errno != EAGAIN) {
 						string err = "Error in sendfile: ";
 						err += GETERR;
 						LOG_ERROR("Client:", current_mission.get_ip_port_s(), " has error: ", err);
 						close_connection(fd);
+						co_return;
 					}
 					current_mission.is_write_awaiting = true;
 					co_yield 1;
 				}
-			} while (off != (loff_t)file_size);
+				else if (ret == 0) break;
+			}
 			LOG_INFO("Finish sending: " + send_page.filename());
 			if (parse_result[hd_connection] == "close") {
 				close_connection(fd);
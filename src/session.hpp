@@ -0,0 +1,244 @@
+#ifndef SESSION_HPP
+#define SESSION_HPP
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include "../include/checksum.hpp"
+#include "../include/io.hpp"
+#include "resume.hpp"
+
+/*
+ * Client side of an sft session: one warm connection that carries any
+ * number of requests. Requests are written by the calling thread without
+ * waiting for earlier replies, and a reader thread settles their futures
+ * as the replies come back in order.
+ *
+ *     session s("192.168.100.5", 9007);
+ *     auto sent = s.put("./a.txt");
+ *     auto got = s.get("b.txt", "./b.txt");
+ *     if (sent.get() && got.get()) ...
+ */
+class session
+{
+public:
+	session(const std::string& ip, uint16_t port) :_socket(ip, port) {
+		int flag = 1;
+		setsockopt(_socket.get_fd(), IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+		setsockopt(_socket.get_fd(), SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof flag);
+		_send("s/\n");
+		if (_socket.read() != '1') throw mfcslib::peer_exception("Server refused the session.");
+		_reader = std::thread(&session::_read_replies, this);
+	}
+	session(const session&) = delete;
+	~session() {
+		{
+			std::lock_guard<std::mutex> lock(_queue_mutex);
+			_closing = true;
+			_changed.notify_all();
+		}
+		_reader.join();
+	}
+
+	/* Upload a local file under its own name, or under name, a path in FileReceived. */
+	std::future<bool> put(const std::string& path, const std::string& name = {}) {
+		if (name.find('\n') != std::string::npos) throw std::invalid_argument("Line breaks are not allowed in a request.");
+		mfcslib::File file(path);
+		file.open_read_only();
+		auto size = file.size();
+		auto checksum = std::async(std::launch::async, mfcslib::file_checksum, file.get_fd(), size);
+		std::lock_guard<std::mutex> lock(_write_mutex);
+		auto result = _enqueue('f', {});
+		try {
+			_send(std::to_string(_next_id - 1) + "/f/" + (name.empty() ? file.filename() : name) + '/' + std::to_string(size) + '\n');
+			off_t off = 0;
+			while (uintmax_t(off) < size) {
+				auto ret = sendfile(_socket.get_fd(), file.get_fd(), &off, size - off);
+				if (ret <= 0) throw mfcslib::socket_exception(ret < 0 ? strerror(errno) : "File shrank while sending.");
+			}
+			auto crc = checksum.get();
+			_send(std::string_view(reinterpret_cast<const char*>(&crc), sizeof crc));
+		}
+		catch (const mfcslib::basic_exception& e) {
+			_fail_all();
+			throw;
+		}
+		return result;
+	}
+	/* Download name from the server into local_path, or into its own name in the working directory. */
+	std::future<bool> get(const std::string& name, const std::string& local_path = {}) {
+		return _request('g', name, local_path.empty() ? name.substr(name.find_last_of('/') + 1) : local_path);
+	}
+	std::future<bool> message(const std::string& text) {
+		return _request('m', text, {});
+	}
+	/* A no-op round trip, e.g. to keep the connection from timing out. */
+	std::future<bool> ping() {
+		return _request('n', {}, {});
+	}
+	/* Whether name in FileReceived has this size and checksum already. */
+	std::future<bool> have(const std::string& name, uintmax_t size, uint32_t crc) {
+		return _request('h', std::to_string(size) + '/' + std::to_string(crc) + '/' + name, {});
+	}
+	std::future<bool> make_directory(const std::string& name) {
+		return _request('d', name, {});
+	}
+	std::future<bool> rename(const std::string& from, const std::string& to) {
+		return _request('r', std::to_string(from.size()) + '/' + from + '/' + to, {});
+	}
+	/* A file or a directory with all below it. */
+	std::future<bool> remove(const std::string& name) {
+		return _request('x', name, {});
+	}
+	/* True once the connection failed, every request after that fails too. */
+	bool broken() {
+		std::lock_guard<std::mutex> lock(_queue_mutex);
+		return _broken;
+	}
+
+private:
+	struct pending_request
+	{
+		uint64_t id;
+		char op;
+		std::string local_path;
+		std::promise<bool> done;
+	};
+	mfcslib::NetworkSocket _socket;
+	std::mutex _write_mutex;
+	std::mutex _queue_mutex;
+	std::condition_variable _changed;
+	std::deque<pending_request> _queue;
+	std::thread _reader;
+	uint64_t _next_id = 0;
+	bool _closing = false;
+	bool _broken = false;
+
+	void _send(std::string_view data) {
+		while (!data.empty()) {
+			auto ret = _socket.write(data);
+			if (ret <= 0) throw mfcslib::socket_exception(ret < 0 ? strerror(errno) : "Connection closed.");
+			data.remove_prefix(ret);
+		}
+	}
+	std::future<bool> _enqueue(char op, std::string local_path) {
+		std::lock_guard<std::mutex> lock(_queue_mutex);
+		if (_broken) throw mfcslib::socket_exception("Session connection is broken.");
+		_queue.push_back({ _next_id++, op, std::move(local_path), {} });
+		_changed.notify_all();
+		return _queue.back().done.get_future();
+	}
+	std::future<bool> _request(char op, const std::string& argument, std::string local_path) {
+		if (argument.find('\n') != std::string::npos) throw std::invalid_argument("Line breaks are not allowed in a request.");
+		std::lock_guard<std::mutex> lock(_write_mutex);
+		auto result = _enqueue(op, std::move(local_path));
+		try {
+			std::string line = std::to_string(_next_id - 1) + '/' + op;
+			if (!argument.empty()) line += '/' + argument;
+			_send(line + '\n');
+		}
+		catch (const mfcslib::basic_exception& e) {
+			_fail_all();
+			throw;
+		}
+		return result;
+	}
+	void _fail_all() {
+		std::lock_guard<std::mutex> lock(_queue_mutex);
+		_broken = true;
+		/* The reader may be waiting for a reply that will not come now. */
+		::shutdown(_socket.get_fd(), SHUT_RDWR);
+		_changed.notify_all();
+	}
+
+	std::string _read_until_nul() {
+		std::string reply;
+		for (char ch = 0; ; reply += ch) {
+			if (_socket.read(&ch, 1) <= 0) throw mfcslib::peer_exception("Connection closed while reading reply.");
+			if (ch == '\0') break;
+		}
+		return reply;
+	}
+	void _read_exact(char* data, size_t len) {
+		while (len > 0) {
+			auto ret = _socket.read(data, len);
+			if (ret <= 0) throw mfcslib::peer_exception("Connection closed in the middle of a reply.");
+			data += ret;
+			len -= ret;
+		}
+	}
+	/* Receive the data of a get into its file and check it against the trailing checksum. */
+	bool _receive_file(const std::string& path, uintmax_t size) {
+		mfcslib::File output(path);
+		try {
+			output.open(true, mfcslib::WRONLY);
+		}
+		catch (const mfcslib::file_exception& e) {
+			std::cerr << "\nFail to open " << path << ": " << e.what() << '\n';
+		}
+		auto buffer = mfcslib::make_buffer<Byte>(RECEIVE_BUFFER_SIZE);
+		mfcslib::crc32c crc;
+		/* The data is read even when it can not be kept, so the session stays in step. */
+		for (uintmax_t received = 0; received < size;) {
+			auto ret = _socket.read(buffer, 0, std::min<uintmax_t>(buffer.length(), size - received));
+			if (ret <= 0) throw mfcslib::peer_exception("Connection closed in the middle of a file.");
+			for (ssize_t written = 0; output.available() && written < ret;) {
+				written += output.write(buffer, written, ret - written);
+			}
+			crc.update(buffer.get_ptr(), ret);
+			received += ret;
+		}
+		uint32_t expected = 0;
+		_read_exact(reinterpret_cast<char*>(&expected), sizeof expected);
+		if (!output.available()) return false;
+		if (expected != crc.value()) {
+			unlink(path.c_str());
+			return false;
+		}
+		mfcslib::store_checksum(output.get_fd(), expected);
+		return true;
+	}
+	void _read_replies() {
+		while (true) {
+			pending_request* front = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(_queue_mutex);
+				_changed.wait(lock, [this]() { return !_queue.empty() || _closing || _broken; });
+				if (_queue.empty() || _broken) break;
+				front = &_queue.front();
+			}
+			try {
+				auto reply = _read_until_nul();
+				std::string_view fields(reply);
+				auto id = mfcslib::pop_field(fields);
+				if (id != std::to_string(front->id)) throw mfcslib::peer_exception("Reply does not match its request.");
+				bool success = mfcslib::pop_field(fields) == "1";
+				if (success && front->op == 'g') {
+					success = _receive_file(front->local_path, std::stoull(std::string(fields)));
+				}
+				front->done.set_value(success);
+			}
+			catch (const mfcslib::basic_exception& e) {
+				std::cerr << "\nSession failed: " << e.what() << '\n';
+				_fail_all();
+				break;
+			}
+			catch (const std::exception& e) {
+				std::cerr << "\nSession failed: " << e.what() << '\n';
+				_fail_all();
+				break;
+			}
+			std::lock_guard<std::mutex> lock(_queue_mutex);
+			_queue.pop_front();
+		}
+		/* Whatever is still outstanding will never be answered. */
+		std::lock_guard<std::mutex> lock(_queue_mutex);
+		for (auto& request : _queue) request.done.set_value(false);
+		_queue.clear();
+	}
+};
+#endif // !SESSION_HPP
@@ -0,0 +1,314 @@
+#ifndef SWARM_HPP
+#define SWARM_HPP
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "../include/checksum.hpp"
+#include "../include/io.hpp"
+#define SWARM_PIECE 4'194'304
+#define SWARM_REFRESH 200ms
+#define SWARM_STALL 30s
+#define SWARM_TIMEOUT 30
+
+using namespace std::chrono_literals;
+
+/* Hex digits of a piece map, four pieces to a digit with the first in the lowest bit. */
+inline std::string swarm_bitmap(const std::vector<bool>& have) {
+	std::string hex((have.size() + 3) / 4, '0');
+	for (size_t i = 0; i < have.size(); ++i) {
+		if (!have[i]) continue;
+		auto& digit = hex[i / 4];
+		auto value = (digit <= '9' ? digit - '0' : digit - 'a' + 10) | (1 << (i % 4));
+		digit = "0123456789abcdef"[value];
+	}
+	return hex;
+}
+inline std::optional<std::vector<bool>> parse_swarm_bitmap(std::string_view hex, uint64_t pieces) {
+	if (hex.size() != (pieces + 3) / 4) return std::nullopt;
+	std::vector<bool> have(pieces);
+	for (uint64_t i = 0; i < pieces; ++i) {
+		auto digit = hex[i / 4];
+		int value = digit >= '0' && digit <= '9' ? digit - '0' : digit >= 'a' && digit <= 'f' ? digit - 'a' + 10 : -1;
+		if (value < 0) return std::nullopt;
+		have[i] = value >> (i % 4) & 1;
+	}
+	return have;
+}
+
+/* A file this server is fetching from a swarm, shared by the loop that serves its pieces and the thread that fetches them. */
+class swarm_file
+{
+public:
+	swarm_file(std::string path, uint64_t size) :
+		path(std::move(path)), size(size), _have((size + SWARM_PIECE - 1) / SWARM_PIECE) {}
+	swarm_file(const swarm_file&) = delete;
+	~swarm_file() = default;
+
+	const std::string path;
+	const uint64_t size;
+
+	uint64_t pieces() const {
+		return _have.size();
+	}
+	bool has(uint64_t index) const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return index < _have.size() && _have[index];
+	}
+	void mark(uint64_t index) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_have[index]) ++_count;
+		_have[index] = true;
+	}
+	bool complete() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _count == _have.size();
+	}
+	std::vector<bool> have() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _have;
+	}
+
+private:
+	mutable std::mutex _mutex;
+	std::vector<bool> _have;
+	uint64_t _count = 0;
+};
+
+/* Files being fetched by name. A name is taken before its size is known, it has no file then. */
+class swarm_registry
+{
+public:
+	bool reserve(const std::string& name) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _files.try_emplace(name).second;
+	}
+	void attach(const std::string& name, std::shared_ptr<swarm_file> file) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_files[name] = std::move(file);
+	}
+	void release(const std::string& name) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_files.erase(name);
+	}
+	/* Whether name is being fetched, and its file when that has started. */
+	bool find(const std::string& name, std::shared_ptr<swarm_file>& file) const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto ite = _files.find(name);
+		if (ite == _files.end()) return false;
+		file = ite->second;
+		return true;
+	}
+
+private:
+	mutable std::mutex _mutex;
+	std::unordered_map<std::string, std::shared_ptr<swarm_file>> _files;
+};
+
+/*
+ * Fetches a file from the other servers of a swarm. Each peer gets a thread
+ * and a connection of its own, over which it is asked every SWARM_REFRESH for
+ * the pieces it holds with "a/<name>" and sent for pieces with
+ * "b/<index>/<name>". A thread takes the rarest piece among the peers still
+ * up that its own peer holds and nobody is fetching yet, so pieces held by
+ * one seed spread before the common ones. Each piece is checked with the
+ * CRC32C its sender appends, and can be served from here as soon as it is
+ * written. A peer that fails is dropped and the rest carry on; the fetch
+ * gives up when no piece arrives for SWARM_STALL.
+ */
+class swarm_fetcher
+{
+public:
+	swarm_fetcher(std::string name, std::vector<std::pair<std::string, uint16_t>> peers, std::shared_ptr<swarm_file> file, int file_fd) :
+		_name(std::move(name)), _file(std::move(file)), _file_fd(file_fd), _in_flight(_file->pieces()), _random(std::random_device{}()) {
+		for (auto& [ip, port] : peers) _peers.push_back({ ip, port, {}, true });
+	}
+	swarm_fetcher(const swarm_fetcher&) = delete;
+	~swarm_fetcher() = default;
+
+	/* Size and piece map of name on a peer, nullopt when it has none of it. */
+	static std::optional<std::pair<uint64_t, std::vector<bool>>> advert(mfcslib::NetworkSocket& peer, const std::string& name) {
+		_write_all(peer, "a/" + name);
+		auto reply = _read_reply(peer);
+		if (!reply.starts_with('/')) return std::nullopt;
+		std::string_view fields(reply);
+		fields.remove_prefix(1);
+		auto size = std::stoull(std::string(mfcslib::pop_field(fields)));
+		if (std::stoull(std::string(mfcslib::pop_field(fields))) != SWARM_PIECE) return std::nullopt;
+		auto have = parse_swarm_bitmap(fields, (size + SWARM_PIECE - 1) / SWARM_PIECE);
+		if (!have) return std::nullopt;
+		return std::pair{ size, std::move(*have) };
+	}
+	/* Size of name on the first peer that holds any of it. */
+	static std::optional<uint64_t> probe(const std::vector<std::pair<std::string, uint16_t>>& peers, const std::string& name) {
+		for (auto& [ip, port] : peers) {
+			try {
+				mfcslib::NetworkSocket peer(ip, port);
+				_set_timeouts(peer.get_fd());
+				if (auto found = advert(peer, name); found) return found->first;
+			}
+			catch (const mfcslib::basic_exception& e) {}
+			catch (const std::exception& e) {}
+		}
+		return std::nullopt;
+	}
+
+	/* True once every piece is here. */
+	bool run() {
+		if (_file->complete()) return true;
+		_last_progress = std::chrono::steady_clock::now();
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < _peers.size(); ++i) workers.emplace_back(&swarm_fetcher::_work, this, i);
+		for (auto& worker : workers) worker.join();
+		return _file->complete();
+	}
+
+private:
+	struct peer
+	{
+		std::string ip;
+		uint16_t port;
+		std::vector<bool> have;
+		bool up;
+	};
+	std::string _name;
+	std::shared_ptr<swarm_file> _file;
+	int _file_fd;
+	std::vector<peer> _peers;
+	std::vector<bool> _in_flight;
+	std::mutex _mutex;
+	std::mt19937 _random;
+	std::chrono::steady_clock::time_point _last_progress;
+
+	static void _set_timeouts(int fd) {
+		timeval timeout{ SWARM_TIMEOUT, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+	}
+	static void _write_all(mfcslib::NetworkSocket& peer, std::string_view data) {
+		while (!data.empty()) {
+			auto ret = ::send(peer.get_fd(), data.data(), data.size(), MSG_NOSIGNAL);
+			if (ret <= 0) throw mfcslib::socket_exception(ret < 0 ? strerror(errno) : "Connection closed.");
+			data.remove_prefix(ret);
+		}
+	}
+	static void _read_exact(mfcslib::NetworkSocket& peer, char* data, size_t len) {
+		while (len > 0) {
+			auto ret = ::read(peer.get_fd(), data, len);
+			if (ret <= 0) throw mfcslib::peer_exception("Peer closed in the middle of a reply.");
+			data += ret;
+			len -= ret;
+		}
+	}
+	/* "/<fields>" up to '\0', or a lone '0'. */
+	static std::string _read_reply(mfcslib::NetworkSocket& peer) {
+		std::string reply;
+		for (char ch = 0; reply != "0";) {
+			_read_exact(peer, &ch, 1);
+			if (ch == '\0') break;
+			reply += ch;
+		}
+		return reply;
+	}
+
+	void _work(size_t index) {
+		auto& self = _peers[index];
+		try {
+			mfcslib::NetworkSocket peer(self.ip, self.port);
+			_set_timeouts(peer.get_fd());
+			auto buffer = mfcslib::make_buffer<char>(SWARM_PIECE);
+			while (!_file->complete()) {
+				auto found = advert(peer, _name);
+				std::optional<uint64_t> piece;
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					if (std::chrono::steady_clock::now() - _last_progress > SWARM_STALL) break;
+					if (found && found->first == _file->size) self.have = std::move(found->second);
+					piece = _pick(index);
+				}
+				if (!piece) {
+					std::this_thread::sleep_for(SWARM_REFRESH);
+					continue;
+				}
+				/* Keep asking this peer while it has pieces to give. */
+				for (; piece; piece = _pick_locked(index)) {
+					bool ok = false;
+					try {
+						ok = _fetch(peer, *piece, buffer.get_ptr());
+					}
+					catch (...) {
+						std::lock_guard<std::mutex> lock(_mutex);
+						_in_flight[*piece] = false;
+						throw;
+					}
+					std::lock_guard<std::mutex> lock(_mutex);
+					_in_flight[*piece] = false;
+					if (!ok) {
+						/* The peer no longer serves it, its map is stale. */
+						self.have[*piece] = false;
+						break;
+					}
+					_file->mark(*piece);
+					_last_progress = std::chrono::steady_clock::now();
+				}
+			}
+		}
+		catch (const mfcslib::basic_exception& e) {}
+		catch (const std::exception& e) {}
+		std::lock_guard<std::mutex> lock(_mutex);
+		self.up = false;
+	}
+	std::optional<uint64_t> _pick_locked(size_t index) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _pick(index);
+	}
+	/* The rarest piece peer index can give, ties broken at random so threads spread out. Holds _mutex. */
+	std::optional<uint64_t> _pick(size_t index) {
+		auto& have = _peers[index].have;
+		auto held = _file->have();
+		std::optional<uint64_t> best;
+		size_t best_count = SIZE_MAX, ties = 0;
+		for (uint64_t piece = 0; piece < have.size(); ++piece) {
+			if (!have[piece] || held[piece] || _in_flight[piece]) continue;
+			size_t count = 0;
+			for (auto& other : _peers) count += other.up && piece < other.have.size() && other.have[piece];
+			if (count < best_count) {
+				best_count = count;
+				best = piece;
+				ties = 1;
+			}
+			else if (count == best_count && _random() % ++ties == 0) best = piece;
+		}
+		if (best) _in_flight[*best] = true;
+		return best;
+	}
+	/* False when the peer answers that it does not have the piece. */
+	bool _fetch(mfcslib::NetworkSocket& peer, uint64_t piece, char* buffer) {
+		_write_all(peer, "b/" + std::to_string(piece) + '/' + _name);
+		auto reply = _read_reply(peer);
+		if (!reply.starts_with('/')) return false;
+		if (std::stoull(reply.substr(1)) != _file->size) throw mfcslib::peer_exception("Peer holds another file of that name.");
+		_write_all(peer, "1");
+		uint64_t offset = piece * SWARM_PIECE;
+		auto length = std::min<uint64_t>(SWARM_PIECE, _file->size - offset);
+		_read_exact(peer, buffer, length);
+		uint32_t expected = 0;
+		_read_exact(peer, reinterpret_cast<char*>(&expected), sizeof expected);
+		mfcslib::crc32c crc;
+		crc.update(buffer, length);
+		if (crc.value() != expected) throw mfcslib::peer_exception("Piece failed its checksum.");
+		for (uint64_t written = 0; written < length;) {
+			auto ret = ::pwrite(_file_fd, buffer + written, length - written, offset + written);
+			if (ret <= 0) throw mfcslib::file_exception(ret < 0 ? strerror(errno) : "Short write.");
+			written += ret;
+		}
+		return true;
+	}
+};
+#endif // !SWARM_HPP
@@ -73,7 +73,10 @@ public:
 		}
 	}
 	void shutdown_pool() {
-		m_shutdown = true;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_shutdown = true;
+		}
 		m_cv.notify_all();
 		for (auto& td : m_threads) {
 			if (td.joinable()) {
@@ -94,7 +97,11 @@ public:
 		/* This wrapper_func contains a lambda function
 		 * that captures a shared_ptrand execute after dereference it
 		 */
-		m_queue.push(wrapper_func);
+		{
+			/* Pushed under the workers' lock, so that none of them misses the notification. */
+			unique_lock<mutex> lock(m_mutex);
+			m_queue.push(wrapper_func);
+		}
 		m_cv.notify_one();
 		return task_ptr->get_future();
 	}
@@ -116,9 +123,7 @@ private:
 			while (!m_pool->m_shutdown) {
 				{
 					unique_lock<mutex> lock(m_pool->m_mutex);
-					if (m_pool->m_queue.is_empty()) {
-						m_pool->m_cv.wait(lock);
-					}
+					m_pool->m_cv.wait(lock, [this]() { return m_pool->m_shutdown || !m_pool->m_queue.is_empty(); });
 					already_poped = m_pool->m_queue.pop(tmp_func);
 				}
 				//free the lock in advance to avoid holding it
@@ -0,0 +1,478 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <cstdio>
+#include <thread>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include "../include/delta.hpp"
+#include "../include/direct_io.hpp"
+#include "../include/io.hpp"
+#include "../include/rudp.hpp"
+#include "../include/send_engine.hpp"
+#include "../src/merkle.hpp"
+#include "../src/message_log.hpp"
+#include "../src/message_stream.hpp"
+using std::cout;
+using std::string;
+namespace sc = std::chrono;
+constexpr size_t RECEIVE_CHUNK = 262'144;
+constexpr auto usage_content =
+	"Usage: ./bench [delta|hash|direct|engine|log|udp] [size_in_MiB]\n"
+	"       ./bench messages ip:port [message_bytes]   (against a running server)\n"
+	"       ./bench tree [thousands_of_files]\n";
+
+double seconds_of(const std::function<void()>& func) {
+	auto start = sc::steady_clock::now();
+	func();
+	return sc::duration<double>(sc::steady_clock::now() - start).count();
+}
+
+void write_all(int fd, const char* data, size_t len, off_t off) {
+	while (len > 0) {
+		auto ret = pwrite(fd, data, len, off);
+		if (ret <= 0) throw std::runtime_error("Fail to write bench file.");
+		data += ret;
+		len -= ret;
+		off += ret;
+	}
+}
+
+/* Old and new copy of a file that differ in 1% of their bytes. */
+void bench_delta(size_t size) {
+	std::mt19937_64 engine(20240414);
+	string data(size, '\0');
+	for (auto& ch : data) ch = char(engine());
+	mfcslib::File basis("./bench_basis"), source("./bench_source"), output("./bench_output");
+	basis.open(true, mfcslib::RDWR);
+	source.open(true, mfcslib::RDWR);
+	output.open_random_access(mfcslib::RDWR);
+	output.truncate(0);
+	write_all(basis.get_fd(), data.data(), size, 0);
+	/* Every 400 KiB on average one 4 KiB page is rewritten, a quarter of them are inserted instead. */
+	string modified;
+	modified.reserve(size + size / 100);
+	for (size_t pos = 0; pos < size;) {
+		size_t keep = std::min<size_t>(size - pos, engine() % 819'200);
+		modified.append(data, pos, keep);
+		pos += keep;
+		size_t run = std::min<size_t>(size - pos, 4096);
+		for (size_t i = 0; i < run; ++i) modified += char(engine());
+		if (engine() % 4 != 0) pos += run;
+	}
+	data = std::move(modified);
+	write_all(source.get_fd(), data.data(), data.size(), 0);
+	auto block = mfcslib::choose_block_size(size);
+	std::vector<mfcslib::block_signature> sigs;
+	auto t_sig = seconds_of([&]() {
+		sigs = mfcslib::compute_signatures(basis.get_fd(), size, block);
+	});
+	string stream;
+	uintmax_t matched = 0;
+	auto t_enc = seconds_of([&]() {
+		mfcslib::delta_encoder encoder(source.get_fd(), data.size(), block, size, sigs);
+		while (encoder.next(stream));
+		matched = encoder.matched();
+	});
+	bool verified = false;
+	auto t_dec = seconds_of([&]() {
+		mfcslib::delta_decoder decoder(basis.get_fd(), block, size, output.get_fd());
+		decoder.feed(stream.data(), stream.size());
+		verified = decoder.verified();
+	});
+	auto sig_bytes = sigs.size() * mfcslib::signature_length;
+	cout << "delta: " << data.size() / 1'048'576 << " MiB, block " << block << ", 1% changed\n";
+	cout << "  signatures " << t_sig << " s, " << sig_bytes << " bytes\n";
+	cout << "  encode     " << t_enc << " s, " << stream.size() << " bytes ("
+		<< 100.0 * stream.size() / data.size() << "% of file), " << matched << " bytes matched\n";
+	cout << "  decode     " << t_dec << " s, " << (verified ? "verified" : "MISMATCH") << '\n';
+	remove("./bench_basis");
+	remove("./bench_source");
+	remove("./bench_output");
+}
+
+/* Throughput of the checksum kernels over a buffer already in memory. */
+void bench_hash(size_t size) {
+	std::mt19937_64 engine(20240415);
+	string data(size, '\0');
+	for (auto& ch : data) ch = char(engine());
+	auto pt = reinterpret_cast<const uint8_t*>(data.data());
+	auto report = [size](const char* name, const std::function<uint64_t()>& kernel) {
+		uint64_t result = 0;
+		auto secs = seconds_of([&]() { result = kernel(); });
+		cout << "  " << name << ' ' << size / secs / 1'073'741'824 << " GiB/s (" << std::hex << result << std::dec << ")\n";
+	};
+	cout << "hash: " << size / 1'048'576 << " MiB\n";
+	report("crc32c table ", [&]() { return ~mfcslib::crc32c::update_software(~0u, pt, size); });
+#ifdef __SSE4_2__
+	report("crc32c sse4.2", [&]() { return ~mfcslib::crc32c::update_hardware(~0u, pt, size); });
+#endif // __SSE4_2__
+	report("xxh64        ", [&]() { return mfcslib::xxh64(pt, size); });
+	report("sha256       ", [&]() { return mfcslib::sha256::of(pt, size)[0]; });
+}
+
+/* Pages of the first size bytes of fd held in the page cache. */
+size_t resident_pages(int fd, size_t size) {
+	auto page = size_t(sysconf(_SC_PAGESIZE));
+	auto map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) return 0;
+	std::vector<unsigned char> vec((size + page - 1) / page);
+	size_t count = 0;
+	if (mincore(map, size, vec.data()) == 0) {
+		for (auto val : vec) count += val & 1;
+	}
+	munmap(map, size);
+	return count;
+}
+
+/* Receiving into the page cache against O_DIRECT, both synced to the disk at the end. */
+void bench_direct(size_t size) {
+	std::mt19937_64 engine(20240416);
+	string chunk(RECEIVE_CHUNK, '\0');
+	for (auto& ch : chunk) ch = char(engine());
+	/* An odd length so that the direct path has to deal with an unaligned tail. */
+	size += 1234;
+	auto page = size_t(sysconf(_SC_PAGESIZE));
+	cout << "direct: " << size / 1'048'576 << " MiB in " << RECEIVE_CHUNK / 1024 << " KiB reads\n";
+	{
+		mfcslib::File output("./bench_buffered");
+		output.open(true, mfcslib::RDWR);
+		auto secs = seconds_of([&]() {
+			for (size_t off = 0; off < size; off += chunk.size()) {
+				write_all(output.get_fd(), chunk.data(), std::min(chunk.size(), size - off), off);
+			}
+			fdatasync(output.get_fd());
+		});
+		cout << "  buffered " << size / secs / 1'073'741'824 << " GiB/s, "
+			<< resident_pages(output.get_fd(), size) * page / 1'048'576 << " MiB left in page cache\n";
+	}
+	{
+		mfcslib::File output("./bench_direct");
+		output.open(true, mfcslib::RDWR);
+		auto secs = seconds_of([&]() {
+			mfcslib::direct_writer writer("./bench_direct", 0);
+			for (size_t off = 0; off < size;) {
+				auto len = std::min({ chunk.size(), size - off, writer.space_left() });
+				memcpy(writer.space(), chunk.data(), len);
+				writer.commit(len);
+				off += len;
+			}
+			writer.finish();
+			fdatasync(output.get_fd());
+		});
+		cout << "  direct   " << size / secs / 1'073'741'824 << " GiB/s, "
+			<< resident_pages(output.get_fd(), size) * page / 1'048'576 << " MiB left in page cache, size "
+			<< (output.size() == size ? "ok" : "WRONG") << '\n';
+	}
+	remove("./bench_buffered");
+	remove("./bench_direct");
+}
+
+/* A connected pair of loopback TCP sockets. */
+std::pair<int, int> loopback_pair() {
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof addr;
+	if (bind(listener, (sockaddr*)&addr, len) < 0 || listen(listener, 1) < 0 || getsockname(listener, (sockaddr*)&addr, &len) < 0)
+		throw std::runtime_error("Fail to listen on loopback.");
+	int sender = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sender, (sockaddr*)&addr, len) < 0) throw std::runtime_error("Fail to connect on loopback.");
+	int receiver = accept(listener, nullptr, nullptr);
+	close(listener);
+	return { sender, receiver };
+}
+
+/* Every send engine and chunk size over loopback for a few file sizes, from the page cache. */
+void bench_engine(size_t size) {
+	std::mt19937_64 engine(20240417);
+	string chunk(1'048'576, '\0');
+	for (auto& ch : chunk) ch = char(engine());
+	mfcslib::File source("./bench_engine");
+	source.open(true, mfcslib::RDWR);
+	for (size_t off = 0; off < size; off += chunk.size()) {
+		write_all(source.get_fd(), chunk.data(), std::min(chunk.size(), size - off), off);
+	}
+	cout << "engine: GiB/s over loopback, file in page cache\n";
+	cout << "  file\tchunk\t";
+	for (auto name : mfcslib::send_method_names) cout << std::string(name) + string(11 - name.size(), ' ');
+	cout << '\n';
+	for (size_t file_size : { size_t(1'048'576), size / 16, size }) {
+		if (file_size == 0) continue;
+		for (size_t chunk_size : { 65'536, 262'144, 1'048'576, 4'194'304 }) {
+			cout << "  " << file_size / 1'048'576 << " MiB\t" << chunk_size / 1024 << " KiB\t";
+			for (size_t i = 0; i < std::size(mfcslib::send_method_names); ++i) {
+				auto [sender, receiver] = loopback_pair();
+				std::thread sink([receiver = receiver]() {
+					string buf(1'048'576, '\0');
+					while (read(receiver, buf.data(), buf.size()) > 0);
+				});
+				/* Small files are sent repeatedly so that every run moves at least as much as the largest. */
+				size_t rounds = std::max<size_t>(1, size / file_size);
+				auto secs = seconds_of([&, sender = sender]() {
+					for (size_t round = 0; round < rounds; ++round) {
+						mfcslib::send_engine sending({ mfcslib::send_method(i), chunk_size });
+						off_t off = 0;
+						while (size_t(off) < file_size) {
+							if (sending.send(sender, source.get_fd(), &off, file_size - off) <= 0)
+								throw std::runtime_error("Send engine failed.");
+						}
+					}
+				});
+				shutdown(sender, SHUT_WR);
+				sink.join();
+				close(sender);
+				close(receiver);
+				printf("%-11.2f", double(file_size) * rounds / secs / 1'073'741'824);
+			}
+			cout << std::endl;
+		}
+	}
+	remove("./bench_engine");
+}
+
+/*
+ * The message log on its own: 100-byte messages appended in batches of 1000
+ * with a group commit requested after each batch, then read back through
+ * the index from the start and from the middle.
+ */
+void bench_log(size_t size) {
+	const string dir = "./bench_log/";
+	mkdir(dir.c_str(), S_IRWXU);
+	string message(100, 'm');
+	size_t batch = 1000, count = size / (message.size() + sizeof(message_record_header)) / batch * batch;
+	string frames;
+	for (size_t i = 0; i < batch; ++i) {
+		uint32_t len = message.size();
+		frames.append(reinterpret_cast<const char*>(&len), sizeof len);
+		frames.append(message);
+	}
+	size_t syncs = 0;
+	{
+		message_log log;
+		log.open(dir);
+		auto drain = [&](int timeout) {
+			pollfd wait{ log.event_fd(), POLLIN, 0 };
+			if (poll(&wait, 1, timeout) > 0) {
+				log.drain();
+				++syncs;
+			}
+		};
+		auto secs = seconds_of([&]() {
+			for (size_t i = 0; i < count; i += batch) {
+				log.append(frames, batch);
+				log.request_sync();
+				drain(0);
+			}
+			while (log.synced() < log.end()) {
+				log.request_sync();
+				drain(-1);
+			}
+		});
+		printf("log: append and sync\t%10.0f msg/s  %.1f MiB/s  %zu syncs\n", count / secs, count * message.size() / secs / 1'048'576, syncs);
+	}
+	message_reader reader(dir);
+	for (uint64_t from : { uint64_t(0), uint64_t(count / 2) }) {
+		size_t got = 0;
+		bool intact = true;
+		auto secs = seconds_of([&]() {
+			for (uint64_t next = from; ; ) {
+				auto ret = reader.read(next, 100'000, [&](uint64_t offset, std::string_view data) {
+					intact = intact && offset == next && data == message;
+					++next;
+				});
+				if (ret == 0) break;
+				got += ret;
+			}
+		});
+		printf("log: read from %-8lu\t%10.0f msg/s  %s\n", (unsigned long)from, got / secs, intact && got == count - from ? "ok" : "WRONG");
+	}
+	for (auto& path : mfcslib::list_all_files_in_directory(dir.c_str())) remove(path.c_str());
+	rmdir(dir.c_str());
+}
+
+/*
+ * The UDP transport over loopback with packets dropped on purpose at both
+ * ends. Loopback has no real loss and hardly any delay, so this shows the
+ * cost of recovery; a lossy long link is where TCP falls behind.
+ */
+void bench_udp(size_t size) {
+	std::mt19937_64 engine(20240417);
+	string chunk(1'048'576, '\0');
+	for (auto& ch : chunk) ch = char(engine());
+	mfcslib::File source("./bench_udp_source"), target("./bench_udp_target");
+	source.open(true, mfcslib::RDWR);
+	target.open(true, mfcslib::RDWR);
+	for (size_t off = 0; off < size; off += chunk.size()) {
+		write_all(source.get_fd(), chunk.data(), std::min(chunk.size(), size - off), off);
+	}
+	/* Written back now rather than during the first run. */
+	fdatasync(source.get_fd());
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	cout << "udp: MiB/s over loopback\n";
+	for (double loss : { 0.0, 0.01, 0.05 }) {
+		target.truncate(0);
+		int receiving = mfcslib::rudp_socket(addr), sending = mfcslib::rudp_socket(addr);
+		auto peer = addr;
+		peer.sin_port = htons(mfcslib::rudp_port(receiving));
+		connect(sending, (sockaddr*)&peer, sizeof peer);
+		bool received = false, sent = false;
+		std::thread receiver([&]() {
+			received = mfcslib::rudp_receiver(receiving, 1, false, target.get_fd(), size, { loss }).run();
+		});
+		mfcslib::rudp_sender sender(sending, 1, true, source.get_fd(), size, { loss });
+		auto secs = seconds_of([&]() { sent = sender.run(); });
+		receiver.join();
+		close(receiving);
+		close(sending);
+		auto& stats = sender.stats();
+		printf("  loss %4.1f%%\t%8.1f  %lu of %lu packets resent  %s\n", loss * 100, size / secs / 1'048'576,
+			(unsigned long)stats.retransmits, (unsigned long)stats.packets, sent && received ? "ok" : "FAILED");
+	}
+	auto [sender, receiver] = loopback_pair();
+	std::thread sink([receiver = receiver]() {
+		string buf(1'048'576, '\0');
+		while (read(receiver, buf.data(), buf.size()) > 0);
+	});
+	auto secs = seconds_of([&, sender = sender]() {
+		off_t off = 0;
+		while (size_t(off) < size) {
+			if (sendfile(sender, source.get_fd(), &off, size - off) <= 0) throw std::runtime_error("sendfile failed.");
+		}
+	});
+	shutdown(sender, SHUT_WR);
+	sink.join();
+	close(sender);
+	close(receiver);
+	printf("  tcp, no loss\t%8.1f\n", size / secs / 1'048'576);
+	remove("./bench_udp_source");
+	remove("./bench_udp_target");
+}
+
+/*
+ * Message rate against a running server: a message per connection with m/,
+ * an unpaced stream for throughput, and a stream paced at 50k messages a
+ * second for the latency from send to ack.
+ */
+void bench_messages(const string& ip, uint16_t port, size_t message_size) {
+	string message(message_size, 'x');
+	cout << "messages: " << message_size << " bytes each\n";
+	{
+		size_t count = 2000;
+		auto secs = seconds_of([&]() {
+			for (size_t i = 0; i < count; ++i) {
+				mfcslib::NetworkSocket server(ip, port);
+				server.write("m/" + message);
+				if (server.read() != '1') throw std::runtime_error("Message was not acknowledged.");
+			}
+		});
+		printf("  connection per message\t%10.0f msg/s\n", count / secs);
+	}
+	{
+		size_t count = 2'000'000;
+		uint64_t stored = 0;
+		auto secs = seconds_of([&]() {
+			message_stream stream(ip, port);
+			for (size_t i = 0; i < count; ++i) stream.send(message);
+			stream.close();
+			stored = stream.acked();
+		});
+		printf("  stream, unpaced\t%10.0f msg/s  %.1f MiB/s  %s\n", count / secs,
+			count * (message_size + 4) / secs / 1'048'576, stored == count ? "ok" : "LOST");
+	}
+	{
+		constexpr size_t rate = 50'000, per_tick = 50, seconds = 3;
+		size_t count = rate * seconds;
+		std::vector<std::atomic<int64_t>> sent_at(count + 1);
+		std::vector<int64_t> latency;
+		latency.reserve(count);
+		uint64_t seen = 0;
+		auto now_ns = []() { return sc::duration_cast<sc::nanoseconds>(sc::steady_clock::now().time_since_epoch()).count(); };
+		message_stream stream(ip, port, [&](uint64_t acked) {
+			auto at = now_ns();
+			for (; seen < acked; ++seen) latency.push_back(at - sent_at[seen + 1].load(std::memory_order_relaxed));
+		});
+		auto start = sc::steady_clock::now();
+		for (size_t tick = 0; tick * per_tick < count; ++tick) {
+			std::this_thread::sleep_until(start + sc::microseconds(tick * per_tick * 1'000'000 / rate));
+			for (size_t i = 0; i < per_tick; ++i) {
+				sent_at[stream.sent() + 1].store(now_ns(), std::memory_order_relaxed);
+				stream.send(message);
+			}
+			stream.flush();
+		}
+		stream.close();
+		std::sort(latency.begin(), latency.end());
+		auto at = [&](double q) { return latency[size_t(q * (latency.size() - 1))] / 1000.0; };
+		printf("  stream, %zu msg/s\tp50 %.0f us  p99 %.0f us  max %.0f us  %s\n", rate, at(0.5), at(0.99), at(1.0),
+			latency.size() == count ? "ok" : "LOST");
+	}
+}
+
+/*
+ * Merkle scans of a directory of small files, 1000 to a subdirectory. The
+ * first scan reads every file, later ones reuse the last tree and only stat.
+ */
+void bench_tree(size_t files) {
+	const string dir = "./bench_tree/";
+	for (size_t i = 0; i < files; ++i) {
+		auto sub = dir + std::to_string(i / 1000) + '/';
+		if (i % 1000 == 0) make_directories(sub);
+		auto fd = open((sub + std::to_string(i)).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		auto text = std::to_string(i);
+		write_all(fd, text.data(), text.size(), 0);
+		close(fd);
+	}
+	merkle_index index;
+	index.init(dir);
+	uint64_t hashes[3]{};
+	auto cold = seconds_of([&]() { hashes[0] = index.scan("")->hash; });
+	auto warm = seconds_of([&]() { hashes[1] = index.scan("")->hash; });
+	auto fd = open((dir + "0/0").c_str(), O_WRONLY | O_APPEND);
+	write_all(fd, "x", 1, 1);
+	close(fd);
+	auto changed = seconds_of([&]() { hashes[2] = index.scan("")->hash; });
+	printf("tree: first scan\t%10.0f files/s\n", files / cold);
+	printf("tree: rescan\t\t%10.0f files/s  %s\n", files / warm, hashes[1] == hashes[0] ? "ok" : "WRONG");
+	printf("tree: one file changed\t%10.0f files/s  %s\n", files / changed, hashes[2] != hashes[0] ? "ok" : "WRONG");
+	remove_tree(dir);
+}
+
+auto main(int argc, char* argv[])->int {
+	string which = argc > 1 ? argv[1] : "all";
+	if (which == "messages") {
+		string address = argc > 2 ? argv[2] : "";
+		auto colon = address.find(':');
+		if (colon == string::npos) {
+			std::cerr << usage_content;
+			return 1;
+		}
+		bench_messages(address.substr(0, colon), uint16_t(std::stoul(address.substr(colon + 1))), argc > 3 ? std::stoul(argv[3]) : 100);
+		return 0;
+	}
+	if (which == "tree") {
+		bench_tree((argc > 2 ? std::stoul(argv[2]) : 100) * 1000);
+		return 0;
+	}
+	size_t size = (argc > 2 ? std::stoul(argv[2]) : 256) * 1'048'576;
+	if (which != "delta" && which != "hash" && which != "direct" && which != "engine" && which != "log" && which != "udp" && which != "all") {
+		std::cerr << usage_content;
+		return 1;
+	}
+	if (which == "delta" || which == "all") bench_delta(size);
+	if (which == "hash" || which == "all") bench_hash(size);
+	if (which == "direct" || which == "all") bench_direct(size);
+	if (which == "engine" || which == "all") bench_engine(size);
+	if (which == "log" || which == "all") bench_log(size);
+	if (which == "udp" || which == "all") bench_udp(size);
+	return 0;
+}
@@ -18,7 +18,102 @@ void parse_arg(const string& arg, string& ip, int& port) {
 	ip = arg.substr(0,index);
 	port = stoi(arg.substr(index+1));
 }
+void check(bool condition, const char* what) {
+	if (!condition) {
+		cerr << "Check failed: " << what << '\n';
+		exit(1);
+	}
+}
+template<typename F>
+bool throws_peer_exception(F&& func) {
+	try {
+		func();
+	}
+	catch (const mfcslib::peer_exception& e) {
+		return true;
+	}
+	return false;
+}
+/* Rebuild source from basis through the delta stream, fed to the decoder in small pieces. */
+bool delta_round_trip(const string& basis, const string& source, size_t& stream_size) {
+	auto basis_file = tmpfile(), source_file = tmpfile(), output_file = tmpfile();
+	pwrite(fileno(basis_file), basis.data(), basis.size(), 0);
+	pwrite(fileno(source_file), source.data(), source.size(), 0);
+	auto block = mfcslib::choose_block_size(basis.size());
+	auto sigs = mfcslib::compute_signatures(fileno(basis_file), basis.size(), block);
+	auto serialized = mfcslib::serialize_signatures(sigs);
+	mfcslib::delta_encoder encoder(fileno(source_file), source.size(), block, basis.size(), mfcslib::parse_signatures(serialized.data(), sigs.size()));
+	string stream;
+	while (encoder.next(stream));
+	stream_size = stream.size();
+	mfcslib::delta_decoder decoder(fileno(basis_file), block, basis.size(), fileno(output_file));
+	for (size_t used = 0; used < stream.size() && !decoder.finished();) {
+		used += decoder.feed(stream.data() + used, std::min<size_t>(4096, stream.size() - used));
+	}
+	string rebuilt(decoder.written(), '\0');
+	pread(fileno(output_file), rebuilt.data(), rebuilt.size(), 0);
+	fclose(basis_file);
+	fclose(source_file);
+	fclose(output_file);
+	return decoder.verified() && rebuilt == source;
+}
+void test_delta(std::mt19937_64& engine) {
+	string basis(1'000'000, '\0');
+	for (auto& ch : basis) ch = char(engine());
+	size_t stream_size = 0;
+	check(delta_round_trip(basis, basis, stream_size), "delta of an unchanged file");
+	check(stream_size < 64, "delta of an unchanged file is copies only");
+	auto source = basis;
+	source.replace(300'000, 1'000, "changed");
+	source.insert(700'000, 5'000, 'x');
+	source.resize(900'000);
+	check(delta_round_trip(basis, source, stream_size), "delta of a changed file");
+	check(stream_size < 50'000, "delta of a changed file copies the unchanged blocks");
+	check(delta_round_trip("", basis, stream_size), "delta against an empty basis");
+}
+void test_extents() {
+	auto table = [](std::vector<mfcslib::extent> extents) { return mfcslib::serialize_extents(extents); };
+	auto extents = mfcslib::parse_extents(table({ { 0, 10 }, { 20, 5 } }), 30);
+	check(extents.size() == 2 && extents[1].offset == 20 && extents[1].length == 5, "parse_extents of a valid table");
+	check(throws_peer_exception([&] { mfcslib::parse_extents(table({ { 0, 10 }, { 5, 5 } }), 30); }), "parse_extents refuses overlaps");
+	check(throws_peer_exception([&] { mfcslib::parse_extents(table({ { 20, 11 } }), 30); }), "parse_extents refuses extents past the end");
+	check(throws_peer_exception([&] { mfcslib::parse_extents(table({ { UINT64_MAX - 1, 4 } }), 30); }), "parse_extents refuses wrapping extents");
+}
+void test_manifest() {
+	using namespace std::string_view_literals;
+	auto entries = mfcslib::parse_manifest("3/a\0" "5/dir/b\0"sv, 2);
+	check(entries.size() == 2 && entries[1].path == "dir/b" && entries[1].size == 5, "parse_manifest of a valid manifest");
+	check(throws_peer_exception([] { mfcslib::parse_manifest("x/a\0"sv, 1); }), "parse_manifest refuses a bad size");
+	check(throws_peer_exception([] { mfcslib::parse_manifest("3/../a\0"sv, 1); }), "parse_manifest refuses paths leaving the root");
+	check(throws_peer_exception([] { mfcslib::parse_manifest("3/a\0"sv, 2); }), "parse_manifest refuses a wrong count");
+}
+void test_relative_paths() {
+	check(mfcslib::is_safe_relative_path("a") && mfcslib::is_safe_relative_path("dir/a.txt"), "plain relative paths");
+	for (auto path : { "", "/etc/passwd", "..", "../a", "a/../b", "a/..", "./a", "a//b", "a/" }) {
+		check(!mfcslib::is_safe_relative_path(path), path);
+	}
+}
+void test_range_dispatcher() {
+	range_dispatcher ranges(RANGE_MIN);
+	auto owner = ranges.take(1);
+	check(owner.has_value(), "the first source gets the range");
+	auto helper = ranges.take(1e12);
+	check(helper.has_value() && helper->id == owner->id, "a much faster source helps a slow one");
+	check(!ranges.take(1e12), "a range is helped once at a time");
+	ranges.give_back(helper->id);
+	auto second = ranges.take(1e12);
+	check(second.has_value() && second->id == owner->id, "a range is helped again after its helper failed");
+	check(ranges.complete(second->id) && !ranges.complete(owner->id), "the first to finish counts");
+	check(ranges.finished(), "all ranges done");
+}
 auto main(int argc, char* argv[])->int {
+	std::mt19937_64 engine(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
+	test_delta(engine);
+	test_extents();
+	test_manifest();
+	test_relative_paths();
+	test_range_dispatcher();
+	std::cout << "Finishing unit checks.\n";
 	if (argc != 2) {
 		cerr << usage_content;
 		exit(1);
@@ -26,7 +121,6 @@ auto main(int argc, char* argv[])->int {
 	string ip;
 	auto port = 0;
 	parse_arg(argv[1], ip, port);
-	std::mt19937_64 engine(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
 	auto file = "temp_" + std::to_string(engine());
 	auto path = "./" + file;
 	auto content = file + std::to_string(engine()) + std::to_string(engine()) + std::to_string(engine());